@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, http server response output
+ *
+ */
+
+#include "http_out.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static http_out_buffer *http_out_pool = NULL;
+static int http_out_pooled = 0;
+static pthread_mutex_t http_out_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Write to the client. Once a write fails the client is gone, and the next
+// writes fail without touching the socket.
+static int out_send(http_out_t *out, char *buffer, int length) {
+	if (out->failed) {
+		return -1;
+	}
+
+	if (out->write(out->arg, buffer, length) < 0) {
+		out->failed = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void http_out_init(http_out_t *out, http_out_write_t write, void *arg) {
+	out->buf = NULL;
+	out->write = write;
+	out->arg = arg;
+	out->chunked = 0;
+	out->failed = 0;
+}
+
+http_out_buffer *http_out_get(http_out_t *out) {
+	http_out_buffer *buf = out->buf;
+
+	if (!buf) {
+		pthread_mutex_lock(&http_out_mtx);
+		buf = http_out_pool;
+		if (buf) {
+			http_out_pool = buf->next;
+			http_out_pooled--;
+		}
+		pthread_mutex_unlock(&http_out_mtx);
+
+		if (!buf) {
+			buf = (http_out_buffer *)malloc(sizeof(http_out_buffer));
+			if (!buf) {
+				return NULL;
+			}
+		}
+
+		buf->next = NULL;
+		buf->len = 0;
+		buf->chunk_start = -1;
+		out->buf = buf;
+	}
+
+	return buf;
+}
+
+void http_out_close_chunk(http_out_buffer *buf) {
+	if (buf->chunk_start < 0) return;
+
+	int length = buf->len - buf->chunk_start - HTTP_CHUNK_HDR_SIZE;
+	if (length == 0) {
+		//a chunk with a length of zero would end our whole transfer
+		buf->len = buf->chunk_start;
+	} else {
+		snprintf(buf->data + buf->chunk_start, HTTP_CHUNK_HDR_SIZE, "%04x\r", length);
+		buf->data[buf->chunk_start + HTTP_CHUNK_HDR_SIZE - 1] = '\n';
+		buf->data[buf->len++] = '\r';
+		buf->data[buf->len++] = '\n';
+	}
+
+	buf->chunk_start = -1;
+}
+
+int http_out_flush(http_out_t *out) {
+	http_out_buffer *buf = out->buf;
+	int rc = 0;
+
+	if (buf) {
+		http_out_close_chunk(buf);
+		if (buf->len > 0) {
+			rc = out_send(out, buf->data, buf->len);
+			buf->len = 0;
+		}
+	}
+
+	return rc;
+}
+
+void http_out_release(http_out_t *out) {
+	http_out_buffer *buf = out->buf;
+
+	if (!buf) return;
+
+	http_out_flush(out);
+	out->buf = NULL;
+
+	pthread_mutex_lock(&http_out_mtx);
+	if (http_out_pooled < HTTP_OUT_POOL_SIZE) {
+		buf->next = http_out_pool;
+		http_out_pool = buf;
+		http_out_pooled++;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&http_out_mtx);
+
+	free(buf);
+}
+
+int http_out_avail(http_out_t *out, http_out_buffer *buf) {
+	int trailer = out->chunked ? HTTP_CHUNK_TRL_SIZE : 0;
+
+	if (out->chunked && buf->chunk_start < 0) {
+		if (buf->len + HTTP_CHUNK_HDR_SIZE + HTTP_CHUNK_TRL_SIZE >= HTTP_OUT_BUFF_SIZE) {
+			http_out_flush(out);
+		}
+
+		buf->chunk_start = buf->len;
+		buf->len += HTTP_CHUNK_HDR_SIZE;
+	}
+
+	return HTTP_OUT_BUFF_SIZE - buf->len - trailer;
+}
+
+int http_out_write(http_out_t *out, const char *buffer, int length) {
+	http_out_buffer *buf = http_out_get(out);
+	int avail, n;
+
+	if (!buf) {
+		// No memory for a buffer, send the data as is, in its own chunk
+		// when the body is chunked
+		if (out->chunked) {
+			char header[16];
+
+			if (length == 0) {
+				return 0;
+			}
+
+			snprintf(header, sizeof(header), "%x\r\n", length);
+			if (out_send(out, header, strlen(header)) < 0) {
+				return -1;
+			}
+		}
+
+		if (out_send(out, (char *)buffer, length) < 0) {
+			return -1;
+		}
+
+		return out->chunked ? out_send(out, "\r\n", 2) : 0;
+	}
+
+	while (length > 0) {
+		avail = http_out_avail(out, buf);
+		if (out->failed) {
+			return -1;
+		}
+
+		if (avail <= 0) {
+			if (http_out_flush(out) < 0) {
+				return -1;
+			}
+			continue;
+		}
+
+		n = (length < avail) ? length : avail;
+		memcpy(buf->data + buf->len, buffer, n);
+		buf->len += n;
+		buffer += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+#define BUFFER_SIZE_MAX 2048
+int http_out_vprintf(http_out_t *out, const char *fmt, va_list args) {
+	http_out_buffer *buf = http_out_get(out);
+	va_list copy;
+	int length, avail;
+
+	if (buf) {
+		// Format in place if it fits, after a flush if needed
+		for (int retry = 0; retry < 2; retry++) {
+			avail = http_out_avail(out, buf);
+			if (out->failed) {
+				return -1;
+			}
+
+			va_copy(copy, args);
+			length = vsnprintf(buf->data + buf->len, avail > 0 ? avail : 0, fmt, copy);
+			va_end(copy);
+
+			if (length < 0) {
+				return -1;
+			}
+
+			if (length < avail) {
+				buf->len += length;
+				return length;
+			}
+
+			if (http_out_flush(out) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	// Doesn't fit in the output buffer
+	char *buffer = (char *)malloc(BUFFER_SIZE_MAX);
+	if (!buffer) {
+		return -1;
+	}
+
+	va_copy(copy, args);
+	length = vsnprintf(buffer, BUFFER_SIZE_MAX, fmt, copy);
+	va_end(copy);
+
+	if (length >= BUFFER_SIZE_MAX) {
+		length = BUFFER_SIZE_MAX - 1;
+	}
+
+	if ((length > 0) && (http_out_write(out, buffer, length) < 0)) {
+		length = -1;
+	}
+	free(buffer);
+
+	return length;
+}
+
+#if defined(UNIT_TESTS)
+
+/*
+ * Benchmarks the output buffer against the unbuffered output it replaced,
+ * serving a chunked page to a loopback client over one connection per page,
+ * as the server does. The client decodes each page and checks its body.
+ * Writes are the send() calls of the server, and packets are the data
+ * segments sent, from TCP_INFO.
+ *
+ * Build and run in the host with:
+ *
+ *   cc -O2 -DUNIT_TESTS -o http_out http_out.c -lpthread && ./http_out
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+
+#define BENCH_PAGES 2000
+#define BENCH_ROWS  100
+#define BENCH_RUNS  3
+#define BENCH_ROW   "<tr><td>sensor %d</td><td>%d.%d</td></tr>\n"
+
+static unsigned long bench_writes;
+static unsigned long bench_bytes;
+
+static int bench_send(void *arg, char *buffer, int length) {
+	int sent = 0;
+	int rc;
+
+	while (sent < length) {
+		rc = send(*(int *)arg, buffer + sent, length - sent, 0);
+		if (rc <= 0) {
+			return -1;
+		}
+
+		sent += rc;
+	}
+
+	bench_writes++;
+	bench_bytes += sent;
+
+	return sent;
+}
+
+// do_printf used before the output buffer, one send() per call
+static int old_printf(int socket, const char *fmt, ...) {
+	char buffer[256];
+	va_list args;
+	int length;
+
+	va_start(args, fmt);
+	length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+
+	bench_writes++;
+	bench_bytes += length;
+	return send(socket, buffer, length, MSG_DONTWAIT);
+}
+
+static int bench_printf(http_out_t *out, const char *fmt, ...) {
+	va_list args;
+	int ret;
+
+	va_start(args, fmt);
+	ret = http_out_vprintf(out, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+// Headers sent by send_headers for a lua page
+#define BENCH_HEADERS(printf, out) \
+	printf(out, "%s %d %s\r\n", "HTTP/1.1", 200, "OK"); \
+	printf(out, "Server: %s\r\n", "lua-rtos-http-server/1.0"); \
+	printf(out, "Content-Type: %s\r\n", "text/html"); \
+	printf(out, "Transfer-Encoding: chunked\r\n"); \
+	printf(out, "Connection: close\r\n"); \
+	printf(out, "Cache-Control: no-cache, no-store, must-revalidate\r\n"); \
+	printf(out, "no-cache\r\n"); \
+	printf(out, "0\r\n"); \
+	printf(out, "\r\n");
+
+// A lua page printing a table, one http.print per row
+static void bench_page(int socket, int buffered) {
+	char row[64];
+	int i, len;
+
+	if (buffered) {
+		http_out_t out;
+
+		http_out_init(&out, bench_send, &socket);
+		BENCH_HEADERS(bench_printf, &out);
+		out.chunked = 1;
+
+		for (i = 0; i < BENCH_ROWS; i++) {
+			len = snprintf(row, sizeof(row), BENCH_ROW, i, 20 + i % 10, i % 10);
+			http_out_write(&out, row, len);
+		}
+
+		http_out_close_chunk(out.buf);
+		out.chunked = 0;
+		bench_printf(&out, "0\r\n\r\n");
+		http_out_release(&out);
+	} else {
+		BENCH_HEADERS(old_printf, socket);
+
+		for (i = 0; i < BENCH_ROWS; i++) {
+			len = snprintf(row, sizeof(row), BENCH_ROW, i, 20 + i % 10, i % 10);
+
+			// chunk(request, "%s", ...)
+			old_printf(socket, "%x\r\n", len);
+			old_printf(socket, "%s\r\n", row);
+		}
+
+		old_printf(socket, "0\r\n\r\n");
+	}
+}
+
+// Reads pages, decoding the chunked body and checking it
+static void *bench_client(void *arg) {
+	struct sockaddr_in *addr = (struct sockaddr_in *)arg;
+	static char page[65536];
+	char body[8192], expected[8192];
+	char *p, *end;
+	int page_len, body_len, expected_len, len, rc;
+	int s, i, n;
+	long *bad = calloc(1, sizeof(long));
+
+	expected_len = 0;
+	for (i = 0; i < BENCH_ROWS; i++) {
+		expected_len += sprintf(expected + expected_len, BENCH_ROW, i, 20 + i % 10, i % 10);
+	}
+
+	for (n = 0; n < BENCH_PAGES; n++) {
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(s, (struct sockaddr *)addr, sizeof(*addr)) != 0) {
+			(*bad)++;
+			close(s);
+			continue;
+		}
+
+		page_len = 0;
+		while ((rc = recv(s, page + page_len, sizeof(page) - page_len - 1, 0)) > 0) {
+			page_len += rc;
+		}
+		page[page_len] = '\0';
+		close(s);
+
+		p = strstr(page, "\r\n0\r\n\r\n");
+		body_len = 0;
+		if (p) {
+			p += 7;
+			end = page + page_len;
+			while (p < end) {
+				len = strtol(p, &p, 16);
+				p += 2;
+				if (len == 0) break;
+				if ((p + len + 2 > end) || (body_len + len > (int)sizeof(body))) {
+					body_len = -1;
+					break;
+				}
+				memcpy(body + body_len, p, len);
+				body_len += len;
+				p += len + 2;
+			}
+		}
+
+		if ((body_len != expected_len) || memcmp(body, expected, expected_len)) {
+			(*bad)++;
+		}
+	}
+
+	return bad;
+}
+
+static void bench(int buffered) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	struct timespec start, end;
+	struct tcp_info info;
+	socklen_t info_len;
+	unsigned long packets = 0;
+	pthread_t thread;
+	int server, client, n;
+	long *bad;
+	double secs;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	server = socket(AF_INET, SOCK_STREAM, 0);
+	bind(server, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(server, (struct sockaddr *)&addr, &addr_len);
+	listen(server, 16);
+
+	bench_writes = 0;
+	bench_bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&thread, NULL, bench_client, &addr);
+
+	for (n = 0; n < BENCH_PAGES; n++) {
+		client = accept(server, NULL, NULL);
+		bench_page(client, buffered);
+
+		info_len = sizeof(info);
+		if (getsockopt(client, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+			packets += info.tcpi_data_segs_out;
+		}
+
+		shutdown(client, SHUT_RDWR);
+		close(client);
+	}
+
+	pthread_join(thread, (void **)&bad);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(server);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-10s %4.1f writes/page, %4.1f packets/page, %5.0f pages/s, %5.1f MB/s, %ld bad pages\n",
+		   buffered ? "buffered" : "unbuffered", (double)bench_writes / BENCH_PAGES, (double)packets / BENCH_PAGES,
+		   BENCH_PAGES / secs, bench_bytes / secs / 1e6, *bad);
+	free(bad);
+}
+
+int main(void) {
+	int run;
+
+	for (run = 0; run < BENCH_RUNS; run++) {
+		bench(0);
+		bench(1);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, http server response output
+ *
+ */
+
+#ifndef HTTP_HTTP_OUT_H_
+#define HTTP_HTTP_OUT_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#if defined(UNIT_TESTS)
+#define TCP_MSS 1436 // ESP-IDF default
+#else
+#include "lwip/opt.h"
+#endif
+
+/*
+ * Response output buffer. Output is batched into TCP_MSS sized writes, and
+ * when the body is chunked each write carries a single chunk, whose size
+ * header is reserved at chunk_start and filled in when the chunk is closed.
+ */
+#define HTTP_OUT_BUFF_SIZE   TCP_MSS
+#define HTTP_OUT_POOL_SIZE   2
+#define HTTP_CHUNK_HDR_SIZE  6 // "xxxx\r\n", leading zeros are allowed in chunk sizes
+#define HTTP_CHUNK_TRL_SIZE  2 // "\r\n"
+
+typedef struct http_out_buffer {
+	struct http_out_buffer *next; //next free buffer in the pool
+	int len;
+	int chunk_start; //offset of the open chunk's header, or -1
+	char data[HTTP_OUT_BUFF_SIZE];
+} http_out_buffer;
+
+// Writes length bytes to the client, returns -1 if the client is gone
+typedef int (*http_out_write_t)(void *arg, char *buffer, int length);
+
+// Response output of a request
+typedef struct {
+	http_out_buffer *buf; //taken from the pool on the first output
+	http_out_write_t write;
+	void *arg; //argument for write
+	uint8_t chunked; //body is sent with chunked transfer encoding
+	uint8_t failed; //a write failed, the rest of the response is discarded
+} http_out_t;
+
+/**
+ * @brief Initialize the output of a request.
+ *
+ * @param out   Output.
+ * @param write Function that writes to the client.
+ * @param arg   Argument for write.
+ */
+void http_out_init(http_out_t *out, http_out_write_t write, void *arg);
+
+/**
+ * @brief Get the output buffer, taking one from the pool if there is none yet.
+ *
+ * @param out Output.
+ *
+ * @return The buffer, or NULL if there is not enough memory. Then output is
+ *         written unbuffered.
+ */
+http_out_buffer *http_out_get(http_out_t *out);
+
+/**
+ * @brief Close the open chunk of an output buffer, filling in its size.
+ *
+ * @param buf Output buffer.
+ */
+void http_out_close_chunk(http_out_buffer *buf);
+
+/**
+ * @brief Send everything buffered so far.
+ *
+ * @param out Output.
+ *
+ * @return 0, or -1 if the client is gone.
+ */
+int http_out_flush(http_out_t *out);
+
+/**
+ * @brief Flush and give the output buffer back to the pool.
+ *
+ * @param out Output.
+ */
+void http_out_release(http_out_t *out);
+
+/**
+ * @brief Get the space left for data in the output buffer, opening a chunk if
+ *        the body is chunked.
+ *
+ * @param out Output.
+ * @param buf Output buffer of out.
+ *
+ * @return Bytes that can be added at buf->data + buf->len.
+ */
+int http_out_avail(http_out_t *out, http_out_buffer *buf);
+
+/**
+ * @brief Add data to the response, chunked if the body is sent chunked.
+ *
+ * @param out    Output.
+ * @param buffer Data.
+ * @param length Length of data.
+ *
+ * @return 0, or -1 if the client is gone, then the response must be aborted.
+ */
+int http_out_write(http_out_t *out, const char *buffer, int length);
+
+/**
+ * @brief Add formatted data to the response, chunked if the body is sent
+ *        chunked.
+ *
+ * @param out  Output.
+ * @param fmt  Format.
+ * @param args Arguments.
+ *
+ * @return Bytes added, or -1 if the client is gone.
+ */
+int http_out_vprintf(http_out_t *out, const char *fmt, va_list args);
+
+#endif /* HTTP_HTTP_OUT_H_ */
@@ -31,6 +31,8 @@
 #if CONFIG_LUA_RTOS_USE_HTTP_SERVER
 
 #include "preprocessor.h"
+#include "httpsrv.h"
+#include "http_out.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -41,6 +43,9 @@
 #include <sys/panic.h>
 #include <sys/delay.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "esp_wifi_types.h"
 #include "esp_log.h"
 #include <pthread.h>
@@ -49,14 +54,17 @@
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <sys/syslog.h>
+#include <sys/trace.h>
 #include <sys/path.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <linux/in6.h>
 
-#include <openssl/ssl.h>
+#include "esp_timer.h"
 #include "mbedtls/platform.h"
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/esp_debug.h"
@@ -65,13 +73,31 @@
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
 #include "mbedtls/certs.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+// Repeat visitors rely on session resumption, by session ID and by ticket.
+// Without them in the mbedTLS configuration every handshake is a full one.
+#if defined(MBEDTLS_SSL_CACHE_C)
+#include "mbedtls/ssl_cache.h"
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+#include "mbedtls/ssl_ticket.h"
+#endif
 
 #define SERVER_ID      "lua-rtos-http-server/1.0"
 #define PROTOCOL       "HTTP/1.1"
 #define RFC1123FMT     "%a, %d %b %Y %H:%M:%S GMT"
 #define HTTP_BUFF_SIZE 1024
+#define HTTP_HEADERS_SIZE 1024
+#define HTTP_NO_LENGTH -2 //body without length nor chunks, it ends when the connection is closed
 #define CAPTIVE_SERVER_NAME	"config-esp32-settings"
 
+// Suffix appended to a .lua page for its preprocessed copy. It changes each
+// time the code generated by the preprocessor changes, so preprocessed copies
+// made by older firmwares are never loaded.
+#define HTTP_PREPROCESSED_SUFFIX "y"
+
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -106,27 +132,90 @@ typedef struct {
 	const int secure;
 	char *certificate;
 	char *private_key;
+	lua_callback_t *callback; //each server runs its pages in its own lua thread
 } http_server_config;
 
-#define HTTP_Normal_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT, &socket_server_normal, 0, NULL, NULL }
-#define HTTP_Secure_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT_SSL, &socket_server_secure, 1, NULL, NULL } //cert and privkey need to be supplied from lua
+#define HTTP_Normal_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT, &socket_server_normal, 0, NULL, NULL, NULL }
+#define HTTP_Secure_initializer { CONFIG_LUA_RTOS_HTTP_SERVER_PORT_SSL, &socket_server_secure, 1, NULL, NULL, NULL } //cert and privkey need to be supplied from lua
+
+/*
+ * TLS. The secure server uses mbedTLS directly, as the openssl compatibility
+ * layer can't resume sessions. The configuration, with the parsed certificate
+ * and private key, the session cache and the ticket keys, is kept across
+ * server restarts while the certificate and key files don't change, so repeat
+ * visitors get an abbreviated handshake.
+ */
+#define HTTP_TLS_TICKET_LIFETIME 86400 // seconds
+
+typedef struct {
+	mbedtls_ssl_context ssl;
+	mbedtls_net_context net;
+	int64_t io_us; //time spent waiting for the network during the handshake
+} http_tls_session_t;
 
 typedef struct {
+	int ready;
+	char *certificate; //files the credentials were parsed from
+	char *private_key;
+	time_t certificate_mtime;
+	time_t private_key_mtime;
+	mbedtls_x509_crt crt;
+	mbedtls_pk_context pk;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_ssl_config conf;
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_context cache;
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_context ticket;
+#endif
+} http_tls_t;
+
+static http_tls_t http_tls;
+
+// Statistics, to measure writes (packets) per request and throughput. They
+// are updated by all the server threads, with http_stat_mtx locked.
+static pthread_mutex_t http_stat_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t http_stat_requests = 0;
+static uint32_t http_stat_writes = 0;
+static uint32_t http_stat_bytes = 0;
+static uint32_t http_stat_tls_handshakes = 0;
+static uint32_t http_stat_tls_resumed = 0;
+static uint64_t http_stat_tls_handshake_latency_us = 0;
+static uint64_t http_stat_tls_handshake_cpu_us = 0;
+
+// Event stream subscribers, with http_sse_mtx locked
+static pthread_mutex_t http_sse_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int http_sse_count = 0;
+
+typedef struct http_request_handle {
 	http_server_config *config;
 	int socket;
-	SSL *ssl;
+	http_tls_session_t *tls;
 	uint8_t headers_sent;
 	struct sockaddr_storage *client;
 	socklen_t client_len;
 	char *path;
 	char *method;
 	char *data;
-	char *chunk_buffer;
-	char *printf_buffer;
+	char *headers;
+	const char *script_name;
+	uint8_t detached; //connection kept open as an event stream subscriber
+	http_out_t out;
 } http_request_handle;
 
-#define HTTP_Request_Normal_initializer { config, client, NULL, 0, &client_addr, client_addr_len, NULL, NULL, NULL, NULL, NULL };
-#define HTTP_Request_Secure_initializer { config, client, ssl,  0, &client_addr, client_addr_len, NULL, NULL, NULL, NULL, NULL };
+#define HTTP_Request_Normal_initializer { config, client, NULL, 0, &client_addr, client_addr_len, NULL, NULL, NULL, NULL, NULL, 0 };
+#define HTTP_Request_Secure_initializer { config, client, tls,  0, &client_addr, client_addr_len, NULL, NULL, NULL, NULL, NULL, 0 };
+
+// Request context passed to a lua page as its chunk argument. The request
+// pointer is cleared when the page ends, so a context kept by the page
+// can't reach a request that no longer exists.
+typedef struct {
+	http_request_handle *request;
+} http_context_t;
+
+#define HTTP_CONTEXT_META "http.req"
 
 static http_server_config http_normal = HTTP_Normal_initializer;
 static http_server_config http_secure = HTTP_Secure_initializer;
@@ -162,51 +251,261 @@ char *get_mime_type(char *name) {
 	return NULL;
 }
 
-static int request_write(http_request_handle *request, char *buffer, int length) {
-	return (request->config->secure) ? SSL_write(request->ssl, buffer, length) : send(request->socket, buffer, length, MSG_DONTWAIT);
+// Add n to a statistic
+static void http_stat_add(uint32_t *stat, uint32_t n) {
+	pthread_mutex_lock(&http_stat_mtx);
+	*stat += n;
+	pthread_mutex_unlock(&http_stat_mtx);
+}
+
+// Count a write of length bytes
+static void http_stat_write(int length) {
+	pthread_mutex_lock(&http_stat_mtx);
+	http_stat_writes++;
+	http_stat_bytes += length;
+	pthread_mutex_unlock(&http_stat_mtx);
+}
+
+// Write to the client, called by the response output
+static int request_write(void *arg, char *buffer, int length) {
+	http_request_handle *request = (http_request_handle *)arg;
+	int sent = 0;
+	int rc;
+
+	while (sent < length) {
+		rc = (request->config->secure) ? mbedtls_ssl_write(&request->tls->ssl, (unsigned char *)buffer + sent, length - sent) : send(request->socket, buffer + sent, length - sent, 0);
+		if (rc <= 0) {
+			return -1;
+		}
+
+		sent += rc;
+	}
+
+	http_stat_write(length);
+
+	return sent;
 }
 
-#define BUFFER_SIZE_INITIAL 256
-#define BUFFER_SIZE_MAX 2048
 static int do_printf(http_request_handle *request, const char *fmt, ...) {
-	int ret = 0;
 	va_list args;
+	int ret;
 
-	if (request->printf_buffer == NULL)
-		request->printf_buffer = (char *)malloc(BUFFER_SIZE_INITIAL);
-
-	if (request->printf_buffer) {
-		*(request->printf_buffer) = '\0';
-		va_start(args, fmt);
-		int length = vsnprintf(request->printf_buffer, BUFFER_SIZE_INITIAL, fmt, args);
-		va_end(args);
-		if (length>=0 && length<BUFFER_SIZE_INITIAL) {
-			if(length) { //don't try to transfer "nothing"
-				ret = request_write(request, request->printf_buffer, length);
-			}
-		}
-		else {
-			// retry with a bigger buffer...
-			char *buffer = (char *)malloc(BUFFER_SIZE_MAX);
-			if (buffer) {
-				*buffer = '\0';
-				va_start(args, fmt);
-				length = vsnprintf(buffer, BUFFER_SIZE_MAX, fmt, args);
-				va_end(args);
-				if(length) { //don't try to transfer "nothing"
-					ret = request_write(request, buffer, length);
-				}
-				free(buffer);
-			}
-		}
+	va_start(args, fmt);
+	ret = http_out_vprintf(&request->out, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+static int tls_cache_get(void *data, mbedtls_ssl_session *session) {
+	int ret = mbedtls_ssl_cache_get(data, session);
+
+	if (ret == 0) {
+		http_stat_add(&http_stat_tls_resumed, 1);
+	}
+
+	return ret;
+}
+#endif
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+static int tls_ticket_parse(void *p_ticket, mbedtls_ssl_session *session, unsigned char *buf, size_t len) {
+	int ret = mbedtls_ssl_ticket_parse(p_ticket, session, buf, len);
+
+	if (ret == 0) {
+		http_stat_add(&http_stat_tls_resumed, 1);
+	}
+
+	return ret;
+}
+#endif
+
+static void tls_free() {
+	if (!http_tls.ready) return;
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_free(&http_tls.ticket);
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_free(&http_tls.cache);
+#endif
+	mbedtls_ssl_config_free(&http_tls.conf);
+	mbedtls_ctr_drbg_free(&http_tls.ctr_drbg);
+	mbedtls_entropy_free(&http_tls.entropy);
+	mbedtls_pk_free(&http_tls.pk);
+	mbedtls_x509_crt_free(&http_tls.crt);
+
+	free(http_tls.certificate);
+	free(http_tls.private_key);
+
+	memset(&http_tls, 0, sizeof(http_tls));
+}
+
+// Prepare the TLS configuration, reusing the current one if the credentials didn't change
+static int tls_setup(http_server_config *config) {
+	struct stat certificate_stat, private_key_stat;
+	int ret;
+
+	if ((stat(config->certificate, &certificate_stat) != 0) || (stat(config->private_key, &private_key_stat) != 0)) {
+		syslog(LOG_ERR, "http: couldn't find SSL certificate or private key\n");
+		return -1;
+	}
+
+	if (http_tls.ready &&
+		(strcmp(http_tls.certificate, config->certificate) == 0) && (http_tls.certificate_mtime == certificate_stat.st_mtime) &&
+		(strcmp(http_tls.private_key, config->private_key) == 0) && (http_tls.private_key_mtime == private_key_stat.st_mtime)) {
+		return 0;
+	}
+
+	tls_free();
+
+	mbedtls_x509_crt_init(&http_tls.crt);
+	mbedtls_pk_init(&http_tls.pk);
+	mbedtls_entropy_init(&http_tls.entropy);
+	mbedtls_ctr_drbg_init(&http_tls.ctr_drbg);
+	mbedtls_ssl_config_init(&http_tls.conf);
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_init(&http_tls.cache);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_init(&http_tls.ticket);
+#endif
+	http_tls.ready = 1;
+
+	if ((ret = mbedtls_x509_crt_parse_file(&http_tls.crt, config->certificate)) != 0) {
+		syslog(LOG_ERR, "http: couldn't load SSL certificate (-0x%x)\n", -ret);
+		goto fail;
+	}
+
+	if ((ret = mbedtls_pk_parse_keyfile(&http_tls.pk, config->private_key, NULL)) != 0) {
+		syslog(LOG_ERR, "http: couldn't load SSL private key (-0x%x)\n", -ret);
+		goto fail;
+	}
+
+	if ((ret = mbedtls_ctr_drbg_seed(&http_tls.ctr_drbg, mbedtls_entropy_func, &http_tls.entropy, (const unsigned char *)SERVER_ID, strlen(SERVER_ID))) != 0) {
+		syslog(LOG_ERR, "http: couldn't seed SSL random generator (-0x%x)\n", -ret);
+		goto fail;
+	}
+
+	if ((ret = mbedtls_ssl_config_defaults(&http_tls.conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+		syslog(LOG_ERR, "http: couldn't create SSL context (-0x%x)\n", -ret);
+		goto fail;
+	}
+
+	mbedtls_ssl_conf_rng(&http_tls.conf, mbedtls_ctr_drbg_random, &http_tls.ctr_drbg);
+
+	if ((ret = mbedtls_ssl_conf_own_cert(&http_tls.conf, &http_tls.crt, &http_tls.pk)) != 0) {
+		syslog(LOG_ERR, "http: couldn't set SSL certificate (-0x%x)\n", -ret);
+		goto fail;
+	}
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+	// Session ID resumption
+	mbedtls_ssl_conf_session_cache(&http_tls.conf, &http_tls.cache, tls_cache_get, mbedtls_ssl_cache_set);
+#endif
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+	// Session ticket resumption (RFC 5077), the server keeps no state
+	if (mbedtls_ssl_ticket_setup(&http_tls.ticket, mbedtls_ctr_drbg_random, &http_tls.ctr_drbg, MBEDTLS_CIPHER_AES_256_GCM, HTTP_TLS_TICKET_LIFETIME) == 0) {
+		mbedtls_ssl_conf_session_tickets_cb(&http_tls.conf, mbedtls_ssl_ticket_write, tls_ticket_parse, &http_tls.ticket);
+	}
+#endif
 
+	http_tls.certificate = strdup(config->certificate);
+	http_tls.private_key = strdup(config->private_key);
+	if (!http_tls.certificate || !http_tls.private_key) {
+		goto fail;
 	}
+
+	http_tls.certificate_mtime = certificate_stat.st_mtime;
+	http_tls.private_key_mtime = private_key_stat.st_mtime;
+
+	return 0;
+
+fail:
+	tls_free();
+	return -1;
+}
+
+static void tls_session_free(http_tls_session_t *tls) {
+	mbedtls_ssl_close_notify(&tls->ssl);
+	mbedtls_ssl_free(&tls->ssl);
+	free(tls);
+}
+
+// Network I/O during the handshake, timed to tell the CPU time of the
+// handshake apart from the time spent waiting for the client
+static int tls_handshake_send(void *ctx, const unsigned char *buf, size_t len) {
+	http_tls_session_t *tls = (http_tls_session_t *)ctx;
+	int64_t start = esp_timer_get_time();
+	int ret = mbedtls_net_send(&tls->net, buf, len);
+
+	tls->io_us += esp_timer_get_time() - start;
+	return ret;
+}
+
+static int tls_handshake_recv(void *ctx, unsigned char *buf, size_t len) {
+	http_tls_session_t *tls = (http_tls_session_t *)ctx;
+	int64_t start = esp_timer_get_time();
+	int ret = mbedtls_net_recv(&tls->net, buf, len);
+
+	tls->io_us += esp_timer_get_time() - start;
 	return ret;
 }
 
+// Do the TLS handshake on an accepted client
+static http_tls_session_t *tls_session_accept(int client) {
+	http_tls_session_t *tls;
+	int64_t start, latency;
+	int ret;
+
+	tls = calloc(1, sizeof(http_tls_session_t));
+	if (!tls) {
+		syslog(LOG_ERR, "http: couldn't create SSL session\n");
+		return NULL;
+	}
+
+	mbedtls_ssl_init(&tls->ssl);
+	if ((ret = mbedtls_ssl_setup(&tls->ssl, &http_tls.conf)) != 0) {
+		syslog(LOG_ERR, "http: couldn't create SSL session (-0x%x)\n", -ret);
+		mbedtls_ssl_free(&tls->ssl);
+		free(tls);
+		return NULL;
+	}
+
+	tls->net.fd = client;
+	mbedtls_ssl_set_bio(&tls->ssl, tls, tls_handshake_send, tls_handshake_recv, NULL);
+
+	start = esp_timer_get_time();
+	while ((ret = mbedtls_ssl_handshake(&tls->ssl)) != 0) {
+		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+			if (ret != MBEDTLS_ERR_NET_RECV_FAILED && ret != MBEDTLS_ERR_NET_CONN_RESET) {
+				syslog(LOG_ERR, "http: couldn't accept SSL connection (-0x%x)\n", -ret);
+			}
+			mbedtls_ssl_free(&tls->ssl);
+			free(tls);
+			return NULL;
+		}
+	}
+
+	latency = esp_timer_get_time() - start;
+
+	// The rest of the connection goes straight to the socket
+	mbedtls_ssl_set_bio(&tls->ssl, &tls->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+	pthread_mutex_lock(&http_stat_mtx);
+	http_stat_tls_handshakes++;
+	http_stat_tls_handshake_latency_us += latency;
+	http_stat_tls_handshake_cpu_us += latency - tls->io_us;
+	pthread_mutex_unlock(&http_stat_mtx);
+
+	return tls;
+}
+
 static char *do_gets(char *s, int size, http_request_handle *request) {
 
-	int socket = request->config->secure ? SSL_get_fd(request->ssl) : request->socket;
+	int socket = request->socket;
 
 	fd_set set;
 	FD_ZERO(&set); /* clear the set */
@@ -220,38 +519,28 @@ static char *do_gets(char *s, int size, http_request_handle *request) {
 		if (request->config->secure) {
 
 			//only do this once for secure (or if nothing pending)
-			if (c == s && 0 == SSL_pending(request->ssl)) {
+			if (c == s && 0 == mbedtls_ssl_get_bytes_avail(&request->tls->ssl)) {
 				// select supports setting a timeout
 				// so *only* if select tells us data
 				// is ready we read the data using recv
 				rc = select(socket+1, &set, NULL, NULL, &timeout);
 				if (rc == -1) {
-					syslog(LOG_DEBUG, "http: select failed\r");
+					TRACE(TRACE_HTTP, LOG_DEBUG, "http: select failed on socket %d", socket);
 					return NULL;
 				}
 				else if (rc == 0 && !FD_ISSET(socket, &set)) {
 					//no data received or connection is closed
-					syslog(LOG_DEBUG, "http: no data received\r");
+					TRACE(TRACE_HTTP, LOG_DEBUG, "http: no data received on socket %d", socket);
 					break;
 				}
 			}
 
-			//see http://www.past5.com/tutorials/2014/02/21/openssl-and-select/
-			int ssl_error;
-			rc = SSL_read(request->ssl, c, 1);
-
-			//check SSL errors
-			switch(ssl_error = SSL_get_error(request->ssl,rc)) {
-				case SSL_ERROR_NONE:
-					//all good - we do our stuff with the newly read character below
-					break;
-				case SSL_ERROR_ZERO_RETURN:	 	//connection closed by client, clean up
-				case SSL_ERROR_WANT_READ:			//the operation did not complete, block the read
-				case SSL_ERROR_WANT_WRITE:		//the operation did not complete
-				case SSL_ERROR_SYSCALL:				//some I/O error occured (could be caused by false start in Chrome for instance), disconnect the client and clean up
-				default:											//some other error, clean up
-					return NULL;
-					break;
+			rc = mbedtls_ssl_read(&request->tls->ssl, (unsigned char *)c, 1);
+			if (rc <= 0) {
+				//connection closed by client (close notify or EOF), or some
+				//I/O error occured (could be caused by false start in Chrome
+				//for instance), clean up
+				return NULL;
 			}
 		}
 		else
@@ -267,11 +556,11 @@ static char *do_gets(char *s, int size, http_request_handle *request) {
 		}
 		else if (rc==0) {
 			//no data received or connection is closed
-			syslog(LOG_DEBUG, "http: no data received or connection is closed\r");
+			TRACE(TRACE_HTTP, LOG_DEBUG, "http: no data received or connection is closed on socket %d", socket);
 			break;
 		}
 		else {
-			syslog(LOG_DEBUG, "http: discarding half-received data\r");
+			TRACE(TRACE_HTTP, LOG_DEBUG, "http: discarding half-received data on socket %d, errno %d", socket, errno);
 			return NULL; //discard half-received data
 		}
 	}
@@ -279,6 +568,61 @@ static char *do_gets(char *s, int size, http_request_handle *request) {
 	return (c == s ? 0 : s);
 }
 
+/*
+ * Read the request headers into request->headers, as a sequence of
+ * "Name: value" strings terminated by an empty string. Headers that don't
+ * fit in HTTP_HEADERS_SIZE are dropped.
+ */
+static int read_headers(http_request_handle *request, char *linebuf) {
+	char *pos, *end;
+	int len;
+
+	request->headers = calloc(1, HTTP_HEADERS_SIZE);
+	if (!request->headers) {
+		return -1;
+	}
+
+	pos = request->headers;
+	end = request->headers + HTTP_HEADERS_SIZE - 1;
+
+	while (do_gets(linebuf, HTTP_BUFF_SIZE, request)) {
+		len = strlen(linebuf);
+		while (len > 0 && (linebuf[len - 1] == '\r' || linebuf[len - 1] == '\n')) {
+			linebuf[--len] = 0;
+		}
+
+		if (len == 0) {
+			break;
+		}
+
+		if (pos + len + 1 < end) {
+			memcpy(pos, linebuf, len + 1);
+			pos += len + 1;
+		}
+	}
+
+	return 0;
+}
+
+// Get the value of a request header, or NULL if not present
+static char *find_header(http_request_handle *request, const char *name) {
+	char *header = request->headers;
+	int len = strlen(name);
+
+	while (header && *header) {
+		if ((strncasecmp(header, name, len) == 0) && (header[len] == ':')) {
+			header += len + 1;
+			while (*header == ' ' || *header == '\t') header++;
+
+			return header;
+		}
+
+		header += strlen(header) + 1;
+	}
+
+	return NULL;
+}
+
 void send_headers(http_request_handle *request, int status, char *title, char *extra, char *mime, int length) {
 	do_printf(request, "%s %d %s\r\n", PROTOCOL, status, title);
 	do_printf(request, "Server: %s\r\n", SERVER_ID);
@@ -287,7 +631,7 @@ void send_headers(http_request_handle *request, int status, char *title, char *e
 
 	if (length >= 0) {
 		do_printf(request, "Content-Length: %d\r\n", length);
-	} else {
+	} else if (length != HTTP_NO_LENGTH) {
 		do_printf(request, "Transfer-Encoding: chunked\r\n");
 	}
 
@@ -298,6 +642,8 @@ void send_headers(http_request_handle *request, int status, char *title, char *e
 	do_printf(request, "0\r\n");
 
 	do_printf(request, "\r\n");
+
+	request->out.chunked = (length < 0) && (length != HTTP_NO_LENGTH);
 }
 
 #define HTTP_STATUS_LEN     3
@@ -322,51 +668,53 @@ void send_error(http_request_handle *request, int status, char *title, char *ext
 	do_printf(request, HTTP_ERROR_LINE_2, status, title);
 	do_printf(request, HTTP_ERROR_LINE_3, text);
 	do_printf(request, HTTP_ERROR_LINE_4);
-
-	// after send_error the request will usually end
-	// so make sure the buffer used in do_printf is deleted here
-	// as the calling function might not really notice it's usage
-	if (request->printf_buffer) {
-		free(request->printf_buffer);
-		request->printf_buffer = NULL;
-	}
 }
 
-#define CHUNK_SIZE_INITIAL (BUFFER_SIZE_INITIAL-2)
-#define CHUNK_SIZE_MAX  (BUFFER_SIZE_MAX-2)
+// Add formatted data to the body, sent as chunks
 static void chunk(http_request_handle *request, const char *fmt, ...) {
 	va_list args;
 
-	if (request->chunk_buffer == NULL)
-		request->chunk_buffer = (char *)malloc(CHUNK_SIZE_INITIAL);
-
-	if (request->chunk_buffer) {
-		*(request->chunk_buffer) = '\0';
-		va_start(args, fmt);
-		int length = vsnprintf(request->chunk_buffer, CHUNK_SIZE_INITIAL, fmt, args);
-		va_end(args);
-		if (length>=0 && length<CHUNK_SIZE_INITIAL) {
-			if(length) { //a length of zero would end our whole transfer
-				do_printf(request, "%x\r\n", length);
-				do_printf(request, "%s\r\n", request->chunk_buffer);
-			}
-		}
-		else {
-			// retry with a bigger buffer...
-			char *buffer = (char *)malloc(CHUNK_SIZE_MAX);
-			if (buffer) {
-				*buffer = '\0';
-				va_start(args, fmt);
-				length = vsnprintf(buffer, CHUNK_SIZE_MAX, fmt, args);
-				va_end(args);
-				if(length) { //a length of zero would end our whole transfer
-					do_printf(request, "%x\r\n", length);
-					do_printf(request, "%s\r\n", buffer);
-				}
-				free(buffer);
-			}
+	va_start(args, fmt);
+	http_out_vprintf(&request->out, fmt, args);
+	va_end(args);
+}
+
+// End a chunked body
+static void chunk_end(http_request_handle *request) {
+	if (request->out.chunked) {
+		if (request->out.buf) {
+			http_out_close_chunk(request->out.buf);
 		}
+
+		request->out.chunked = 0;
+		do_printf(request, "0\r\n\r\n");
+	}
+
+	http_out_flush(&request->out);
+}
+
+/*
+ * Get the request served by the calling lua page. Functions obtained from the
+ * request context (http.print, ...) carry the context as upvalue, the legacy
+ * net.service.http functions find it in the registry, keyed by the task of
+ * the server that runs the page. The key is not the lua thread, so that the
+ * request is also found from coroutines created by the page.
+ */
+static http_request_handle *http_get_request(lua_State *L) {
+	http_context_t *ctx = (http_context_t *)lua_touserdata(L, lua_upvalueindex(1));
+
+	if (!ctx) {
+		lua_rawgetp(L, LUA_REGISTRYINDEX, xTaskGetCurrentTaskHandle());
+		ctx = (http_context_t *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
 	}
+
+	if (!ctx || !ctx->request) {
+		luaL_error(L, "this function may only be called inside a lua script served by httpsrv");
+		return NULL;
+	}
+
+	return ctx->request;
 }
 
 int http_status(lua_State* L) {
@@ -377,19 +725,10 @@ int http_status(lua_State* L) {
 	const char *content_type = luaL_optstring( L, 4, "text/html" );
 	int content_length = luaL_optinteger( L, 5, -1 );
 
-	lua_getglobal(L, "http_internal_handle");
-	if (!lua_islightuserdata(L, -1)) {
-		return luaL_error(L, "this function may only be called inside a lua script served by httpsrv");
-	}
-	http_request_handle *request = (http_request_handle*)lua_touserdata(L, -1);
-
-	if (!request) {
-		return luaL_error(L, "this function may only be called inside a lua script served by httpsrv");
-	}
+	http_request_handle *request = http_get_request(L);
 
 	if (!request->headers_sent) {
 		send_headers(request, code, (char *)title, (char *)extra_headers, (char *)content_type, content_length);
-		if (!request->config->secure) fsync(request->socket);
 		request->headers_sent = 1;
 
 		lua_pop(L, lua_gettop(L));
@@ -405,26 +744,21 @@ int http_status(lua_State* L) {
 
 int http_print(lua_State* L) {
 
-	lua_getglobal(L, "http_internal_handle");
-	if (!lua_islightuserdata(L, -1)) {
-		return luaL_error(L, "this function may only be called inside a lua script served by httpsrv");
-	}
-	http_request_handle *request = (http_request_handle*)lua_touserdata(L, -1);
-
-	if (!request) {
-		return luaL_error(L, "this function may only be called inside a lua script served by httpsrv");
-	}
+	http_request_handle *request = http_get_request(L);
 
 	if (!request->headers_sent) {
 			send_headers(request, 200, "OK", NULL, "text/html", -1);
-			if (!request->config->secure) fsync(request->socket);
 			request->headers_sent = 1;
 	}
 
 	int nargs = lua_gettop(L);
 	for (int i=1; i <= nargs; i++) {
 		if (lua_isstring(L, i)) {
-			chunk(request, "%s", lua_tostring(L, i));
+			size_t len;
+			const char *str = lua_tolstring(L, i, &len);
+			if (http_out_write(&request->out, str, len) < 0) {
+				return luaL_error(L, "connection closed by the client");
+			}
 		}
 		else {
 			/* non-strings handling not reqired */
@@ -435,202 +769,477 @@ int http_print(lua_State* L) {
 	return 0;
 }
 
-int http_reboot(lua_State* L) {
+int http_flush(lua_State* L) {
 
-	lua_getglobal(L, "http_internal_handle");
-	if (!lua_islightuserdata(L, -1)) {
-		return luaL_error(L, "this function may only be called inside a lua script served by httpsrv");
-	}
-	http_request_handle *request = (http_request_handle*)lua_touserdata(L, -1);
+	http_request_handle *request = http_get_request(L);
 
-	if (!request) {
-		return luaL_error(L, "this function may only be called inside a lua script served by httpsrv");
+	if (request->headers_sent) {
+		http_out_flush(&request->out);
 	}
 
-	script_wants_reboot = 1;
-
 	return 0;
 }
 
-#define LUA_INTERPRETER_ERROR_LENGTH 256
-int __garbage_collector();
-static int http_execute_lua (lua_State *L) {
-		if (!lua_islightuserdata(L, 2)) {
-			syslog(LOG_ERR, "http: FATAL ERROR, got wrong param...");
-			return 0;
-		}
-		http_request_handle *request = (http_request_handle*)lua_touserdata(L, 2);
-		const char *path = luaL_checkstring( L, 3);
-
-		struct stat statbuf;
-		stat(path, &statbuf);
+int http_stats(lua_State* L) {
+	uint32_t requests, writes, bytes, tls_handshakes, tls_resumed;
+	int subscribers;
+	uint64_t tls_handshake_latency_us, tls_handshake_cpu_us;
 
-		char ppath[PATH_MAX + 1];
-		strcpy(ppath, path);
+	pthread_mutex_lock(&http_stat_mtx);
+	requests = http_stat_requests;
+	writes = http_stat_writes;
+	bytes = http_stat_bytes;
+	tls_handshakes = http_stat_tls_handshakes;
+	tls_resumed = http_stat_tls_resumed;
+	tls_handshake_latency_us = http_stat_tls_handshake_latency_us;
+	tls_handshake_cpu_us = http_stat_tls_handshake_cpu_us;
+	pthread_mutex_unlock(&http_stat_mtx);
 
-		if (strlen(ppath) < PATH_MAX) {
-			strcat(ppath, "p");
+	pthread_mutex_lock(&http_sse_mtx);
+	subscribers = http_sse_count;
+	pthread_mutex_unlock(&http_sse_mtx);
 
-			// Store .lua file modified time
-			time_t src_mtime = statbuf.st_mtime;
+	lua_createtable(L, 0, 8);
 
-			// Get .luap file modified time
-			if (stat(ppath, &statbuf) == 0) {
-				if (src_mtime > statbuf.st_mtime) {
-					http_preprocess_lua_page(path,ppath);
-				}
-			} else {
-				http_preprocess_lua_page(path,ppath);
-			}
+	lua_pushinteger(L, requests);
+	lua_setfield(L, -2, "requests");
 
-			if (S_ISDIR(statbuf.st_mode)) {
-				send_error(request, 500, "Internal Server Error", NULL, "Folder found where a precompiled file was expected.");
-			}
-			else if (!S_ISREG(statbuf.st_mode)) {
-				send_error(request, 500, "Internal Server Error", NULL, "Special file found where a regular precompiled file was expected.");
-			}
-			else {
-				if (heap_caps_get_free_size(MALLOC_CAP_DEFAULT) < statbuf.st_size*3) {
-					//free heap might be too low to load the file, so call GC before trying to load
-					luaC_fullgc(L, 0);
-					lua_unlock(L);
-					vTaskDelay(1 / portTICK_PERIOD_MS);
-					lua_lock(L);
-					luaC_fullgc(L, 0);
-					lua_unlock(L);
-					vTaskDelay(1 / portTICK_PERIOD_MS);
-				}
+	lua_pushinteger(L, writes);
+	lua_setfield(L, -2, "writes");
 
-				if (heap_caps_get_free_size(MALLOC_CAP_DEFAULT) < statbuf.st_size*3) {
-					//free heap might still be too low to load the file, so call the emergency GC before trying to load
-					__garbage_collector();
-				}
+	lua_pushinteger(L, bytes);
+	lua_setfield(L, -2, "bytes");
 
-				lua_lock(L);
-				int ret = luaL_loadfile(L, ppath);
-				lua_unlock(L);
+	lua_pushinteger(L, subscribers);
+	lua_setfield(L, -2, "subscribers");
 
-				if (LUA_OK != ret) {
-					char* error = (char *)malloc(LUA_INTERPRETER_ERROR_LENGTH+1);
-					if (error) {
-						*error = '\0';
-						snprintf(error, LUA_INTERPRETER_ERROR_LENGTH, "FATAL ERROR: %s", lua_tostring(L, -1));
-						send_error(request, 500, "Internal Server Error", NULL, error);
-						free(error);
-					}
-					else {
-						send_error(request, 500, "Internal Server Error", NULL, "FATAL ERROR occurred");
-					}
-				}
-				else {
+	lua_pushinteger(L, tls_handshakes);
+	lua_setfield(L, -2, "tls_handshakes");
 
-					//as we execute a lua script let's prepare the remote ip address
-					// -> first clean a possible IP4 addr from its leading '::ffff:'
-					if (request->client->ss_family==AF_INET6) {
-							struct sockaddr_in6* sa6=(struct sockaddr_in6*)request->client;
-							if (IN6_IS_ADDR_V4MAPPED(&sa6->sin6_addr)) {
-									struct sockaddr_in sa4;
-									memset(&sa4,0,sizeof(sa4));
-									sa4.sin_family=AF_INET;
-									sa4.sin_port=sa6->sin6_port;
-									memcpy(&sa4.sin_addr.s_addr,sa6->sin6_addr.s6_addr+12,4);
-									memcpy(request->client,&sa4,sizeof(sa4));
-									request->client_len=sizeof(sa4);
-							}
-					}
+	lua_pushinteger(L, tls_resumed);
+	lua_setfield(L, -2, "tls_resumed");
 
-					// -> now convert the address to human-readable form
-					char *buffer = (char *)malloc(INET6_ADDRSTRLEN+1);
-					if (buffer) {
-						int err=getnameinfo((struct sockaddr*)request->client,request->client_len,buffer,INET6_ADDRSTRLEN,0,0,NI_NUMERICHOST);
-						if (err!=0) {
-								snprintf(buffer,INET6_ADDRSTRLEN,"invalid address");
-						}
-					}
+	// Wall-clock time, it includes the network round trips, not only the CPU time
+	lua_pushinteger(L, tls_handshake_latency_us);
+	lua_setfield(L, -2, "tls_handshake_latency_us");
 
-					lua_lock(L);
-					lua_pushstring(L, (strcasecmp(request->method, "GET") == 0) ? "GET":"POST");
-					lua_setglobal(L, "http_method");
-					lua_pushstring(L, request->path);
-					lua_setglobal(L, "http_uri");
-					lua_pushstring(L, (request->data && *request->data) ? request->data:"");
-					lua_setglobal(L, "http_request");
-					lua_pushinteger(L, request->config->port);
-					lua_setglobal(L, "http_port");
-					lua_pushinteger(L, request->config->secure);
-					lua_setglobal(L, "http_secure");
-					lua_pushstring(L, buffer ? buffer:"");
-					lua_setglobal(L, "http_remote_addr");
-					lua_pushinteger(L, request->client->ss_family==AF_INET6 ? ((struct sockaddr_in6*)request->client)->sin6_port : ((struct sockaddr_in*)request->client)->sin_port);
-					lua_setglobal(L, "http_remote_port");
-					lua_pushstring(L, path);
-					lua_setglobal(L, "http_script_name");
-					lua_pushlightuserdata(L, (void*)request);
-					lua_setglobal(L, "http_internal_handle");
-					lua_unlock(L);
+	// Time computing the handshakes, without the time waiting for the network.
+	// It also includes the time taken by higher priority tasks meanwhile.
+	lua_pushinteger(L, tls_handshake_cpu_us);
+	lua_setfield(L, -2, "tls_handshake_cpu_us");
 
-					int rc = lua_pcall(L, 0, 0, 0);
-					if (LUA_OK != rc) {
-						if (LUA_ERRRUN != rc) {
-							syslog(LOG_ERR, "http: couldn't execute lua script, error %i\n", rc);
-						}
-						else {
-							char* error = (char *)malloc(LUA_INTERPRETER_ERROR_LENGTH+1);
-							if (error) {
-								*error = '\0';
-								snprintf(error, LUA_INTERPRETER_ERROR_LENGTH, "FATAL ERROR: %s", lua_tostring(L, -1));
-								send_error(request, 500, "Internal Server Error", NULL, error);
-								syslog(LOG_ERR, "http: couldn't execute lua script, %s\n", error);
-								free(error);
-							}
-							else {
-								send_error(request, 500, "Internal Server Error", NULL, "FATAL ERROR occurred");
-							}
-						}
-					}
+	return 1;
+}
 
-					lua_lock(L);
-					lua_pushnil(L);
-					lua_setglobal(L, "http_method");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_uri");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_request");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_port");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_secure");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_remote_addr");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_remote_port");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_script_name");
-					lua_pushnil(L);
-					lua_setglobal(L, "http_internal_handle");
-					lua_unlock(L);
+int http_reboot(lua_State* L) {
 
-					free(buffer);
+	// Only allowed inside a page
+	http_get_request(L);
 
-					if (!request->config->secure) fsync(request->socket);
-					do_printf(request, "0\r\n\r\n");
-				}
+	script_wants_reboot = 1;
 
-				//free the heap again by calling GC
-				lua_lock(L);
-				luaC_fullgc(L, 0);
-				lua_unlock(L);
-				vTaskDelay(1 / portTICK_PERIOD_MS);
+	return 0;
+}
 
-			}
-		}
-		else {
+// Clean an IP4 address from its leading '::ffff:'
+static void unmap_remote_addr(http_request_handle *request) {
+	if (request->client->ss_family==AF_INET6) {
+			struct sockaddr_in6* sa6=(struct sockaddr_in6*)request->client;
+			if (IN6_IS_ADDR_V4MAPPED(&sa6->sin6_addr)) {
+					struct sockaddr_in sa4;
+					memset(&sa4,0,sizeof(sa4));
+					sa4.sin_family=AF_INET;
+					sa4.sin_port=sa6->sin6_port;
+					memcpy(&sa4.sin_addr.s_addr,sa6->sin6_addr.s6_addr+12,4);
+					memcpy(request->client,&sa4,sizeof(sa4));
+					request->client_len=sizeof(sa4);
+			}
+	}
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Push a x-www-form-urlencoded string of the given length, decoded
+static void push_urldecoded(lua_State *L, const char *s, size_t len) {
+	luaL_Buffer b;
+	int hi, lo;
+
+	luaL_buffinit(L, &b);
+	while (len > 0) {
+		if (*s == '+') {
+			luaL_addchar(&b, ' ');
+		} else if (*s == '%' && len > 2 && (hi = hex_value(s[1])) >= 0 && (lo = hex_value(s[2])) >= 0) {
+			luaL_addchar(&b, (char)((hi << 4) | lo));
+			s += 2;
+			len -= 2;
+		} else {
+			luaL_addchar(&b, *s);
+		}
+		s++;
+		len--;
+	}
+	luaL_pushresult(&b);
+}
+
+// Push a table with the parameters of a query string / form body
+static void push_params(lua_State *L, const char *data) {
+	const char *name, *eq, *end;
+
+	lua_newtable(L);
+	while (data && *data) {
+		name = data;
+		end = strchr(name, '&');
+		if (!end) end = name + strlen(name);
+
+		eq = memchr(name, '=', end - name);
+		if (end > name) {
+			push_urldecoded(L, name, (eq ? eq : end) - name);
+			if (eq) {
+				push_urldecoded(L, eq + 1, end - eq - 1);
+			} else {
+				lua_pushliteral(L, "");
+			}
+			lua_rawset(L, -3);
+		}
+
+		data = *end ? end + 1 : end;
+	}
+}
+
+// Push a table with the request headers, names in lower case
+static void push_headers(lua_State *L, const char *headers) {
+	const char *colon, *value;
+	luaL_Buffer b;
+
+	lua_newtable(L);
+	while (headers && *headers) {
+		colon = strchr(headers, ':');
+		if (colon) {
+			luaL_buffinit(L, &b);
+			for (const char *c = headers; c < colon; c++) {
+				luaL_addchar(&b, tolower((int)*c));
+			}
+			luaL_pushresult(&b);
+
+			value = colon + 1;
+			while (*value == ' ' || *value == '\t') value++;
+			lua_pushstring(L, value);
+			lua_rawset(L, -3);
+		}
+
+		headers += strlen(headers) + 1;
+	}
+}
+
+static int http_context_print(lua_State* L) {
+	return http_print(L);
+}
+
+static int http_context_status(lua_State* L) {
+	return http_status(L);
+}
+
+static int http_context_reboot(lua_State* L) {
+	return http_reboot(L);
+}
+
+static int http_context_flush(lua_State* L) {
+	return http_flush(L);
+}
+
+static int is_form_data(http_request_handle *request) {
+	const char *type;
+
+	if (strcasecmp(request->method, "POST") != 0) return 1;
+
+	type = find_header(request, "Content-Type");
+	return (!type || strncasecmp(type, "application/x-www-form-urlencoded", 33) == 0);
+}
+
+/*
+ * __index metamethod of the request context. Fields are materialised on the
+ * first access, and the costly ones (tables, remote address) are cached in the
+ * context's user value.
+ */
+int http_context_index(lua_State* L) {
+	http_context_t *ctx = (http_context_t *)luaL_checkudata(L, 1, HTTP_CONTEXT_META);
+	const char *key = luaL_checkstring(L, 2);
+	http_request_handle *request = ctx->request;
+
+	if (!request) {
+		return luaL_error(L, "request has already finished");
+	}
+
+	if (strcmp(key, "print") == 0) {
+		lua_pushvalue(L, 1);
+		lua_pushcclosure(L, http_context_print, 1);
+		return 1;
+	} else if (strcmp(key, "set_headers") == 0) {
+		lua_pushvalue(L, 1);
+		lua_pushcclosure(L, http_context_status, 1);
+		return 1;
+	} else if (strcmp(key, "do_reboot") == 0) {
+		lua_pushvalue(L, 1);
+		lua_pushcclosure(L, http_context_reboot, 1);
+		return 1;
+	} else if (strcmp(key, "flush") == 0) {
+		lua_pushvalue(L, 1);
+		lua_pushcclosure(L, http_context_flush, 1);
+		return 1;
+	} else if (strcmp(key, "method") == 0) {
+		if (strcasecmp(request->method, "GET") == 0) {
+			lua_pushliteral(L, "GET");
+		} else if (strcasecmp(request->method, "POST") == 0) {
+			lua_pushliteral(L, "POST");
+		} else {
+			lua_pushstring(L, request->method);
+		}
+		return 1;
+	} else if (strcmp(key, "uri") == 0) {
+		lua_pushstring(L, request->path);
+		return 1;
+	} else if (strcmp(key, "data") == 0) {
+		lua_pushstring(L, (request->data && *request->data) ? request->data:"");
+		return 1;
+	} else if (strcmp(key, "port") == 0) {
+		lua_pushinteger(L, request->config->port);
+		return 1;
+	} else if (strcmp(key, "secure") == 0) {
+		lua_pushinteger(L, request->config->secure);
+		return 1;
+	} else if (strcmp(key, "remote_port") == 0) {
+		lua_pushinteger(L, ntohs(request->client->ss_family==AF_INET6 ? ((struct sockaddr_in6*)request->client)->sin6_port : ((struct sockaddr_in*)request->client)->sin_port));
+		return 1;
+	} else if (strcmp(key, "script_name") == 0) {
+		lua_pushstring(L, request->script_name ? request->script_name:"");
+		return 1;
+	} else if (strcmp(key, "remote_addr") != 0 && strcmp(key, "params") != 0 && strcmp(key, "headers") != 0) {
+		return 0;
+	}
+
+	// Cached fields
+	lua_getuservalue(L, 1);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setuservalue(L, 1);
+	}
+
+	lua_pushvalue(L, 2);
+	if (lua_rawget(L, -2) != LUA_TNIL) {
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	if (strcmp(key, "remote_addr") == 0) {
+		char buffer[INET6_ADDRSTRLEN + 1];
+
+		if (getnameinfo((struct sockaddr*)request->client, request->client_len, buffer, INET6_ADDRSTRLEN, 0, 0, NI_NUMERICHOST) != 0) {
+			snprintf(buffer, INET6_ADDRSTRLEN, "invalid address");
+		}
+		lua_pushstring(L, buffer);
+	} else if (strcmp(key, "params") == 0) {
+		push_params(L, is_form_data(request) ? request->data : NULL);
+	} else {
+		push_headers(L, request->headers);
+	}
+
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+
+	return 1;
+}
+
+#define LUA_INTERPRETER_ERROR_LENGTH 256
+int __garbage_collector();
+
+// Call the page chunk / route function on top of the stack with the request context
+static void run_page(lua_State *L, http_request_handle *request) {
+	unmap_remote_addr(request);
+
+	// Pass the request context to the page, and also register it
+	// for the legacy net.service.http functions
+	lua_lock(L);
+	http_context_t *ctx = (http_context_t *)lua_newuserdata(L, sizeof(http_context_t));
+	ctx->request = request;
+	luaL_getmetatable(L, HTTP_CONTEXT_META);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, xTaskGetCurrentTaskHandle());
+	lua_unlock(L);
+
+	int rc = lua_pcall(L, 1, 0, 0);
+
+	// A page aborted because the client is gone isn't an error of the page
+	if ((LUA_OK != rc) && !request->out.failed) {
+		if (LUA_ERRRUN != rc) {
+			syslog(LOG_ERR, "http: couldn't execute lua script, error %i\n", rc);
+		}
+		else {
+			char* error = (char *)malloc(LUA_INTERPRETER_ERROR_LENGTH+1);
+			if (error) {
+				*error = '\0';
+				snprintf(error, LUA_INTERPRETER_ERROR_LENGTH, "FATAL ERROR: %s", lua_tostring(L, -1));
+				send_error(request, 500, "Internal Server Error", NULL, error);
+				syslog(LOG_ERR, "http: couldn't execute lua script, %s\n", error);
+				free(error);
+			}
+			else {
+				send_error(request, 500, "Internal Server Error", NULL, "FATAL ERROR occurred");
+			}
+		}
+	}
+
+	ctx->request = NULL;
+	request->script_name = NULL;
+
+	lua_lock(L);
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, xTaskGetCurrentTaskHandle());
+	lua_unlock(L);
+
+	chunk_end(request);
+}
+
+/*
+ * Executed in the server's lua thread. Argument 2 is the request, argument 3
+ * is either the path of a lua page, or the function of a lua route.
+ */
+static int http_execute_lua (lua_State *L) {
+		if (!lua_islightuserdata(L, 2)) {
+			syslog(LOG_ERR, "http: FATAL ERROR, got wrong param...");
+			return 0;
+		}
+		http_request_handle *request = (http_request_handle*)lua_touserdata(L, 2);
+
+		if (lua_isfunction(L, 3)) {
+			lua_pushvalue(L, 3);
+			run_page(L, request);
+			return 0;
+		}
+
+		const char *path = luaL_checkstring( L, 3);
+
+		struct stat statbuf;
+		stat(path, &statbuf);
+
+		char ppath[PATH_MAX + 1];
+		strcpy(ppath, path);
+
+		if (strlen(ppath) < PATH_MAX) {
+			strcat(ppath, HTTP_PREPROCESSED_SUFFIX);
+
+			// Store .lua file modified time
+			time_t src_mtime = statbuf.st_mtime;
+
+			// Get preprocessed file modified time
+			if (stat(ppath, &statbuf) == 0) {
+				if (src_mtime > statbuf.st_mtime) {
+					http_preprocess_lua_page(path,ppath);
+				}
+			} else {
+				http_preprocess_lua_page(path,ppath);
+			}
+
+			if (S_ISDIR(statbuf.st_mode)) {
+				send_error(request, 500, "Internal Server Error", NULL, "Folder found where a precompiled file was expected.");
+			}
+			else if (!S_ISREG(statbuf.st_mode)) {
+				send_error(request, 500, "Internal Server Error", NULL, "Special file found where a regular precompiled file was expected.");
+			}
+			else {
+				if (heap_caps_get_free_size(MALLOC_CAP_DEFAULT) < statbuf.st_size*3) {
+					//free heap might be too low to load the file, so call GC before trying to load
+					luaC_fullgc(L, 0);
+					lua_unlock(L);
+					vTaskDelay(1 / portTICK_PERIOD_MS);
+					lua_lock(L);
+					luaC_fullgc(L, 0);
+					lua_unlock(L);
+					vTaskDelay(1 / portTICK_PERIOD_MS);
+				}
+
+				if (heap_caps_get_free_size(MALLOC_CAP_DEFAULT) < statbuf.st_size*3) {
+					//free heap might still be too low to load the file, so call the emergency GC before trying to load
+					__garbage_collector();
+				}
+
+				lua_lock(L);
+				int ret = luaL_loadfile(L, ppath);
+				lua_unlock(L);
+
+				if (LUA_OK != ret) {
+					char* error = (char *)malloc(LUA_INTERPRETER_ERROR_LENGTH+1);
+					if (error) {
+						*error = '\0';
+						snprintf(error, LUA_INTERPRETER_ERROR_LENGTH, "FATAL ERROR: %s", lua_tostring(L, -1));
+						send_error(request, 500, "Internal Server Error", NULL, error);
+						free(error);
+					}
+					else {
+						send_error(request, 500, "Internal Server Error", NULL, "FATAL ERROR occurred");
+					}
+				}
+				else {
+
+					request->script_name = path;
+					run_page(L, request);
+				}
+
+				//free the heap again by calling GC
+				lua_lock(L);
+				luaC_fullgc(L, 0);
+				lua_unlock(L);
+				vTaskDelay(1 / portTICK_PERIOD_MS);
+
+			}
+		}
+		else {
 			send_error(request, 500, "Internal Server Error", NULL, "Path too long.");
 		}
 
 	return 0;
 }
 
+// Call http_execute_lua with the arguments already pushed to the server's lua thread
+static void call_lua(http_request_handle *request) {
+	lua_State *L = luaS_callback_state(request->config->callback);
+	int rc = luaS_callback_call(request->config->callback, 3);
+	if ((LUA_OK != rc) && !request->out.failed) {
+		if (LUA_ERRRUN != rc) {
+			syslog(LOG_ERR, "http: couldn't execute http_callback, error %i\n", rc);
+		}
+		else {
+			char* error = (char *)malloc(LUA_INTERPRETER_ERROR_LENGTH+1);
+			if (error) {
+				*error = '\0';
+				snprintf(error, LUA_INTERPRETER_ERROR_LENGTH, "FATAL ERROR: %s", lua_tostring(L, -2));
+				send_error(request, 500, "Internal Server Error", NULL, error);
+				syslog(LOG_ERR, "http: couldn't execute http_callback, %s\n", error);
+				free(error);
+			}
+			else {
+				send_error(request, 500, "Internal Server Error", NULL, "FATAL ERROR occurred");
+			}
+		}
+	}
+}
+
+static void execute_lua(http_request_handle *request, const char *path) {
+	lua_State *L = luaS_callback_state(request->config->callback);
+	lua_pushcfunction(L, &http_execute_lua);  /* to call 'http_execute_lua' in protected mode */
+	lua_pushlightuserdata(L, (void*)request);
+	lua_pushstring(L, path);
+	call_lua(request);
+}
+
 void send_file(http_request_handle *request, char *path, struct stat *statbuf) {
 
 	FILE *file = fopen(path, "r");
@@ -639,39 +1248,47 @@ void send_file(http_request_handle *request, char *path, struct stat *statbuf) {
 	} else if (is_lua(path)) {
 		fclose(file);
 
-		lua_State *L = luaS_callback_state(http_callback);
-		lua_pushcfunction(L, &http_execute_lua);  /* to call 'http_execute_lua' in protected mode */
-		lua_pushlightuserdata(L, (void*)request);
-		lua_pushstring(L, path);
-		int rc = luaS_callback_call(http_callback, 3);
-		if (LUA_OK != rc) {
-			if (LUA_ERRRUN != rc) {
-				syslog(LOG_ERR, "http: couldn't execute http_callback, error %i\n", rc);
-			}
-			else {
-				char* error = (char *)malloc(LUA_INTERPRETER_ERROR_LENGTH+1);
-				if (error) {
-					*error = '\0';
-					snprintf(error, LUA_INTERPRETER_ERROR_LENGTH, "FATAL ERROR: %s", lua_tostring(L, -2));
-					send_error(request, 500, "Internal Server Error", NULL, error);
-					syslog(LOG_ERR, "http: couldn't execute http_callback, %s\n", error);
-					free(error);
+		execute_lua(request, path);
+		//NOTE: no need to "clean up" the stack here!
+	} else {
+		int length = S_ISREG(statbuf->st_mode) ? statbuf->st_size : -1;
+		send_headers(request, 200, "OK", NULL, get_mime_type(path), length);
+
+		// read the file straight into the output buffer
+		http_out_buffer *out = http_out_get(&request->out);
+		if (out) {
+			for (;;) {
+				int avail = http_out_avail(&request->out, out);
+				if (request->out.failed) {
+					break;
 				}
-				else {
-					send_error(request, 500, "Internal Server Error", NULL, "FATAL ERROR occurred");
+
+				if (avail <= 0) {
+					if (http_out_flush(&request->out) < 0) {
+						break;
+					}
+					continue;
+				}
+
+				int read = fread(out->data + out->len, 1, avail, file);
+				if (read <= 0) {
+					break;
+				}
+				out->len += read;
+			}
+		} else {
+			// No memory for the output buffer, the headers are already out, so
+			// send the body in small writes
+			char data[128];
+			int read;
+
+			while ((read = fread(data, 1, sizeof(data), file)) > 0) {
+				if (http_out_write(&request->out, data, read) < 0) {
+					break;
 				}
 			}
 		}
-		//NOTE: no need to "clean up" the stack here!
-	} else {
-		char *data = calloc(1, HTTP_BUFF_SIZE);
-		if (data) {
-			int length = S_ISREG(statbuf->st_mode) ? statbuf->st_size : -1;
-			send_headers(request, 200, "OK", NULL, get_mime_type(path), length);
-			int read = 0;
-			while ((read = fread(data, 1, sizeof (data), file)) > 0) request_write(request, data, read);
-			free(data);
-		}
+		chunk_end(request);
 		fclose(file);
 	}
 }
@@ -710,170 +1327,707 @@ int filepath_merge(char *newpath, const char *rootpath, const char *reqpath, con
 		*pos = '/';
 		pos++;
 	}
-	*pos = 0;
+	*pos = 0;
+
+	// remove leading slashes from the request path
+	while (*reqpath=='/') {
+		reqpath++;
+	}
+
+	int rootlen = pos - newpath;
+	int pathlen = rootlen;
+
+	// add the request path segment by segment
+	while (*reqpath) {
+		// finding the closing '/'
+		const char *next = reqpath;
+		while (*next && (*next != '/')) {
+			++next;
+		}
+		seglen = next - reqpath;
+
+		if (seglen == 0 || (seglen == 1 && reqpath[0] == '.')) {
+			// noop segment (/ or ./) => skip
+		}
+		else if (seglen == 2 && reqpath[0] == '.' && reqpath[1] == '.') {
+			// backpath (../)
+
+			// try to crop the prior segment
+			do {
+				--pathlen;
+			} while (pathlen && newpath[pathlen - 1] != '/');
+
+			// now test if we are above root path length and
+			// get back if necessary
+			if (pathlen < rootlen) {
+				pathlen = rootlen;
+			}
+		}
+		else {
+			// an actual segment, append to dest path
+			if (*next) {
+				seglen++;
+			}
+			memcpy(newpath + pathlen, reqpath, seglen);
+			pathlen += seglen;
+		}
+
+		// skip over trailing slash => next segment
+		if (*next) {
+			++next;
+		}
+
+		reqpath = next;
+	}
+	pos = newpath + pathlen;
+
+	// add the additional path
+	if (addpath) {
+
+		// check if the addpath is only a file extension:
+		if (*addpath == '.') {
+			// make sure the current path does NOT end with a slash
+			if(*(pos-1) == '/') {
+				pos--;
+			}
+		}
+		else {
+			// make sure the current path ends with a slash
+			if(*(pos-1) != '/') {
+				*pos = '/';
+				pos++;
+			}
+
+			// remove leading slashes from the request path
+			while (*addpath=='/') {
+				addpath++;
+			}
+		}
+
+		seglen = strlen(addpath);
+		if(pos - newpath + seglen < HTTP_BUFF_SIZE)
+			memcpy(pos, addpath, seglen);
+
+		pos += seglen;
+	}
+	*pos = 0;
+
+	return 1;
+}
+
+static void list_dir(http_request_handle *request, char *pathbuf, struct stat *statbuf, int len) {
+	DIR *dir;
+	struct dirent *de;
+
+	send_headers(request, 200, "OK", NULL, "text/html", -1);
+	chunk(request, "<HTML><HEAD><TITLE>Index of %s</TITLE></HEAD><BODY>", request->path);
+	chunk(request, "<H4>Index of %s</H4>", request->path);
+
+	chunk(request, "<TABLE>");
+	chunk(request, "<TR>");
+	chunk(request, "<TH style=\"width: 250;text-align: left;\">Name</TH><TH style=\"width: 100px;text-align: right;\">Size</TH>");
+	chunk(request, "</TR>");
+
+	if (len > 1) {
+		chunk(request, "<TR>");
+		chunk(request, "<TD><A HREF=\"..\">..</A></TD><TD></TD>");
+		chunk(request, "</TR>");
+	}
+
+	filepath_merge(pathbuf, CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT, request->path, NULL); //restore folder pathbuf
+	dir = opendir(pathbuf);
+	while ((de = readdir(dir)) != NULL) {
+		filepath_merge(pathbuf, CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT, request->path, de->d_name);
+		stat(pathbuf, statbuf);
+
+		chunk(request, "<TR>");
+		chunk(request, "<TD>");
+		chunk(request, "<A HREF=\"%s%s\">", de->d_name, S_ISDIR(statbuf->st_mode) ? "/" : "");
+		chunk(request, "%s%s", de->d_name, S_ISDIR(statbuf->st_mode) ? "/</A>" : "</A> ");
+		chunk(request, "</TD>");
+		chunk(request, "<TD style=\"text-align: right;\">");
+		if (!S_ISDIR(statbuf->st_mode)) {
+			chunk(request, "%d", (int)statbuf->st_size);
+		}
+		chunk(request, "</TD>");
+		chunk(request, "</TR>");
+	}
+	closedir(dir);
+
+
+	chunk(request, "</TABLE>");
+
+	chunk(request, "</BODY></HTML>");
+
+	chunk_end(request);
+}
+
+/* we need this as the lwip implementation of
+ * getsockname(request->socket, (struct sockaddr*)&addr, &addr_len)
+ * returns an ip-address of 0 */
+static bool remote_matches_ap_subnet(http_request_handle *request) {
+
+	unmap_remote_addr(request);
+
+	if (request->client->ss_family==AF_INET) {
+		u32_t addr_client = ((struct sockaddr_in*)request->client)->sin_addr.s_addr & IP_CLASSA_HOST; //use IP_CLASSA_HOST instead of IP_CLASSC_NET as the IP address is "reversed"
+		return (ap_ip4addr == addr_client);
+	}
+	else if (request->client->ss_family==AF_INET6) {
+		//FIXME find out how to properly compare remote IPv6 with local AP's IPv6
+		//FIXME if they match on the right "class" then return true here
+	}
+
+	return false;
+}
+
+/*
+ * Route table. Routes are matched before looking for a file, exact routes
+ * first and then the longest matching prefix route.
+ */
+typedef struct http_route {
+	struct http_route *next;
+	char *method; //NULL for any method
+	char *path;
+	size_t len;
+	int flags;
+	http_route_handler_t handler; //native handler, or NULL for a lua route
+	void *arg;
+	int ref; //lua function reference
+} http_route_t;
+
+static http_route_t *http_routes = NULL;
+static pthread_mutex_t http_route_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int route_matches_method(http_route_t *route, const char *method) {
+	return (!route->method || (method && strcasecmp(route->method, method) == 0));
+}
+
+static int route_is(http_route_t *route, const char *method, const char *path) {
+	if (strcmp(route->path, path) != 0) return 0;
+	if (!route->method || !method) return (!route->method && !method);
+
+	return (strcasecmp(route->method, method) == 0);
+}
+
+// A prefix only matches whole path segments, so "/api" matches "/api" and
+// "/api/x", but not "/apix"
+static int route_prefix_matches(http_route_t *route, const char *path) {
+	if (strncmp(path, route->path, route->len) != 0) return 0;
+	if ((route->len > 0) && (route->path[route->len - 1] == '/')) return 1;
+
+	return ((path[route->len] == '\0') || (path[route->len] == '/'));
+}
+
+// Must be called with http_route_mtx locked
+static http_route_t *route_find(const char *method, const char *path) {
+	http_route_t *route, *best = NULL;
+
+	for (route = http_routes; route; route = route->next) {
+		if (!route_matches_method(route, method)) continue;
+
+		if (route->flags & HTTP_ROUTE_PREFIX) {
+			if (route_prefix_matches(route, path) && (!best || route->len > best->len)) {
+				best = route;
+			}
+		} else if (strcmp(path, route->path) == 0) {
+			return route;
+		}
+	}
+
+	return best;
+}
+
+// Must be called with http_route_mtx locked, returns the removed route
+static http_route_t *route_unlink(const char *method, const char *path) {
+	http_route_t **prev, *route;
+
+	for (prev = &http_routes; (route = *prev); prev = &route->next) {
+		if (route_is(route, method, path)) {
+			*prev = route->next;
+			return route;
+		}
+	}
+
+	return NULL;
+}
+
+static int route_add(const char *method, const char *path, int flags, http_route_handler_t handler, void *arg, int ref, int *old_ref) {
+	http_route_t *route, *old;
+
+	*old_ref = LUA_NOREF;
+
+	route = calloc(1, sizeof(http_route_t));
+	if (!route) {
+		return -1;
+	}
+
+	if (method && strcmp(method, "*") == 0) {
+		method = NULL;
+	}
+
+	route->method = method ? strdup(method) : NULL;
+	route->path = strdup(path);
+	if ((method && !route->method) || !route->path) {
+		free(route->method);
+		free(route->path);
+		free(route);
+		return -1;
+	}
+
+	route->len = strlen(path);
+	route->flags = flags;
+	route->handler = handler;
+	route->arg = arg;
+	route->ref = ref;
+
+	pthread_mutex_lock(&http_route_mtx);
+	old = route_unlink(method, path);
+	route->next = http_routes;
+	http_routes = route;
+	pthread_mutex_unlock(&http_route_mtx);
+
+	if (old) {
+		*old_ref = old->ref;
+		free(old->method);
+		free(old->path);
+		free(old);
+	}
+
+	return 0;
+}
+
+static int route_remove(const char *method, const char *path, int *old_ref) {
+	http_route_t *old;
+
+	if (method && strcmp(method, "*") == 0) {
+		method = NULL;
+	}
+
+	pthread_mutex_lock(&http_route_mtx);
+	old = route_unlink(method, path);
+	pthread_mutex_unlock(&http_route_mtx);
+
+	if (!old) {
+		return -1;
+	}
+
+	*old_ref = old->ref;
+	free(old->method);
+	free(old->path);
+	free(old);
+
+	return 0;
+}
+
+int http_route_add(const char *method, const char *path, int flags, http_route_handler_t handler, void *arg) {
+	int old_ref;
+
+	// A route without handler would be dispatched as a lua route
+	if (!handler || !path) {
+		return -1;
+	}
+
+	// There's no lua state here to release the function of a replaced lua
+	// route, so lua routes should only be replaced from lua
+	return route_add(method, path, flags, handler, arg, LUA_NOREF, &old_ref);
+}
+
+int http_route_remove(const char *method, const char *path) {
+	int old_ref;
+
+	return route_remove(method, path, &old_ref);
+}
+
+static void sse_subscribe(http_request_t *request, void *arg);
+
+// Serve the request from the route table, returns 1 if a route was found
+static int dispatch_route(http_request_handle *request) {
+	http_route_handler_t handler = NULL;
+	http_route_t *route;
+	void *arg = NULL;
+	int found = 0;
+
+	pthread_mutex_lock(&http_route_mtx);
+	route = route_find(request->method, request->path);
+	if (route) {
+		found = 1;
+		if (route->handler) {
+			handler = route->handler;
+			arg = route->arg;
+		} else {
+			// Push the function while the route can't be removed
+			lua_State *L = luaS_callback_state(request->config->callback);
+			lua_pushcfunction(L, &http_execute_lua);
+			lua_pushlightuserdata(L, (void*)request);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, route->ref);
+		}
+	}
+	pthread_mutex_unlock(&http_route_mtx);
+
+	// Nothing more is read from the client, except on event streams, where
+	// reading is how a closed subscriber is noticed, see sse_closed
+	if (!request->config->secure && handler != sse_subscribe) {
+		shutdown(request->socket, SHUT_RD);
+	}
+
+	if (!found) {
+		return 0;
+	}
+
+	syslog(LOG_DEBUG, "http: %s %s routed\r", request->method, request->path);
+
+	if (handler) {
+		handler(request, arg);
+		chunk_end(request);
+	} else {
+		call_lua(request);
+	}
+
+	return 1;
+}
+
+// net.service.http.route(method, path, func, [prefix])
+int http_route(lua_State* L) {
+	const char *method = luaL_optstring(L, 1, NULL);
+	const char *path = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	int flags = lua_toboolean(L, 4) ? HTTP_ROUTE_PREFIX : HTTP_ROUTE_EXACT;
+	int old_ref;
+
+	lua_pushvalue(L, 3);
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	if (route_add(method, path, flags, NULL, NULL, ref, &old_ref) < 0) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		return luaL_error(L, "not enough memory");
+	}
+
+	luaL_unref(L, LUA_REGISTRYINDEX, old_ref);
+
+	return 0;
+}
+
+// net.service.http.unroute(method, path)
+int http_unroute(lua_State* L) {
+	const char *method = luaL_optstring(L, 1, NULL);
+	const char *path = luaL_checkstring(L, 2);
+	int old_ref;
+
+	if (route_remove(method, path, &old_ref) < 0) {
+		return luaL_error(L, "route not found");
+	}
+
+	luaL_unref(L, LUA_REGISTRYINDEX, old_ref);
+
+	return 0;
+}
+
+const char *http_request_method(http_request_t *request) {
+	return request->method;
+}
+
+const char *http_request_path(http_request_t *request) {
+	return request->path;
+}
+
+const char *http_request_data(http_request_t *request) {
+	return request->data ? request->data : "";
+}
+
+const char *http_request_header(http_request_t *request, const char *name) {
+	return find_header(request, name);
+}
+
+void http_send_headers(http_request_t *request, int status, const char *title, const char *extra, const char *mime, int length) {
+	if (!request->headers_sent) {
+		send_headers(request, status, (char *)title, (char *)extra, (char *)mime, length);
+		request->headers_sent = 1;
+	}
+}
 
-	// remove leading slashes from the request path
-	while (*reqpath=='/') {
-		reqpath++;
+int http_write(http_request_t *request, const char *data, int length) {
+	return http_out_write(&request->out, data, length);
+}
+
+int http_printf(http_request_t *request, const char *fmt, ...) {
+	va_list args;
+	int ret;
+
+	va_start(args, fmt);
+	ret = http_out_vprintf(&request->out, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+/*
+ * Server-Sent Events. A GET request to an event stream route gets the
+ * text/event-stream headers, and then its connection is detached from the
+ * server thread and kept in the subscriber list, so the server can go on
+ * serving other requests. net.service.http.broadcast formats an event once
+ * and writes it to all the subscribers of the stream, dropping the ones that
+ * can't be written anymore.
+ *
+ * Subscriber sockets are non-blocking, so a broadcast never waits for a
+ * client. A subscriber that can't take a whole event in its send buffer is
+ * too slow (or gone), and it's dropped, because a partially written event
+ * can't be resumed without corrupting the stream.
+ */
+#define HTTP_SSE_MAX_SUBSCRIBERS 8
+
+typedef struct http_sse_subscriber {
+	struct http_sse_subscriber *next;
+	http_server_config *config;
+	int socket;
+	http_tls_session_t *tls;
+	char *stream;
+} http_sse_subscriber_t;
+
+static http_sse_subscriber_t *http_sse_subscribers = NULL;
+
+static void sse_free(http_sse_subscriber_t *subscriber) {
+	if (subscriber->tls) {
+		tls_session_free(subscriber->tls);
+	} else {
+		shutdown(subscriber->socket, SHUT_RDWR);
 	}
 
-	int rootlen = pos - newpath;
-	int pathlen = rootlen;
+	close(subscriber->socket);
+	free(subscriber->stream);
+	free(subscriber);
+}
 
-	// add the request path segment by segment
-	while (*reqpath) {
-		// finding the closing '/'
-		const char *next = reqpath;
-		while (*next && (*next != '/')) {
-			++next;
-		}
-		seglen = next - reqpath;
+static int sse_write(http_sse_subscriber_t *subscriber, const char *buffer, int length) {
+	int sent = 0;
+	int rc;
 
-		if (seglen == 0 || (seglen == 1 && reqpath[0] == '.')) {
-			// noop segment (/ or ./) => skip
+	while (sent < length) {
+		rc = subscriber->tls ? mbedtls_ssl_write(&subscriber->tls->ssl, (const unsigned char *)buffer + sent, length - sent) : send(subscriber->socket, buffer + sent, length - sent, MSG_DONTWAIT);
+		if (rc <= 0) {
+			// Includes EAGAIN / MBEDTLS_ERR_SSL_WANT_WRITE, the subscriber is too slow
+			return -1;
 		}
-		else if (seglen == 2 && reqpath[0] == '.' && reqpath[1] == '.') {
-			// backpath (../)
 
-			// try to crop the prior segment
-			do {
-				--pathlen;
-			} while (pathlen && newpath[pathlen - 1] != '/');
+		sent += rc;
+	}
 
-			// now test if we are above root path length and
-			// get back if necessary
-			if (pathlen < rootlen) {
-				pathlen = rootlen;
-			}
-		}
-		else {
-			// an actual segment, append to dest path
-			if (*next) {
-				seglen++;
-			}
-			memcpy(newpath + pathlen, reqpath, seglen);
-			pathlen += seglen;
-		}
+	http_stat_write(length);
 
-		// skip over trailing slash => next segment
-		if (*next) {
-			++next;
-		}
+	return 0;
+}
 
-		reqpath = next;
+// Check if the client of a subscriber closed the connection. Subscribers
+// don't send anything, so a readable socket is either the end of the
+// connection or data that is discarded. Called with http_sse_mtx locked,
+// broadcasts use the TLS session too.
+static int sse_closed(http_sse_subscriber_t *subscriber) {
+	char buffer[64];
+	int rc;
+
+	if (subscriber->tls) {
+		rc = mbedtls_ssl_read(&subscriber->tls->ssl, (unsigned char *)buffer, sizeof(buffer));
+		return (rc <= 0) && (rc != MBEDTLS_ERR_SSL_WANT_READ) && (rc != MBEDTLS_ERR_SSL_WANT_WRITE);
 	}
-	pos = newpath + pathlen;
 
-	// add the additional path
-	if (addpath) {
+	rc = recv(subscriber->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
 
-		// check if the addpath is only a file extension:
-		if (*addpath == '.') {
-			// make sure the current path does NOT end with a slash
-			if(*(pos-1) == '/') {
-				pos--;
-			}
-		}
-		else {
-			// make sure the current path ends with a slash
-			if(*(pos-1) != '/') {
-				*pos = '/';
-				pos++;
-			}
+	return (rc == 0) || ((rc < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK));
+}
 
-			// remove leading slashes from the request path
-			while (*addpath=='/') {
-				addpath++;
+// Add the sockets of the subscribers of a server to a select set, so that
+// the server sees when their clients go away. Returns the highest socket.
+static int sse_fd_set(http_server_config *config, fd_set *set, int max) {
+	http_sse_subscriber_t *subscriber;
+
+	pthread_mutex_lock(&http_sse_mtx);
+	for(subscriber = http_sse_subscribers;subscriber;subscriber = subscriber->next) {
+		if (subscriber->config == config) {
+			FD_SET(subscriber->socket, set);
+			if (subscriber->socket > max) {
+				max = subscriber->socket;
 			}
 		}
+	}
+	pthread_mutex_unlock(&http_sse_mtx);
 
-		seglen = strlen(addpath);
-		if(pos - newpath + seglen < HTTP_BUFF_SIZE)
-			memcpy(pos, addpath, seglen);
+	return max;
+}
 
-		pos += seglen;
+// Drop the subscribers of a server whose clients closed the connection,
+// without waiting for the next broadcast
+static void sse_reap(http_server_config *config, fd_set *set) {
+	http_sse_subscriber_t **prev, *subscriber;
+
+	pthread_mutex_lock(&http_sse_mtx);
+	prev = &http_sse_subscribers;
+	while ((subscriber = *prev)) {
+		if ((subscriber->config == config) && FD_ISSET(subscriber->socket, set) && sse_closed(subscriber)) {
+			*prev = subscriber->next;
+			http_sse_count--;
+			sse_free(subscriber);
+		} else {
+			prev = &subscriber->next;
+		}
 	}
-	*pos = 0;
-
-	return 1;
+	pthread_mutex_unlock(&http_sse_mtx);
 }
 
-static void list_dir(http_request_handle *request, char *pathbuf, struct stat *statbuf, int len) {
-	DIR *dir;
-	struct dirent *de;
+// Close the subscribers of a server that is shutting down
+static void sse_close_all(http_server_config *config) {
+	http_sse_subscriber_t **prev, *subscriber;
+
+	pthread_mutex_lock(&http_sse_mtx);
+	prev = &http_sse_subscribers;
+	while ((subscriber = *prev)) {
+		if (subscriber->config == config) {
+			*prev = subscriber->next;
+			http_sse_count--;
+			sse_free(subscriber);
+		} else {
+			prev = &subscriber->next;
+		}
+	}
+	pthread_mutex_unlock(&http_sse_mtx);
+}
 
-	send_headers(request, 200, "OK", NULL, "text/html", -1);
-	chunk(request, "<HTML><HEAD><TITLE>Index of %s</TITLE></HEAD><BODY>", request->path);
-	chunk(request, "<H4>Index of %s</H4>", request->path);
+// Route handler of event streams
+static void sse_subscribe(http_request_t *request, void *arg) {
+	http_sse_subscriber_t *subscriber;
 
-	chunk(request, "<TABLE>");
-	chunk(request, "<TR>");
-	chunk(request, "<TH style=\"width: 250;text-align: left;\">Name</TH><TH style=\"width: 100px;text-align: right;\">Size</TH>");
-	chunk(request, "</TR>");
+	if (strcasecmp(request->method, "GET") != 0) {
+		send_error(request, 405, "Method Not Allowed", NULL, "Event streams only accept GET.");
+		return;
+	}
 
-	if (len > 1) {
-		chunk(request, "<TR>");
-		chunk(request, "<TD><A HREF=\"..\">..</A></TD><TD></TD>");
-		chunk(request, "</TR>");
+	subscriber = calloc(1, sizeof(http_sse_subscriber_t));
+	if (subscriber) {
+		subscriber->stream = strdup(request->path);
 	}
 
-	filepath_merge(pathbuf, CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT, request->path, NULL); //restore folder pathbuf
-	dir = opendir(pathbuf);
-	while ((de = readdir(dir)) != NULL) {
-		filepath_merge(pathbuf, CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT, request->path, de->d_name);
-		stat(pathbuf, statbuf);
+	if (!subscriber || !subscriber->stream) {
+		free(subscriber);
+		send_error(request, 500, "Internal Server Error", NULL, "Error allocating memory.");
+		return;
+	}
 
-		chunk(request, "<TR>");
-		chunk(request, "<TD>");
-		chunk(request, "<A HREF=\"%s%s\">", de->d_name, S_ISDIR(statbuf->st_mode) ? "/" : "");
-		chunk(request, "%s%s", de->d_name, S_ISDIR(statbuf->st_mode) ? "/</A>" : "</A> ");
-		chunk(request, "</TD>");
-		chunk(request, "<TD style=\"text-align: right;\">");
-		if (!S_ISDIR(statbuf->st_mode)) {
-			chunk(request, "%d", (int)statbuf->st_size);
-		}
-		chunk(request, "</TD>");
-		chunk(request, "</TR>");
+	pthread_mutex_lock(&http_sse_mtx);
+	if (http_sse_count >= HTTP_SSE_MAX_SUBSCRIBERS) {
+		pthread_mutex_unlock(&http_sse_mtx);
+		free(subscriber->stream);
+		free(subscriber);
+		send_error(request, 503, "Service Unavailable", NULL, "Too many event stream subscribers.");
+		return;
+	}
+	http_sse_count++;
+	pthread_mutex_unlock(&http_sse_mtx);
+
+	// The stream ends when the connection is closed, so neither a length nor chunks
+	send_headers(request, 200, "OK", "X-Accel-Buffering: no", "text/event-stream", HTTP_NO_LENGTH);
+	request->headers_sent = 1;
+
+	if (http_out_flush(&request->out) < 0) {
+		// The client is already gone
+		pthread_mutex_lock(&http_sse_mtx);
+		http_sse_count--;
+		pthread_mutex_unlock(&http_sse_mtx);
+
+		free(subscriber->stream);
+		free(subscriber);
+		return;
 	}
-	closedir(dir);
 
+	// Broadcasts must never block on a subscriber, see sse_write
+	fcntl(request->socket, F_SETFL, fcntl(request->socket, F_GETFL, 0) | O_NONBLOCK);
 
-	chunk(request, "</TABLE>");
+	subscriber->config = request->config;
+	subscriber->socket = request->socket;
+	subscriber->tls = request->tls;
 
-	chunk(request, "</BODY></HTML>");
+	pthread_mutex_lock(&http_sse_mtx);
+	subscriber->next = http_sse_subscribers;
+	http_sse_subscribers = subscriber;
+	pthread_mutex_unlock(&http_sse_mtx);
 
-	do_printf(request, "0\r\n\r\n");
+	request->detached = 1;
 }
 
-/* we need this as the lwip implementation of
- * getsockname(request->socket, (struct sockaddr*)&addr, &addr_len)
- * returns an ip-address of 0 */
-static bool remote_matches_ap_subnet(http_request_handle *request) {
+// net.service.http.eventstream(path)
+int http_eventstream(lua_State* L) {
+	const char *path = luaL_checkstring(L, 1);
+	int old_ref;
 
-	// -> first clean a possible IP4 addr from its leading '::ffff:'
-	if (request->client->ss_family==AF_INET6) {
-			struct sockaddr_in6* sa6=(struct sockaddr_in6*)request->client;
-			if (IN6_IS_ADDR_V4MAPPED(&sa6->sin6_addr)) {
-					struct sockaddr_in sa4;
-					memset(&sa4,0,sizeof(sa4));
-					sa4.sin_family=AF_INET;
-					sa4.sin_port=sa6->sin6_port;
-					memcpy(&sa4.sin_addr.s_addr,sa6->sin6_addr.s6_addr+12,4);
-					memcpy(request->client,&sa4,sizeof(sa4));
-					request->client_len=sizeof(sa4);
-			}
+	if (route_add("GET", path, HTTP_ROUTE_EXACT, sse_subscribe, NULL, LUA_NOREF, &old_ref) < 0) {
+		return luaL_error(L, "not enough memory");
 	}
 
-	if (request->client->ss_family==AF_INET) {
-		u32_t addr_client = ((struct sockaddr_in*)request->client)->sin_addr.s_addr & IP_CLASSA_HOST; //use IP_CLASSA_HOST instead of IP_CLASSC_NET as the IP address is "reversed"
-		return (ap_ip4addr == addr_client);
+	luaL_unref(L, LUA_REGISTRYINDEX, old_ref);
+
+	return 0;
+}
+
+// net.service.http.broadcast(path, data, [event]), returns the number of subscribers reached
+int http_broadcast(lua_State* L) {
+	const char *path = luaL_checkstring(L, 1);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	const char *event = luaL_optstring(L, 3, NULL);
+	http_sse_subscriber_t **prev, *subscriber;
+	const char *line, *end;
+	luaL_Buffer b;
+	int count = 0;
+
+	// Format the event once, each line of data in its own data field
+	luaL_buffinit(L, &b);
+	if (event) {
+		luaL_addstring(&b, "event: ");
+		for (; *event; event++) {
+			// A line break would end the field and start a new one
+			if (*event != '\r' && *event != '\n') {
+				luaL_addchar(&b, *event);
+			}
+		}
+		luaL_addchar(&b, '\n');
 	}
-	else if (request->client->ss_family==AF_INET6) {
-		//FIXME find out how to properly compare remote IPv6 with local AP's IPv6
-		//FIXME if they match on the right "class" then return true here
+
+	// Clients end a line on CR, LF or CRLF, so split the data on all of them
+	line = data;
+	do {
+		for (end = line; end < data + len && *end != '\r' && *end != '\n'; end++);
+
+		luaL_addstring(&b, "data: ");
+		luaL_addlstring(&b, line, end - line);
+		luaL_addchar(&b, '\n');
+
+		line = end + 1;
+		if (end + 1 < data + len && end[0] == '\r' && end[1] == '\n') line++;
+	} while (end < data + len);
+
+	luaL_addchar(&b, '\n');
+	luaL_pushresult(&b);
+
+	const char *message = lua_tolstring(L, -1, &len);
+
+	pthread_mutex_lock(&http_sse_mtx);
+	prev = &http_sse_subscribers;
+	while ((subscriber = *prev)) {
+		if (strcmp(subscriber->stream, path) == 0) {
+			if (sse_write(subscriber, message, len) < 0) {
+				*prev = subscriber->next;
+				http_sse_count--;
+				sse_free(subscriber);
+				continue;
+			}
+
+			count++;
+		}
+
+		prev = &subscriber->next;
 	}
+	pthread_mutex_unlock(&http_sse_mtx);
 
-	return false;
+	lua_pushinteger(L, count);
+	return 1;
 }
 
 static int process(http_request_handle *request) {
@@ -938,47 +2092,6 @@ static int process(http_request_handle *request) {
 		}
 	}
 
-	//only in AP mode we redirect arbitrary host names to our own host name
-	if (captivedns_running() && (wifi_mode == WIFI_MODE_AP || wifi_mode == WIFI_MODE_APSTA) && remote_matches_ap_subnet(request)) {
-
-		//find the Host: header and check if it matches our IP or captive server name
-		while (do_gets(pathbuf, HTTP_BUFF_SIZE, request) && strlen(pathbuf)>0 ) {
-
-			//quick check if the first char matches, only then do strcasestr
-			if(pathbuf[0]=='h' || pathbuf[0]=='H') {
-				host = strcasestr(pathbuf, "Host:");
-
-				//check if the line begins with "Host:"
-				if (host==(char *)pathbuf) {
-					save_ptr = NULL;
-					host = strtok_r(host, ":", &save_ptr); //Host:
-					host = strtok_r(NULL, "\r", &save_ptr); //the actual host
-					while(*host==' ') host++; //skip any spaces after the colon
-
-					if (0 == strcasecmp(CAPTIVE_SERVER_NAME, host) ||
-							0 == strcasecmp(ap_ip4addr_str, host)) {
-						break; //done parsing headers
-					}
-					else {
-						//redirect
-						snprintf(pathbuf, HTTP_BUFF_SIZE, "Location: http://%s/", CAPTIVE_SERVER_NAME);
-						send_headers(request, 302, "Found", pathbuf, NULL, 0);
-						free(reqbuf);
-						free(pathbuf);
-						request->path = NULL;
-						request->data = NULL;
-						if (request->printf_buffer) {
-							free(request->printf_buffer);
-							request->printf_buffer = NULL;
-						}
-						return 0;
-					}
-				}
-			}
-
-		} // while
-	} // AP mode
-
 	if (!request->method || !request->path) {
 		free(reqbuf);
 		free(pathbuf);
@@ -987,68 +2100,83 @@ static int process(http_request_handle *request) {
 		return -1; //protocol may be omitted
 	}
 
-	if(strcasecmp(request->method, "POST") == 0) {
+	//a request without protocol doesn't have headers
+	if (protocol && read_headers(request, pathbuf) < 0) {
+		send_error(request, 500, "Internal Server Error", NULL, "Error allocating memory.");
+		free(reqbuf);
+		free(pathbuf);
+		request->path = NULL;
+		request->data = NULL;
+		return 0;
+	}
+
+	//only in AP mode we redirect arbitrary host names to our own host name
+	if (captivedns_running() && (wifi_mode == WIFI_MODE_AP || wifi_mode == WIFI_MODE_APSTA) && remote_matches_ap_subnet(request)) {
+
+		//check if the Host: header matches our IP or captive server name
+		host = find_header(request, "Host");
+		if (host && 0 != strcasecmp(CAPTIVE_SERVER_NAME, host) && 0 != strcasecmp(ap_ip4addr_str, host)) {
+			//redirect
+			snprintf(pathbuf, HTTP_BUFF_SIZE, "Location: http://%s/", CAPTIVE_SERVER_NAME);
+			send_headers(request, 302, "Found", pathbuf, NULL, 0);
+			free(reqbuf);
+			free(pathbuf);
+			free(request->headers);
+			request->headers = NULL;
+			request->path = NULL;
+			request->data = NULL;
+			return 0;
+		}
+	} // AP mode
+
+	//read the request data of POST requests, and of any other non-GET request with content
+	if(strcasecmp(request->method, "POST") == 0 || (strcasecmp(request->method, "GET") != 0 && find_header(request, "Content-Length"))) {
 		char *skip;
 		int contentlength = HTTP_BUFF_SIZE;
-		//skip headers to the actual request data
-		while (do_gets(pathbuf, HTTP_BUFF_SIZE, request) && strlen(pathbuf)>0 ) {
-			if (strlen(pathbuf)<3) {
-				skip = pathbuf;
-				while (*skip=='\r' || *skip=='\n') skip++;
-				if (strlen(skip)==0) {
-					break;
-				}
-			}
-			else {
-				//look for the content-length header to avoid
-				//a timeout later when reading the actual request data
-
-				//quick check if the first char matches, only then do strcasestr
-				if(pathbuf[0]=='c' || pathbuf[0]=='C') {
-					char *contentlen = strcasestr(pathbuf, "Content-Length:");
-
-					//check if the line begins with "Content-Length:"
-					if (contentlen==(char *)pathbuf) {
-						save_ptr = NULL;
-						contentlen = strtok_r(contentlen, ":", &save_ptr); //Content-Length:
-						contentlen = strtok_r(NULL, "\r", &save_ptr); //the actual content length
-						while(*contentlen==' ') contentlen++; //skip any spaces after the colon
-						contentlength = atoi(contentlen)+1;
-					}
-				}
+
+		//look for the content-length header to avoid
+		//a timeout later when reading the actual request data
+		char *contentlen = find_header(request, "Content-Length");
+		if (contentlen) {
+			contentlength = atoi(contentlen)+1;
+			if (contentlength > HTTP_BUFF_SIZE) {
+				contentlength = HTTP_BUFF_SIZE;
 			}
-		} // while headers
+		}
+
 		//while empty lines
+		*pathbuf = 0;
 		while (do_gets(pathbuf, contentlength, request) && strlen(pathbuf)>0 ) {
-			if (pathbuf && strlen(pathbuf)>0) {
-				skip = pathbuf;
-				while (*skip=='\r' || *skip=='\n') skip++;
-				if (strlen(skip)>0) {
-					break;
-				}
+			skip = pathbuf;
+			while (*skip=='\r' || *skip=='\n') skip++;
+			if (strlen(skip)>0) {
+				break;
 			}
 		} // while empty lines
 		//preserve the data
-		if (pathbuf && strlen(pathbuf)>0 ) {
+		if (strlen(pathbuf)>0 ) {
 			databuf = calloc(1, strlen(pathbuf)+1);
 			if (!databuf) {
 				send_error(request, 500, "Internal Server Error", NULL, "Error allocating POST data memory.");
 				free(reqbuf);
 				free(pathbuf);
+				free(request->headers);
+				request->headers = NULL;
 				request->path = NULL;
 				request->data = NULL;
 				return 0;
 			}
 			strcpy(databuf, pathbuf);
 			request->data = databuf;
-		} // while
+		}
 	}
 
 	syslog(LOG_DEBUG, "http: %s %s %s\r", request->method, request->path, protocol ? protocol:"");
 
-	if (!request->config->secure) shutdown(request->socket, SHUT_RD);
-
-	if (strcasecmp(request->method, "GET") != 0 && strcasecmp(request->method, "POST") != 0) {
+	if (dispatch_route(request)) {
+		//served by a route, without touching the file system
+	}
+	else if (strcasecmp(request->method, "GET") != 0 && strcasecmp(request->method, "POST") != 0) {
 		syslog(LOG_DEBUG, "http: %s not supported\r", request->method);
 		send_error(request, 501, "Not supported", NULL, "Method is not supported.");
 	}
@@ -1098,18 +2226,11 @@ static int process(http_request_handle *request) {
 	free(reqbuf);
 	free(pathbuf);
 	if (databuf) free(databuf);
+	free(request->headers);
+	request->headers = NULL;
 	request->path = NULL;
 	request->data = NULL;
 
-	if (request->chunk_buffer) {
-		free(request->chunk_buffer);
-		request->chunk_buffer = NULL;
-	}
-	if (request->printf_buffer) {
-		free(request->printf_buffer);
-		request->printf_buffer = NULL;
-	}
-
 	return 0;
 }
 
@@ -1166,16 +2287,11 @@ static void http_net_callback(system_event_t *event){
 	}
 }
 
-static void mbedtls_zeroize( void *v, size_t n ) {
-	volatile unsigned char *p = v; while( n-- ) *p++ = 0;
-}
-
 extern __NOINIT_ATTR uint32_t backtrace_count;
 static void *http_thread(void *arg) {
 	http_server_config *config = (http_server_config*) arg;
 	struct sockaddr_in6 sin;
-	SSL_CTX *ctx = NULL;
-	SSL *ssl = NULL;
+	http_tls_session_t *tls = NULL;
 	int rc = 0;
 
 	net_init();
@@ -1211,52 +2327,10 @@ static void *http_thread(void *arg) {
 		setsockopt(*config->server, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 	}
 
-	if (config->secure) {
-		ctx = SSL_CTX_new(TLS_server_method());
-		if (!ctx) {
-			syslog(LOG_ERR, "http: couldn't create SSL context\n");
-			return NULL;
-		}
-
-		//load cert
-		size_t certificate_bytes;
-		unsigned char *certificate_buf;
-		if( mbedtls_pk_load_file( config->certificate, &certificate_buf, &certificate_bytes ) != 0 ) {
-			syslog(LOG_ERR, "http: couldn't load SSL certificate\n");
-			SSL_CTX_free(ctx);
-			ctx = NULL;
-			return NULL;
-		}
-		if (!SSL_CTX_use_certificate_ASN1(ctx, certificate_bytes, certificate_buf)) {
-			syslog(LOG_ERR, "http: couldn't set SSL certificate\n");
-			mbedtls_zeroize( certificate_buf, certificate_bytes );
-			//MUST NOT free certificate_buf !!!
-			SSL_CTX_free(ctx);
-			ctx = NULL;
-			return NULL;
-		}
-		mbedtls_zeroize( certificate_buf, certificate_bytes );
-		//MUST NOT free certificate_buf !!!
+	http_refcount++;
 
-		//load privkey
-		size_t private_key_bytes;
-		unsigned char *private_key_buf;
-		if( mbedtls_pk_load_file( config->private_key, &private_key_buf, &private_key_bytes ) != 0 ) {
-			syslog(LOG_ERR, "http: couldn't load SSL certificate\n");
-			SSL_CTX_free(ctx);
-			ctx = NULL;
-			return NULL;
-		}
-		if (!SSL_CTX_use_PrivateKey_ASN1(0, ctx, private_key_buf, private_key_bytes)) {
-			syslog(LOG_ERR, "http: couldn't load SSL private key\n");
-			mbedtls_zeroize( private_key_buf, private_key_bytes );
-			//MUST NOT free private_key_buf !!!
-			SSL_CTX_free(ctx);
-			ctx = NULL;
-			return NULL;
-		}
-		mbedtls_zeroize( private_key_buf, private_key_bytes );
-		//MUST NOT free private_key_buf !!!
+	if (config->secure && tls_setup(config) < 0) {
+		goto done;
 	}
 
 	syslog(LOG_INFO, "http: server listening on port %d\n", config->port);
@@ -1265,10 +2339,28 @@ static void *http_thread(void *arg) {
 	struct sockaddr_storage client_addr;
 	socklen_t client_addr_len = sizeof(client_addr);
 
-	http_refcount++;
+	int detached = 0;
+
 	while (!http_shutdown) {
+		struct timeval wait = {1L, 0L}; /* check for shutdown every second */
+		fd_set set;
+		int max;
+
+		// Wait for a request, or for an event stream subscriber to go away
+		FD_ZERO(&set);
+		FD_SET(*config->server, &set);
+		max = sse_fd_set(config, &set, *config->server);
+
+		if (select(max + 1, &set, NULL, NULL, &wait) <= 0) {
+			continue;
+		}
+
+		sse_reap(config, &set);
+
+		if (!FD_ISSET(*config->server, &set)) {
+			continue;
+		}
 
-		// Wait for a request ...
 		if ((client = accept(*config->server, (struct sockaddr *)&client_addr, &client_addr_len)) != -1) {
 
 			// We wait for send all data before close socket's stream
@@ -1283,41 +2375,40 @@ static void *http_thread(void *arg) {
 			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
 			if (config->secure) {
-				ssl = SSL_new(ctx);
-				if (!ssl) {
-					syslog(LOG_ERR, "http: couldn't create SSL session\n");
-					break; //exit the loop to shutdown the server
-				}
-
-				SSL_set_fd(ssl, client);
-
-				if (!(rc = SSL_accept(ssl))) {
-					int err_SSL_get_error = SSL_get_error(ssl, rc);
-					if (err_SSL_get_error == SSL_ERROR_SYSCALL) {
-						if (errno != EAGAIN && errno != ECONNRESET) {
-							syslog(LOG_ERR, "http: couldn't accept SSL connection - RC %d errno %d %s\n", rc, errno, strerror(errno));
-						}
-					} else {
-						syslog(LOG_ERR, "http: couldn't accept SSL connection - SSL_get_error() returned: %i\n", err_SSL_get_error);
-					}
-				} else {
+				tls = tls_session_accept(client);
+				if (tls) {
 					http_request_handle request = HTTP_Request_Secure_initializer;
+					http_out_init(&request.out, request_write, &request);
 					process(&request);
-				}
+					http_out_release(&request.out);
+					http_stat_add(&http_stat_requests, 1);
+					detached = request.detached;
 
-				SSL_shutdown(ssl);
-				SSL_free(ssl);
-				ssl = NULL;
+					if (!detached) {
+						tls_session_free(tls);
+					}
+					tls = NULL;
+				}
 			}
 			else
 			{
 				http_request_handle request = HTTP_Request_Normal_initializer;
+				http_out_init(&request.out, request_write, &request);
 				process(&request);
-				shutdown(client, SHUT_RDWR);
+				http_out_release(&request.out);
+				http_stat_add(&http_stat_requests, 1);
+				detached = request.detached;
+				if (!detached) {
+					shutdown(client, SHUT_RDWR);
+				}
 			}
 
-			close(client);
+			//event stream subscribers are now owned by the subscriber list
+			if (!detached) {
+				close(client);
+			}
 			client = -1;
+			detached = 0;
 
 			//make sure external systems can't occupy our whole cpu...
 			vTaskDelay(1 / portTICK_PERIOD_MS);
@@ -1330,10 +2421,12 @@ static void *http_thread(void *arg) {
 		}
 	}
 
-	if (config->secure) {
-		SSL_CTX_free(ctx);
-		ctx = NULL;
+done:
+	// Subscribers of this server are closed with it
+	sse_close_all(config);
 
+	if (config->secure) {
+		//the TLS configuration is kept for the next start
 		free(config->certificate);
 		config->certificate = NULL;
 
@@ -1356,6 +2449,11 @@ static void *http_thread(void *arg) {
 	    the TCP timewait state."
 	*/
 
+	if (config->callback != NULL) {
+		luaS_callback_destroy(config->callback);
+		config->callback = NULL;
+	}
+
 	http_refcount--;
 
 	if (0 == http_refcount) {
@@ -1390,7 +2488,7 @@ int http_start(lua_State* L) {
 		// Create document root directory if not exist
 		mkpath(CONFIG_LUA_RTOS_HTTP_SERVER_DOCUMENT_ROOT);
 
-		// Prepare a callback to execute lua code
+		// Prepare a callback, its lua state is also used by the captive dns service
 		if (http_callback != NULL) {
 			luaS_callback_destroy(http_callback);
 			http_callback = NULL;
@@ -1447,6 +2545,12 @@ int http_start(lua_State* L) {
 
 		http_normal.port = luaL_optinteger( L, 1, CONFIG_LUA_RTOS_HTTP_SERVER_PORT );
 		if (http_normal.port) {
+			// Each server runs its pages in its own lua thread, so pages
+			// served by both servers can run at the same time
+			lua_pushcfunction(L, &http_execute_lua);
+			http_normal.callback = luaS_callback_create(L, -1);
+			lua_pop(L, 1);
+
 			res = pthread_create(&thread_normal, &attr, http_thread, &http_normal);
 			if (res) {
 				return luaL_error(L, "couldn't start http_thread");
@@ -1462,6 +2566,10 @@ int http_start(lua_State* L) {
 		http_secure.private_key = private_key ? strdup(private_key) : NULL;
 
 		if ( http_secure.port && http_secure.certificate && http_secure.private_key ) {
+			lua_pushcfunction(L, &http_execute_lua);
+			http_secure.callback = luaS_callback_create(L, -1);
+			lua_pop(L, 1);
+
 			res = pthread_create(&thread_secure, &attr, http_thread, &http_secure);
 			if (res) {
 				return luaL_error(L, "couldn't start secure http_thread");
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, http server routes
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_USE_HTTP_SERVER
+
+#ifndef HTTP_HTTPSRV_H_
+#define HTTP_HTTPSRV_H_
+
+#include <stdarg.h>
+
+// Request being served, opaque for route handlers
+typedef struct http_request_handle http_request_t;
+
+/*
+ * Native route handler. It runs in the http server thread, and must send the
+ * response using the http_send_headers / http_write / http_printf functions.
+ */
+typedef void (*http_route_handler_t)(http_request_t *request, void *arg);
+
+// Route flags
+#define HTTP_ROUTE_EXACT  0
+#define HTTP_ROUTE_PREFIX 1
+
+/**
+ * @brief Register a native handler for a route. Requests for the route are
+ *        dispatched to the handler without touching the file system.
+ *
+ * @param method HTTP method ("GET", "POST", ...), or NULL for any method.
+ * @param path Route path. With HTTP_ROUTE_PREFIX it matches the request paths
+ *             starting with it at a segment boundary ("/api" matches "/api" and
+ *             "/api/x", but not "/apix"), and the longest matching prefix wins.
+ * @param flags HTTP_ROUTE_EXACT or HTTP_ROUTE_PREFIX.
+ * @param handler Handler function.
+ * @param arg Argument passed to the handler.
+ *
+ * @return
+ *     - 0 on success.
+ *     - -1 if handler or path is NULL, or if there is not enough memory.
+ */
+int http_route_add(const char *method, const char *path, int flags, http_route_handler_t handler, void *arg);
+
+/**
+ * @brief Remove a route registered with http_route_add, or from lua.
+ *
+ * @param method HTTP method used when the route was registered.
+ * @param path Route path.
+ *
+ * @return
+ *     - 0 on success.
+ *     - -1 if the route doesn't exist.
+ */
+int http_route_remove(const char *method, const char *path);
+
+// Request accessors for route handlers
+const char *http_request_method(http_request_t *request);
+const char *http_request_path(http_request_t *request);
+const char *http_request_data(http_request_t *request);
+const char *http_request_header(http_request_t *request, const char *name);
+
+/**
+ * @brief Send the response headers. With a length < 0 the body is sent with
+ *        chunked transfer encoding.
+ */
+void http_send_headers(http_request_t *request, int status, const char *title, const char *extra, const char *mime, int length);
+
+// Add data to the response body. They return -1 if the client is gone, then
+// the handler must stop writing, the rest of the response is discarded.
+int http_write(http_request_t *request, const char *data, int length);
+int http_printf(http_request_t *request, const char *fmt, ...);
+
+#endif
+
+#endif
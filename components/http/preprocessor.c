@@ -48,9 +48,76 @@
 #if CONFIG_LUA_RTOS_USE_HTTP_SERVER
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
 
 #include <sys/syslog.h>
 
+// Local that holds the request context, the page's chunk argument. Its name
+// can't clash with the page's own names, pages get the context with "...".
+#define CONTEXT_LOCAL "__http_context"
+
+// Request variables that older pages got as globals, and the context field
+// that holds each one
+static const struct {
+    const char *name;
+    const char *field;
+} legacy_globals[] = {
+    {"http_method",      "method"},
+    {"http_uri",         "uri"},
+    {"http_request",     "data"},
+    {"http_port",        "port"},
+    {"http_secure",      "secure"},
+    {"http_remote_addr", "remote_addr"},
+    {"http_remote_port", "remote_port"},
+    {"http_script_name", "script_name"},
+};
+
+#define LEGACY_GLOBALS (sizeof(legacy_globals) / sizeof(legacy_globals[0]))
+
+// Longest legacy name
+#define LEGACY_MAX_NAME 16
+
+/*
+ * Find the request variables that older pages got as globals, so that they
+ * can be declared as locals only when needed. Only whole identifiers match.
+ * Returns a mask with a bit set for each variable used by the page.
+ */
+static uint32_t legacy_globals_used(FILE *ifp) {
+    char token[LEGACY_MAX_NAME + 1];
+    uint32_t used = 0;
+    int len = 0;
+    int c, i;
+
+    do {
+        c = fgetc(ifp);
+
+        if ((c != EOF) && (isalnum(c) || (c == '_'))) {
+            if (len < LEGACY_MAX_NAME) {
+                token[len] = c;
+            }
+
+            len++;
+            continue;
+        }
+
+        if ((len > 0) && (len <= LEGACY_MAX_NAME)) {
+            token[len] = '\0';
+
+            for(i = 0;i < LEGACY_GLOBALS;i++) {
+                if (strcmp(token, legacy_globals[i].name) == 0) {
+                    used |= (1u << i);
+                }
+            }
+        }
+
+        len = 0;
+    } while (c != EOF);
+
+    return used;
+}
+
 int http_preprocess_lua_page(const char *ipath, const char *opath) {
     FILE *ifp; // Input file
     FILE *ofp; // Output file
@@ -64,6 +131,8 @@ int http_preprocess_lua_page(const char *ipath, const char *opath) {
 	char io_write = 0;
 	char add_cr = 0;
     char buff[6];
+    uint32_t used;
+    int i;
 
     const char *bt = "<?lua";
     const char *et = "?>";
@@ -89,8 +158,19 @@ int http_preprocess_lua_page(const char *ipath, const char *opath) {
 	string = 0;
 	*cbuff = '\0';
 
+	// The request context is the page's chunk argument
 	fprintf(ofp, "do\n");
-	fprintf(ofp, "local print = net.service.http.print_chunk\n");
+	fprintf(ofp, "local " CONTEXT_LOCAL " = ...\n");
+	fprintf(ofp, "local print = " CONTEXT_LOCAL ".print\n");
+
+	used = legacy_globals_used(ifp);
+	for(i = 0;i < LEGACY_GLOBALS;i++) {
+		if (used & (1u << i)) {
+			fprintf(ofp, "local %s = " CONTEXT_LOCAL ".%s\n", legacy_globals[i].name, legacy_globals[i].field);
+		}
+	}
+
+	rewind(ifp);
 
     while((c = fgetc(ifp)) != EOF) {
     	if (c == '"') {
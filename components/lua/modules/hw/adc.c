@@ -119,6 +119,7 @@ static int ladc_attach( lua_State* L ) {
     max = luaL_optinteger( L, 5, 0 );
 
     adc_userdata *adc = (adc_userdata *)lua_newuserdata(L, sizeof(adc_userdata));
+    adc->callback = NULL;
 
     if ((error = adc_setup(id, channel, 0, vref, max, res, &adc->h))) {
     	return luaL_driver_error(L, error);
@@ -148,6 +149,99 @@ static int ladc_read( lua_State* L ) {
     }
 }
 
+// Pass a block of samples to the Lua callback, as a binary string with the
+// raw samples (16 bits, little endian), and a table with the statistics
+static void ladc_block(void *arg, const uint16_t *samples, uint32_t n, const adc_block_stats_t *stats) {
+	lua_callback_t *callback = (lua_callback_t *)arg;
+	lua_State *L = luaS_callback_state(callback);
+
+	if (!samples) {
+		// Stopped, the callback is not running, so it can be destroyed
+		luaS_callback_destroy(callback);
+		return;
+	}
+
+	lua_pushlstring(L, (const char *)samples, n * sizeof(uint16_t));
+
+	lua_createtable(L, 0, 4);
+
+	lua_pushinteger(L, stats->min);
+	lua_setfield(L, -2, "min");
+
+	lua_pushinteger(L, stats->max);
+	lua_setfield(L, -2, "max");
+
+	lua_pushnumber(L, stats->mean);
+	lua_setfield(L, -2, "mean");
+
+	lua_pushnumber(L, stats->rms);
+	lua_setfield(L, -2, "rms");
+
+	luaS_callback_call(callback, 2);
+}
+
+static int ladc_stop( lua_State* L ) {
+    driver_error_t *error;
+    adc_userdata *adc = NULL;
+    uint32_t overruns = 0;
+
+    adc = (adc_userdata *)luaL_checkudata(L, 1, "adc.chan");
+    luaL_argcheck(L, adc, 1, "adc expected");
+
+    if (!adc->callback) {
+    	return 0;
+    }
+
+    if ((error = adc_stop(&adc->h, &overruns))) {
+    	return luaL_driver_error(L, error);
+    }
+
+    // Destroyed by ladc_block, that can be the caller
+    adc->callback = NULL;
+
+    lua_pushinteger(L, overruns);
+
+    return 1;
+}
+
+// ch:start(rate, size, callback)
+static int ladc_start( lua_State* L ) {
+    driver_error_t *error;
+    adc_userdata *adc = NULL;
+
+    adc = (adc_userdata *)luaL_checkudata(L, 1, "adc.chan");
+    luaL_argcheck(L, adc, 1, "adc expected");
+
+    lua_Integer rate = luaL_checkinteger( L, 2 );
+    lua_Integer size = luaL_checkinteger( L, 3 );
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    luaL_argcheck(L, rate > 0, 2, "invalid rate");
+    luaL_argcheck(L, (size > 0) && (size <= 16384), 3, "invalid size");
+
+    if (adc->callback) {
+    	return luaL_exception(L, ADC_ERR_CONT_STARTED);
+    }
+
+    lua_callback_t *callback = luaS_callback_create(L, 4);
+
+    if ((error = adc_start(&adc->h, rate, size, ladc_block, callback))) {
+    	luaS_callback_destroy(callback);
+    	return luaL_driver_error(L, error);
+    }
+
+    adc->callback = callback;
+
+    return 0;
+}
+
+// Destructor
+static int ladc_gc( lua_State* L ) {
+	ladc_stop(L);
+
+	return 0;
+}
+
 static const LUA_REG_TYPE ladc_map[] = {
 	{ LSTRKEY( "calibrate"),	  LFUNCVAL( ladc_calib  ) },
     { LSTRKEY( "attach"),		  LFUNCVAL( ladc_attach  ) },
@@ -182,8 +276,11 @@ static const LUA_REG_TYPE ladc_map[] = {
 
 static const LUA_REG_TYPE ladc_chan_map[] = {
   	{ LSTRKEY( "read"        ),	  LFUNCVAL( ladc_read          ) },
+  	{ LSTRKEY( "start"       ),	  LFUNCVAL( ladc_start         ) },
+  	{ LSTRKEY( "stop"        ),	  LFUNCVAL( ladc_stop          ) },
     { LSTRKEY( "__metatable" ),	  LROVAL  ( ladc_chan_map      ) },
 	{ LSTRKEY( "__index"     ),   LROVAL  ( ladc_chan_map      ) },
+	{ LSTRKEY( "__gc"        ),   LFUNCVAL( ladc_gc            ) },
 	{ LNILKEY, LNILVAL }
 };
 
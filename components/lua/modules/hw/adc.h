@@ -50,8 +50,11 @@
 #include "drivers/adc.h"
 #include "drivers/cpu.h"
 
+#include "sys.h"
+
 typedef struct {
     adc_channel_h_t h;
+    lua_callback_t *callback; // Continuous mode callback, NULL if not started
 } adc_userdata;
 
 #ifdef CPU_ADC0
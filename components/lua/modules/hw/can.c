@@ -186,24 +186,37 @@ static int lcan_dump(lua_State* L) {
 
 static int lcan_stats(lua_State* L) {
     can_status_info_t status_info;
+    can_gw_stats_t gw_stats;
+    int unit = 0, arg = 1;
+
+    // The unit is optional, for compatibility with can.stats([table])
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        unit = luaL_checkinteger(L, 1);
+        arg = 2;
+    }
+
     driver_error_t *error = can_check_error(can_get_status_info(&status_info));
     if (error) {
         return luaL_driver_error(L, error);
     }
 
+    if ((error = can_gateway_stats(unit, &gw_stats))) {
+        return luaL_driver_error(L, error);
+    }
+
     uint8_t table = 0;
 
     // Check if user wants result as a table, or wants scan's result
     // on the console
-    if (lua_gettop(L) == 1) {
-        luaL_checktype(L, 1, LUA_TBOOLEAN);
-        if (lua_toboolean(L, 1)) {
+    if (lua_gettop(L) == arg) {
+        luaL_checktype(L, arg, LUA_TBOOLEAN);
+        if (lua_toboolean(L, arg)) {
             table = 1;
         }
     }
 
     if (table) {
-        lua_createtable(L, 0, 12);
+        lua_createtable(L, 0, 15);
 
         lua_pushinteger(L, status_info.state);
         lua_setfield (L, -2, "state");
@@ -231,6 +244,28 @@ static int lcan_stats(lua_State* L) {
 
         lua_pushinteger(L, status_info.bus_error_count);
         lua_setfield (L, -2, "bus_error_count");
+
+        lua_createtable(L, 0, 6);
+
+        lua_pushinteger(L, gw_stats.rx_frames);
+        lua_setfield (L, -2, "rx_frames");
+
+        lua_pushinteger(L, gw_stats.rx_dropped);
+        lua_setfield (L, -2, "rx_dropped");
+
+        lua_pushinteger(L, gw_stats.tx_frames);
+        lua_setfield (L, -2, "tx_frames");
+
+        lua_pushinteger(L, gw_stats.tx_dropped);
+        lua_setfield (L, -2, "tx_dropped");
+
+        lua_pushinteger(L, gw_stats.batches);
+        lua_setfield (L, -2, "batches");
+
+        lua_pushinteger(L, gw_stats.clients);
+        lua_setfield (L, -2, "clients");
+
+        lua_setfield (L, -2, "gateway");
     } else {
         char *state = NULL;
         switch(status_info.state) {
@@ -252,6 +287,15 @@ static int lcan_stats(lua_State* L) {
             status_info.bus_error_count,
             status_info.arb_lost_count
         );
+
+        printf("gateway:\r\n");
+        printf("   clients: %d\r\n", gw_stats.clients);
+        printf("   bus to clients: %d frames, %d dropped, %d batches\r\n",
+            gw_stats.rx_frames, gw_stats.rx_dropped, gw_stats.batches
+        );
+        printf("   clients to bus: %d frames, %d dropped\r\n",
+            gw_stats.tx_frames, gw_stats.tx_dropped
+        );
     }
 
     return table;
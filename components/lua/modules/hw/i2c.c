@@ -54,6 +54,8 @@
 #include "modules.h"
 #include "error.h"
 
+#include <string.h>
+
 #include <drivers/i2c.h>
 #include <drivers/cpu.h>
 #include <drivers/gpio.h>
@@ -340,6 +342,179 @@ static int li2c_write(lua_State* L) {
     return 0;
 }
 
+// Get a field of a message table, without metamethods, so the data length
+// doesn't change between the passes over the messages
+static int li2c_msg_field(lua_State* L, int idx, const char *k) {
+    lua_pushstring(L, k);
+
+    return lua_rawget(L, idx);
+}
+
+// Parse the message table at index idx. If msg is NULL only the data length
+// is computed. Else the data is stored in data, that has room for avail bytes.
+// Returns the data length.
+static int li2c_msg_parse(lua_State* L, int idx, i2c_msg_t *msg, uint8_t *data, size_t avail) {
+    int address, isnum, read = 0, stop, type;
+    const char *sval = NULL;
+    size_t len = 0, i;
+    lua_Integer val;
+
+    idx = lua_absindex(L, idx);
+
+    if (!lua_istable(L, idx)) {
+        return luaL_error(L, "message table expected");
+    }
+
+    // Address, as "address" field, or as first element
+    if (li2c_msg_field(L, idx, "address") == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_rawgeti(L, idx, 1);
+    }
+
+    address = lua_tointegerx(L, -1, &isnum);
+    if (!isnum || (address < 0) || (address > 0x7f)) {
+        return luaL_error(L, "invalid address");
+    }
+    lua_pop(L, 1);
+
+    // Data
+    if (li2c_msg_field(L, idx, "read") != LUA_TNIL) {
+        val = lua_tointegerx(L, -1, &isnum);
+        if (!isnum || (val < 1) || (val > 0xffff)) {
+            return luaL_error(L, "invalid read length");
+        }
+
+        len = val;
+        read = 1;
+    }
+    lua_pop(L, 1);
+
+    switch ((type = li2c_msg_field(L, idx, "write"))) {
+    case LUA_TNIL:
+        break;
+
+    case LUA_TNUMBER:
+        len = 1;
+        break;
+
+    case LUA_TSTRING:
+        sval = lua_tolstring(L, -1, &len);
+        break;
+
+    case LUA_TTABLE:
+        len = lua_rawlen(L, -1);
+        break;
+
+    default:
+        return luaL_error(L, "invalid write data");
+    }
+
+    if (read && (type != LUA_TNIL)) {
+        return luaL_error(L, "a message can't read and write");
+    }
+
+    if (len > 0xffff) {
+        return luaL_error(L, "invalid write length");
+    }
+
+    // The messages are parsed twice, the second time they must fit in the
+    // space got the first time
+    if (data && (len > avail)) {
+        return luaL_error(L, "message changed while parsed");
+    }
+
+    if (data) {
+        switch (type) {
+        case LUA_TNUMBER:
+            data[0] = (uint8_t) (luaL_checkinteger(L, -1) & 0xff);
+            break;
+
+        case LUA_TSTRING:
+            memcpy(data, sval, len);
+            break;
+
+        case LUA_TTABLE:
+            for(i = 0;i < len;i++) {
+                lua_rawgeti(L, -1, i + 1);
+                data[i] = (uint8_t) (luaL_checkinteger(L, -1) & 0xff);
+                lua_pop(L, 1);
+            }
+            break;
+        }
+    }
+    lua_pop(L, 1);
+
+    li2c_msg_field(L, idx, "stop");
+    stop = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    if (msg) {
+        msg->address = address;
+        msg->flags = (read?I2C_MSG_READ:0) | (stop?I2C_MSG_STOP:0);
+        msg->len = len;
+        msg->buf = data;
+    }
+
+    return len;
+}
+
+static int li2c_transfer(lua_State* L) {
+    driver_error_t *error;
+    i2c_user_data_t *user_data;
+    i2c_msg_t *msg;
+    uint8_t *data;
+    size_t size = 0, len;
+    int count, i, reads = 0;
+
+    // Get user data
+    user_data = (i2c_user_data_t *) luaL_checkudata(L, 1, "i2c.trans");
+    luaL_argcheck(L, user_data, 1, "i2c transaction expected");
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    count = lua_rawlen(L, 2);
+    luaL_argcheck(L, count > 0, 2, "message list is empty");
+
+    // Get the data length of all messages
+    for(i = 1;i <= count;i++) {
+        lua_rawgeti(L, 2, i);
+        size += li2c_msg_parse(L, -1, NULL, NULL, 0);
+        lua_pop(L, 1);
+    }
+
+    // Messages and data are stored in a single userdata, collected after return
+    msg = (i2c_msg_t *) lua_newuserdata(L, sizeof(i2c_msg_t) * count + size);
+    data = (uint8_t *) (msg + count);
+
+    for(i = 0;i < count;i++) {
+        lua_rawgeti(L, 2, i + 1);
+        len = li2c_msg_parse(L, -1, &msg[i], data, size);
+        lua_pop(L, 1);
+
+        data += len;
+        size -= len;
+
+        if (msg[i].flags & I2C_MSG_READ) {
+            reads++;
+        }
+    }
+
+    if ((error = i2c_transfer(user_data->unit, msg, count, NULL))) {
+        return luaL_driver_error(L, error);
+    }
+
+    // Return the read data, one string for each read message
+    luaL_checkstack(L, reads, "too many read messages");
+
+    for(i = 0;i < count;i++) {
+        if (msg[i].flags & I2C_MSG_READ) {
+            lua_pushlstring(L, (const char *) msg[i].buf, msg[i].len);
+        }
+    }
+
+    return reads;
+}
+
 // Destructor
 static int li2c_trans_gc(lua_State *L) {
     li2c_detach(L);
@@ -365,6 +540,7 @@ static const LUA_REG_TYPE li2c_trans_map[] = {
     { LSTRKEY( "address"     ),        LFUNCVAL( li2c_address   ) },
     { LSTRKEY( "read"        ),        LFUNCVAL( li2c_read      ) },
     { LSTRKEY( "write"       ),        LFUNCVAL( li2c_write     ) },
+    { LSTRKEY( "transfer"    ),        LFUNCVAL( li2c_transfer  ) },
     { LSTRKEY( "setspeed"    ),        LFUNCVAL( li2c_setspeed  ) },
     { LSTRKEY( "stop"        ),        LFUNCVAL( li2c_stop      ) },
     { LSTRKEY( "__metatable" ),        LROVAL  ( li2c_trans_map ) },
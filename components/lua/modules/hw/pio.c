@@ -26,6 +26,7 @@
 #include <drivers/gpio.h>
 
 #include "esp_intr.h"
+#include "esp_timer.h"
 
 // PIO public constants
 #define PIO_DIR_OUTPUT      0
@@ -90,6 +91,116 @@ static void pioTask(void *taskArgs) {
     luaS_callback_destroy(args->callback);
 }
 
+// Default values for pio.pin.edges
+#define PIO_EDGES_LATENCY   100  // Max latency, in milliseconds
+#define PIO_EDGES_SIZE      256  // Edges stored in the ring buffer
+
+typedef struct {
+    uint32_t time;  // esp_timer time of the edge, in microseconds (wraps around)
+    uint32_t level; // Pin level after the edge
+} pio_edge_t;
+
+typedef struct {
+    uint8_t pin;
+    uint8_t type;
+    lua_callback_t *callback;
+    TaskHandle_t task;
+    TickType_t latency;        // Max time between an edge and the callback, in ticks
+    pio_edge_t *edges;         // Ring buffer with the captured edges
+    uint32_t size;             // Ring buffer size, power of 2
+    volatile uint32_t head;    // Edges captured, only updated by the interrupt handler
+    volatile uint32_t tail;    // Edges delivered, only updated by the task
+    volatile uint32_t overflow;// Edges dropped because the ring buffer was full
+} pio_edges_t;
+
+// Capture an edge into the ring buffer, without disabling the interrupt. The
+// task is notified when the first edge is captured after the ring buffer is
+// empty, and when the ring buffer becomes half full.
+static void IRAM_ATTR pio_edges_intr_handler(void* arg) {
+    portBASE_TYPE high_priority_task_awoken = 0;
+    pio_edges_t *args = (pio_edges_t *)arg;
+    uint32_t head = args->head;
+    uint32_t count = head - args->tail;
+    pio_edge_t *edge;
+
+    if (count == args->size) {
+        args->overflow++;
+        return;
+    }
+
+    edge = &args->edges[head & (args->size - 1)];
+    edge->time = (uint32_t)esp_timer_get_time();
+
+    switch (args->type) {
+        case GPIO_INTR_POSEDGE: edge->level = 1; break;
+        case GPIO_INTR_NEGEDGE: edge->level = 0; break;
+        default: edge->level = gpio_ll_pin_get(args->pin); break;
+    }
+
+    // The edge must be in the ring buffer before the task can see it
+    __sync_synchronize();
+    args->head = head + 1;
+
+    if ((count == 0) || (count + 1 == (args->size >> 1))) {
+        vTaskNotifyGiveFromISR(args->task, &high_priority_task_awoken);
+
+        if(high_priority_task_awoken == pdTRUE) {
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+// Deliver the captured edges to the Lua callback in batches, as an array of
+// {level, time} entries, plus the number of dropped edges
+static void pioEdgesTask(void *taskArgs) {
+    pio_edges_t *args = (pio_edges_t *)taskArgs;
+    lua_State *L = luaS_callback_state(args->callback);
+    uint32_t overflow = 0;
+    uint32_t tail, count, i;
+    pio_edge_t *edge;
+
+    for(;;) {
+        // Wait for the first edge
+        if (args->head == args->tail) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+
+        // Wait until the max latency expires, or until the ring buffer is half
+        // full, to get more edges in the same batch
+        if (args->head - args->tail < (args->size >> 1)) {
+            ulTaskNotifyTake(pdTRUE, args->latency);
+        }
+
+        tail = args->tail;
+        count = args->head - tail;
+        if ((count == 0) && (overflow == args->overflow)) {
+            continue;
+        }
+
+        lua_createtable(L, count, 0);
+        for(i = 0; i < count; i++) {
+            edge = &args->edges[(tail + i) & (args->size - 1)];
+
+            lua_createtable(L, 2, 0);
+            lua_pushinteger(L, edge->level);
+            lua_rawseti(L, -2, 1);
+            lua_pushinteger(L, edge->time);
+            lua_rawseti(L, -2, 2);
+            lua_rawseti(L, -2, i + 1);
+        }
+
+        // The edges are copied, the interrupt handler can reuse their space
+        args->tail = tail + count;
+
+        overflow = args->overflow;
+        lua_pushinteger(L, overflow);
+
+        luaS_callback_call(args->callback, 2);
+    }
+
+    luaS_callback_destroy(args->callback);
+}
+
 // Helper functions
 //
 // port goes from 1 to GPIO_PORTS
@@ -418,6 +529,74 @@ static int pio_pin_interrupt(lua_State *L) {
     return 0;
 }
 
+static int pio_pin_edges(lua_State *L) {
+    driver_error_t *error;
+    pio_edges_t *args;
+
+    uint32_t pin = luaL_checkinteger(L, 1);
+    int type = luaL_optinteger(L, 3, GPIO_INTR_ANYEDGE);
+    int latency = luaL_optinteger(L, 4, PIO_EDGES_LATENCY);
+    int size = luaL_optinteger(L, 5, PIO_EDGES_SIZE);
+    int stack = luaL_optinteger(L, 6, CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE);
+    int priority = luaL_optinteger(L, 7, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY);
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if ((type != GPIO_INTR_POSEDGE) && (type != GPIO_INTR_NEGEDGE) && (type != GPIO_INTR_ANYEDGE)) {
+        return luaL_error(L, "invalid edge type");
+    }
+
+    if (latency < 0) {
+        return luaL_error(L, "invalid latency");
+    }
+
+    if (size < 2) {
+        return luaL_error(L, "invalid size");
+    }
+
+    args = (pio_edges_t *)calloc(1,sizeof(pio_edges_t));
+    if (!args) {
+        return luaL_exception(L, GPIO_ERR_NOT_ENOUGH_MEMORY);
+    }
+
+    // Ring buffer size must be a power of 2
+    args->size = 2;
+    while (args->size < size) {
+        args->size <<= 1;
+    }
+
+    args->edges = (pio_edge_t *)calloc(args->size, sizeof(pio_edge_t));
+    if (!args->edges) {
+        free(args);
+        return luaL_exception(L, GPIO_ERR_NOT_ENOUGH_MEMORY);
+    }
+
+    args->callback = luaS_callback_create(L, 2);
+    if (args->callback == NULL) {
+        free(args->edges);
+        free(args);
+        return luaL_exception(L, GPIO_ERR_NOT_ENOUGH_MEMORY);
+    }
+
+    args->pin = pin;
+    args->type = type;
+    args->latency = latency / portTICK_PERIOD_MS;
+
+    // ISR related task must run on the same core that ISR handler is added
+    xTaskCreatePinnedToCore(pioEdgesTask, "lpio", stack, args, priority, &args->task, xPortGetCoreID());
+
+    if ((error = gpio_isr_attach(pin, pio_edges_intr_handler, type, args))) {
+        vTaskDelete(args->task);
+        luaS_callback_destroy(args->callback);
+        free(args->edges);
+        free(args);
+
+        return luaL_driver_error(L, error);
+    }
+
+    return 0;
+}
+
 static int pio_port_setdir(lua_State *L) {
     return pio_gen_setdir(L, PIO_PORT_OP);
 }
@@ -491,6 +670,7 @@ static const LUA_REG_TYPE pio_pin_map[] = {
     { LSTRKEY( "getval"    ),            LFUNCVAL( pio_pin_getval     ) },
     { LSTRKEY( "num"         ),          LFUNCVAL( pio_pin_pinnum     ) },
     { LSTRKEY( "interrupt" ),            LFUNCVAL( pio_pin_interrupt  ) },
+    { LSTRKEY( "edges"     ),            LFUNCVAL( pio_pin_edges      ) },
     { LSTRKEY( "IntrPosEdge"   ),        LINTVAL ( GPIO_INTR_POSEDGE        ) },
     { LSTRKEY( "IntrNegEdge"   ),        LINTVAL ( GPIO_INTR_NEGEDGE        ) },
     { LSTRKEY( "IntrAnyEdge"   ),        LINTVAL ( GPIO_INTR_ANYEDGE        ) },
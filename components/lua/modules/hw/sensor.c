@@ -244,16 +244,26 @@ static int lsensor_dettach( lua_State* L ) {
 
     if (!udata->instance) return 0;
 
-    // Destroy callbacks
+    // Get callbacks, they are destroyed when the sensor is not dispatching
+    // them anymore
+    int callbacks[SENSOR_MAX_CALLBACKS];
     int i;
     for(i=0; i < SENSOR_MAX_CALLBACKS; i++) {
-        if (udata->instance->callbacks[i].callback_id) {
-            luaS_callback_destroy((lua_callback_t *)udata->instance->callbacks[i].callback_id);
+        callbacks[i] = udata->instance->callbacks[i].callback_id;
+    }
+
+    // Destroy sensor. The callbacks are removed from the sensor even if
+    // there is an error.
+    error = sensor_unsetup(udata->instance);
+
+    // Destroy callbacks
+    for(i=0; i < SENSOR_MAX_CALLBACKS; i++) {
+        if (callbacks[i]) {
+            luaS_callback_destroy((lua_callback_t *)callbacks[i]);
         }
     }
 
-    // Destroy sensor
-    if ((error = sensor_unsetup(udata->instance))) {
+    if (error) {
         return luaL_driver_error(L, error);
     }
 
@@ -262,6 +272,49 @@ static int lsensor_dettach( lua_State* L ) {
     return 0;
 }
 
+// instance:set("filter", id, type [, param [, deadband]])
+//
+// type is "none", "average", "median", "iir" or "decimate". param is the
+// window size for "average" and "median", the decimation factor for
+// "decimate", and the smoothing factor for "iir".
+static int lsensor_set_filter( lua_State* L, sensor_userdata *udata ) {
+    static const char *const types[] = {"none", "average", "median", "iir", "decimate", NULL};
+    driver_error_t *error;
+    sensor_filter_config_t config;
+
+    const char *id = luaL_checkstring( L, 3 );
+
+    memset(&config, 0, sizeof(config));
+    config.type = luaL_checkoption(L, 4, NULL, types);
+
+    switch (config.type) {
+        case SENSOR_FILTER_AVERAGE:
+        case SENSOR_FILTER_MEDIAN:
+        case SENSOR_FILTER_DECIMATE: {
+            lua_Integer n = luaL_checkinteger(L, 5);
+
+            luaL_argcheck(L, (n > 0) && (n <= ((config.type == SENSOR_FILTER_DECIMATE)?UINT8_MAX:SENSOR_FILTER_MAX_N)), 5, "invalid value");
+            config.n = n;
+            break;
+        }
+
+        case SENSOR_FILTER_IIR:
+            config.alpha = luaL_checknumber(L, 5);
+            break;
+
+        default:
+            break;
+    }
+
+    config.deadband = luaL_optnumber(L, 6, 0);
+
+    if ((error = sensor_set_filter(udata->instance, id, &config))) {
+        return luaL_driver_error(L, error);
+    }
+
+    return 0;
+}
+
 static int lsensor_set( lua_State* L ) {
     sensor_userdata *udata = NULL;
     driver_error_t *error;
@@ -277,6 +330,11 @@ static int lsensor_set( lua_State* L ) {
         return luaL_exception(L, SENSOR_ERR_DETACHED);
     }
 
+    // Data filters are handled by the driver, not by the sensor
+    if (strcmp(property, "filter") == 0) {
+        return lsensor_set_filter(L, udata);
+    }
+
     // Prepare property value
     if ((ret = lsensor_set_prepare(L, udata->instance->sensor, property, &property_value))) {
         return ret;
@@ -786,6 +844,134 @@ static int lsensor_callback(lua_State* L) {
     return 0;
 }
 
+static int lsensor_stats(lua_State* L) {
+    sensor_userdata *udata = NULL;
+
+    udata = (sensor_userdata *)luaL_checkudata(L, 1, "sensor.ins");
+    luaL_argcheck(L, udata, 1, "sensor expected");
+
+    if (!udata->instance) {
+        return luaL_exception(L, SENSOR_ERR_DETACHED);
+    }
+
+    lua_createtable(L, 0, 6);
+
+    lua_pushinteger(L, udata->instance->deferred.slot.dispatched);
+    lua_setfield (L, -2, "dispatched");
+
+    lua_pushinteger(L, udata->instance->deferred.slot.coalesced);
+    lua_setfield (L, -2, "coalesced");
+
+    lua_pushinteger(L, udata->instance->deferred.slot.dropped);
+    lua_setfield (L, -2, "dropped");
+
+    lua_pushinteger(L, udata->instance->sampling.samples);
+    lua_setfield (L, -2, "samples");
+
+    lua_pushinteger(L, udata->instance->sampling.sched.batched);
+    lua_setfield (L, -2, "batched");
+
+    lua_pushinteger(L, udata->instance->sampling.errors);
+    lua_setfield (L, -2, "errors");
+
+    return 1;
+}
+
+static int lsensor_sample(lua_State* L) {
+    sensor_userdata *udata = NULL;
+    driver_error_t *error;
+
+    udata = (sensor_userdata *)luaL_checkudata(L, 1, "sensor.ins");
+    luaL_argcheck(L, udata, 1, "sensor expected");
+
+    lua_Integer period = luaL_checkinteger(L, 2);
+    lua_Integer depth = luaL_optinteger(L, 3, SENSOR_HISTORY_DEPTH);
+
+    luaL_argcheck(L, period >= 0, 2, "invalid period");
+    luaL_argcheck(L, (depth > 0) && (depth <= UINT16_MAX), 3, "invalid depth");
+
+    if (!udata->instance) {
+        return luaL_exception(L, SENSOR_ERR_DETACHED);
+    }
+
+    if ((error = sensor_sample(udata->instance, period, depth))) {
+        return luaL_driver_error(L, error);
+    }
+
+    return 0;
+}
+
+static int lsensor_history(lua_State* L) {
+    sensor_userdata *udata = NULL;
+    driver_error_t *error;
+    sensor_value_t *value;
+    int64_t *t;
+    int i, count;
+
+    udata = (sensor_userdata *)luaL_checkudata(L, 1, "sensor.ins");
+    luaL_argcheck(L, udata, 1, "sensor expected");
+
+    const char *id = luaL_checkstring(L, 2);
+
+    if (!udata->instance) {
+        return luaL_exception(L, SENSOR_ERR_DETACHED);
+    }
+
+    count = luaL_optinteger(L, 3, udata->instance->sampling.history.depth);
+    luaL_argcheck(L, count >= 0, 3, "invalid count");
+
+    if (count > udata->instance->sampling.history.depth) {
+        count = udata->instance->sampling.history.depth;
+    }
+
+    t = calloc(count + 1, sizeof(int64_t));
+    value = calloc(count + 1, sizeof(sensor_value_t));
+    if (!t || !value) {
+        free(t);
+        free(value);
+        return luaL_exception(L, SENSOR_ERR_NOT_ENOUGH_MEMORY);
+    }
+
+    if ((error = sensor_history(udata->instance, id, &count, t, value))) {
+        free(t);
+        free(value);
+        return luaL_driver_error(L, error);
+    }
+
+    // Each sample is returned as { value, time }, oldest first
+    lua_createtable(L, count, 0);
+
+    for(i=0;i < count;i++) {
+        lua_createtable(L, 2, 0);
+
+        switch (value[i].type) {
+            case SENSOR_DATA_INT:
+                lua_pushinteger(L, value[i].integerd.value);
+                break;
+            case SENSOR_DATA_FLOAT:
+                lua_pushnumber(L, value[i].floatd.value);
+                break;
+            case SENSOR_DATA_DOUBLE:
+                lua_pushnumber(L, value[i].doubled.value);
+                break;
+            default:
+                lua_pushnil(L);
+                break;
+        }
+        lua_rawseti(L, -2, 1);
+
+        lua_pushinteger(L, t[i]);
+        lua_rawseti(L, -2, 2);
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    free(t);
+    free(value);
+
+    return 1;
+}
+
 // Destructor
 static int lsensor_ins_gc (lua_State *L) {
     lsensor_dettach(L);
@@ -809,6 +995,9 @@ static const LUA_REG_TYPE lsensor_ins_map[] = {
       { LSTRKEY( "set"         ),    LFUNCVAL( lsensor_set         ) },
       { LSTRKEY( "get"         ),    LFUNCVAL( lsensor_get         ) },
       { LSTRKEY( "callback"    ),    LFUNCVAL( lsensor_callback  ) },
+      { LSTRKEY( "stats"       ),    LFUNCVAL( lsensor_stats     ) },
+      { LSTRKEY( "sample"      ),    LFUNCVAL( lsensor_sample    ) },
+      { LSTRKEY( "history"     ),    LFUNCVAL( lsensor_history   ) },
     { LSTRKEY( "__metatable" ),    LROVAL  ( lsensor_ins_map   ) },
     { LSTRKEY( "__index"     ),  LROVAL  ( lsensor_ins_map   ) },
     { LSTRKEY( "__gc"        ),  LFUNCVAL( lsensor_ins_gc    ) },
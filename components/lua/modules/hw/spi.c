@@ -361,6 +361,45 @@ static int lspi_detach(lua_State* L) {
     return 0;
 }
 
+static int lspi_stats(lua_State* L) {
+    driver_error_t *error;
+    spi_stats_t stats;
+
+    spi_userdata *spi = (spi_userdata *)luaL_checkudata(L, 1, "spi.ins");
+    luaL_argcheck(L, spi, 1, "spi expected");
+
+    if ((error = spi_get_stats(spi->spi_device, &stats))) {
+        return luaL_driver_error(L, error);
+    }
+
+    lua_createtable(L, 0, 7);
+
+    lua_pushinteger(L, stats.transfers);
+    lua_setfield(L, -2, "transfers");
+
+    lua_pushinteger(L, stats.transactions);
+    lua_setfield(L, -2, "transactions");
+
+    lua_pushinteger(L, stats.copies);
+    lua_setfield(L, -2, "copies");
+
+    lua_pushnumber(L, stats.bytes);
+    lua_setfield(L, -2, "bytes");
+
+    // Throughput in bytes per second, while transferring
+    lua_pushnumber(L, stats.time?((double)stats.bytes * 1000000.0 / stats.time):0);
+    lua_setfield(L, -2, "throughput");
+
+    // Average and max time of a transfer, in usecs
+    lua_pushnumber(L, stats.transfers?((double)stats.time / stats.transfers):0);
+    lua_setfield(L, -2, "latency");
+
+    lua_pushinteger(L, stats.max_latency);
+    lua_setfield(L, -2, "max_latency");
+
+    return 1;
+}
+
 // Destructor
 static int lspi_ins_gc (lua_State *L) {
     lspi_detach(L);
@@ -390,6 +429,7 @@ static const LUA_REG_TYPE lspi_ins_map[] = {
     { LSTRKEY( "deselect"    ),  LFUNCVAL( lspi_deselect  ) },
     { LSTRKEY( "write"       ),  LFUNCVAL( lspi_write     ) },
     { LSTRKEY( "readwrite"   ),  LFUNCVAL( lspi_readwrite ) },
+    { LSTRKEY( "stats"       ),  LFUNCVAL( lspi_stats     ) },
     { LSTRKEY( "__metatable" ),  LROVAL  ( lspi_ins_map   ) },
     { LSTRKEY( "__index"     ),  LROVAL  ( lspi_ins_map   ) },
     { LSTRKEY( "__gc"        ),  LFUNCVAL( lspi_ins_gc    ) },
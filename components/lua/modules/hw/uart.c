@@ -319,6 +319,56 @@ static int luart_read( lua_State* L ) {
     return 0;
 }
 
+static int luart_readline( lua_State* L ) {
+    int id = luaL_checkinteger(L, 1);
+    const char *delims = luaL_optstring(L, 2, "\r\n");
+    int timeout, size, len;
+    uint8_t eol;
+    char *str;
+
+    // Some integrity checks
+    if (!uart_exists(id)) {
+        return luaL_error(L, "UART%d does not exist", id);
+    }
+
+    if (!uart_is_setup(id)) {
+        return luaL_error(L, "UART%d is not setup", id);
+    }
+
+    if (!*delims) {
+        return luaL_error(L, "delimiters can't be empty");
+    }
+
+    timeout = luaL_optinteger(L, 3, 0xffffffff);
+    if (timeout == 0xffffffff) {
+        timeout = portMAX_DELAY;
+    }
+
+    size = luaL_optinteger(L, 4, LUAL_BUFFERSIZE);
+    if (size < 1) {
+        return luaL_error(L, "invalid line size");
+    }
+
+    str = (char *)malloc(size + 1);
+    if (NULL == str) {
+        return luaL_error(L, "could not allocate memory to read line");
+    }
+
+    // The second result tells if the line is complete, or if it is a
+    // partial line because of a timeout, or because it doesn't fit in size
+    len = uart_readline(id, str, size + 1, delims, timeout, &eol);
+    if (len >= 0) {
+        lua_pushlstring(L, str, len);
+        lua_pushboolean(L, eol);
+    } else {
+        lua_pushnil(L);
+        lua_pushboolean(L, 0);
+    }
+
+    free(str);
+    return 2;
+}
+
 static int luart_consume( lua_State* L ) {
 	driver_error_t *error;
 	int id = luaL_checkinteger(L, 1);
@@ -364,6 +414,7 @@ static const LUA_REG_TYPE uart_map[] = {
 	{ LSTRKEY( "setpins"  ),	 LFUNCVAL( luart_setpins  ) },
     { LSTRKEY( "write"    ),	 LFUNCVAL( luart_write ) },
     { LSTRKEY( "read"     ),	 LFUNCVAL( luart_read ) },
+    { LSTRKEY( "readline" ),	 LFUNCVAL( luart_readline ) },
     { LSTRKEY( "consume"  ),	 LFUNCVAL( luart_consume ) },
     { LSTRKEY( "lock"     ),	 LFUNCVAL( luart_lock ) },
     { LSTRKEY( "unlock"   ),	 LFUNCVAL( luart_unlock ) },
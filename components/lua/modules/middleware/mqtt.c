@@ -56,6 +56,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
 
 #include <errno.h>
 #include <string.h>
@@ -63,6 +64,7 @@
 
 #include <mqtt/MQTTAsync.h>
 #include <mqtt/MQTTClientPersistence.h>
+#include <mqtt/mqtt_topic.h>
 
 #include <sys/mutex.h>
 #include <sys/delay.h>
@@ -74,6 +76,18 @@
 
 #define MQTT_CONNECT_TIMEOUT 20000
 
+// Default inbound queue size, and messages delivered per dispatcher run
+#define MQTT_QUEUE_SIZE  16
+#define MQTT_QUEUE_BATCH 1
+
+// Inbound queue overflow policies
+#define MQTT_QUEUE_DROP_OLDEST 0
+#define MQTT_QUEUE_DROP_NEWEST 1
+#define MQTT_QUEUE_BLOCK       2
+
+// With the block policy, time between checks for the client being collected
+#define MQTT_QUEUE_BLOCK_WAIT 100
+
 #define evMQTT_CONNECTED  ( 1 << 0 )
 #define evMQTT_TIMEOUT    ( 1 << 1 )
 
@@ -87,6 +101,7 @@ void MQTTAsync_init(void);
 #define LUA_MQTT_ERR_CANT_PUBLISH       (DRIVER_EXCEPTION_BASE(MQTT_DRIVER_ID) |  4)
 #define LUA_MQTT_ERR_CANT_DISCONNECT    (DRIVER_EXCEPTION_BASE(MQTT_DRIVER_ID) |  5)
 #define LUA_MQTT_ERR_NOT_ENOUGH_MEMORY  (DRIVER_EXCEPTION_BASE(MQTT_DRIVER_ID) |  6)
+#define LUA_MQTT_ERR_CANT_SET_QUEUE     (DRIVER_EXCEPTION_BASE(MQTT_DRIVER_ID) |  7)
 
 // Register driver and messages
 DRIVER_REGISTER_BEGIN(MQTT,mqtt,0,NULL,NULL);
@@ -97,6 +112,7 @@ DRIVER_REGISTER_BEGIN(MQTT,mqtt,0,NULL,NULL);
     DRIVER_REGISTER_ERROR(MQTT, mqtt, CannotPublishToTopic, "can't publish to topic", LUA_MQTT_ERR_CANT_PUBLISH);
     DRIVER_REGISTER_ERROR(MQTT, mqtt, CannotDisconnect, "can't disconnect", LUA_MQTT_ERR_CANT_DISCONNECT);
     DRIVER_REGISTER_ERROR(MQTT, mqtt, NotEnoughMemory, "not enough memory", LUA_MQTT_ERR_NOT_ENOUGH_MEMORY);
+    DRIVER_REGISTER_ERROR(MQTT, mqtt, CannotSetQueue, "can't set queue", LUA_MQTT_ERR_CANT_SET_QUEUE);
 DRIVER_REGISTER_END(MQTT,mqtt,0,NULL,NULL);
 
 // MQTT client initialized?
@@ -110,8 +126,34 @@ typedef struct {
     void *luafunc;            // For comparison *only*
     lua_callback_t *callback; // Lua callback, called when a message is received on topic
     void *next;               // Next subscribed topic
+    void *sibling;            // Next subscription with the same topic
+    int pending;              // Messages in the callback's batch table
+    void *match;              // Next subscription matching the message being dispatched
 } mqtt_subs;
 
+// Inbound message, as received from the MQTT client
+typedef struct {
+    char *topicName;
+    int topicLen;
+    MQTTAsync_message *m;     // NULL stops the dispatcher
+} mqtt_inbound;
+
+// Subscriptions matching the message being dispatched
+typedef struct {
+    mqtt_subs *first;
+    mqtt_subs **last;
+} mqtt_delivery;
+
+// Resources handed over to the dispatcher when the client is collected from one
+// of its callbacks. The dispatcher can't wait for itself, so it releases them
+// once the running callback returns.
+typedef struct {
+    int detached;
+    mqtt_subs *subs;
+    mqtt_topic_node topics;
+    QueueHandle_t queue;
+} mqtt_orphan;
+
 // MQTT user data
 typedef struct {
     struct mtx mtx;
@@ -129,156 +171,351 @@ typedef struct {
     // Subscription list
     mqtt_subs *subs;
 
+    // Subscription topic trie, used for dispatch
+    mqtt_topic_node topics;
+
+    // Inbound message queue, drained by the dispatcher task
+    QueueHandle_t queue;
+    TaskHandle_t dispTask;
+    TaskHandle_t gcTask;
+    mqtt_orphan *orphan;      // In the dispatcher's stack
+    volatile int closing;     // Client is being collected, stop blocking on a full queue
+    int queue_size;
+    int queue_policy;
+    int queue_batch;
+    uint32_t queue_max;       // Queue high watermark
+    uint32_t queue_dropped;
+    uint32_t queue_delivered;
+
     int secure;
     int persistence;
 } mqtt_userdata;
 
-// Emit a Lua exception using the result code (rc) provided by the MQTT library
-static int mqtt_emit_exeption(lua_State* L, int exception, int rc) {
+// Get the message of a result code (rc) provided by the MQTT library, or NULL
+static const char *mqtt_error_string(int rc) {
     switch (rc) {
     case MQTTASYNC_FAILURE:
-        return luaL_exception_extended(L, exception, "client failure");
-        break;
+        return "client failure";
 
     case MQTTASYNC_PERSISTENCE_ERROR:
-        return luaL_exception_extended(L, exception, "persistence error");
-        break;
+        return "persistence error";
 
     case MQTTASYNC_DISCONNECTED:
-        return luaL_exception_extended(L, exception, "client is disconnected");
-        break;
+        return "client is disconnected";
 
     case MQTTASYNC_MAX_MESSAGES_INFLIGHT:
-        return luaL_exception_extended(L, exception, "maximum number of messages allowed to be simultaneously in-flight has been reached");
-        break;
+        return "maximum number of messages allowed to be simultaneously in-flight has been reached";
 
     case MQTTASYNC_BAD_UTF8_STRING:
-        return luaL_exception_extended(L, exception, "an invalid UTF-8 string has been detected");
-        break;
+        return "an invalid UTF-8 string has been detected";
 
     case MQTTASYNC_NULL_PARAMETER:
-        return luaL_exception_extended(L, exception, "a NULL parameter has been supplied when this is invalid");
-        break;
+        return "a NULL parameter has been supplied when this is invalid";
 
     case MQTTASYNC_TOPICNAME_TRUNCATED:
-        return luaL_exception_extended(L, exception, "the topic has been truncated (the topic string includes embedded NULL characters");
-        break;
+        return "the topic has been truncated (the topic string includes embedded NULL characters";
 
     case MQTTASYNC_BAD_STRUCTURE:
-        return luaL_exception_extended(L, exception, "a structure parameter does not have the correct eye-catcher and version number");
-        break;
+        return "a structure parameter does not have the correct eye-catcher and version number";
 
     case MQTTASYNC_BAD_QOS:
-        return luaL_exception_extended(L, exception, "a qos parameter is not 0, 1 or 2");
-        break;
+        return "a qos parameter is not 0, 1 or 2";
 
     case MQTTASYNC_NO_MORE_MSGIDS:
-        return luaL_exception_extended(L, exception, "all message ids are being used");
-        break;
+        return "all message ids are being used";
 
     case MQTTASYNC_OPERATION_INCOMPLETE:
-        return luaL_exception_extended(L, exception, "the request is being discarded when not complete");
-        break;
+        return "the request is being discarded when not complete";
 
     case MQTTASYNC_MAX_BUFFERED_MESSAGES:
-        return luaL_exception_extended(L, exception, "no more messages can be buffered");
-        break;
+        return "no more messages can be buffered";
 
     case MQTTASYNC_SSL_NOT_SUPPORTED:
-        return luaL_exception_extended(L, exception, "attempting SSL connection using non-SSL version of library");
-        break;
+        return "attempting SSL connection using non-SSL version of library";
 
     case MQTTASYNC_BAD_PROTOCOL:
-        return luaL_exception_extended(L, exception, "protocol prefix in serverURI should be tcp:// or ssl://");
-        break;
+        return "protocol prefix in serverURI should be tcp:// or ssl://";
+    }
+
+    return NULL;
+}
+
+// Emit a Lua exception using the result code (rc) provided by the MQTT library
+static int mqtt_emit_exeption(lua_State* L, int exception, int rc) {
+    const char *msg = mqtt_error_string(rc);
+
+    if (msg) {
+        return luaL_exception_extended(L, exception, msg);
     }
 
     return 0;
 }
 
-// Extracted from:
-//
-// http://git.eclipse.org/c/mosquitto/org.eclipse.mosquitto.git/tree/lib/util_mosq.c
-//
-// mosquitto_topic_matches_sub function
-static int topic_matches_sub(const char *sub, const char *topic) {
-    int slen, tlen;
-    int spos, tpos;
-    bool multilevel_wildcard = false;
+// Append the subscriptions linked to a trie node to the delivery list
+static void topic_node_match(mqtt_topic_node *node, void *arg) {
+    mqtt_delivery *delivery = (mqtt_delivery *)arg;
+    mqtt_subs *subs;
+
+    for (subs = (mqtt_subs *)node->subs; subs; subs = subs->sibling) {
+        subs->match = NULL;
+        *delivery->last = subs;
+        delivery->last = (mqtt_subs **)&subs->match;
+    }
+}
+
+// Call the Lua callbacks of the matching subscriptions. In batch mode the message is
+// appended to the callback's batch table instead, which is delivered by the dispatcher
+// at the end of the batch. Stops if the client is collected by a callback.
+static void mqtt_deliver(mqtt_subs *subs, mqtt_inbound *msg, int batch, mqtt_orphan *orphan) {
+    MQTTAsync_message *m = msg->m;
+    lua_State *L;
+
+    for (; subs && !orphan->detached; subs = subs->match) {
+        L = luaS_callback_state(subs->callback);
+
+        if (batch > 1) {
+            if (subs->pending == 0) {
+                lua_createtable(L, batch, 0);
+            }
 
-    slen = strlen(sub);
-    tlen = strlen(topic);
+            lua_createtable(L, 0, 2);
+            lua_pushlstring(L, m->payload, m->payloadlen);
+            lua_setfield(L, -2, "payload");
+        } else {
+            // Push argument for the callback's function
+            lua_pushinteger(L, m->payloadlen);
+            lua_pushlstring(L, m->payload, m->payloadlen);
+        }
 
-    if (slen && tlen) {
-        if ((sub[0] == '$' && topic[0] != '$')
-                || (topic[0] == '$' && sub[0] != '$')) {
+        // see: https://www.ibm.com/support/knowledgecenter/SSFKSJ_7.5.0/com.ibm.mq.javadoc.doc/WMQMQxrCClasses/_m_q_t_t_client_8h.html?view=kc#aa42130dd069e7e949bcab37b6dce64a5
+        if (batch > 1) {
+            if (msg->topicLen == 0) {
+                lua_pushstring(L, msg->topicName);
+            } else {
+                lua_pushlstring(L, msg->topicName, msg->topicLen);
+            }
+            lua_setfield(L, -2, "topic");
+
+            lua_rawseti(L, -2, ++subs->pending);
+        } else {
+            if (msg->topicLen == 0) {
+                lua_pushinteger(L, strlen(msg->topicName));
+                lua_pushstring(L, msg->topicName);
+            } else {
+                lua_pushinteger(L, msg->topicLen);
+                lua_pushlstring(L, msg->topicName, msg->topicLen);
+            }
 
-            return 0;
+            luaS_callback_call(subs->callback, 4);
         }
     }
+}
 
-    spos = 0;
-    tpos = 0;
+static void mqtt_inbound_free(mqtt_inbound *msg) {
+    MQTTAsync_freeMessage(&msg->m);
+    MQTTAsync_free(msg->topicName);
+}
 
-    while (spos < slen && tpos < tlen) {
-        if (sub[spos] == topic[tpos]) {
-            if (tpos == tlen - 1) {
-                /* Check for e.g. foo matching foo/# */
-                if (spos == slen - 3 && sub[spos + 1] == '/'
-                        && sub[spos + 2] == '#') {
-                    multilevel_wildcard = true;
-                    return 1;
-                }
+// Free the inbound queue, with the messages not yet delivered
+static void mqtt_queue_free(QueueHandle_t queue) {
+    mqtt_inbound msg;
+
+    while (xQueueReceive(queue, &msg, 0) == pdTRUE) {
+        if (msg.m) {
+            mqtt_inbound_free(&msg);
+        }
+    }
+
+    vQueueDelete(queue);
+}
+
+// Free the subscriptions, with their Lua callbacks, and the topic trie
+static void mqtt_subs_free(mqtt_subs *subs, mqtt_topic_node *topics) {
+    mqtt_subs *next_subs;
+
+    while (subs) {
+        luaS_callback_destroy(subs->callback);
+
+        next_subs = subs->next;
+        if (subs->topic){
+          free(subs->topic);
+          subs->topic = NULL;
+        }
+
+        free(subs);
+        subs = next_subs;
+    }
+
+    mqtt_topic_node_free(topics);
+}
+
+// Dispatcher task, delivers the queued messages to the Lua callbacks, up to
+// queue_batch messages per run. The callbacks are called without mqtt->mtx,
+// and the client can be collected by one of them, then mqtt is no longer valid.
+static void mqtt_dispatcher(void *arg) {
+    mqtt_userdata *mqtt = (mqtt_userdata *)arg;
+    mqtt_orphan orphan = {0, NULL, {NULL, NULL, NULL, NULL}, NULL};
+    mqtt_delivery delivery;
+    mqtt_inbound msg;
+    mqtt_subs *subs;
+    int stop = 0;
+    int batch;
+    int count;
+
+    mqtt->orphan = &orphan;
+
+    while (!stop) {
+        xQueueReceive(mqtt->queue, &msg, portMAX_DELAY);
+        if (!msg.m) {
+            break;
+        }
+
+        mtx_lock(&mqtt->mtx);
+        batch = mqtt->queue_batch;
+        mtx_unlock(&mqtt->mtx);
+
+        count = 0;
+        for(;;) {
+            delivery.first = NULL;
+            delivery.last = &delivery.first;
+
+            mtx_lock(&mqtt->mtx);
+            mqtt_topic_match(&mqtt->topics, msg.topicName, topic_node_match, &delivery);
+            mtx_unlock(&mqtt->mtx);
+
+            mqtt_deliver(delivery.first, &msg, batch, &orphan);
+            mqtt_inbound_free(&msg);
+            count++;
+
+            if (orphan.detached) {
+                stop = 1;
+                break;
             }
-            spos++;
-            tpos++;
-            if (spos == slen && tpos == tlen) {
-                return 1;
-            } else if (tpos == tlen && spos == slen - 1 && sub[spos] == '+') {
-                spos++;
-                return 1;
+
+            if ((count >= batch) || (xQueueReceive(mqtt->queue, &msg, 0) != pdTRUE)) {
+                break;
             }
-        } else {
-            if (sub[spos] == '+') {
-                spos++;
-                while (tpos < tlen && topic[tpos] != '/') {
-                    tpos++;
-                }
-                if (tpos == tlen && spos == slen) {
-                    return 1;
-                }
-            } else if (sub[spos] == '#') {
-                multilevel_wildcard = true;
-                if (spos + 1 != slen) {
-                    return 0;
-                } else {
-                    return 1;
+
+            if (!msg.m) {
+                stop = 1;
+                break;
+            }
+        }
+
+        if ((batch > 1) && !orphan.detached) {
+            // Subscriptions are only added to the head of the list
+            mtx_lock(&mqtt->mtx);
+            subs = mqtt->subs;
+            mtx_unlock(&mqtt->mtx);
+
+            for (; subs && !orphan.detached; subs = subs->next) {
+                if (subs->pending) {
+                    subs->pending = 0;
+                    luaS_callback_call(subs->callback, 1);
                 }
-            } else {
-                return 0;
             }
         }
+
+        if (orphan.detached) {
+            break;
+        }
+
+        mtx_lock(&mqtt->mtx);
+        mqtt->queue_delivered += count;
+        mtx_unlock(&mqtt->mtx);
     }
 
-    if (multilevel_wildcard == false && (tpos < tlen || spos < slen)) {
+    if (orphan.detached) {
+        mqtt_subs_free(orphan.subs, &orphan.topics);
+        mqtt_queue_free(orphan.queue);
+    } else {
+        xTaskNotify(mqtt->gcTask, 0, eSetValueWithOverwrite);
+    }
+
+    vTaskDelete(NULL);
+}
+
+// Create the inbound queue and start the dispatcher
+static int mqtt_queue_start(mqtt_userdata *mqtt) {
+    if (mqtt->queue) {
         return 0;
     }
 
+    mqtt->queue = xQueueCreate(mqtt->queue_size, sizeof(mqtt_inbound));
+    if (!mqtt->queue) {
+        return -1;
+    }
+
+    if (xTaskCreatePinnedToCore(mqtt_dispatcher, "mqtt", CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE, mqtt, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &mqtt->dispTask, xPortGetCoreID()) != pdPASS) {
+        vQueueDelete(mqtt->queue);
+        mqtt->queue = NULL;
+        return -1;
+    }
+
     return 0;
 }
 
+// Stop the dispatcher and free the inbound queue. When called from the dispatcher,
+// that is from a callback, the queue and the subscriptions are handed over to the
+// dispatcher instead.
+static void mqtt_queue_stop(mqtt_userdata *mqtt) {
+    mqtt_inbound msg = {NULL, 0, NULL};
+    mqtt_inbound old;
+    uint32_t rc_val;
+
+    if (!mqtt->queue) {
+        return;
+    }
+
+    if (xTaskGetCurrentTaskHandle() == mqtt->dispTask) {
+        mtx_lock(&mqtt->mtx);
+        mqtt->orphan->subs = mqtt->subs;
+        mqtt->orphan->topics = mqtt->topics;
+        mqtt->orphan->queue = mqtt->queue;
+        mqtt->orphan->detached = 1;
+
+        mqtt->subs = NULL;
+        memset(&mqtt->topics, 0, sizeof(mqtt->topics));
+        mtx_unlock(&mqtt->mtx);
+    } else {
+        // The client is destroyed, so nothing else sends to the queue. If it's
+        // full, drop the oldest message to make room for the stop.
+        mqtt->gcTask = xTaskGetCurrentTaskHandle();
+        while (xQueueSend(mqtt->queue, &msg, 0) != pdTRUE) {
+            if (xQueueReceive(mqtt->queue, &old, 0) == pdTRUE) {
+                if (old.m) {
+                    mqtt_inbound_free(&old);
+                }
+            }
+        }
+        xTaskNotifyWait(ULONG_MAX, ULONG_MAX, &rc_val, portMAX_DELAY);
+
+        mqtt_queue_free(mqtt->queue);
+    }
+
+    mqtt->queue = NULL;
+    mqtt->dispTask = NULL;
+}
+
 // Add a topic to the subscription list, and subscribe the topic to the broker if client is
 // connected. Also, a Lua callback is linked with the topic.
 static int add_subs(lua_State *L, int index, mqtt_userdata *mqtt, const char *topic, int qos) {
 
     // make sure that the exact same callback has not yet been added
     void *luafunc = (void*)lua_topointer(L, index);
-    mqtt_subs *subs = mqtt->subs;
+    mqtt_topic_node *node = mqtt_topic_node_get(&mqtt->topics, topic, 0);
+    mqtt_subs *subs = (node?(mqtt_subs *)node->subs:NULL);
     while (subs) {
-        if (subs->qos == qos && 0 == strcmp(subs->topic, topic) && subs->luafunc == luafunc) {
+        if (subs->qos == qos && subs->luafunc == luafunc) {
             return 0; //return zero to indicate all is good
         }
-        subs = subs->next;
+        subs = subs->sibling;
+    }
+
+    // Get the trie node for the topic
+    node = mqtt_topic_node_get(&mqtt->topics, topic, 1);
+    if (!node) {
+        return luaL_exception_extended(L, LUA_MQTT_ERR_NOT_ENOUGH_MEMORY, NULL);
     }
 
     // Create and populate subscription structure
@@ -309,10 +546,13 @@ static int add_subs(lua_State *L, int index, mqtt_userdata *mqtt, const char *to
         return luaL_exception_extended(L, LUA_MQTT_ERR_NOT_ENOUGH_MEMORY, NULL);
     }
 
-    // Add the subscription to the subscription list
+    // Add the subscription to the subscription list and to the topic trie
     subs->next = mqtt->subs;
     mqtt->subs = subs;
 
+    subs->sibling = node->subs;
+    node->subs = subs;
+
     if (MQTTAsync_isConnected(mqtt->client)) {
         // If client is connected, subscribe to topic now
         int rc;
@@ -425,41 +665,57 @@ static void discSuccess(void *context, MQTTAsync_successData *response) {
     mtx_unlock(&mqtt->mtx);
 }
 
-// Message arrived callback
+// Message arrived callback, queues the message for the dispatcher. The message is
+// owned by the queue until it is delivered or dropped.
 static int msgArrived(void *context, char * topicName, int topicLen, MQTTAsync_message* m) {
     mqtt_userdata *mqtt = (mqtt_userdata *) context;
-    if (mqtt) {
-        mqtt_subs *subs;
+    mqtt_inbound msg = {topicName, topicLen, m};
+    mqtt_inbound old;
+    UBaseType_t waiting;
+    int queued;
+
+    if (mqtt && mqtt->queue) {
+        queued = (xQueueSend(mqtt->queue, &msg, 0) == pdTRUE);
+
+        // Wait for the dispatcher, unless the client is being collected, as the
+        // dispatcher may be the one collecting it
+        while (!queued && (mqtt->queue_policy == MQTT_QUEUE_BLOCK) && !mqtt->closing) {
+            queued = (xQueueSend(mqtt->queue, &msg, MQTT_QUEUE_BLOCK_WAIT / portTICK_PERIOD_MS) == pdTRUE);
+        }
 
-        mtx_lock(&mqtt->mtx);
+        if (!queued && (mqtt->queue_policy == MQTT_QUEUE_DROP_OLDEST)) {
+            // Make room, unless the dispatcher already did it
+            if (xQueueReceive(mqtt->queue, &old, 0) == pdTRUE) {
+                mqtt_inbound_free(&old);
 
-        subs = mqtt->subs;
-        while (subs) {
-            if (topic_matches_sub(subs->topic, topicName)) {
-                // Push argument for the callback's function
-                lua_pushinteger(luaS_callback_state(subs->callback), m->payloadlen);
-                lua_pushlstring(luaS_callback_state(subs->callback), m->payload, m->payloadlen);
-
-                // see: https://www.ibm.com/support/knowledgecenter/SSFKSJ_7.5.0/com.ibm.mq.javadoc.doc/WMQMQxrCClasses/_m_q_t_t_client_8h.html?view=kc#aa42130dd069e7e949bcab37b6dce64a5
-                if (topicLen == 0) {
-                    lua_pushinteger(luaS_callback_state(subs->callback), strlen(topicName));
-                    lua_pushstring(luaS_callback_state(subs->callback), topicName);
-                } else {
-                    lua_pushinteger(luaS_callback_state(subs->callback), topicLen);
-                    lua_pushlstring(luaS_callback_state(subs->callback), topicName, topicLen);
-                }
-
-                luaS_callback_call(subs->callback, 4);
+                mtx_lock(&mqtt->mtx);
+                mqtt->queue_dropped++;
+                mtx_unlock(&mqtt->mtx);
             }
-            subs = subs->next;
+
+            queued = (xQueueSend(mqtt->queue, &msg, 0) == pdTRUE);
         }
 
-        MQTTAsync_freeMessage(&m);
-        MQTTAsync_free(topicName);
+        if (queued) {
+            waiting = uxQueueMessagesWaiting(mqtt->queue);
+
+            mtx_lock(&mqtt->mtx);
+            if (waiting > mqtt->queue_max) {
+                mqtt->queue_max = waiting;
+            }
+            mtx_unlock(&mqtt->mtx);
 
+            return 1;
+        }
+
+        mtx_lock(&mqtt->mtx);
+        mqtt->queue_dropped++;
         mtx_unlock(&mqtt->mtx);
     }
 
+    MQTTAsync_freeMessage(&m);
+    MQTTAsync_free(topicName);
+
     return 1;
 }
 
@@ -482,11 +738,19 @@ static int lmqtt_client(lua_State* L) {
 #endif
 
     if (lua_gettop(L) > 5) {
-        luaL_checktype(L, 6, LUA_TBOOLEAN);
-        persistence =
-                lua_toboolean(L, 6) ?
-                        MQTTCLIENT_PERSISTENCE_DEFAULT :
-                        MQTTCLIENT_PERSISTENCE_NONE;
+        // Persistence can be a boolean (file or none), or a persistence type
+        if (lua_type(L, 6) == LUA_TNUMBER) {
+            persistence = luaL_checkinteger(L, 6);
+            luaL_argcheck(L, (persistence == MQTTCLIENT_PERSISTENCE_DEFAULT) ||
+                             (persistence == MQTTCLIENT_PERSISTENCE_NONE) ||
+                             (persistence == MQTTCLIENT_PERSISTENCE_LOG), 6, "invalid persistence");
+        } else {
+            luaL_checktype(L, 6, LUA_TBOOLEAN);
+            persistence =
+                    lua_toboolean(L, 6) ?
+                            MQTTCLIENT_PERSISTENCE_DEFAULT :
+                            MQTTCLIENT_PERSISTENCE_NONE;
+        }
         persistence_folder = luaL_optstring(L, 7, NULL); //is being strdup'd in MQTTClient_create
     }
 
@@ -496,6 +760,18 @@ static int lmqtt_client(lua_State* L) {
     mqtt->discTask = NULL;
     mqtt->client = NULL;
     mqtt->subs = NULL;
+    memset(&mqtt->topics, 0, sizeof(mqtt->topics));
+    mqtt->queue = NULL;
+    mqtt->dispTask = NULL;
+    mqtt->gcTask = NULL;
+    mqtt->orphan = NULL;
+    mqtt->closing = 0;
+    mqtt->queue_size = MQTT_QUEUE_SIZE;
+    mqtt->queue_policy = MQTT_QUEUE_DROP_OLDEST;
+    mqtt->queue_batch = MQTT_QUEUE_BATCH;
+    mqtt->queue_max = 0;
+    mqtt->queue_dropped = 0;
+    mqtt->queue_delivered = 0;
     mqtt->secure = secure;
     mqtt->persistence = persistence;
 #ifdef OPENSSL
@@ -519,7 +795,7 @@ static int lmqtt_client(lua_State* L) {
     //url is being strdup'd in MQTTClient_create
     MQTTAsync_createOptions create_opts = MQTTAsync_createOptions_initializer;
 
-    create_opts.sendWhileDisconnected = (persistence == MQTTCLIENT_PERSISTENCE_DEFAULT);
+    create_opts.sendWhileDisconnected = (persistence != MQTTCLIENT_PERSISTENCE_NONE);
 
     rc = MQTTAsync_createWithOptions(&mqtt->client, url, clientId, persistence, (char*)persistence_folder, &create_opts);
     if (rc < 0) {
@@ -634,6 +910,15 @@ static int lmqtt_connect(lua_State* L) {
 
     bcopy(&conn_opts, &mqtt->conn_opts, sizeof(MQTTAsync_connectOptions));
 
+    // Start the inbound message dispatcher
+    if (mqtt_queue_start(mqtt) < 0) {
+        mtx_lock(&mqtt->mtx);
+        mqtt->connTask = NULL;
+        mtx_unlock(&mqtt->mtx);
+
+        return luaL_exception(L, LUA_MQTT_ERR_NOT_ENOUGH_MEMORY);
+    }
+
     // Try to connect
     if (!wait_for_network_init(10)) {
         mtx_lock(&mqtt->mtx);
@@ -693,6 +978,7 @@ static int lmqtt_subscribe(lua_State* L) {
     // Add subscription
     mtx_lock(&mqtt->mtx);
     if ((rc = add_subs(L, 4, mqtt, topic, qos)) != 0) {
+        mtx_unlock(&mqtt->mtx);
         return mqtt_emit_exeption(L, LUA_MQTT_ERR_CANT_SUBSCRIBE, rc);
     }
     mtx_unlock(&mqtt->mtx);
@@ -700,38 +986,124 @@ static int lmqtt_subscribe(lua_State* L) {
     return 0;
 }
 
+// Publish a batch of {topic, payload} pairs. Only qos 0 batches avoid copying the payloads:
+// they reference the Lua strings, kept alive by the batch table until they are serialized
+// into the single write of the batch. qos > 0 messages are kept by the client until they
+// are acknowledged, maybe after the batch table is gone, so MQTTAsync_sendMessage copies
+// each payload, as for a single publish.
+static int lmqtt_publish_batch(lua_State* L, mqtt_userdata *mqtt, int qos, int retained) {
+    int count = lua_rawlen(L, 2);
+    size_t payload_len;
+    char **topics;
+    MQTTAsync_message *msgs;
+    MQTTAsync_message **pmsgs;
+    int rc = MQTTASYNC_SUCCESS;
+    int sent;
+    int i;
+
+    if (count == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    // Scratch arrays, in a userdata so they are collected if an argument is wrong
+    topics = (char **)lua_newuserdata(L, count * (sizeof(char *) + sizeof(MQTTAsync_message) + sizeof(MQTTAsync_message *)));
+    msgs = (MQTTAsync_message *)(topics + count);
+    pmsgs = (MQTTAsync_message **)(msgs + count);
+
+    for (i = 0; i < count; i++) {
+        MQTTAsync_message msg = MQTTAsync_message_initializer;
+
+        lua_rawgeti(L, 2, i + 1);
+        luaL_argcheck(L, lua_istable(L, -1), 2, "table of {topic, payload} expected");
+
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING, 2, "table of {topic, payload} expected");
+
+        topics[i] = (char *)lua_tostring(L, -2);
+        msg.payload = (char *)lua_tolstring(L, -1, &payload_len);
+        msg.payloadlen = payload_len;
+        msg.qos = qos;
+        msg.retained = retained;
+
+        msgs[i] = msg;
+        pmsgs[i] = &msgs[i];
+
+        lua_pop(L, 3);
+    }
+
+    // A qos 0 batch is accepted or rejected as a whole. The messages of a
+    // qos > 0 batch are accepted one by one, so on an error the ones before
+    // are already accepted.
+    if (qos == 0) {
+        rc = MQTTAsync_sendMessages(mqtt->client, count, topics, pmsgs);
+        sent = (rc == MQTTASYNC_SUCCESS)?count:0;
+    } else {
+        for (sent = 0; sent < count; sent++) {
+            rc = MQTTAsync_sendMessage(mqtt->client, topics[sent], pmsgs[sent], NULL);
+            if (rc != MQTTASYNC_SUCCESS) {
+                break;
+            }
+        }
+    }
+
+    if (sent == 0) {
+        return mqtt_emit_exeption(L, LUA_MQTT_ERR_CANT_PUBLISH, rc);
+    }
+
+    // Return the number of accepted messages, and the error if not all of
+    // them were accepted, so that the caller knows where to resume
+    lua_pushinteger(L, sent);
+
+    if (sent < count) {
+        lua_pushstring(L, mqtt_error_string(rc));
+        return 2;
+    }
+
+    return 1;
+}
+
 static int lmqtt_publish(lua_State* L) {
     int rc;
     int qos;
     size_t payload_len;
-    const char *topic;
-    char *payload;
+    const char *topic = NULL;
+    char *payload = NULL;
     int retained = 0;
+    int batch;
 
     // Get user data
     mqtt_userdata *mqtt = (mqtt_userdata *) luaL_checkudata(L, 1, "mqtt.cli");
     luaL_argcheck(L, mqtt, 1, "mqtt expected");
 
-    // Get arguments
-    topic = luaL_checkstring(L, 2);
-    payload = (char *) luaL_checklstring(L, 3, &payload_len);
-    qos = luaL_checkinteger(L, 4);
+    // Get arguments, a topic and a payload, or a batch table
+    batch = lua_istable(L, 2);
+    if (!batch) {
+        topic = luaL_checkstring(L, 2);
+        payload = (char *) luaL_checklstring(L, 3, &payload_len);
+    }
+    qos = luaL_checkinteger(L, batch?3:4);
 
     // Sanity checks
     if (qos > 0 && mqtt->persistence == MQTTCLIENT_PERSISTENCE_NONE) {
         return luaL_exception_extended(L, LUA_MQTT_ERR_CANT_PUBLISH, "enable persistence for a qos > 0");
     }
 
-    if (lua_gettop(L) >= 5) {
-        luaL_checktype(L, 5, LUA_TBOOLEAN);
-        retained = lua_toboolean(L, 5);
+    if (lua_gettop(L) >= (batch?4:5)) {
+        luaL_checktype(L, batch?4:5, LUA_TBOOLEAN);
+        retained = lua_toboolean(L, batch?4:5);
+    }
+
+    if (batch) {
+        return lmqtt_publish_batch(L, mqtt, qos, retained);
     }
 
     // Prepare message
     MQTTAsync_message msg = MQTTAsync_message_initializer;
 
     msg.payload = payload;
-    msg.payloadlen = strlen(payload);
+    msg.payloadlen = payload_len;
     msg.qos = qos;
     msg.retained = retained;
 
@@ -743,6 +1115,59 @@ static int lmqtt_publish(lua_State* L) {
     return 0;
 }
 
+// Configure the inbound queue: size, overflow policy, and messages per callback. With
+// a batch greater than 1, callbacks receive a table of {payload, topic} messages.
+static int lmqtt_queue(lua_State* L) {
+    // Get user data
+    mqtt_userdata *mqtt = (mqtt_userdata *) luaL_checkudata(L, 1, "mqtt.cli");
+    luaL_argcheck(L, mqtt, 1, "mqtt expected");
+
+    int size = luaL_optinteger(L, 2, mqtt->queue_size);
+    int policy = luaL_optinteger(L, 3, mqtt->queue_policy);
+    int batch = luaL_optinteger(L, 4, mqtt->queue_batch);
+
+    luaL_argcheck(L, size > 0, 2, "invalid queue size");
+    luaL_argcheck(L, (policy >= MQTT_QUEUE_DROP_OLDEST) && (policy <= MQTT_QUEUE_BLOCK), 3, "invalid overflow policy");
+    luaL_argcheck(L, batch > 0, 4, "invalid batch size");
+
+    if (mqtt->queue && (size != mqtt->queue_size)) {
+        return luaL_exception_extended(L, LUA_MQTT_ERR_CANT_SET_QUEUE, "queue size can't be changed after connect");
+    }
+
+    mtx_lock(&mqtt->mtx);
+    mqtt->queue_size = size;
+    mqtt->queue_policy = policy;
+    mqtt->queue_batch = batch;
+    mtx_unlock(&mqtt->mtx);
+
+    return 0;
+}
+
+static int lmqtt_stats(lua_State* L) {
+    // Get user data
+    mqtt_userdata *mqtt = (mqtt_userdata *) luaL_checkudata(L, 1, "mqtt.cli");
+    luaL_argcheck(L, mqtt, 1, "mqtt expected");
+
+    lua_createtable(L, 0, 5);
+
+    lua_pushinteger(L, mqtt->queue_size);
+    lua_setfield(L, -2, "size");
+
+    lua_pushinteger(L, (mqtt->queue?uxQueueMessagesWaiting(mqtt->queue):0));
+    lua_setfield(L, -2, "queued");
+
+    lua_pushinteger(L, mqtt->queue_max);
+    lua_setfield(L, -2, "max");
+
+    lua_pushinteger(L, mqtt->queue_dropped);
+    lua_setfield(L, -2, "dropped");
+
+    lua_pushinteger(L, mqtt->queue_delivered);
+    lua_setfield(L, -2, "delivered");
+
+    return 1;
+}
+
 static int lmqtt_disconnect(lua_State* L) {
     // Get user data
     mqtt_userdata *mqtt = (mqtt_userdata *) luaL_checkudata(L, 1, "mqtt.cli");
@@ -805,37 +1230,26 @@ static int lmqtt_disconnect(lua_State* L) {
     return 0;
 }
 
-// Destructor
+// Destructor. It can run on the dispatcher, when the client is collected from
+// one of its callbacks.
 static int lmqtt_client_gc(lua_State *L) {
-    mqtt_subs *subs;
-    mqtt_subs *next_subs;
-
     // Get user data
     mqtt_userdata *mqtt = (mqtt_userdata *) luaL_testudata(L, 1, "mqtt.cli");
     if (mqtt) {
-        mtx_lock(&mqtt->mtx);
+        // Destroy client, then stop the dispatcher. The dispatcher keeps running
+        // meanwhile, and a client blocked on a full queue gives up.
+        mqtt->closing = 1;
+        MQTTAsync_destroy(&mqtt->client);
+        mqtt->client = NULL;
 
-        // Free all the resources used by the subscribed topics
-        subs = mqtt->subs;
-        while (subs) {
-            luaS_callback_destroy(subs->callback);
-
-            next_subs = subs->next;
-            if (subs->topic){
-              free(subs->topic);
-              subs->topic = NULL;
-            }
+        mqtt_queue_stop(mqtt);
 
-            free(subs);
-            subs = next_subs;
-        }
+        mtx_lock(&mqtt->mtx);
 
+        // Free all the resources used by the subscribed topics
+        mqtt_subs_free(mqtt->subs, &mqtt->topics);
         mqtt->subs = NULL;
 
-        // Destroy client
-        MQTTAsync_destroy(&mqtt->client);
-        mqtt->client = NULL;
-
 #ifdef OPENSSL
         if (mqtt->ca_file) {
             free((char*) mqtt->ca_file);
@@ -871,6 +1285,11 @@ static const LUA_REG_TYPE lmqtt_map[] = {
     { LSTRKEY("PERSISTENCE_FILE"), LINTVAL(MQTTCLIENT_PERSISTENCE_DEFAULT) },
     { LSTRKEY("PERSISTENCE_NONE"), LINTVAL(MQTTCLIENT_PERSISTENCE_NONE) },
     { LSTRKEY("PERSISTENCE_USER"), LINTVAL(MQTTCLIENT_PERSISTENCE_USER) },
+    { LSTRKEY("PERSISTENCE_LOG"), LINTVAL(MQTTCLIENT_PERSISTENCE_LOG) },
+
+    { LSTRKEY("QUEUE_DROP_OLDEST"), LINTVAL(MQTT_QUEUE_DROP_OLDEST) },
+    { LSTRKEY("QUEUE_DROP_NEWEST"), LINTVAL(MQTT_QUEUE_DROP_NEWEST) },
+    { LSTRKEY("QUEUE_BLOCK"), LINTVAL(MQTT_QUEUE_BLOCK) },
 
     // Error definitions
     DRIVER_REGISTER_LUA_ERRORS(mqtt)
@@ -883,6 +1302,8 @@ static const LUA_REG_TYPE lmqtt_client_map[] = {
     { LSTRKEY( "disconnect"  ),   LFUNCVAL( lmqtt_disconnect ) },
     { LSTRKEY( "subscribe"   ),   LFUNCVAL( lmqtt_subscribe  ) },
     { LSTRKEY( "publish"     ),   LFUNCVAL( lmqtt_publish    ) },
+    { LSTRKEY( "queue"       ),   LFUNCVAL( lmqtt_queue      ) },
+    { LSTRKEY( "stats"       ),   LFUNCVAL( lmqtt_stats      ) },
     { LSTRKEY( "__metatable" ),   LROVAL  ( lmqtt_client_map ) },
     { LSTRKEY( "__index"     ),   LROVAL  ( lmqtt_client_map ) },
     { LSTRKEY( "__gc"        ),   LFUNCVAL( lmqtt_client_gc  ) },
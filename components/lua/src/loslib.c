@@ -518,6 +518,12 @@ static const LUA_REG_TYPE syslib[] =
   { LSTRKEY( "syslog" ),      LFUNCVAL( os_syslog ) },
 #if CONFIG_LUA_RTOS_USE_RSYSLOG
   { LSTRKEY( "rsyslog" ),     LFUNCVAL( os_setrsyslog ) },
+  { LSTRKEY( "rsyslogstats" ), LFUNCVAL( os_rsyslogstats ) },
+#endif
+#if CONFIG_LUA_RTOS_USE_TRACE
+  { LSTRKEY( "tracelevel" ),  LFUNCVAL( os_tracelevel ) },
+  { LSTRKEY( "tracedump" ),   LFUNCVAL( os_tracedump ) },
+  { LSTRKEY( "traceclear" ),  LFUNCVAL( os_traceclear ) },
 #endif
   { LSTRKEY( "stats" ),       LFUNCVAL( os_stats ) },
   { LSTRKEY( "format" ),      LFUNCVAL( os_format ) },
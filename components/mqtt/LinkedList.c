@@ -33,6 +33,14 @@
 
 
 static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int freeContent);
+static void ListIndexAdd(List* aList, ListElement* el);
+static void ListIndexDelete(List* aList, ListElement* el);
+static void ListIndexReset(List* aList);
+
+/** Smallest number of slots allocated for a list index */
+#define LIST_INDEX_MIN 16
+/** Marks the index slot of a removed element, so that probing continues past it */
+static ListElement ListIndexRemoved;
 
 
 /**
@@ -87,6 +95,7 @@ void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t s
 	aList->last = newel;
 	++(aList->count);
 	aList->size += size;
+	ListIndexAdd(aList, newel);
 #if __XTENSA__
   }
 #endif
@@ -149,6 +158,7 @@ void ListInsert(List* aList, void* content, size_t size, ListElement* index)
 
 		++(aList->count);
 		aList->size += size;
+		ListIndexAdd(aList, newel);
 	}
 #if __XTENSA__
   }
@@ -221,6 +231,213 @@ ListElement* ListFindItem(List* aList, void* content, int(*callback)(void*, void
 }
 
 
+/**
+ * Returns the number of index slots to use for a list, keeping the table at most half full
+ * @param count the number of items in the list
+ * @return the number of slots, a power of 2
+ */
+static int ListIndexCapacity(int count)
+{
+	int capacity = LIST_INDEX_MIN;
+
+	while (capacity < 2 * count)
+		capacity <<= 1;
+	return capacity;
+}
+
+
+/**
+ * Finds the index slot holding a key, or the empty slot where it would be placed.
+ * Keys such as message ids are allocated sequentially, so they are used as their own hash.
+ * @param index the list index
+ * @param key the key to look for
+ * @return the slot number
+ */
+static int ListIndexSlot(ListIndex* index, int key)
+{
+	int mask = index->capacity - 1;
+	int i = key & mask;
+
+	while (index->slots[i] != NULL &&
+			(index->slots[i] == &ListIndexRemoved || index->key(index->slots[i]->content) != key))
+		i = (i + 1) & mask;
+	return i;
+}
+
+
+/**
+ * Rebuilds the index of a list from its elements into a new table, dropping the
+ * slots of removed elements
+ * @param aList the list whose index is to be rebuilt
+ * @param capacity the number of slots in the new table
+ * @return 1=index rebuilt, 0=out of memory, the previous table is kept
+ */
+static int ListIndexRebuild(List* aList, int capacity)
+{
+	ListIndex* index = &aList->index;
+	ListElement** slots = calloc(capacity, sizeof(ListElement*));
+	ListElement* current = NULL;
+
+	if (slots == NULL)
+		return 0;
+	free(index->slots);
+	index->slots = slots;
+	index->capacity = capacity;
+	index->used = 0;
+	while (ListNextElement(aList, &current) != NULL)
+	{
+		int i = ListIndexSlot(index, index->key(current->content));
+
+		if (slots[i] == NULL)
+			++(index->used);
+		slots[i] = current;
+	}
+	return 1;
+}
+
+
+/**
+ * Adds a newly linked list element to the index of the list, if any.  An element with the
+ * same key as one already indexed replaces it in the index.
+ * @param aList the list to which the element has been added
+ * @param el the list element
+ */
+static void ListIndexAdd(List* aList, ListElement* el)
+{
+	ListIndex* index = &aList->index;
+	int i;
+
+	if (index->key == NULL)
+		return;
+	if (index->slots == NULL || 4 * (index->used + 1) > 3 * index->capacity)
+	{
+		if (!ListIndexRebuild(aList, ListIndexCapacity(aList->count)) &&
+				(index->slots == NULL || index->used + 1 >= index->capacity))
+		{	/* no memory to grow the table: search linearly until a later rebuild succeeds */
+			free(index->slots);
+			index->slots = NULL;
+			return;
+		}
+	}
+	i = ListIndexSlot(index, index->key(el->content));
+	if (index->slots[i] == NULL)
+	{
+		/* a new key takes the first slot of a removed element on its way, if any, so
+		   keys that come and go don't fill the table with removed marks */
+		int mask = index->capacity - 1;
+		int j = index->key(el->content) & mask;
+
+		while (j != i && index->slots[j] != &ListIndexRemoved)
+			j = (j + 1) & mask;
+		if (j == i)
+			++(index->used);
+		i = j;
+	}
+	index->slots[i] = el;
+}
+
+
+/**
+ * Removes an element from the index of a list, if any.  Must be called while the
+ * element content is still valid.
+ * @param aList the list from which the element is being removed
+ * @param el the list element
+ */
+static void ListIndexDelete(List* aList, ListElement* el)
+{
+	ListIndex* index = &aList->index;
+	int i;
+
+	if (index->slots == NULL)
+		return;
+	i = ListIndexSlot(index, index->key(el->content));
+	if (index->slots[i] != el)
+		return; /* not indexed, or replaced by a later element with the same key */
+	index->slots[i] = &ListIndexRemoved;
+	if (aList->count == 1)
+	{	/* the list is left empty: clear the table, keeping its size for the next elements */
+		memset(index->slots, 0, index->capacity * sizeof(ListElement*));
+		index->used = 0;
+	}
+}
+
+
+/**
+ * Frees the index table of a list, keeping the key function for new elements.
+ * @param aList the list whose index is to be reset
+ */
+static void ListIndexReset(List* aList)
+{
+	free(aList->index.slots);
+	aList->index.slots = NULL;
+	aList->index.capacity = aList->index.used = 0;
+}
+
+
+/**
+ * Indexes the elements of a list by an integer key, so that they can be found with
+ * ListFindIndexed without walking the list.  The key of an element must not change
+ * while it is in the list.
+ * @param aList the list to be indexed
+ * @param key pointer to a function which returns the key of an element content
+ */
+void ListSetIndex(List* aList, int(*key)(void*))
+{
+#if __XTENSA__
+  if (aList) {
+#endif
+	ListIndexReset(aList);
+	aList->index.key = key;
+	if (key != NULL && aList->count > 0)
+		ListIndexRebuild(aList, ListIndexCapacity(aList->count));
+#if __XTENSA__
+  }
+#endif
+}
+
+
+/**
+ * Finds an element in an indexed list by its key, and makes it the current element,
+ * as ListFindItem does.
+ * @param aList the list in which the search is to be conducted
+ * @param key the key to look for
+ * @return the list element found, or NULL
+ */
+ListElement* ListFindIndexed(List* aList, int key)
+{
+	ListElement* rc = NULL;
+
+#if __XTENSA__
+  if (aList) {
+#endif
+	if (aList->current != NULL && aList->index.key != NULL && aList->index.key(aList->current->content) == key)
+		rc = aList->current; /* acks mostly arrive in order, and removal moves current to the next element */
+	else if (aList->first != NULL && aList->index.key != NULL && aList->index.key(aList->first->content) == key)
+		rc = aList->first; /* the oldest message in flight is usually the next one acknowledged */
+	else if (aList->index.slots != NULL)
+		rc = aList->index.slots[ListIndexSlot(&aList->index, key)];
+	else if (aList->index.key != NULL)
+	{
+		ListElement* current = NULL;
+
+		while (ListNextElement(aList, &current) != NULL)
+		{
+			if (aList->index.key(current->content) == key)
+			{
+				rc = current;
+				break;
+			}
+		}
+	}
+	if (rc != NULL)
+		aList->current = rc;
+#if __XTENSA__
+  }
+#endif
+	return rc;
+}
+
+
 /**
  * Removes and optionally frees an element in a list by comparing the content.
  * A callback function is used to define the method of comparison for each element.
@@ -254,6 +471,7 @@ static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*),
 		aList->current->next->prev = aList->current->prev;
 
 	next = aList->current->next;
+	ListIndexDelete(aList, aList->current);
 	if (freeContent)
         {
 		free(aList->current->content);
@@ -320,6 +538,7 @@ void* ListDetachHead(List* aList)
 		aList->first = aList->first->next;
 		if (aList->first)
 			aList->first->prev = NULL;
+		ListIndexDelete(aList, first);
 		free(first);
 		--(aList->count);
 	}
@@ -364,6 +583,7 @@ void* ListPopTail(List* aList)
 		aList->last = aList->last->prev;
 		if (aList->last)
 			aList->last->next = NULL;
+		ListIndexDelete(aList, last);
 		free(last);
 		--(aList->count);
 	}
@@ -425,6 +645,7 @@ void ListEmpty(List* aList)
 	aList->count = 0;
 	aList->size = 0;
 	aList->current = aList->first = aList->last = NULL;
+	ListIndexReset(aList);
 #if __XTENSA__
   }
 #endif
@@ -456,6 +677,7 @@ void ListFreeNoContent(List* aList)
 		aList->first = first->next;
 		free(first);
 	}
+	ListIndexReset(aList);
 	free(aList);
 #if __XTENSA__
   }
@@ -515,6 +737,54 @@ int stringcompare(void* a, void* b)
 
 #if defined(UNIT_TESTS)
 
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_INFLIGHT 1000
+#define BENCH_ROUNDS 200
+
+static int intkey(void* a)
+{
+	return *((int*)a);
+}
+
+
+/**
+ * Simulates ack processing for BENCH_INFLIGHT messages in flight: the list is filled
+ * with message ids, which are then acknowledged in the given order, each ack looking
+ * the message up by id and removing it.
+ * @return the number of acks processed per second
+ */
+static double bench_acks(int indexed, int* order)
+{
+	int r, i, found = 0;
+	clock_t start;
+	List* l = ListInitialize();
+
+	if (indexed)
+		ListSetIndex(l, intkey);
+	start = clock();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+	{
+		for (i = 0; i < BENCH_INFLIGHT; i++)
+		{
+			int* ip = malloc(sizeof(int));
+			*ip = i + 1;
+			ListAppend(l, ip, sizeof(int));
+		}
+		for (i = 0; i < BENCH_INFLIGHT; i++)
+		{
+			ListElement* el = indexed ? ListFindIndexed(l, order[i]) : ListFindItem(l, &order[i], intcompare);
+			if (el != NULL && ListRemove(l, el->content))
+				++found;
+		}
+	}
+	ListFree(l);
+	if (found != BENCH_ROUNDS * BENCH_INFLIGHT)
+		printf("Benchmark lost acks: %d of %d\n", found, BENCH_ROUNDS * BENCH_INFLIGHT);
+	return (double)found * CLOCKS_PER_SEC / (clock() - start + 1);
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -560,6 +830,42 @@ int main(int argc, char *argv[])
 
 	ListFree(l);
 	printf("List freed\n");
+
+	{
+		int order[BENCH_INFLIGHT];
+
+		l = ListInitialize();
+		ListSetIndex(l, intkey);
+		for (i = 0; i < 100; i++)
+		{
+			ip = malloc(sizeof(int));
+			*ip = i;
+			ListAppend(l, ip, sizeof(int));
+			if (i % 3 == 0)
+				ListRemove(l, ListFindIndexed(l, i / 2)->content);
+		}
+		current = NULL;
+		while (ListNextElement(l, &current) != NULL)
+			if (ListFindIndexed(l, *((int*)(current->content))) == NULL)
+				printf("Indexed element %d not found\n", *((int*)(current->content)));
+		ListFree(l);
+		printf("List index checked\n");
+
+		for (i = 0; i < BENCH_INFLIGHT; i++)
+			order[i] = i + 1;
+		printf("In order acks, %d in flight: linear %.0f/s, indexed %.0f/s\n", BENCH_INFLIGHT,
+			bench_acks(0, order), bench_acks(1, order));
+		srand(1);
+		for (i = BENCH_INFLIGHT - 1; i > 0; i--)
+		{
+			int j = rand() % (i + 1), t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+		printf("Out of order acks, %d in flight: linear %.0f/s, indexed %.0f/s\n", BENCH_INFLIGHT,
+			bench_acks(0, order), bench_acks(1, order));
+	}
+	return 0;
 }
 
 #endif
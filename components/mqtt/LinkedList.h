@@ -61,6 +61,20 @@ typedef struct ListElementStruct
 } ListElement;
 
 
+/**
+ * Structure to hold an optional lookup index for a list.  Elements are kept in an
+ * open addressing table keyed by an integer taken from their content, so that
+ * lookups do not have to walk the list.
+ */
+typedef struct
+{
+	int (*key)(void*);	/**< returns the key of an element content, NULL if the list is not indexed */
+	ListElement** slots;	/**< table of elements, NULL until the first element is added */
+	int capacity;	/**< no of slots, always a power of 2 */
+	int used;	/**< no of slots in use, including those of removed elements */
+} ListIndex;
+
+
 /**
  * Structure to hold all data for one list
  */
@@ -71,6 +85,7 @@ typedef struct
 				*current;	/**< current element in the list, for iteration */
 	int count;  /**< no of items */
 	size_t size;  /**< heap storage used */
+	ListIndex index;  /**< optional lookup index */
 } List;
 
 void ListZero(List*);
@@ -99,6 +114,9 @@ ListElement* ListPrevElement(List* aList, ListElement** pos);
 ListElement* ListFind(List* aList, void* content);
 ListElement* ListFindItem(List* aList, void* content, int(*callback)(void*, void*));
 
+void ListSetIndex(List* aList, int(*key)(void*));
+ListElement* ListFindIndexed(List* aList, int key);
+
 int intcompare(void* a, void* b);
 int stringcompare(void* a, void* b);
 
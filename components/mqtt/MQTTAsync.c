@@ -280,6 +280,7 @@ typedef struct
 			void* payload;
 			int qos;
 			int retained;
+			int batch; /**< number of serialized qos 0 PUBLISH packets in payload, see MQTTAsync_sendMessages */
 		} pub;
 		struct
 		{
@@ -537,7 +538,9 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 	memset(m->c, '\0', sizeof(Clients));
 	m->c->context = m;
 	m->c->outboundMsgs = ListInitialize();
+	ListSetIndex(m->c->outboundMsgs, messageIDKey);
 	m->c->inboundMsgs = ListInitialize();
+	ListSetIndex(m->c->inboundMsgs, messageIDKey);
 	m->c->messageQueue = ListInitialize();
 	m->c->clientID = MQTTStrdup(clientId);
 
@@ -973,7 +976,8 @@ static int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_si
 	{
 		ListAppend(commands, command, command_size);
 #if !defined(NO_PERSISTENCE)
-		if (command->client->c->persistence)
+		if (command->client->c->persistence &&
+			!(command->command.type == PUBLISH && command->command.details.pub.batch))
 			MQTTAsync_persistCommand(command);
 #endif
 	}
@@ -1379,6 +1383,28 @@ static int MQTTAsync_processCommand(void)
 		rc = MQTTProtocol_unsubscribe(command->client->c, topics, command->command.token);
 		ListFreeNoContent(topics);
 	}
+	else if (command->command.type == PUBLISH && command->command.details.pub.batch)
+	{
+		networkHandles* net = &command->client->c->net;
+
+		/* the packets are already serialized, so they are written in one go */
+#if defined(OPENSSL)
+		if (net->ssl)
+			rc = SSLSocket_putdatas(net->ssl, net->socket, command->command.details.pub.payload,
+				command->command.details.pub.payloadlen, 0, NULL, NULL, NULL);
+		else
+#endif
+			rc = Socket_putdatas(net->socket, command->command.details.pub.payload,
+				command->command.details.pub.payloadlen, 0, NULL, NULL, NULL);
+
+		if (rc == TCPSOCKET_COMPLETE)
+			time(&(net->lastSent));
+		else if (rc == TCPSOCKET_INTERRUPTED)
+		{
+			command->command.details.pub.payload = NULL; /* this will be freed by the socket code */
+			command->client->pending_write = &command->command;
+		}
+	}
 	else if (command->command.type == PUBLISH)
 	{
 		Messages* msg = NULL;
@@ -3025,7 +3051,7 @@ static int MQTTAsync_countBufferedMessages(MQTTAsyncs* m)
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 
 		if (cmd->client == m && cmd->command.type == PUBLISH)
-			count++;
+			count += (cmd->command.details.pub.batch ? cmd->command.details.pub.batch : 1);
 	}
 	return count;
 }
@@ -3139,6 +3165,125 @@ exit:
 }
 
 
+int MQTTAsync_sendMessages(MQTTAsync handle, int count, char* const* destinationNames, MQTTAsync_message* const* messages)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	MQTTAsync_queuedCommand* pub;
+	size_t total = 0;
+	char* buf = NULL;
+	char* ptr;
+	int i;
+
+	FUNC_ENTRY;
+	if (m == NULL || m->c == NULL)
+		rc = MQTTASYNC_FAILURE;
+	else if (destinationNames == NULL || messages == NULL || count <= 0)
+		rc = MQTTASYNC_NULL_PARAMETER;
+	else if (m->c->connected == 0 && (m->createOptions == NULL ||
+		m->createOptions->sendWhileDisconnected == 0 || m->shouldBeConnected == 0))
+		rc = MQTTASYNC_DISCONNECTED;
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	/* work out the size of the serialized packets */
+	for (i = 0; i < count; i++)
+	{
+		char lenbuf[4];
+		size_t remaining;
+
+		if (destinationNames[i] == NULL || messages[i] == NULL)
+			rc = MQTTASYNC_NULL_PARAMETER;
+		else if (strncmp(messages[i]->struct_id, "MQTM", 4) != 0 || messages[i]->struct_version != 0)
+			rc = MQTTASYNC_BAD_STRUCTURE;
+		else if (!UTF8_validateString(destinationNames[i]))
+			rc = MQTTASYNC_BAD_UTF8_STRING;
+		else if (messages[i]->qos != 0)
+			rc = MQTTASYNC_BAD_QOS;
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+
+		remaining = 2 + strlen(destinationNames[i]) + messages[i]->payloadlen;
+		total += 1 + MQTTPacket_encode(lenbuf, remaining) + remaining;
+	}
+
+	/* each message of the batch counts as a buffered message */
+	if (m->createOptions && (count > m->createOptions->maxBufferedMessages))
+	{
+		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
+		goto exit;
+	}
+	else if (m->createOptions && (MQTTAsync_countBufferedMessages(m) + count > m->createOptions->maxBufferedMessages))
+		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
+
+#if __XTENSA__
+	if (rc == MQTTASYNC_MAX_BUFFERED_MESSAGES) {
+	    int timeout = 4000;
+
+	    // Wait some time to get space in the message buffer, as MQTTAsync_send does
+	    while ((MQTTAsync_countBufferedMessages(m) + count > m->createOptions->maxBufferedMessages) && (timeout > 0)) {
+	        // Sleep 10 msecs
+	        usleep(10000);
+
+	        timeout -= 10;
+	    }
+
+	    if (timeout > 0) {
+	        rc = MQTTASYNC_SUCCESS;
+	    }
+	}
+#endif
+
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	if ((buf = malloc(total)) == NULL)
+	{
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+
+	/* serialize the PUBLISH packets, the payloads are copied once, straight from the caller's buffers */
+	ptr = buf;
+	for (i = 0; i < count; i++)
+	{
+		Header header;
+		int topiclen = (int)strlen(destinationNames[i]);
+
+		header.byte = 0;
+		header.bits.type = PUBLISH;
+		header.bits.retain = messages[i]->retained;
+
+		*ptr++ = header.byte;
+		ptr += MQTTPacket_encode(ptr, 2 + topiclen + messages[i]->payloadlen);
+		writeInt(&ptr, topiclen);
+		memcpy(ptr, destinationNames[i], topiclen);
+		ptr += topiclen;
+		memcpy(ptr, messages[i]->payload, messages[i]->payloadlen);
+		ptr += messages[i]->payloadlen;
+	}
+
+	/* Add publish request to operation queue */
+	if ((pub = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	{
+		free(buf);
+		rc = MQTTASYNC_FAILURE;
+		goto exit;
+	}
+	memset(pub, '\0', sizeof(MQTTAsync_queuedCommand));
+	pub->client = m;
+	pub->command.type = PUBLISH;
+	pub->command.details.pub.payloadlen = (int)total;
+	pub->command.details.pub.payload = buf;
+	pub->command.details.pub.batch = count;
+	rc = MQTTAsync_addCommand(pub, sizeof(pub));
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 static void MQTTAsync_retry(void)
 {
 	static time_t last = 0L;
@@ -3641,3 +3786,203 @@ const char* MQTTAsync_strerror(int code)
 
   return NULL;
 }
+
+
+#if defined(ASYNC_UNIT_TESTS)
+/*
+ * Publish throughput against a broker stand-in, with one MQTTAsync_sendMessage
+ * call per message, and with batches of MQTTAsync_sendMessages. The stand-in
+ * answers CONNECT and PINGREQ, and counts the PUBLISH packets it gets. The
+ * writev calls of the client are counted by wrapping writev at link time.
+ *
+ * Build and run in the host with:
+ *
+ *   cc -O2 -DASYNC_UNIT_TESTS -DNOSTACKTRACE -D_GNU_SOURCE \
+ *      -DCONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE=8192 \
+ *      -include stdarg.h -include stdlib.h -o async_bench \
+ *      MQTTAsync.c Clients.c LinkedList.c Log.c MQTTPacket.c MQTTPacketOut.c \
+ *      MQTTPersistence.c MQTTPersistenceDefault.c MQTTPersistenceLog.c \
+ *      MQTTProtocolClient.c MQTTProtocolOut.c Messages.c OsWrapper.c Socket.c \
+ *      SocketBuffer.c Thread.c utf-8.c -Wl,--wrap=writev -lpthread && ./async_bench
+ */
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#define BENCH_MESSAGES 20000
+#define BENCH_MAX_BATCH 50
+#define BENCH_RUNS 3
+
+static int bench_listener;
+static volatile int bench_published;
+static volatile int bench_writes;
+static volatile int bench_connected;
+
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	bench_writes++;
+	return __real_writev(fd, iov, iovcnt);
+}
+
+/* Broker stand-in, serves one connection at a time */
+static void* bench_broker(void* arg)
+{
+	static char buf[16384];
+	static const char connack[] = {0x20, 0x02, 0x00, 0x00};
+	static const char pingresp[] = {(char)0xd0, 0x00};
+
+	for (;;)
+	{
+		int fd = accept(bench_listener, NULL, NULL);
+		size_t have = 0;
+		ssize_t n;
+
+		while ((n = recv(fd, buf + have, sizeof(buf) - have, 0)) > 0)
+		{
+			size_t pos = 0;
+
+			have += n;
+
+			/* handle the whole packets received, keep the rest for the next read */
+			for (;;)
+			{
+				size_t len = 0, hdr = 1;
+				int mul = 1;
+
+				do
+				{
+					if (pos + hdr >= have)
+						goto incomplete;
+					len += (buf[pos + hdr] & 0x7f) * mul;
+					mul *= 128;
+				} while (buf[pos + hdr++] & 0x80);
+				if (pos + hdr + len > have)
+					break;
+
+				switch ((buf[pos] >> 4) & 0x0f)
+				{
+				case CONNECT:
+					send(fd, connack, sizeof(connack), 0);
+					break;
+				case PUBLISH:
+					bench_published++;
+					break;
+				case PINGREQ:
+					send(fd, pingresp, sizeof(pingresp), 0);
+					break;
+				}
+				pos += hdr + len;
+			}
+incomplete:
+			memmove(buf, buf + pos, have - pos);
+			have -= pos;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static void bench_onConnect(void* context, MQTTAsync_successData* response)
+{
+	bench_connected = 1;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Publish BENCH_MESSAGES qos 0 messages, batch of them per call, and wait until
+   the stand-in gets all of them */
+static void bench(const char* url, int batch)
+{
+	MQTTAsync client;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_message msgs[BENCH_MAX_BATCH];
+	MQTTAsync_message* pmsgs[BENCH_MAX_BATCH];
+	char* topics[BENCH_MAX_BATCH];
+	double start, elapsed;
+	int i, rc;
+
+	for (i = 0; i < batch; i++)
+	{
+		MQTTAsync_message msg = MQTTAsync_message_initializer;
+
+		msg.payload = "21.5";
+		msg.payloadlen = 4;
+		msgs[i] = msg;
+		pmsgs[i] = &msgs[i];
+		topics[i] = "bench/room/temperature";
+	}
+
+	MQTTAsync_create(&client, url, "bench", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	opts.onSuccess = bench_onConnect;
+	bench_connected = 0;
+	MQTTAsync_connect(client, &opts);
+	while (!bench_connected)
+		usleep(1000);
+
+	bench_published = 0;
+	bench_writes = 0;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_MESSAGES; i += batch)
+	{
+		if (batch == 1)
+			rc = MQTTAsync_sendMessage(client, topics[0], pmsgs[0], NULL);
+		else
+			rc = MQTTAsync_sendMessages(client, batch, topics, pmsgs);
+		if (rc != MQTTASYNC_SUCCESS)
+		{
+			printf("publish failed: %d\n", rc);
+			exit(1);
+		}
+	}
+	while (bench_published < BENCH_MESSAGES)
+		usleep(100);
+	elapsed = bench_now() - start;
+
+	printf("%5d %10.0f msgs/s %7d writes\n", batch, BENCH_MESSAGES / elapsed, bench_writes);
+
+	MQTTAsync_disconnect(client, NULL);
+	usleep(100000);
+	MQTTAsync_destroy(&client);
+}
+
+int main(int argc, char** argv)
+{
+	static const int batches[] = {1, 5, 20, 50};
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t broker;
+	char url[32];
+	int i, run;
+
+	bench_listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(bench_listener, (struct sockaddr*)&addr, sizeof(addr));
+	listen(bench_listener, 1);
+	getsockname(bench_listener, (struct sockaddr*)&addr, &len);
+	snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", ntohs(addr.sin_port));
+	pthread_create(&broker, NULL, bench_broker, NULL);
+
+	printf("%d qos 0 publishes of 4 bytes\n", BENCH_MESSAGES);
+	printf("batch (1 is one MQTTAsync_sendMessage per message)\n");
+	for (run = 0; run < BENCH_RUNS; run++)
+		for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++)
+			bench(url, batches[i]);
+
+	return 0;
+}
+#endif
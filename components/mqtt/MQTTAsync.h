@@ -1056,6 +1056,24 @@ DLLExport int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int
 DLLExport int MQTTAsync_sendMessage(MQTTAsync handle, const char* destinationName, const MQTTAsync_message* msg, MQTTAsync_responseOptions* response);
 
 
+/**
+  * This function attempts to publish several qos 0 messages at once. The
+  * PUBLISH packets are serialized into a single buffer, which is written to
+  * the network in one go.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param count The number of messages.
+  * @param destinationNames An array of <i>count</i> topics, one per message.
+  * @param messages An array of <i>count</i> pointers to MQTTAsync_message
+  * structures, all of them with a qos of 0.
+  * @return ::MQTTASYNC_SUCCESS if the messages are accepted for publication.
+  * An error code is returned if there was a problem accepting the messages.
+  * Each message counts against MQTTAsync_createOptions.maxBufferedMessages,
+  * so a batch bigger than it is rejected with ::MQTTASYNC_MAX_BUFFERED_MESSAGES.
+  */
+DLLExport int MQTTAsync_sendMessages(MQTTAsync handle, int count, char* const* destinationNames, MQTTAsync_message* const* messages);
+
+
 /**
   * This function sets a pointer to an array of tokens for
   * messages that are currently in-flight (pending completion).
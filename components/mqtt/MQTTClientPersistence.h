@@ -77,6 +77,11 @@
   * persistence mechanism (see MQTTClient_create()).
   */
 #define MQTTCLIENT_PERSISTENCE_USER 2
+/**
+  * This <i>persistence_type</i> value specifies a log file-based
+  * persistence mechanism, with an in-memory index (see MQTTClient_create()).
+  */
+#define MQTTCLIENT_PERSISTENCE_LOG 3
 
 /** 
   * Application-specific persistence functions must return this error code if 
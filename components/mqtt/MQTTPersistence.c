@@ -27,6 +27,7 @@
 
 #include "MQTTPersistence.h"
 #include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
 #include "MQTTProtocolClient.h"
 #include "Heap.h"
 
@@ -82,6 +83,33 @@ int MQTTPersistence_create(MQTTClient_persistence** persistence, int type, void*
 			else
 				rc = MQTTCLIENT_PERSISTENCE_ERROR;
 			break;
+		case MQTTCLIENT_PERSISTENCE_LOG :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				if ( pcontext != NULL )
+				{
+					per->context = malloc(strlen(pcontext) + 1);
+#if __XTENSA__
+          if (per->context)
+#endif
+					strcpy(per->context, pcontext);
+				}
+				else
+					per->context = ".";  /* working directory */
+				/* log file functions */
+				per->popen        = plogopen;
+				per->pclose       = plogclose;
+				per->pput         = plogput;
+				per->pget         = plogget;
+				per->premove      = plogremove;
+				per->pkeys        = plogkeys;
+				per->pclear       = plogclear;
+				per->pcontainskey = plogcontainskey;
+			}
+			else
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			break;
 		case MQTTCLIENT_PERSISTENCE_USER :
 			per = (MQTTClient_persistence *)pcontext;
 			if ( per == NULL || (per != NULL && (per->context == NULL || per->pclear == NULL ||
@@ -140,7 +168,7 @@ int MQTTPersistence_close(Clients *c)
 		rc = c->persistence->pclose(c->phandle);
 		c->phandle = NULL;
 #if !defined(NO_PERSISTENCE)
-		if ( c->persistence->popen == pstopen )
+		if ( c->persistence->popen == pstopen || c->persistence->popen == plogopen )
 			free(c->persistence);
 #endif
 		c->persistence = NULL;
@@ -0,0 +1,1052 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, MQTT log file persistence
+ *
+ */
+
+/**
+ * @file
+ * \brief A log file based persistence implementation.
+ *
+ * All the wire messages of a client are appended to a single log file, named after the
+ * client ID and connection key, in the directory specified when the MQTT client is created.
+ * An in-memory index, a hash table of the live records, maps each key to the offset of its
+ * data in the log, so only get needs to read the file, and no directory scans are required. Removals are appended as
+ * tombstone records, and the log is compacted when most of it is dead. fsync is done
+ * every ::LOG_SYNC_RECORDS records, and when the store is closed.
+ *
+ * Record format: type (1 byte), key length (2 bytes), data length (4 bytes), key, data.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+/** Record types */
+#define LOG_RECORD_PUT    'P'
+#define LOG_RECORD_REMOVE 'R'
+/** Length of the record header */
+#define LOG_HEADER_LENGTH 7
+/** Initial number of hash buckets of the index, a power of 2 */
+#define LOG_INDEX_BUCKETS 16
+
+/** Index entry of a live record */
+typedef struct
+{
+	char* key;     /**< record key */
+	long offset;   /**< offset of the data in the log file */
+	int len;       /**< length of the data */
+	unsigned hash; /**< hash of the key */
+	int next;      /**< next entry in the same bucket, or -1 */
+} LogEntry;
+
+/** Log store, the persistence handle */
+typedef struct
+{
+	char* file;        /**< log file name */
+	FILE* fp;          /**< log file, open for update */
+	int ontmp;         /**< 1 if fp is the compacted tmp file, that couldn't be renamed yet */
+	LogEntry* entries; /**< live records, unordered */
+	int count;         /**< number of live records */
+	int size;          /**< allocated index entries */
+	int* buckets;      /**< hash buckets, first entry of each bucket, or -1 */
+	int nbuckets;      /**< number of hash buckets, a power of 2 */
+	long live;         /**< bytes used by the live records */
+	long end;          /**< end of the last valid record */
+	int unsynced;      /**< records written since the last fsync */
+} LogStore;
+
+
+static int logrecordlen(int keylen, int datalen)
+{
+	return LOG_HEADER_LENGTH + keylen + datalen;
+}
+
+
+/** FNV-1a hash of a key */
+static unsigned loghash(const char* key)
+{
+	unsigned hash = 2166136261u;
+
+	while (*key)
+		hash = (hash ^ (unsigned char)*key++) * 16777619u;
+
+	return hash;
+}
+
+
+static int logfind(LogStore* store, const char* key)
+{
+	unsigned hash;
+	int i;
+
+	if (store->nbuckets == 0)
+		return -1;
+
+	hash = loghash(key);
+	for (i = store->buckets[hash & (store->nbuckets - 1)]; i >= 0; i = store->entries[i].next)
+	{
+		if (store->entries[i].hash == hash && strcmp(store->entries[i].key, key) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+
+/** Link entry i into its bucket */
+static void loglink(LogStore* store, int i)
+{
+	int* bucket = &store->buckets[store->entries[i].hash & (store->nbuckets - 1)];
+
+	store->entries[i].next = *bucket;
+	*bucket = i;
+}
+
+
+/** Unlink entry i from its bucket */
+static void logunlink(LogStore* store, int i)
+{
+	int* prev = &store->buckets[store->entries[i].hash & (store->nbuckets - 1)];
+
+	while (*prev != i)
+		prev = &store->entries[*prev].next;
+
+	*prev = store->entries[i].next;
+}
+
+
+/** Resize the hash table to nbuckets buckets, and rehash all the entries */
+static int logrehash(LogStore* store, int nbuckets)
+{
+	int* buckets;
+	int i;
+
+	if ((buckets = malloc(nbuckets * sizeof(int))) == NULL)
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+
+	free(store->buckets);
+	store->buckets = buckets;
+	store->nbuckets = nbuckets;
+
+	for (i = 0; i < nbuckets; i++)
+		buckets[i] = -1;
+
+	for (i = 0; i < store->count; i++)
+		loglink(store, i);
+
+	return 0;
+}
+
+
+/** Remove entry i from the index. The last entry is moved to its place. */
+static void logunindex(LogStore* store, int i)
+{
+	int last = store->count - 1;
+
+	store->live -= logrecordlen(strlen(store->entries[i].key), store->entries[i].len);
+	logunlink(store, i);
+	free(store->entries[i].key);
+
+	if (i != last)
+	{
+		logunlink(store, last);
+		store->entries[i] = store->entries[last];
+		loglink(store, i);
+	}
+
+	store->count--;
+}
+
+
+/** Add a record to the index, replacing the previous record with the same key. On error
+ *  the index is left as it was. */
+static int logindex(LogStore* store, const char* key, long offset, int len)
+{
+	LogEntry* entries;
+	char* copy;
+	int i;
+
+	if ((copy = malloc(strlen(key) + 1)) == NULL)
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+	strcpy(copy, key);
+
+	if (store->count == store->size)
+	{
+		entries = realloc(store->entries, (store->size + 8) * sizeof(LogEntry));
+		if (entries == NULL)
+		{
+			free(copy);
+			return MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+
+		store->entries = entries;
+		store->size += 8;
+	}
+
+	/* keep at most one entry per bucket on average */
+	if (store->count >= store->nbuckets &&
+		logrehash(store, store->nbuckets ? store->nbuckets * 2 : LOG_INDEX_BUCKETS) != 0)
+	{
+		free(copy);
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+
+	/* nothing can fail from here on */
+	if ((i = logfind(store, key)) >= 0)
+		logunindex(store, i);
+
+	entries = &store->entries[store->count];
+	entries->key = copy;
+	entries->offset = offset;
+	entries->len = len;
+	entries->hash = loghash(key);
+	loglink(store, store->count);
+
+	store->count++;
+	store->live += logrecordlen(strlen(key), len);
+
+	return 0;
+}
+
+
+static void logfreeindex(LogStore* store)
+{
+	int i;
+
+	for (i = 0; i < store->count; i++)
+		free(store->entries[i].key);
+
+	free(store->entries);
+	free(store->buckets);
+	store->entries = NULL;
+	store->buckets = NULL;
+	store->nbuckets = 0;
+	store->count = 0;
+	store->size = 0;
+	store->live = 0;
+}
+
+
+static void logsync(LogStore* store)
+{
+	fflush(store->fp);
+	fsync(fileno(store->fp));
+	store->unsynced = 0;
+}
+
+
+/** Write a record to fp, at the current position */
+static int logwrite(FILE* fp, char type, const char* key, int bufcount, char* buffers[], int buflens[])
+{
+	unsigned char header[LOG_HEADER_LENGTH];
+	int keylen = strlen(key);
+	int datalen = 0;
+	int i;
+
+	for (i = 0; i < bufcount; i++)
+		datalen += buflens[i];
+
+	header[0] = type;
+	header[1] = keylen & 0xff;
+	header[2] = (keylen >> 8) & 0xff;
+	header[3] = datalen & 0xff;
+	header[4] = (datalen >> 8) & 0xff;
+	header[5] = (datalen >> 16) & 0xff;
+	header[6] = (datalen >> 24) & 0xff;
+
+	if (fwrite(header, 1, LOG_HEADER_LENGTH, fp) != LOG_HEADER_LENGTH)
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+
+	if (fwrite(key, 1, keylen, fp) != (size_t)keylen)
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+
+	for (i = 0; i < bufcount; i++)
+	{
+		if (fwrite(buffers[i], 1, buflens[i], fp) != (size_t)buflens[i])
+			return MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+
+	return 0;
+}
+
+
+/** Append a record to the log. A failed append is overwritten by the next one. */
+static int logappend(LogStore* store, char type, const char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = 0;
+	int datalen = 0;
+	int i;
+
+	for (i = 0; i < bufcount; i++)
+		datalen += buflens[i];
+
+	if (fseek(store->fp, store->end, SEEK_SET) != 0)
+		return MQTTCLIENT_PERSISTENCE_ERROR;
+
+	if ((rc = logwrite(store->fp, type, key, bufcount, buffers, buflens)) == 0)
+		rc = (fflush(store->fp) == 0) ? 0 : MQTTCLIENT_PERSISTENCE_ERROR;
+
+	if (rc == 0)
+	{
+		store->end += logrecordlen(strlen(key), datalen);
+
+		if (++store->unsynced >= LOG_SYNC_RECORDS)
+			logsync(store);
+	}
+
+	return rc;
+}
+
+
+/** Drop the last record of the log, appended at end but not indexed, so it isn't loaded
+ *  back. If the log can't be truncated, the key is removed with a tombstone instead, as
+ *  the record would replace the previous one when the log is loaded. */
+static void logdrop(LogStore* store, const char* key, long end)
+{
+	int i;
+
+	if (fflush(store->fp) == 0 && ftruncate(fileno(store->fp), end) == 0)
+	{
+		store->end = end;
+		return;
+	}
+
+	if ((i = logfind(store, key)) >= 0)
+		logunindex(store, i);
+	logappend(store, LOG_RECORD_REMOVE, key, 0, NULL, NULL);
+}
+
+
+/** Rebuild the index from the log. Returns 1 if the log has a truncated tail, or
+ *  MQTTCLIENT_PERSISTENCE_ERROR if the index can't be built. */
+static int logload(LogStore* store)
+{
+	unsigned char header[LOG_HEADER_LENGTH];
+	char* key;
+	long size;
+	long offset = 0;
+	int keylen, datalen;
+	int rc = 0;
+
+	fseek(store->fp, 0, SEEK_END);
+	size = ftell(store->fp);
+	fseek(store->fp, 0, SEEK_SET);
+
+	while (fread(header, 1, LOG_HEADER_LENGTH, store->fp) == LOG_HEADER_LENGTH)
+	{
+		keylen = header[1] | (header[2] << 8);
+		datalen = header[3] | (header[4] << 8) | (header[5] << 16) | (header[6] << 24);
+
+		if ((header[0] != LOG_RECORD_PUT && header[0] != LOG_RECORD_REMOVE) || keylen == 0 || datalen < 0 ||
+			offset + logrecordlen(keylen, datalen) > size)
+			break;
+
+		/* not a truncated tail, the rest of the log must not be dropped */
+		if ((key = malloc(keylen + 1)) == NULL)
+			return MQTTCLIENT_PERSISTENCE_ERROR;
+
+		if (fread(key, 1, keylen, store->fp) != (size_t)keylen)
+		{
+			free(key);
+			break;
+		}
+		key[keylen] = '\0';
+
+		if (header[0] == LOG_RECORD_PUT)
+			rc = logindex(store, key, offset + LOG_HEADER_LENGTH + keylen, datalen);
+		else
+		{
+			int i = logfind(store, key);
+
+			if (i >= 0)
+				logunindex(store, i);
+		}
+		free(key);
+
+		if (rc != 0)
+			return rc;
+
+		offset += logrecordlen(keylen, datalen);
+		fseek(store->fp, offset, SEEK_SET);
+	}
+
+	store->end = offset;
+
+	return (offset < size);
+}
+
+
+/** Replace the log file with the compacted tmp file, that is the open log. The old log is
+ *  removed first, as rename may not replace it. If the rename fails the log goes on in the
+ *  tmp file, the rename is retried later, and plogopen recovers the tmp file. */
+static int logrename(LogStore* store)
+{
+	int rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	char* tmp;
+
+	if ((tmp = malloc(strlen(store->file) + 5)) == NULL)
+		return rc;
+	sprintf(tmp, "%s.tmp", store->file);
+
+	remove(store->file);
+	if (rename(tmp, store->file) == 0)
+	{
+		store->ontmp = 0;
+		rc = 0;
+	}
+
+	free(tmp);
+	return rc;
+}
+
+
+/** Rewrite the log with the live records only */
+static int logcompact(LogStore* store)
+{
+	int rc = 0;
+	char* tmp = NULL;
+	char* buffer = NULL;
+	long* offsets = NULL;
+	long end = 0;
+	FILE* fp = NULL;
+	int i;
+
+	FUNC_ENTRY;
+	/* the tmp file of the previous compaction is still the open log */
+	if (store->ontmp && (rc = logrename(store)) != 0)
+		goto exit;
+
+	tmp = malloc(strlen(store->file) + 5);
+	if (tmp == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	sprintf(tmp, "%s.tmp", store->file);
+
+	if (store->count > 0 && (offsets = malloc(store->count * sizeof(long))) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if ((fp = fopen(tmp, "w+b")) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	for (i = 0; i < store->count && rc == 0; i++)
+	{
+		LogEntry* entry = &store->entries[i];
+
+		if ((buffer = malloc(entry->len ? entry->len : 1)) == NULL)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else if (fseek(store->fp, entry->offset, SEEK_SET) != 0 || fread(buffer, 1, entry->len, store->fp) != (size_t)entry->len)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else if ((rc = logwrite(fp, LOG_RECORD_PUT, entry->key, 1, &buffer, &entry->len)) == 0)
+		{
+			offsets[i] = end + LOG_HEADER_LENGTH + strlen(entry->key);
+			end += logrecordlen(strlen(entry->key), entry->len);
+		}
+
+		free(buffer);
+		buffer = NULL;
+	}
+
+	if (rc == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) != 0))
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	/* on errors the current log is kept */
+	if (rc != 0)
+	{
+		fclose(fp);
+		remove(tmp);
+		goto exit;
+	}
+
+	/* the compacted log is complete and open, so the old one can be closed */
+	fclose(store->fp);
+	store->fp = fp;
+	store->ontmp = 1;
+
+	for (i = 0; i < store->count; i++)
+		store->entries[i].offset = offsets[i];
+
+	store->end = end;
+	store->unsynced = 0;
+
+	logrename(store);
+
+exit:
+	free(offsets);
+	free(tmp);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Compact the log when most of it is dead */
+static void logcheckcompact(LogStore* store)
+{
+	if (store->end > LOG_COMPACT_MIN && store->live * 2 < store->end)
+		logcompact(store);
+}
+
+
+/** Open the log file for the client: context/clientID-serverURI.log, and load its index.
+ *  See ::Persistence_open
+ */
+int plogopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	int rc = 0;
+	char *dataDir = context;
+	char *tmp = NULL;
+	char *ptraux;
+	LogStore* store;
+
+	FUNC_ENTRY;
+	store = calloc(1, sizeof(LogStore));
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	/* consider '/'  +  '-'  +  '\0', ':' and '/' are not allowed in the file name */
+	store->file = malloc(strlen(dataDir) + strlen(clientID) + strlen(serverURI) + strlen(LOG_FILENAME_EXTENSION) + 3);
+	tmp = malloc(strlen(dataDir) + strlen(clientID) + strlen(serverURI) + strlen(LOG_FILENAME_EXTENSION) + 7);
+	if (store->file == NULL || tmp == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	sprintf(store->file, "%s/%s-%s%s", dataDir, clientID, serverURI, LOG_FILENAME_EXTENSION);
+	for (ptraux = store->file + strlen(dataDir) + 1; *ptraux; ptraux++)
+	{
+		if (*ptraux == ':' || *ptraux == '/')
+			*ptraux = '-';
+	}
+	sprintf(tmp, "%s.tmp", store->file);
+
+	if ((rc = pstmkdir(dataDir)) != 0)
+		goto exit;
+
+	/* recover from a compaction interrupted after the old log was removed */
+	if (access(store->file, F_OK) != 0 && access(tmp, F_OK) == 0)
+		rename(tmp, store->file);
+	else
+		remove(tmp);
+
+	if ((store->fp = fopen(store->file, "r+b")) == NULL && errno == ENOENT)
+		store->fp = fopen(store->file, "w+b");
+
+	if (store->fp == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	/* a truncated tail is dropped by rewriting the log */
+	if ((rc = logload(store)) == 1)
+		rc = logcompact(store);
+	else if (rc == 0)
+		logcheckcompact(store);
+
+exit:
+	free(tmp);
+	if (rc != 0 && store != NULL)
+	{
+		if (store->fp != NULL)
+			fclose(store->fp);
+		logfreeindex(store);
+		free(store->file);
+		free(store);
+		store = NULL;
+	}
+	*handle = store;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Close the log file, and remove it if it's empty.
+ *  See ::Persistence_close
+ */
+int plogclose(void* handle)
+{
+	int rc = 0;
+	LogStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	/* the store is released anyway */
+	if (store->fp == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+	{
+		logsync(store);
+		fclose(store->fp);
+
+		if (store->ontmp)
+			logrename(store);
+
+		if (store->count == 0)
+			remove(store->file);
+	}
+
+	logfreeindex(store);
+	free(store->file);
+	free(store);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a wire message to the log.
+ *  See ::Persistence_put
+ */
+int plogput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = 0;
+	LogStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL || store->fp == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if ((rc = logappend(store, LOG_RECORD_PUT, key, bufcount, buffers, buflens)) == 0)
+	{
+		int datalen = 0;
+		int i;
+
+		for (i = 0; i < bufcount; i++)
+			datalen += buflens[i];
+
+		if ((rc = logindex(store, key, store->end - datalen, datalen)) != 0)
+			logdrop(store, key, store->end - logrecordlen(strlen(key), datalen));
+		else
+			logcheckcompact(store);
+	}
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Retrieve a wire message from the log.
+ *  See ::Persistence_get
+ */
+int plogget(void* handle, char* key, char** buffer, int* buflen)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	char *buf;
+	int i;
+
+	FUNC_ENTRY;
+	if (store == NULL || store->fp == NULL || (i = logfind(store, key)) < 0)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	buf = malloc(store->entries[i].len ? store->entries[i].len : 1);
+	if (buf == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if (fseek(store->fp, store->entries[i].offset, SEEK_SET) != 0 ||
+		fread(buf, 1, store->entries[i].len, store->fp) != (size_t)store->entries[i].len)
+	{
+		free(buf);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	*buffer = buf;
+	*buflen = store->entries[i].len;
+	/* the caller must free buf */
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete a persisted message, appending a tombstone to the log.
+ *  See ::Persistence_remove
+ */
+int plogremove(void* handle, char* key)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	int i;
+
+	FUNC_ENTRY;
+	if (store == NULL || store->fp == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if ((i = logfind(store, key)) < 0)
+		goto exit;
+
+	if ((rc = logappend(store, LOG_RECORD_REMOVE, key, 0, NULL, NULL)) == 0)
+	{
+		logunindex(store, i);
+		logcheckcompact(store);
+	}
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys in the index.
+ *  See ::Persistence_keys
+ */
+int plogkeys(void* handle, char*** keys, int* nkeys)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	char **fkeys = NULL;
+	int i;
+
+	FUNC_ENTRY;
+	if (store == NULL || store->fp == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if (store->count != 0)
+	{
+		if ((fkeys = (char **)malloc(store->count * sizeof(char *))) == NULL)
+		{
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+			goto exit;
+		}
+
+		for (i = 0; i < store->count; i++)
+		{
+			if ((fkeys[i] = malloc(strlen(store->entries[i].key) + 1)) == NULL)
+			{
+				while (--i >= 0)
+					free(fkeys[i]);
+				free(fkeys);
+				rc = MQTTCLIENT_PERSISTENCE_ERROR;
+				goto exit;
+			}
+			strcpy(fkeys[i], store->entries[i].key);
+		}
+	}
+
+	*nkeys = store->count;
+	*keys = fkeys;
+	/* the caller must free keys */
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the persisted messages, truncating the log.
+ *  See ::Persistence_clear
+ */
+int plogclear(void* handle)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	FILE* fp;
+
+	FUNC_ENTRY;
+	if (store == NULL || store->fp == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	/* the new log is opened before closing the current one, that is kept on errors */
+	if ((fp = fopen(store->file, "w+b")) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	fclose(store->fp);
+	store->fp = fp;
+
+	/* a stale tmp file is removed by plogopen, as the log file exists again */
+	store->ontmp = 0;
+
+	logfreeindex(store);
+	store->end = 0;
+	store->unsynced = 0;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether a wire message is in the index.
+ * See ::Persistence_containskey
+ */
+int plogcontainskey(void* handle, char* key)
+{
+	int rc = 0;
+	LogStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL || store->fp == NULL || logfind(store, key) < 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+#if defined(UNIT_TESTS)
+/*
+ * cc -O2 -DNOSTACKTRACE -c MQTTPersistenceDefault.c
+ * cc -O2 -DUNIT_TESTS -DNOSTACKTRACE -o plog MQTTPersistenceLog.c MQTTPersistenceDefault.o && ./plog
+ */
+#include <time.h>
+
+/* The file store doesn't sync. To compare both stores with the same durability, the
+   benchmark syncs its files as often as the log store syncs the log. */
+static int pstsynced = 0;
+
+static int pstput_synced(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = pstput(handle, key, bufcount, buffers, buflens);
+
+	if (++pstsynced % LOG_SYNC_RECORDS == 0)
+		sync();
+	return rc;
+}
+
+static int pstremove_synced(void* handle, char* key)
+{
+	int rc = pstremove(handle, key);
+
+	if (++pstsynced % LOG_SYNC_RECORDS == 0)
+		sync();
+	return rc;
+}
+
+/* QoS1 publish pattern: put the message, and remove it when it's acknowledged */
+static double bench(const char *name, Persistence_open popen, Persistence_close pclose,
+	Persistence_put pput, Persistence_remove premove, int nmsgs, int inflight)
+{
+	char *handle;
+	char key[16];
+	char header[4] = {0x32, 0x40, 0x00, 0x01};
+	char payload[64];
+	char *bufs[2] = {header, payload};
+	int buflens[2] = {sizeof(header), sizeof(payload)};
+	struct timespec start, end;
+	double secs;
+	int i;
+
+	memset(payload, 'p', sizeof(payload));
+	popen((void**)&handle, "TheUTClient", "tcp://127.0.0.1:1883", ".");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nmsgs; i++)
+	{
+		sprintf(key, "s-%d", i % 65535);
+		pput(handle, key, 2, bufs, buflens);
+		if (i >= inflight)
+		{
+			sprintf(key, "s-%d", (i - inflight) % 65535);
+			premove(handle, key);
+		}
+	}
+	for (i = (nmsgs > inflight ? nmsgs - inflight : 0); i < nmsgs; i++)
+	{
+		sprintf(key, "s-%d", i % 65535);
+		premove(handle, key);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pclose(handle);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-8s %6d msgs, %2d in flight: %10.0f msgs/s\n", name, nmsgs, inflight, nmsgs / secs);
+	return nmsgs / secs;
+}
+
+int main (int argc, char *argv[])
+{
+#define RC !rc ? "(Success)" : "(Failed) "
+	int rc;
+	char *handle;
+	char **keys;
+	int nkeys;
+	char *buffer;
+	int buflen;
+	char *bufs[2] = {"m0", "mm1"};
+	int buflens[2] = {2, 3};
+	int i;
+
+	rc = plogopen((void**)&handle, "TheUTClient", "127.0.0.1:1883", ".");
+	printf("%s Open log\n", RC);
+
+	rc = plogput(handle, "s-1", 2, bufs, buflens) || plogput(handle, "s-2", 2, bufs, buflens) ||
+		plogput(handle, "s-1", 1, bufs, buflens) || plogremove(handle, "s-2");
+	printf("%s Put / remove\n", RC);
+
+	plogclose(handle);
+	rc = plogopen((void**)&handle, "TheUTClient", "127.0.0.1:1883", ".");
+	rc = rc || plogkeys(handle, &keys, &nkeys) || nkeys != 1 || strcmp(keys[0], "s-1") != 0;
+	printf("%s Reload index\n", RC);
+	for (i = 0; i < nkeys; i++)
+		free(keys[i]);
+	free(keys);
+
+	rc = plogget(handle, "s-1", &buffer, &buflen) || buflen != 2 || memcmp(buffer, "m0", 2) != 0;
+	printf("%s Get\n", RC);
+	free(buffer);
+
+	rc = !plogcontainskey(handle, "s-2") || plogclear(handle) || !plogcontainskey(handle, "s-1");
+	printf("%s Clear\n", RC);
+
+	/* enough keys to grow the index, and enough removals to compact the log */
+	for (i = 0, rc = 0; i < 1000 && rc == 0; i++)
+	{
+		char key[16];
+
+		sprintf(key, "s-%d", i);
+		rc = plogput(handle, key, 2, bufs, buflens);
+	}
+	for (i = 0; i < 1000 && rc == 0; i += 2)
+	{
+		char key[16];
+
+		sprintf(key, "s-%d", i);
+		rc = plogremove(handle, key);
+	}
+	plogclose(handle);
+	rc = rc || plogopen((void**)&handle, "TheUTClient", "127.0.0.1:1883", ".") || plogkeys(handle, &keys, &nkeys) || nkeys != 500;
+	for (i = 0; i < 1000 && rc == 0; i++)
+	{
+		char key[16];
+
+		sprintf(key, "s-%d", i);
+		if (i % 2 == 0)
+			rc = !plogcontainskey(handle, key);
+		else
+		{
+			rc = plogget(handle, key, &buffer, &buflen) || buflen != 5 || memcmp(buffer, "m0mm1", 5) != 0;
+			free(buffer);
+		}
+	}
+	printf("%s Index and compaction\n", RC);
+	for (i = 0; i < nkeys; i++)
+		free(keys[i]);
+	free(keys);
+	plogclear(handle);
+
+	/* a put that can't be indexed must not replace the previous record on reload */
+	{
+		LogStore* store = (LogStore*)handle;
+		long end;
+
+		rc = plogput(handle, "s-1", 2, bufs, buflens);
+		end = store->end;
+		rc = rc || logappend(store, LOG_RECORD_PUT, "s-1", 1, bufs, buflens);
+		if (rc == 0)
+			logdrop(store, "s-1", end);
+		plogclose(handle);
+		rc = rc || plogopen((void**)&handle, "TheUTClient", "127.0.0.1:1883", ".") ||
+			plogget(handle, "s-1", &buffer, &buflen) || buflen != 5 || memcmp(buffer, "m0mm1", 5) != 0;
+		if (rc == 0)
+			free(buffer);
+	}
+	printf("%s Unindexed put dropped\n", RC);
+	plogclear(handle);
+	plogclose(handle);
+
+	for (i = 1; i <= 32; i *= 4)
+	{
+		bench("file", pstopen, pstclose, pstput_synced, pstremove_synced, 2000, i);
+		bench("log", plogopen, plogclose, plogput, plogremove, 2000, i);
+	}
+
+	return 0;
+}
+#endif
+
+#endif /* NO_PERSISTENCE */
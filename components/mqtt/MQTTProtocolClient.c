@@ -68,6 +68,17 @@ int messageIDCompare(void* a, void* b)
 }
 
 
+/**
+ * List index function returning the message id of a Message structure
+ * @param a the Message structure
+ * @return the message id
+ */
+int messageIDKey(void* a)
+{
+	return ((Messages*)a)->msgid;
+}
+
+
 /**
  * Assign a new message id for a client.  Make sure it isn't already being used and does
  * not exceed the maximum.
@@ -81,7 +92,7 @@ int MQTTProtocol_assignMsgId(Clients* client)
 
 	FUNC_ENTRY;
 	msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-	while (ListFindItem(client->outboundMsgs, &msgid, messageIDCompare) != NULL)
+	while (ListFindIndexed(client->outboundMsgs, msgid) != NULL)
 	{
 		msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
 		if (msgid == start_msgid)
@@ -331,7 +342,7 @@ int MQTTProtocol_handlePublishes(void* pack, int sock)
 		m->qos = publish->header.bits.qos;
 		m->retain = publish->header.bits.retain;
 		m->nextMessageType = PUBREL;
-		if ( ( listElem = ListFindItem(client->inboundMsgs, &(m->msgid), messageIDCompare) ) != NULL )
+		if ( ( listElem = ListFindIndexed(client->inboundMsgs, m->msgid) ) != NULL )
 		{   /* discard queued publication with same msgID that the current incoming message */
 			Messages* msg = (Messages*)(listElem->content);
 			MQTTProtocol_removePublication(msg->publish);
@@ -367,7 +378,7 @@ int MQTTProtocol_handlePubacks(void* pack, int sock)
 	Log(LOG_PROTOCOL, 14, NULL, sock, client->clientID, puback->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	if (ListFindItem(client->outboundMsgs, &(puback->msgId), messageIDCompare) == NULL)
+	if (ListFindIndexed(client->outboundMsgs, puback->msgId) == NULL)
 		Log(TRACE_MIN, 3, NULL, "PUBACK", client->clientID, puback->msgId);
 	else
 	{
@@ -408,7 +419,7 @@ int MQTTProtocol_handlePubrecs(void* pack, int sock)
 
 	/* look for the message by message id in the records of outbound messages for this client */
 	client->outboundMsgs->current = NULL;
-	if (ListFindItem(client->outboundMsgs, &(pubrec->msgId), messageIDCompare) == NULL)
+	if (ListFindIndexed(client->outboundMsgs, pubrec->msgId) == NULL)
 	{
 		if (pubrec->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBREC", client->clientID, pubrec->msgId);
@@ -456,7 +467,7 @@ int MQTTProtocol_handlePubrels(void* pack, int sock)
 	Log(LOG_PROTOCOL, 17, NULL, sock, client->clientID, pubrel->msgId);
 
 	/* look for the message by message id in the records of inbound messages for this client */
-	if (ListFindItem(client->inboundMsgs, &(pubrel->msgId), messageIDCompare) == NULL)
+	if (ListFindIndexed(client->inboundMsgs, pubrel->msgId) == NULL)
 	{
 		if (pubrel->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBREL", client->clientID, pubrel->msgId);
@@ -520,7 +531,7 @@ int MQTTProtocol_handlePubcomps(void* pack, int sock)
 	Log(LOG_PROTOCOL, 19, NULL, sock, client->clientID, pubcomp->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	if (ListFindItem(client->outboundMsgs, &(pubcomp->msgId), messageIDCompare) == NULL)
+	if (ListFindIndexed(client->outboundMsgs, pubcomp->msgId) == NULL)
 	{
 		if (pubcomp->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBCOMP", client->clientID, pubcomp->msgId);
@@ -34,6 +34,7 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages** mm, int qos, int retained);
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len);
 int messageIDCompare(void* a, void* b);
+int messageIDKey(void* a);
 int MQTTProtocol_assignMsgId(Clients* client);
 void MQTTProtocol_removePublication(Publications* p);
 void Protocol_processPublication(Publish* publish, Clients* client);
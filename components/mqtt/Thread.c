@@ -109,9 +109,6 @@ mutex_type Thread_create_mutex(void)
 			rc = GetLastError();
 	#else
 		mutex = malloc(sizeof(pthread_mutex_t));
-		#if !__XTENSA__
-		*mutex = PTHREAD_MUTEX_INITIALIZER;
-		#endif
 #if __XTENSA__
     if (mutex)
 #endif
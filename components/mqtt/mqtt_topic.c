@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, MQTT subscription topic trie
+ *
+ */
+
+#include "mqtt_topic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Get the child of a trie node for a topic level of len bytes, creating it if required
+static mqtt_topic_node *topic_node_child(mqtt_topic_node *node, const char *level, int len, int create) {
+    mqtt_topic_node *child;
+
+    for (child = node->child; child; child = child->next) {
+        if ((strncmp(child->level, level, len) == 0) && (child->level[len] == '\0')) {
+            return child;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    // The level is stored just after the node
+    child = (mqtt_topic_node *)calloc(1, sizeof(mqtt_topic_node) + len + 1);
+    if (!child) {
+        return NULL;
+    }
+
+    child->level = (char *)(child + 1);
+    memcpy(child->level, level, len);
+
+    child->next = node->child;
+    node->child = child;
+
+    return child;
+}
+
+mqtt_topic_node *mqtt_topic_node_get(mqtt_topic_node *root, const char *topic, int create) {
+    mqtt_topic_node *node = root;
+    const char *level = topic;
+    const char *end;
+
+    for(;;) {
+        end = strchr(level, '/');
+
+        node = topic_node_child(node, level, (end?(end - level):strlen(level)), create);
+        if (!node || !end) {
+            return node;
+        }
+
+        level = end + 1;
+    }
+}
+
+void mqtt_topic_node_free(mqtt_topic_node *node) {
+    mqtt_topic_node *child;
+    mqtt_topic_node *next;
+
+    child = node->child;
+    while (child) {
+        next = child->next;
+        mqtt_topic_node_free(child);
+        free(child);
+        child = next;
+    }
+
+    node->child = NULL;
+    node->subs = NULL;
+}
+
+// Find the subscriptions under a trie node that match the topic levels starting at level
+static void topic_node_match(mqtt_topic_node *node, const char *level, int first, mqtt_topic_deliver_t deliver, void *arg) {
+    const char *end = strchr(level, '/');
+    int len = (end?(end - level):strlen(level));
+    int wildcards = !(first && (level[0] == '$'));
+    mqtt_topic_node *child;
+    mqtt_topic_node *multi;
+
+    for (child = node->child; child; child = child->next) {
+        if (wildcards && (strcmp(child->level, "#") == 0)) {
+            deliver(child, arg);
+        } else if ((wildcards && (strcmp(child->level, "+") == 0)) ||
+                   ((strncmp(child->level, level, len) == 0) && (child->level[len] == '\0'))) {
+            if (end) {
+                topic_node_match(child, end + 1, 0, deliver, arg);
+            } else {
+                deliver(child, arg);
+
+                // Check for e.g. foo matching foo/#
+                if ((multi = topic_node_child(child, "#", 1, 0))) {
+                    deliver(multi, arg);
+                }
+            }
+        }
+    }
+}
+
+void mqtt_topic_match(mqtt_topic_node *root, const char *topic, mqtt_topic_deliver_t deliver, void *arg) {
+    topic_node_match(root, topic, 1, deliver, arg);
+}
+
+#if defined(UNIT_TESTS)
+
+/*
+ * Checks the trie against the linear matcher it replaced, and benchmarks both.
+ *
+ * Build and run in the host with:
+ *
+ *   cc -O2 -DUNIT_TESTS -o mqtt_topic mqtt_topic.c && ./mqtt_topic
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Exact subscriptions are home/room<r>/sensor<s>, with BENCH_SENSORS sensors a
+// room. The benchmark runs with each number of exact subscriptions in
+// bench_counts, plus the wildcard ones.
+#define BENCH_SENSORS 10
+#define BENCH_MAX_EXACT 1000
+#define BENCH_MESSAGES 200000
+
+// Subscriptions tried by the linear matcher in each run, it has to try all
+// of them for each message
+#define BENCH_LINEAR_WORK 20000000
+
+typedef struct bench_subs {
+    char topic[48];
+    int hits;
+    struct bench_subs *sibling;
+} bench_subs;
+
+// Linear matcher used before the trie, from mosquitto's mosquitto_topic_matches_sub
+static int topic_matches_sub(const char *sub, const char *topic) {
+    int slen, tlen;
+    int spos, tpos;
+    bool multilevel_wildcard = false;
+
+    slen = strlen(sub);
+    tlen = strlen(topic);
+
+    if (slen && tlen) {
+        if ((sub[0] == '$' && topic[0] != '$')
+                || (topic[0] == '$' && sub[0] != '$')) {
+
+            return 0;
+        }
+    }
+
+    spos = 0;
+    tpos = 0;
+
+    while (spos < slen && tpos < tlen) {
+        if (sub[spos] == topic[tpos]) {
+            if (tpos == tlen - 1) {
+                /* Check for e.g. foo matching foo/# */
+                if (spos == slen - 3 && sub[spos + 1] == '/'
+                        && sub[spos + 2] == '#') {
+                    multilevel_wildcard = true;
+                    return 1;
+                }
+            }
+            spos++;
+            tpos++;
+            if (spos == slen && tpos == tlen) {
+                return 1;
+            } else if (tpos == tlen && spos == slen - 1 && sub[spos] == '+') {
+                spos++;
+                return 1;
+            }
+        } else {
+            if (sub[spos] == '+') {
+                spos++;
+                while (tpos < tlen && topic[tpos] != '/') {
+                    tpos++;
+                }
+                if (tpos == tlen && spos == slen) {
+                    return 1;
+                }
+            } else if (sub[spos] == '#') {
+                multilevel_wildcard = true;
+                if (spos + 1 != slen) {
+                    return 0;
+                } else {
+                    return 1;
+                }
+            } else {
+                return 0;
+            }
+        }
+    }
+
+    if (multilevel_wildcard == false && (tpos < tlen || spos < slen)) {
+        return 0;
+    }
+
+    return 0;
+}
+
+static void bench_deliver(mqtt_topic_node *node, void *arg) {
+    bench_subs *subs;
+
+    for (subs = (bench_subs *)node->subs; subs; subs = subs->sibling) {
+        subs->hits++;
+    }
+}
+
+static int nsubs = 0;
+static bench_subs subs[BENCH_MAX_EXACT + 16];
+
+static void add_subs(mqtt_topic_node *root, const char *topic) {
+    bench_subs *s = &subs[nsubs++];
+    mqtt_topic_node *node;
+
+    strcpy(s->topic, topic);
+
+    node = mqtt_topic_node_get(root, topic, 1);
+    s->sibling = (bench_subs *)node->subs;
+    node->subs = s;
+}
+
+static void clear_hits() {
+    int i;
+
+    for (i = 0; i < nsubs; i++) {
+        subs[i].hits = 0;
+    }
+}
+
+// Check the trie against the linear matcher, and benchmark both, with the
+// given number of exact subscriptions. Returns 1 if the matchers differ.
+static int bench(int exact) {
+    static const char *wildcards[] = {
+        "home/+/temperature", "home/#", "+/room3/+", "#", "$SYS/#",
+        "home/room7/#", "+/+/+", "+", "home/+",
+    };
+    static const char *extra[] = {
+        "home", "home/room3", "$SYS/broker/load", "other/room3/x", "home/room7",
+        "home/room7/sensor2/raw",
+    };
+    static char topics[BENCH_MAX_EXACT + 8][48];
+    int ntopics = 0, failed = 0, messages;
+    mqtt_topic_node root;
+    clock_t start;
+    double linear, trie;
+    int i, k, hits;
+
+    memset(&root, 0, sizeof(root));
+    nsubs = 0;
+
+    // An exact subscription for each sensor, plus some wildcard subscriptions
+    for (i = 0; i < exact; i++) {
+        snprintf(topics[ntopics], sizeof(topics[0]), "home/room%d/sensor%d", i / BENCH_SENSORS, i % BENCH_SENSORS);
+        add_subs(&root, topics[ntopics++]);
+    }
+
+    for (i = 0; i < sizeof(wildcards) / sizeof(wildcards[0]); i++) {
+        add_subs(&root, wildcards[i]);
+    }
+
+    for (i = 0; i < sizeof(extra) / sizeof(extra[0]); i++) {
+        strcpy(topics[ntopics++], extra[i]);
+    }
+    strcpy(topics[ntopics++], "home/room4/temperature");
+
+    // Both matchers must find the same subscriptions for each topic
+    for (i = 0; i < ntopics; i++) {
+        clear_hits();
+        mqtt_topic_match(&root, topics[i], bench_deliver, NULL);
+
+        for (k = 0; k < nsubs; k++) {
+            if (subs[k].hits != topic_matches_sub(subs[k].topic, topics[i])) {
+                printf("topic \"%s\", subscription \"%s\": trie %d, linear %d\n",
+                        topics[i], subs[k].topic, subs[k].hits, topic_matches_sub(subs[k].topic, topics[i]));
+                failed = 1;
+            }
+        }
+    }
+
+    // Benchmark, with the same messages for both matchers
+    messages = BENCH_LINEAR_WORK / nsubs;
+    if (messages > BENCH_MESSAGES) {
+        messages = BENCH_MESSAGES;
+    }
+
+    hits = 0;
+    start = clock();
+    for (i = 0; i < messages; i++) {
+        for (k = 0; k < nsubs; k++) {
+            hits += topic_matches_sub(subs[k].topic, topics[i % ntopics]);
+        }
+    }
+    linear = (double)messages * CLOCKS_PER_SEC / (clock() - start + 1);
+
+    clear_hits();
+    start = clock();
+    for (i = 0; i < messages; i++) {
+        mqtt_topic_match(&root, topics[i % ntopics], bench_deliver, NULL);
+    }
+    trie = (double)messages * CLOCKS_PER_SEC / (clock() - start + 1);
+
+    for (k = 0; k < nsubs; k++) {
+        hits -= subs[k].hits;
+    }
+
+    if (hits != 0) {
+        printf("Benchmark hits differ by %d\n", hits);
+        failed = 1;
+    }
+
+    printf("%4d subscriptions: linear %9.0f msgs/s, trie %9.0f msgs/s\n", nsubs, linear, trie);
+
+    mqtt_topic_node_free(&root);
+
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    static const int bench_counts[] = {10, 100, 1000};
+    int i, failed = 0;
+
+    for (i = 0; i < sizeof(bench_counts) / sizeof(bench_counts[0]); i++) {
+        failed |= bench(bench_counts[i]);
+    }
+
+    printf(failed ? "Failed\n" : "Passed\n");
+
+    return failed;
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, MQTT subscription topic trie
+ *
+ */
+
+#ifndef _MQTT_TOPIC_H_
+#define _MQTT_TOPIC_H_
+
+// Topic trie node, one per topic level
+typedef struct mqtt_topic_node {
+    char *level;                   // Topic level, "+" and "#" for wildcards
+    void *subs;                    // Subscriptions ending at this level, owned by the caller
+    struct mqtt_topic_node *child; // First child level
+    struct mqtt_topic_node *next;  // Next sibling level
+} mqtt_topic_node;
+
+// Called by mqtt_topic_match for each node with subscriptions matching a topic
+typedef void (*mqtt_topic_deliver_t)(mqtt_topic_node *node, void *arg);
+
+/**
+ * @brief Get the trie node for a subscription topic.
+ *
+ * @param root   Root node of the trie.
+ * @param topic  Subscription topic, can have wildcards.
+ * @param create If 1, create the missing nodes.
+ *
+ * @return The node, or NULL if it doesn't exist, or there is not enough memory.
+ */
+mqtt_topic_node *mqtt_topic_node_get(mqtt_topic_node *root, const char *topic, int create);
+
+/**
+ * @brief Free all the nodes below a trie node. The subscriptions are not freed.
+ *
+ * @param node The node.
+ */
+void mqtt_topic_node_free(mqtt_topic_node *node);
+
+/**
+ * @brief Find the subscriptions matching a topic. Wildcards in the first level
+ *        don't match topics starting with '$', and "foo/#" matches "foo".
+ *
+ * @param root    Root node of the trie.
+ * @param topic   Topic of a received message.
+ * @param deliver Function called for each matching node.
+ * @param arg     Argument for deliver.
+ */
+void mqtt_topic_match(mqtt_topic_node *root, const char *topic, mqtt_topic_deliver_t deliver, void *arg);
+
+#endif /* _MQTT_TOPIC_H_ */
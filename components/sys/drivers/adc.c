@@ -46,8 +46,14 @@
 #include "sdkconfig.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_timer.h"
+#include "driver/i2s.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 
 #include <sys/list.h>
 #include <sys/driver.h>
@@ -83,6 +89,37 @@ static const adc_dev_t adc_devs[] = {
 // List of channels
 static struct list channels;
 
+// I2S unit used for sampling the internal ADC in continuous mode
+#define ADC_I2S_NUM 0
+
+// Samples read from I2S DMA at once
+#define ADC_I2S_CHUNK 256
+
+// Max time the I2S reader waits for samples, before checking if it must stop
+#define ADC_I2S_TIMEOUT (100 / portTICK_PERIOD_MS)
+
+// Max sample rate for the external ADCs, sampled from a timer
+#define ADC_TIMER_MAX_RATE 10000
+
+// Continuous mode state
+typedef struct adc_cont {
+	adc_chann_t *chan;
+	adc_stream_t stream;
+	adc_block_callback_t callback;
+	void *arg;
+	volatile uint8_t stop;       // Set by adc_stop, the sampling task exits
+	volatile uint8_t quit;       // Set by adc_stop once the sampling is stopped, the block task exits
+	uint8_t detached;            // Stopped from the callback, the block task frees the state
+	SemaphoreHandle_t done;      // Given by each task, or timer, that is done
+	TaskHandle_t task;           // Delivers the blocks to the callback
+	TaskHandle_t reader;         // Takes the samples from I2S DMA (internal ADC), or from the device (external ADC)
+	esp_timer_handle_t timer;    // Wakes up the reader on each sample (external ADC)
+	esp_timer_handle_t flush;    // Tells when the timer callbacks are done (external ADC)
+} adc_cont_t;
+
+// Channel using I2S, only one channel can use it
+static adc_chann_t *i2s_chan = NULL;
+
 // Register driver and messages
 static void _adc_init();
 
@@ -97,6 +134,9 @@ DRIVER_REGISTER_BEGIN(ADC,adc,0,_adc_init,NULL);
 	DRIVER_REGISTER_ERROR(ADC, adc, InvalidMax, "invalid max value", ADC_ERR_INVALID_MAX);
 	DRIVER_REGISTER_ERROR(ADC, adc, CannotCalibrate, "calibration is not allowed for this ADC", ADC_ERR_CANNOT_CALIBRATE);
 	DRIVER_REGISTER_ERROR(ADC, adc, CalibrationError, "calibration error", ADC_ERR_CALIBRATION);
+	DRIVER_REGISTER_ERROR(ADC, adc, InvalidRate, "invalid sample rate", ADC_ERR_INVALID_RATE);
+	DRIVER_REGISTER_ERROR(ADC, adc, ContinuousStarted, "continuous mode already started", ADC_ERR_CONT_STARTED);
+	DRIVER_REGISTER_ERROR(ADC, adc, CannotStart, "can't start continuous mode", ADC_ERR_CANNOT_START);
 DRIVER_REGISTER_END(ADC,adc,0,_adc_init,NULL);
 
 /*
@@ -126,6 +166,220 @@ static adc_chann_t *get_channel(int8_t unit, int8_t channel, int *item_index) {
     return NULL;
 }
 
+// Wake up the task that delivers the blocks
+static void adc_cont_notify(adc_stream_t *stream) {
+	adc_cont_t *cont = (adc_cont_t *)stream->arg;
+
+	xTaskNotifyGive(cont->task);
+}
+
+static void adc_cont_free(adc_cont_t *cont) {
+	adc_stream_free(&cont->stream);
+	vSemaphoreDelete(cont->done);
+	free(cont);
+}
+
+// Deliver the blocks to the callback, with their statistics, until the
+// continuous mode is stopped
+static void adc_cont_task(void *arg) {
+	adc_cont_t *cont = (adc_cont_t *)arg;
+	const uint16_t *block;
+	adc_block_stats_t stats;
+
+	while (!cont->quit) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		while (!cont->quit && (block = adc_stream_get(&cont->stream))) {
+			adc_stream_stats(block, cont->stream.size, &stats);
+			cont->callback(cont->arg, block, cont->stream.size, &stats);
+			adc_stream_release(&cont->stream);
+		}
+	}
+
+	// No more blocks
+	cont->callback(cont->arg, NULL, 0, NULL);
+
+	if (cont->detached) {
+		// Stopped from the callback, nobody waits for this task
+		adc_cont_free(cont);
+	} else {
+		xSemaphoreGive(cont->done);
+	}
+
+	vTaskDelete(NULL);
+}
+
+// Read the samples of the internal ADC from I2S DMA
+static void adc_i2s_task(void *arg) {
+	adc_cont_t *cont = (adc_cont_t *)arg;
+	uint16_t buffer[ADC_I2S_CHUNK];
+	size_t bytes;
+	int i;
+
+	while (!cont->stop) {
+		if (i2s_read(ADC_I2S_NUM, buffer, sizeof(buffer), &bytes, ADC_I2S_TIMEOUT) != ESP_OK) {
+			continue;
+		}
+
+		// Remove the channel number, in the upper 4 bits
+		for(i = 0;i < bytes / sizeof(uint16_t);i++) {
+			buffer[i] &= 0x0fff;
+		}
+
+		adc_stream_write(&cont->stream, buffer, bytes / sizeof(uint16_t));
+	}
+
+	xSemaphoreGive(cont->done);
+	vTaskDelete(NULL);
+}
+
+// Wake up the task that samples an external ADC. Runs in the esp_timer task,
+// so the device isn't read here, the read can block on the bus.
+static void adc_timer_tick(void *arg) {
+	adc_cont_t *cont = (adc_cont_t *)arg;
+
+	xTaskNotifyGive(cont->reader);
+}
+
+// The esp_timer callbacks run one after the other, so when this one runs, a
+// tick of the stopped sampling timer can't be running
+static void adc_timer_flush(void *arg) {
+	adc_cont_t *cont = (adc_cont_t *)arg;
+
+	xSemaphoreGive(cont->done);
+}
+
+// Take a sample of an external ADC on each timer tick
+static void adc_timer_task(void *arg) {
+	adc_cont_t *cont = (adc_cont_t *)arg;
+	uint16_t sample;
+	driver_error_t *error;
+	int raw;
+
+	for(;;) {
+		// One sample per tick, ticks missed while reading are not lost
+		ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+
+		if (cont->stop) {
+			break;
+		}
+
+		if ((error = adc_devs[cont->chan->unit - CPU_FIRST_ADC].read(cont->chan, &raw, NULL))) {
+			free(error);
+			continue;
+		}
+
+		sample = raw;
+		adc_stream_write(&cont->stream, &sample, 1);
+	}
+
+	xSemaphoreGive(cont->done);
+	vTaskDelete(NULL);
+}
+
+static driver_error_t *adc_i2s_start(adc_cont_t *cont, uint32_t rate) {
+	i2s_config_t i2s_config = {
+		.mode = I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN,
+		.sample_rate = rate,
+		.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+		.communication_format = I2S_COMM_FORMAT_I2S_MSB,
+		.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
+		.intr_alloc_flags = 0,
+		.dma_buf_count = 4,
+		.dma_buf_len = ADC_I2S_CHUNK,
+		.use_apll = 0,
+	};
+
+	if (i2s_chan) {
+		return driver_error(ADC_DRIVER, ADC_ERR_CONT_STARTED, "I2S is used by other channel");
+	}
+
+	if (i2s_driver_install(ADC_I2S_NUM, &i2s_config, 0, NULL) != ESP_OK) {
+		return driver_error(ADC_DRIVER, ADC_ERR_CANNOT_START, "I2S is not available");
+	}
+
+	i2s_set_adc_mode(ADC_UNIT_1, cont->chan->channel);
+
+	if (xTaskCreatePinnedToCore(adc_i2s_task, "adci2s", 2048 + sizeof(uint16_t) * ADC_I2S_CHUNK, cont, configMAX_PRIORITIES - 2, &cont->reader, xPortGetCoreID()) != pdPASS) {
+		i2s_driver_uninstall(ADC_I2S_NUM);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	i2s_adc_enable(ADC_I2S_NUM);
+
+	i2s_chan = cont->chan;
+
+	return NULL;
+}
+
+static void adc_i2s_stop(adc_cont_t *cont) {
+	cont->stop = 1;
+	xSemaphoreTake(cont->done, portMAX_DELAY);
+
+	i2s_adc_disable(ADC_I2S_NUM);
+	i2s_driver_uninstall(ADC_I2S_NUM);
+
+	i2s_chan = NULL;
+}
+
+static driver_error_t *adc_timer_start(adc_cont_t *cont, uint32_t rate) {
+	const esp_timer_create_args_t timer_args = {
+		.callback = adc_timer_tick,
+		.arg = cont,
+		.name = "adc"
+	};
+
+	const esp_timer_create_args_t flush_args = {
+		.callback = adc_timer_flush,
+		.arg = cont,
+		.name = "adcflush"
+	};
+
+	if (rate > ADC_TIMER_MAX_RATE) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_RATE, NULL);
+	}
+
+	if (esp_timer_create(&timer_args, &cont->timer) != ESP_OK) {
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (esp_timer_create(&flush_args, &cont->flush) != ESP_OK) {
+		esp_timer_delete(cont->timer);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (xTaskCreatePinnedToCore(adc_timer_task, "adcsmp", 2048, cont, configMAX_PRIORITIES - 2, &cont->reader, xPortGetCoreID()) != pdPASS) {
+		esp_timer_delete(cont->flush);
+		esp_timer_delete(cont->timer);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (esp_timer_start_periodic(cont->timer, 1000000 / rate) != ESP_OK) {
+		// The sampling task never got a tick, it's waiting for one
+		vTaskDelete(cont->reader);
+		esp_timer_delete(cont->flush);
+		esp_timer_delete(cont->timer);
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_RATE, NULL);
+	}
+
+	return NULL;
+}
+
+static void adc_timer_stop(adc_cont_t *cont) {
+	esp_timer_stop(cont->timer);
+
+	// Wait for a tick that could be running, it wakes up the sampling task
+	esp_timer_start_once(cont->flush, 0);
+	xSemaphoreTake(cont->done, portMAX_DELAY);
+
+	cont->stop = 1;
+	xTaskNotifyGive(cont->reader);
+	xSemaphoreTake(cont->done, portMAX_DELAY);
+
+	esp_timer_delete(cont->flush);
+	esp_timer_delete(cont->timer);
+}
+
 /*
  * Operation functions
  */
@@ -260,3 +514,111 @@ driver_error_t *adc_read_avg(adc_channel_h_t *h, int samples, double *avgr, doub
 
 	return NULL;
 }
+
+driver_error_t *adc_start(adc_channel_h_t *h, uint32_t rate, uint32_t size, adc_block_callback_t callback, void *arg) {
+	driver_error_t *error;
+	adc_chann_t *chan;
+	adc_cont_t *cont;
+
+	// Get channel
+	if (lstget(&channels, (int)*h, (void **)&chan)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_CHANNEL, NULL);
+	}
+
+	if (chan->cont) {
+		return driver_error(ADC_DRIVER, ADC_ERR_CONT_STARTED, NULL);
+	}
+
+	if (rate == 0) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_RATE, NULL);
+	}
+
+	cont = calloc(1, sizeof(adc_cont_t));
+	if (!cont) {
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	cont->chan = chan;
+	cont->callback = callback;
+	cont->arg = arg;
+
+	// Each task, and the flush timer, gives it once
+	if (!(cont->done = xSemaphoreCreateCounting(3, 0))) {
+		free(cont);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (adc_stream_init(&cont->stream, size, adc_cont_notify, cont) < 0) {
+		vSemaphoreDelete(cont->done);
+		free(cont);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (xTaskCreatePinnedToCore(adc_cont_task, "adc", CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE, cont, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &cont->task, xPortGetCoreID()) != pdPASS) {
+		adc_cont_free(cont);
+		return driver_error(ADC_DRIVER, ADC_ERR_NOT_ENOUGH_MEMORY, NULL);
+	}
+
+	if (chan->unit <= CPU_LAST_ADC) {
+		error = adc_i2s_start(cont, rate);
+	} else {
+		error = adc_timer_start(cont, rate);
+	}
+
+	if (error) {
+		// Nothing was sampled, so the block task is waiting, and never called
+		// the callback
+		vTaskDelete(cont->task);
+		adc_cont_free(cont);
+		return error;
+	}
+
+	chan->cont = cont;
+
+	return NULL;
+}
+
+driver_error_t *adc_stop(adc_channel_h_t *h, uint32_t *overruns) {
+	adc_chann_t *chan;
+	adc_cont_t *cont;
+
+	// Get channel
+	if (lstget(&channels, (int)*h, (void **)&chan)) {
+		return driver_error(ADC_DRIVER, ADC_ERR_INVALID_CHANNEL, NULL);
+	}
+
+	if (!(cont = chan->cont)) {
+		return NULL;
+	}
+
+	// Stop the producer before the consumer
+	if (chan->unit <= CPU_LAST_ADC) {
+		adc_i2s_stop(cont);
+	} else {
+		adc_timer_stop(cont);
+	}
+
+	if (overruns) {
+		*overruns = cont->stream.overruns;
+	}
+
+	chan->cont = NULL;
+
+	// The block task exits at a block boundary, so never while the callback
+	// runs
+	cont->quit = 1;
+
+	if (xTaskGetCurrentTaskHandle() == cont->task) {
+		// Called from the callback, the block task exits when the callback
+		// returns
+		cont->detached = 1;
+		return NULL;
+	}
+
+	xTaskNotifyGive(cont->task);
+	xSemaphoreTake(cont->done, portMAX_DELAY);
+
+	adc_cont_free(cont);
+
+	return NULL;
+}
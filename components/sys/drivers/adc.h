@@ -52,6 +52,7 @@
 #include "esp_adc_cal.h"
 
 #include <drivers/cpu.h>
+#include <drivers/adc_stream.h>
 #include <sys/driver.h>
 
 // Channel handler
@@ -69,8 +70,14 @@ typedef struct {
 	int16_t max;             ///< Max voltage attached in mvolts
 
 	esp_adc_cal_characteristics_t *chars;
+
+	struct adc_cont *cont;   ///< Continuous mode, NULL if not started
 } adc_chann_t;
 
+// Called with each block of samples in continuous mode, and once with NULL
+// samples and stats when the continuous mode is stopped, after the last block
+typedef void (*adc_block_callback_t)(void *arg, const uint16_t *samples, uint32_t n, const adc_block_stats_t *stats);
+
 // Adc devices
 typedef struct {
 	const char *name;
@@ -89,6 +96,9 @@ typedef struct {
 #define ADC_ERR_INVALID_MAX				 (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) |  7)
 #define ADC_ERR_CANNOT_CALIBRATE	     (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) |  8)
 #define ADC_ERR_CALIBRATION	             (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) |  9)
+#define ADC_ERR_INVALID_RATE             (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) | 10)
+#define ADC_ERR_CONT_STARTED             (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) | 11)
+#define ADC_ERR_CANNOT_START             (DRIVER_EXCEPTION_BASE(ADC_DRIVER_ID) | 12)
 
 extern const int adc_errors;
 extern const int adc_error_map;
@@ -151,4 +161,38 @@ driver_error_t *adc_read_avg(adc_channel_h_t *h, int samples, double *avgr, doub
  */
 driver_error_t *adc_get_channel(adc_channel_h_t *h, adc_chann_t **chan);
 
+/**
+ * @brief Start sampling an adc channel in continuous mode. Samples are taken at a
+ *        fixed rate into double buffered blocks, and each block is passed to a
+ *        callback with its statistics, from a dedicated task. The internal ADC
+ *        is sampled by I2S DMA, with 12 bits of resolution, and external ADCs
+ *        are sampled by a task woken up by a timer.
+ *
+ * @param h A pointer to a channel handler.
+ * @param rate Samples per second.
+ * @param size Samples per block.
+ * @param callback Function called with each block.
+ * @param arg Argument for the callback.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs. Error can be an operation error or a lock error.
+ */
+driver_error_t *adc_start(adc_channel_h_t *h, uint32_t rate, uint32_t size, adc_block_callback_t callback, void *arg);
+
+/**
+ * @brief Stop the continuous mode of an adc channel. Waits until the sampling,
+ *        and the callback, are done. Can be called from the callback, then the
+ *        callback is not called with more blocks when it returns.
+ *
+ * @param h A pointer to a channel handler.
+ * @param overruns If not NULL, a pointer to a variable that holds the number of
+ *                 blocks dropped because the callback was late.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs. Error can be an operation error or a lock error.
+ */
+driver_error_t *adc_stop(adc_channel_h_t *h, uint32_t *overruns);
+
 #endif	/* ADC_H */
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, ADC continuous sampling blocks
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <drivers/adc_stream.h>
+
+/*
+ * Operation functions
+ */
+
+int adc_stream_init(adc_stream_t *stream, uint32_t size, adc_stream_notify_t notify, void *arg) {
+	memset(stream, 0, sizeof(adc_stream_t));
+
+	stream->buffer = calloc(2 * size, sizeof(uint16_t));
+	if (!stream->buffer) {
+		return -1;
+	}
+
+	stream->size = size;
+	stream->notify = notify;
+	stream->arg = arg;
+
+	return 0;
+}
+
+void adc_stream_free(adc_stream_t *stream) {
+	free(stream->buffer);
+	stream->buffer = NULL;
+}
+
+void adc_stream_write(adc_stream_t *stream, const uint16_t *samples, uint32_t n) {
+	uint32_t count;
+
+	while (n > 0) {
+		count = stream->size - stream->fill;
+		if (count > n) {
+			count = n;
+		}
+
+		memcpy(stream->buffer + stream->filling * stream->size + stream->fill, samples, count * sizeof(uint16_t));
+
+		stream->fill += count;
+		samples += count;
+		n -= count;
+
+		if (stream->fill < stream->size) {
+			break;
+		}
+
+		stream->fill = 0;
+
+		if (stream->ready) {
+			// The consumer is late, refill the same block
+			stream->overruns++;
+			continue;
+		}
+
+		// Switch blocks. filling must be updated before ready, because the
+		// consumer gets the block that is not being filled.
+		stream->filling ^= 1;
+		stream->ready = 1;
+		stream->blocks++;
+
+		if (stream->notify) {
+			stream->notify(stream);
+		}
+	}
+}
+
+const uint16_t *adc_stream_get(adc_stream_t *stream) {
+	if (!stream->ready) {
+		return NULL;
+	}
+
+	return stream->buffer + (stream->filling ^ 1) * stream->size;
+}
+
+void adc_stream_release(adc_stream_t *stream) {
+	stream->ready = 0;
+}
+
+void adc_stream_stats(const uint16_t *samples, uint32_t n, adc_block_stats_t *stats) {
+	uint64_t sum = 0, sum2 = 0;
+	uint16_t min = 0xffff, max = 0;
+	uint32_t i;
+
+	for(i = 0;i < n;i++) {
+		if (samples[i] < min) min = samples[i];
+		if (samples[i] > max) max = samples[i];
+
+		sum  += samples[i];
+		sum2 += (uint32_t)samples[i] * samples[i];
+	}
+
+	stats->min = min;
+	stats->max = max;
+	stats->mean = (double)sum / n;
+	stats->rms = sqrt((double)sum2 / n);
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, ADC continuous sampling blocks
+ *
+ */
+
+#ifndef ADC_STREAM_H
+#define	ADC_STREAM_H
+
+#include <stdint.h>
+
+// Statistics of a block of samples, in raw units
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	double mean;
+	double rms;
+} adc_block_stats_t;
+
+struct adc_stream;
+
+// Called by the producer when a block is ready
+typedef void (*adc_stream_notify_t)(struct adc_stream *);
+
+/*
+ * Double buffered stream of samples
+ *
+ * The producer (a DMA reader, or a sampling timer) fills one block, while the
+ * consumer processes the other one. When the producer fills a block and the
+ * consumer still holds the other one, the filled block is dropped and counted
+ * as an overrun, so the producer never waits.
+ *
+ * There must be a single producer, and a single consumer.
+ */
+typedef struct adc_stream {
+	uint16_t *buffer;            // Space for the 2 blocks
+	uint32_t size;               // Samples per block
+	uint32_t fill;               // Samples in the block being filled
+	volatile uint8_t filling;    // Block being filled
+	volatile uint8_t ready;      // 1 if the other block is full, until released
+	uint32_t blocks;             // Blocks delivered to the consumer
+	uint32_t overruns;           // Blocks dropped
+	adc_stream_notify_t notify;  // Block ready notification, can be NULL
+	void *arg;                   // Notification argument
+} adc_stream_t;
+
+/**
+ * @brief Initialize a stream.
+ *
+ * @param stream Stream.
+ * @param size   Samples per block.
+ * @param notify Function called by the producer when a block is ready.
+ * @param arg    Argument for the notify function.
+ *
+ * @return 0 on success, or -1 if there is not enough memory.
+ */
+int adc_stream_init(adc_stream_t *stream, uint32_t size, adc_stream_notify_t notify, void *arg);
+
+/**
+ * @brief Release the memory used by a stream.
+ *
+ * @param stream Stream.
+ */
+void adc_stream_free(adc_stream_t *stream);
+
+/**
+ * @brief Add samples to a stream. Called by the producer.
+ *
+ * @param stream  Stream.
+ * @param samples Samples.
+ * @param n       Number of samples.
+ */
+void adc_stream_write(adc_stream_t *stream, const uint16_t *samples, uint32_t n);
+
+/**
+ * @brief Get the ready block of a stream. Called by the consumer.
+ *
+ * @param stream Stream.
+ *
+ * @return The block, with stream->size samples, or NULL if there is no block
+ *         ready. The block must be released with adc_stream_release.
+ */
+const uint16_t *adc_stream_get(adc_stream_t *stream);
+
+/**
+ * @brief Release the block got with adc_stream_get. Called by the consumer.
+ *
+ * @param stream Stream.
+ */
+void adc_stream_release(adc_stream_t *stream);
+
+/**
+ * @brief Compute the statistics of a block of samples.
+ *
+ * @param samples Samples.
+ * @param n       Number of samples, greater than 0.
+ * @param stats   Statistics.
+ */
+void adc_stream_stats(const uint16_t *samples, uint32_t n, adc_block_stats_t *stats);
+
+#endif	/* ADC_STREAM_H */
@@ -57,6 +57,7 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 
 #include <driver/can.h>
 
@@ -66,6 +67,7 @@
 
 #include <drivers/cpu.h>
 #include <drivers/can.h>
+#include <drivers/can_filter.h>
 #include <drivers/cpu.h>
 #include <drivers/gpio.h>
 
@@ -93,9 +95,23 @@ static can_general_config_t g_config = CAN_GENERAL_CONFIG_DEFAULT(CONFIG_LUA_RTO
 // CAN gateway configuration
 can_gw_config_t *gw_config = NULL;
 
-// CAN filters
-static uint8_t filters = 0;
-static CAN_filter_t can_filter[CAN_NUM_FILTERS];
+// CAN gateway statistics, per unit
+static can_gw_stats_t gw_stats[CPU_LAST_CAN + 1];
+
+// CAN filters, as added by the user
+static int filters = 0;
+static can_filter_range_t *can_filter = NULL;
+
+// CAN filters, compiled
+static can_filter_set_t filter_set = {.all = 1};
+static struct mtx filter_mtx;
+
+// Driver users. Receive and transmit are users of the driver, and they can run
+// at the same time. The driver is installed again, when the hardware acceptance
+// filter changes, once there are no users. driver_mtx protects both counters.
+static struct mtx driver_mtx;
+static volatile int driver_users = 0;
+static volatile uint8_t driver_reinstall = 0;
 
 // Register driver and errors
 DRIVER_REGISTER_BEGIN(CAN,can,0,NULL,NULL);
@@ -151,6 +167,84 @@ driver_error_t *can_check_error(esp_err_t error) {
 #define MAX_BUS_ERROR 127
 #define MAX_WAITMS_TX 100
 
+// Size of a gateway batch, one TCP segment
+#define CAN_GW_BATCH_SIZE TCP_MSS
+
+// Maximum size of an encoded frame
+#define CAN_GW_MAX_FRAME sizeof(struct can_frame)
+
+// Time to wait for a frame, or for a client, before checking if the
+// gateway must stop, in milliseconds
+#define CAN_GW_IDLE_MS 100
+
+// Time to wait for a frame as a driver user, in milliseconds
+#define CAN_RX_SLICE_MS 100
+
+// Become a driver user, letting a pending reinstall go first
+static void can_ll_lock() {
+    for (;;) {
+        mtx_lock(&driver_mtx);
+        if (!driver_reinstall) {
+            driver_users++;
+            mtx_unlock(&driver_mtx);
+            return;
+        }
+        mtx_unlock(&driver_mtx);
+
+        vTaskDelay(1);
+    }
+}
+
+static void can_ll_unlock() {
+    mtx_lock(&driver_mtx);
+    driver_users--;
+    mtx_unlock(&driver_mtx);
+}
+
+// Get the driver for a reinstall, once the current users are done. New users
+// wait until can_ll_release.
+static void can_ll_acquire() {
+    for (;;) {
+        mtx_lock(&driver_mtx);
+        if (!driver_reinstall) {
+            driver_reinstall = 1;
+            mtx_unlock(&driver_mtx);
+            break;
+        }
+        mtx_unlock(&driver_mtx);
+
+        vTaskDelay(1);
+    }
+
+    while (driver_users > 0) {
+        vTaskDelay(1);
+    }
+}
+
+static void can_ll_release() {
+    mtx_lock(&driver_mtx);
+    driver_reinstall = 0;
+    mtx_unlock(&driver_mtx);
+}
+
+// Install the driver again with the current configuration
+static driver_error_t *can_ll_reinstall() {
+    driver_error_t *error;
+
+    error = can_check_error(can_stop());
+    if (!error) {
+        error = can_check_error(can_driver_uninstall());
+    }
+    if (!error) {
+        error = can_check_error(can_driver_install(&g_config, &t_config, &f_config));
+    }
+    if (!error) {
+        error = can_check_error(can_start());
+    }
+
+    return error;
+}
+
 void can_recovery() {
     can_status_info_t status_info;
     esp_err_t error = can_get_status_info(&status_info);
@@ -163,114 +257,467 @@ void can_recovery() {
 }
 
 static driver_error_t *can_ll_tx(can_message_t *frame) {
-    driver_error_t *error;
-    if ((error = can_check_error(can_transmit(frame, pdMS_TO_TICKS(MAX_WAITMS_TX))))) {
+    esp_err_t err;
+
+    can_ll_lock();
+    err = can_transmit(frame, pdMS_TO_TICKS(MAX_WAITMS_TX));
+    if (err != ESP_OK) {
         can_recovery();
-        return error;
     }
-    return 0;
+    can_ll_unlock();
+
+    return can_check_error(err);
+}
+
+// Check if a frame passes the filters
+static int can_ll_pass(can_message_t *frame) {
+    int pass;
+
+    if (filters == 0) {
+        return 1;
+    }
+
+    mtx_lock(&filter_mtx);
+    pass = can_filter_match(&filter_set, frame->identifier);
+    mtx_unlock(&filter_mtx);
+
+    return pass;
+}
+
+// Compile the first count filters, program the hardware acceptance filter,
+// and make them the current filters. On error the current filters, and the
+// driver configuration, are kept.
+static driver_error_t *can_filter_apply(int count) {
+    can_filter_config_t prev_config;
+    driver_error_t *error;
+    can_filter_set_t set;
+
+    if (can_filter_compile(can_filter, count, &set) < 0) {
+        return driver_error(CAN_DRIVER, CAN_ERR_NOT_ENOUGH_MEMORY, NULL);
+    }
+
+    // The acceptance filter is programmed when the driver is installed. Threads
+    // receiving and transmitting, including the gateway's, wait meanwhile.
+    can_ll_acquire();
+
+    prev_config = f_config;
+    f_config.acceptance_code = set.code;
+    f_config.acceptance_mask = set.mask;
+    f_config.single_filter = true;
+
+    error = can_ll_reinstall();
+    if (error) {
+        // Back to the previous acceptance filter, from wherever the reinstall
+        // stopped
+        f_config = prev_config;
+        can_stop();
+        can_driver_uninstall();
+        if ((can_driver_install(&g_config, &t_config, &f_config) != ESP_OK) || (can_start() != ESP_OK)) {
+            syslog(LOG_ERR, "can%d: couldn't restore the acceptance filter", CPU_FIRST_CAN);
+        }
+
+        can_filter_free(&set);
+    } else {
+        mtx_lock(&filter_mtx);
+        can_filter_free(&filter_set);
+        memcpy(&filter_set, &set, sizeof(can_filter_set_t));
+        filters = count;
+        mtx_unlock(&filter_mtx);
+    }
+
+    can_ll_release();
+
+    return error;
 }
 
 static driver_error_t *can_ll_rx(can_message_t *frame, uint32_t timeout) {
     // Read next frame
     // Check filter
-    uint8_t i;
     uint8_t pass = 0;
-    driver_error_t *error;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed, wait;
+    esp_err_t err;
+    int more;
 
     if (timeout != portMAX_DELAY) {
         timeout = timeout / portTICK_PERIOD_MS;
     }
 
     while (!pass) {
-        if ((error = can_check_error(can_receive(frame, timeout)))) {
+        // Wait in slices, so the driver can be installed again meanwhile
+        wait = pdMS_TO_TICKS(CAN_RX_SLICE_MS);
+        if (timeout != portMAX_DELAY) {
+            elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= timeout) {
+                wait = 0;
+            } else if (timeout - elapsed < wait) {
+                wait = timeout - elapsed;
+            }
+        }
+
+        can_ll_lock();
+        err = can_receive(frame, wait);
+        more = (err == ESP_ERR_TIMEOUT) && ((timeout == portMAX_DELAY) || (xTaskGetTickCount() - start < timeout));
+        if ((err != ESP_OK) && !more) {
             can_recovery();
-            return error;
-        }
-        pass = 1;
-        if (filters > 0) {
-            CAN_FIR_t FIR = (CAN_FIR_t)frame->flags;
-            for(i=0;((i < CAN_NUM_FILTERS) && (!pass));i++) {
-                if ((can_filter[i].fromID >= 0) && (can_filter[i].toID >= 0) && (FIR.B.DLC > 0) && (FIR.B.DLC < 9)) {
-                    pass = ((frame->identifier >= can_filter[i].fromID) && (frame->identifier <= can_filter[i].toID));
-                }
+        }
+        can_ll_unlock();
+
+        if (more) {
+            continue;
+        }
+
+        if (err != ESP_OK) {
+            return can_check_error(err);
+        }
+
+        pass = can_ll_pass(frame);
+    }
+
+    return 0;
+}
+
+static void gw_encode_id(can_message_t *frame, uint32_t *can_id) {
+    *can_id = frame->identifier & CAN_EXTD_ID_MASK;
+
+    if (frame->flags & CAN_MSG_FLAG_EXTD) {
+        *can_id |= (1u << 31);
+    }
+
+    if (frame->flags & CAN_MSG_FLAG_RTR) {
+        *can_id |= (1u << 30);
+    }
+}
+
+static void gw_decode_id(uint32_t can_id, can_message_t *frame) {
+    frame->identifier = can_id & CAN_EXTD_ID_MASK;
+    frame->flags = CAN_MSG_FLAG_NONE;
+
+    if (can_id & (1u << 31)) {
+        frame->flags |= CAN_MSG_FLAG_EXTD;
+    }
+
+    if (can_id & (1u << 30)) {
+        frame->flags |= CAN_MSG_FLAG_RTR;
+    }
+}
+
+// Encode a frame into buffer, and return the encoded length
+int can_gw_encode(can_gw_format_t format, can_message_t *frame, uint8_t *buffer) {
+    uint32_t can_id;
+
+    gw_encode_id(frame, &can_id);
+
+    if (format == CAN_GW_FORMAT_COMPACT) {
+        buffer[0] = can_id >> 24;
+        buffer[1] = can_id >> 16;
+        buffer[2] = can_id >> 8;
+        buffer[3] = can_id;
+        buffer[4] = frame->data_length_code;
+        memcpy(&buffer[5], frame->data, frame->data_length_code);
+
+        return 5 + frame->data_length_code;
+    } else {
+        struct can_frame packet;
+
+        memset(&packet, 0, sizeof(packet));
+
+        packet.can_id = can_id;
+        packet.can_dlc = frame->data_length_code;
+        memcpy(packet.data, frame->data, frame->data_length_code);
+        memcpy(buffer, &packet, sizeof(packet));
+
+        return sizeof(packet);
+    }
+}
+
+// Decode a frame from buffer. Return the decoded length, 0 if buffer
+// don't have a complete frame, or -1 if frame is not valid.
+int can_gw_decode(can_gw_format_t format, uint8_t *buffer, int len, can_message_t *frame) {
+    if (format == CAN_GW_FORMAT_COMPACT) {
+        if (len < 5) {
+            return 0;
+        }
+
+        // Check the dlc before anything else, it is used to copy the data
+        if (buffer[4] > CAN_MAX_DLEN) {
+            return -1;
+        }
+
+        if (len < 5 + buffer[4]) {
+            return 0;
+        }
+
+        gw_decode_id(((uint32_t)buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3], frame);
+        frame->data_length_code = buffer[4];
+        memcpy(frame->data, &buffer[5], frame->data_length_code);
+
+        return 5 + frame->data_length_code;
+    } else {
+        struct can_frame packet;
+
+        if (len < sizeof(packet)) {
+            return 0;
+        }
+
+        memcpy(&packet, buffer, sizeof(packet));
+        if (packet.can_dlc > CAN_MAX_DLEN) {
+            return -1;
+        }
+
+        gw_decode_id(packet.can_id, frame);
+        frame->data_length_code = packet.can_dlc;
+        memcpy(frame->data, packet.data, packet.can_dlc);
+
+        return sizeof(packet);
+    }
+}
+
+// Send the client backlog, followed by len bytes of data, without blocking.
+// What can't be sent now is kept in the backlog. Must be called with the
+// gateway mutex held. Returns -1 if the connection failed, or if the client
+// is so slow that its backlog overflows.
+static int gw_client_send(can_gw_client_t *client, uint8_t *data, int len) {
+    int rc;
+
+    if (client->outlen > 0) {
+        rc = send(client->socket, client->backlog, client->outlen, MSG_DONTWAIT);
+        if (rc < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                return -1;
             }
-        } else {
-            pass = 1;
+
+            rc = 0;
         }
+
+        client->outlen -= rc;
+        memmove(client->backlog, client->backlog + rc, client->outlen);
+    }
+
+    // Data can't be sent before the backlog, or frames would be split
+    if ((client->outlen == 0) && (len > 0)) {
+        rc = send(client->socket, data, len, MSG_DONTWAIT);
+        if (rc < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                return -1;
+            }
+
+            rc = 0;
+        }
+
+        data += rc;
+        len -= rc;
+    }
+
+    if (len > CAN_GW_CLIENT_BACKLOG - client->outlen) {
+        return -1;
+    }
+
+    if (len > 0) {
+        memcpy(client->backlog + client->outlen, data, len);
+        client->outlen += len;
     }
 
     return 0;
 }
 
+// Fail a client. It is closed by gw_thread, that owns the client sockets.
+// Must be called with the gateway mutex held.
+static void gw_client_fail(can_gw_client_t *client) {
+    syslog(LOG_ERR, "can%d gateway: can't write to socket", gw_config->unit);
+
+    client->failed = 1;
+    client->outlen = 0;
+    shutdown(client->socket, SHUT_RDWR);
+}
+
+// Send a batch of frames to all the clients. Sends never block, so a
+// stalled client can't delay the other clients, or the bus.
+static void gw_flush(uint8_t *batch, int len, int frames) {
+    int i, sent = 0;
+
+    mtx_lock(&gw_config->mtx);
+
+    for(i = 0;i < CAN_GW_MAX_CLIENTS;i++) {
+        can_gw_client_t *client = &gw_config->client[i];
+
+        if ((client->socket < 0) || client->failed) {
+            continue;
+        }
+
+        if (gw_client_send(client, batch, len) < 0) {
+            gw_client_fail(client);
+            continue;
+        }
+
+        sent++;
+    }
+
+    mtx_unlock(&gw_config->mtx);
+
+    if (sent > 0) {
+        gw_stats[gw_config->unit].rx_frames += frames;
+        gw_stats[gw_config->unit].batches++;
+    } else {
+        gw_stats[gw_config->unit].rx_dropped += frames;
+    }
+}
+
 static void *gw_thread_up(void *arg) {
     can_message_t frame;
-    struct can_frame packet;
-
-    // Set a timeout for send
-    struct timeval tout;
-    tout.tv_sec = 4;
-    tout.tv_usec = 0;
-    setsockopt(gw_config->client, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout));
+    TickType_t first = 0;
+    TickType_t elapsed, wait;
+    uint8_t *batch;
+    int len = 0, frames = 0;
+    esp_err_t error;
+
+    // Frames are coalesced in batches of up to one TCP segment
+    batch = malloc(CAN_GW_BATCH_SIZE);
+    if (!batch) {
+        syslog(LOG_ERR, "can%d gateway: not enough memory", gw_config->unit);
+        return NULL;
+    }
 
     while(!gw_config->stop) {
-        // Wait for a CAN packet
-        can_ll_rx(&frame, portMAX_DELAY);
-        CAN_FIR_t FIR = (CAN_FIR_t)frame.flags;
-        if (FIR.B.DLC != 0) {
-            // Fill packet
-            memset(&packet, 0, sizeof(packet));
+        if (frames > 0) {
+            // Don't wait more than CAN_GW_FLUSH_MS since the first frame of the batch
+            elapsed = xTaskGetTickCount() - first;
+            if (elapsed >= pdMS_TO_TICKS(CAN_GW_FLUSH_MS)) {
+                gw_flush(batch, len, frames);
+                len = frames = 0;
+                continue;
+            }
+
+            wait = pdMS_TO_TICKS(CAN_GW_FLUSH_MS) - elapsed;
+        } else {
+            wait = pdMS_TO_TICKS(CAN_GW_IDLE_MS);
+        }
 
-            packet.can_id = (FIR.B.FF << 31) | (FIR.B.RTR << 30) | frame.identifier;
-            packet.can_dlc = FIR.B.DLC;
+        // Wait for a CAN frame
+        can_ll_lock();
+        error = can_receive(&frame, wait);
+        if ((error != ESP_OK) && (error != ESP_ERR_TIMEOUT)) {
+            can_recovery();
+        }
+        can_ll_unlock();
 
-            memcpy(packet.data, frame.data, sizeof(frame.data));
+        if (error != ESP_OK) {
+            continue;
+        }
 
-            // Write frame to socket
-            if (write(gw_config->client, &packet, sizeof(packet)) != sizeof(packet)) {
-                close(gw_config->client);
+        if (!can_ll_pass(&frame)) {
+            continue;
+        }
+
+        if (frames == 0) {
+            first = xTaskGetTickCount();
+        }
 
-                syslog(LOG_ERR, "can%d gateway: can't write to socket", gw_config->unit);
+        len += can_gw_encode(gw_config->format, &frame, batch + len);
+        frames++;
 
-                return NULL;
-            }
+        if (len + CAN_GW_MAX_FRAME > CAN_GW_BATCH_SIZE) {
+            gw_flush(batch, len, frames);
+            len = frames = 0;
         }
     }
 
-    close(gw_config->client);
+    free(batch);
 
     return NULL;
 }
 
-static void *gw_thread_down(void *arg) {
-    struct can_frame packet;
+static void gw_client_close(can_gw_client_t *client) {
+    mtx_lock(&gw_config->mtx);
+    close(client->socket);
+    client->socket = -1;
+    client->failed = 0;
+    client->len = 0;
+    client->outlen = 0;
+    gw_stats[gw_config->unit].clients--;
+    mtx_unlock(&gw_config->mtx);
+}
+
+static void gw_client_accept() {
+    int i, socket;
+
+    socket = accept(gw_config->socket, (struct sockaddr*) NULL, NULL);
+    if (socket < 0) {
+        return;
+    }
+
+    mtx_lock(&gw_config->mtx);
+
+    for(i = 0;i < CAN_GW_MAX_CLIENTS;i++) {
+        if (gw_config->client[i].socket < 0) {
+            break;
+        }
+    }
+
+    if (i == CAN_GW_MAX_CLIENTS) {
+        mtx_unlock(&gw_config->mtx);
+        close(socket);
+
+        syslog(LOG_ERR, "can%d gateway: too many clients", gw_config->unit);
+
+        return;
+    }
+
+    gw_config->client[i].socket = socket;
+    gw_config->client[i].failed = 0;
+    gw_config->client[i].len = 0;
+    gw_config->client[i].outlen = 0;
+    gw_stats[gw_config->unit].clients++;
+
+    mtx_unlock(&gw_config->mtx);
+
+    syslog(LOG_INFO, "can%d gateway: client connected", gw_config->unit);
+}
+
+// Read all the available bytes from a client, and send the complete
+// frames to the bus
+static void gw_client_read(can_gw_client_t *client) {
+    driver_error_t *error;
     can_message_t frame;
+    int rc, pos = 0;
 
-    while(!gw_config->stop) {
-        if (read(gw_config->client, &packet, sizeof(packet)) == sizeof(packet)) {
-            // Fill frame
-            frame.identifier = (packet.can_id & 0b11111111111111111111111111111);
-            CAN_FIR_t FIR;
-            memset(&FIR, 0, sizeof(CAN_FIR_t));
-            FIR.B.FF = (packet.can_id & 0b10000000000000000000000000000000?1:0);
-            FIR.B.RTR = (packet.can_id & 0b01000000000000000000000000000000?1:0);
-            FIR.B.DLC = packet.can_dlc;
-            memcpy(&frame.flags, &FIR, sizeof(CAN_FIR_t));
+    rc = recv(client->socket, client->buffer + client->len, sizeof(client->buffer) - client->len, 0);
+    if (rc <= 0) {
+        syslog(LOG_INFO, "can%d gateway: client disconnected", gw_config->unit);
+        gw_client_close(client);
+        return;
+    }
 
-            memcpy(frame.data, packet.data, sizeof(packet.data));
+    client->len += rc;
 
-            can_ll_tx(&frame);
+    while ((rc = can_gw_decode(gw_config->format, client->buffer + pos, client->len - pos, &frame)) > 0) {
+        pos += rc;
+
+        if ((error = can_ll_tx(&frame))) {
+            free(error);
+            gw_stats[gw_config->unit].tx_dropped++;
+        } else {
+            gw_stats[gw_config->unit].tx_frames++;
         }
     }
 
-    close(gw_config->client);
+    if (rc < 0) {
+        syslog(LOG_ERR, "can%d gateway: invalid frame received", gw_config->unit);
+        gw_client_close(client);
+        return;
+    }
 
-    return NULL;
+    // Keep the incomplete frame for the next read
+    client->len -= pos;
+    memmove(client->buffer, client->buffer + pos, client->len);
 }
 
 static void *gw_thread(void *arg) {
     // Create an setup socket
     struct sockaddr_in6 sin;
+    struct timeval timeout;
+    fd_set set, wset;
+    int i, maxfd;
 
     gw_config->socket = socket(AF_INET6, SOCK_STREAM, 0);
     if (gw_config->socket < 0) {
@@ -286,46 +733,90 @@ static void *gw_thread(void *arg) {
 
     if(bind(gw_config->socket, (struct sockaddr *) &sin, sizeof (sin))) {
         syslog(LOG_ERR, "can%d gateway: can't bind to port %d",gw_config->unit, gw_config->port);
+        close(gw_config->socket);
         return NULL;
     }
 
     if (listen(gw_config->socket, 5)) {
         syslog(LOG_ERR, "can%d gateway: can't listen on port %d",gw_config->unit, gw_config->port);
+        close(gw_config->socket);
         return NULL;
     }
 
+    // Start up thread, that sends the frames received from the bus to the clients
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+
+    pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
+    if (pthread_create(&gw_config->thread_up, &attr, gw_thread_up, NULL)) {
+        syslog(LOG_ERR, "can%d gateway: can't start up thread", gw_config->unit);
+        close(gw_config->socket);
+        return NULL;
+    }
+
+    pthread_setname_np(gw_config->thread_up, "can_gw_up");
+
     syslog(LOG_INFO, "can%d gateway: started at port %d", gw_config->unit, gw_config->port);
 
+    // Accept new clients, and send the frames received from the clients to the bus
     while (!gw_config->stop) {
-        // Wait for a connection
-        gw_config->client = accept(gw_config->socket, (struct sockaddr*) NULL, NULL);
-        if (gw_config->client > 0) {
-            syslog(LOG_INFO, "can%d gateway: client connected", gw_config->unit);
-
-            // Start threads for client
-            pthread_t thread_up;
-            pthread_t thread_down;
-            pthread_attr_t attr;
-
-            pthread_attr_init(&attr);
-
-            pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
-            if (pthread_create(&thread_up, &attr, gw_thread_up, NULL)) {
-                syslog(LOG_ERR, "can%d gateway: can't start up thread", gw_config->unit);
-                return NULL;
+        FD_ZERO(&set);
+        FD_ZERO(&wset);
+        FD_SET(gw_config->socket, &set);
+        maxfd = gw_config->socket;
+
+        mtx_lock(&gw_config->mtx);
+        for(i = 0;i < CAN_GW_MAX_CLIENTS;i++) {
+            if (gw_config->client[i].socket >= 0) {
+                FD_SET(gw_config->client[i].socket, &set);
+                if (gw_config->client[i].socket > maxfd) {
+                    maxfd = gw_config->client[i].socket;
+                }
+
+                // Wait to send the backlog, if the bus is quiet
+                if (gw_config->client[i].outlen > 0) {
+                    FD_SET(gw_config->client[i].socket, &wset);
+                }
             }
+        }
+        mtx_unlock(&gw_config->mtx);
+
+        timeout.tv_sec = 0;
+        timeout.tv_usec = CAN_GW_IDLE_MS * 1000;
+
+        if (select(maxfd + 1, &set, &wset, NULL, &timeout) <= 0) {
+            continue;
+        }
 
-            pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
-            if (pthread_create(&thread_down, &attr, gw_thread_down, NULL)) {
-                syslog(LOG_ERR, "can%d gateway: can't start down thread", gw_config->unit);
-                return NULL;
+        mtx_lock(&gw_config->mtx);
+        for(i = 0;i < CAN_GW_MAX_CLIENTS;i++) {
+            can_gw_client_t *client = &gw_config->client[i];
+
+            if ((client->socket >= 0) && !client->failed && FD_ISSET(client->socket, &wset)) {
+                if (gw_client_send(client, NULL, 0) < 0) {
+                    gw_client_fail(client);
+                }
             }
+        }
+        mtx_unlock(&gw_config->mtx);
+
+        if (FD_ISSET(gw_config->socket, &set)) {
+            gw_client_accept();
+        }
+
+        for(i = 0;i < CAN_GW_MAX_CLIENTS;i++) {
+            if ((gw_config->client[i].socket >= 0) && FD_ISSET(gw_config->client[i].socket, &set)) {
+                gw_client_read(&gw_config->client[i]);
+            }
+        }
+    }
 
-            pthread_setname_np(thread_up, "can_gw_up");
-            pthread_setname_np(thread_down, "can_gw_down");
+    pthread_join(gw_config->thread_up, NULL);
 
-            pthread_join(thread_up, NULL);
-            pthread_join(thread_down, NULL);
+    for(i = 0;i < CAN_GW_MAX_CLIENTS;i++) {
+        if (gw_config->client[i].socket >= 0) {
+            gw_client_close(&gw_config->client[i]);
         }
     }
 
@@ -408,16 +899,26 @@ driver_error_t *can_setup(int32_t unit, uint32_t speed, uint16_t rx_size) {
             }
     }
 
+    if (!setup) {
+        mtx_init(&filter_mtx, NULL, NULL, 0);
+        mtx_init(&driver_mtx, NULL, NULL, 0);
+    }
+
     // Start CAN module
     driver_error_t *error;
-    if ((error = can_check_error(can_driver_install(&g_config, &t_config, &f_config)))) {
-        return error;
+    can_ll_acquire();
+    error = can_check_error(can_driver_install(&g_config, &t_config, &f_config));
+    if (!error) {
+        error = can_check_error(can_start());
     }
-    if ((error = can_check_error(can_start()))) {
+    can_ll_release();
+
+    if (error) {
         return error;
     }
 
     if (!setup) {
+
         syslog(LOG_INFO, "can%d at pins tx=%s%d, rx=%s%d", 0,
             gpio_portname(CONFIG_LUA_RTOS_CAN_TX), gpio_name(CONFIG_LUA_RTOS_CAN_TX),
             gpio_portname(CONFIG_LUA_RTOS_CAN_RX), gpio_name(CONFIG_LUA_RTOS_CAN_RX)
@@ -495,38 +996,29 @@ driver_error_t *can_add_filter(int32_t unit, int32_t fromId, int32_t toId) {
 
     // Check if there is some filter that match with the
     // desired filter
-    uint8_t i;
+    int i;
 
-    for(i=0;i < CAN_NUM_FILTERS;i++) {
-        if ((fromId >= can_filter[i].fromID) && (toId <= can_filter[i].toID)) {
+    for(i=0;i < filters;i++) {
+        if ((fromId >= can_filter[i].from) && (toId <= can_filter[i].to)) {
             return NULL;
         }
     }
 
-    // Add filter
-    for(i=0;i < CAN_NUM_FILTERS;i++) {
-        if ((can_filter[i].fromID  == -1) && (can_filter[i].toID == -1)) {
-            can_filter[i].fromID = fromId;
-            can_filter[i].toID = toId;
-            filters++;
-            break;
-        }
-    }
-
-    if (i == CAN_NUM_FILTERS) {
+    if (filters == CAN_NUM_FILTERS) {
         return driver_error(CAN_DRIVER, CAN_ERR_NO_MORE_FILTERS_ALLOWED, NULL);
     }
 
-	// Reset rx queue
-	driver_error_t *error;
-    if ((error = can_check_error(can_stop()))) {
-        return error;
-    }
-    if ((error = can_check_error(can_start()))) {
-        return error;
+    // Add filter
+    can_filter_range_t *filter = realloc(can_filter, sizeof(can_filter_range_t) * (filters + 1));
+    if (!filter) {
+        return driver_error(CAN_DRIVER, CAN_ERR_NOT_ENOUGH_MEMORY, NULL);
     }
 
-    return NULL;
+    can_filter = filter;
+    can_filter[filters].from = fromId;
+    can_filter[filters].to = toId;
+
+    return can_filter_apply(filters + 1);
 }
 
 driver_error_t *can_remove_filter(int32_t unit, int32_t fromId, int32_t toId) {
@@ -547,38 +1039,45 @@ driver_error_t *can_remove_filter(int32_t unit, int32_t fromId, int32_t toId) {
         return driver_error(CAN_DRIVER, CAN_ERR_IS_NOT_SETUP, NULL);
     }
 
-    uint8_t i;
-    for(i=0;i < CAN_NUM_FILTERS;i++) {
-        if ((can_filter[i].fromID  > -1) && (can_filter[i].toID > -1)) {
-            if ((can_filter[i].fromID  == fromId) && (can_filter[i].toID == toId)) {
-                can_filter[i].fromID = -1;
-                can_filter[i].toID = -1;
-                filters--;
-                break;
-            }
+    driver_error_t *error;
+    int i;
+
+    for(i=0;i < filters;i++) {
+        if ((can_filter[i].from == fromId) && (can_filter[i].to == toId)) {
+            break;
         }
     }
 
-	// Reset rx queue
-	driver_error_t *error;
-    if ((error = can_check_error(can_stop()))) {
-        return error;
+    if (i == filters) {
+        return can_filter_apply(filters);
     }
-    if ((error = can_check_error(can_start()))) {
-        return error;
+
+    memmove(&can_filter[i], &can_filter[i + 1], sizeof(can_filter_range_t) * (filters - i - 1));
+
+    error = can_filter_apply(filters - 1);
+    if (error) {
+        // Put the filter back in its place
+        memmove(&can_filter[i + 1], &can_filter[i], sizeof(can_filter_range_t) * (filters - i - 1));
+        can_filter[i].from = fromId;
+        can_filter[i].to = toId;
     }
 
-    return NULL;
+    return error;
 }
 
-driver_error_t *can_gateway_start(int32_t unit, uint32_t speed, int32_t port) {
+driver_error_t *can_gateway_start(int32_t unit, uint32_t speed, int32_t port, can_gw_format_t format) {
     driver_error_t *error;
+    int i;
 
     // Sanity checks
     if ((unit < CPU_FIRST_CAN) || (unit > CPU_LAST_CAN)) {
         return driver_error(CAN_DRIVER, CAN_ERR_INVALID_UNIT, NULL);
     }
 
+    if ((format != CAN_GW_FORMAT_SOCKETCAN) && (format != CAN_GW_FORMAT_COMPACT)) {
+        return driver_error(CAN_DRIVER, CAN_ERR_INVALID_ARGUMENT, "invalid frame format");
+    }
+
     if ((error = can_setup(unit, speed, 100))) {
         return error;
     }
@@ -590,7 +1089,17 @@ driver_error_t *can_gateway_start(int32_t unit, uint32_t speed, int32_t port) {
     }
 
     gw_config->port = port;
+    gw_config->unit = unit;
     gw_config->stop = 0;
+    gw_config->format = format;
+
+    for(i = 0;i < CAN_GW_MAX_CLIENTS;i++) {
+        gw_config->client[i].socket = -1;
+    }
+
+    mtx_init(&gw_config->mtx, NULL, NULL, 0);
+
+    memset(&gw_stats[unit], 0, sizeof(can_gw_stats_t));
 
     // Start main thread
     pthread_attr_t attr;
@@ -599,7 +1108,9 @@ driver_error_t *can_gateway_start(int32_t unit, uint32_t speed, int32_t port) {
 
     pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
     if (pthread_create(&gw_config->thread, &attr, gw_thread, NULL)) {
+        mtx_destroy(&gw_config->mtx);
         free(gw_config);
+        gw_config = NULL;
 
         return driver_error(CAN_DRIVER, CAN_ERR_NOT_ENOUGH_MEMORY, "can't start main thread");
     }
@@ -619,33 +1130,36 @@ driver_error_t *can_gateway_stop(int32_t unit) {
         return driver_error(CAN_DRIVER, CAN_ERR_GW_NOT_STARTED, NULL);
     }
 
-    // Set stop flag
+    // Set stop flag, gateway threads check it at least every CAN_GW_IDLE_MS
     gw_config->stop = 1;
 
-    // Send an empty frame to the queue to unblock gw_thread_up
-    can_message_t frame;
-    memset(&frame, 0, sizeof(frame));
-    driver_error_t *error;
-    if ((error = can_ll_tx(&frame))) {
-        return error;
-    }
-
-    // Close socket to unblock gw_thread
-    close(gw_config->socket);
-
     pthread_join(gw_config->thread, NULL);
 
+    mtx_destroy(&gw_config->mtx);
     free(gw_config);
     gw_config = NULL;
 
+    driver_error_t *error;
+
 	// Reset rx queue
-    if ((error = can_check_error(can_stop()))) {
-        return error;
+    can_ll_lock();
+    error = can_check_error(can_stop());
+    if (!error) {
+        error = can_check_error(can_start());
     }
-    if ((error = can_check_error(can_start()))) {
-        return error;
+    can_ll_unlock();
+
+    return error;
+}
+
+driver_error_t *can_gateway_stats(int32_t unit, can_gw_stats_t *stats) {
+    // Sanity checks
+    if ((unit < CPU_FIRST_CAN) || (unit > CPU_LAST_CAN)) {
+        return driver_error(CAN_DRIVER, CAN_ERR_INVALID_UNIT, NULL);
     }
 
+    memcpy(stats, &gw_stats[unit], sizeof(can_gw_stats_t));
+
     return NULL;
 }
 
@@ -52,8 +52,24 @@
 #include <pthread.h>
 
 #include <sys/driver.h>
+#include <sys/mutex.h>
 
-#define CAN_NUM_FILTERS 10
+// Maximum number of filters
+#define CAN_NUM_FILTERS 256
+
+// Maximum number of clients connected to the gateway at the same time
+#define CAN_GW_MAX_CLIENTS 4
+
+// Size of the receive buffer of each gateway client, in bytes
+#define CAN_GW_CLIENT_BUFFER 256
+
+// Size of the send backlog of each gateway client, in bytes. A client that
+// is so slow that its backlog overflows is disconnected.
+#define CAN_GW_CLIENT_BACKLOG 4096
+
+// Maximum time that a frame received from the bus can wait in a batch
+// before the batch is sent to the gateway clients, in milliseconds
+#define CAN_GW_FLUSH_MS 10
 
 /**
  * \brief CAN frame type (standard/extended)
@@ -87,13 +103,47 @@ typedef struct {
 	int32_t toID;
 } CAN_filter_t;
 
+/*
+ * Gateway frame formats
+ *
+ * CAN_GW_FORMAT_SOCKETCAN: a 16-byte struct can_frame for each frame
+ * CAN_GW_FORMAT_COMPACT: 32-bit can_id (big endian, same flags than
+ *                        struct can_frame), followed by the dlc, and
+ *                        followed by dlc bytes of data
+ */
+typedef enum {
+	CAN_GW_FORMAT_SOCKETCAN = 0,
+	CAN_GW_FORMAT_COMPACT = 1
+} can_gw_format_t;
+
+typedef struct {
+	uint32_t rx_frames;  // Frames received from the bus and sent to the clients
+	uint32_t rx_dropped; // Frames received from the bus and not sent to any client
+	uint32_t tx_frames;  // Frames received from the clients and sent to the bus
+	uint32_t tx_dropped; // Frames received from the clients and not sent to the bus
+	uint32_t batches;    // Batches sent to the clients
+	uint32_t clients;    // Connected clients
+} can_gw_stats_t;
+
+typedef struct {
+	int socket;                            // Client socket, -1 if slot is free
+	uint8_t failed;                        // 1 if a write to the client failed
+	int len;                               // Bytes in buffer
+	uint8_t buffer[CAN_GW_CLIENT_BUFFER];  // Received bytes not processed yet
+	int outlen;                            // Bytes in backlog
+	uint8_t backlog[CAN_GW_CLIENT_BACKLOG];// Bytes not sent yet
+} can_gw_client_t;
+
 typedef struct {
 	uint32_t port;
 	int socket;
-	int client;
 	uint8_t unit;
 	uint8_t stop;
+	can_gw_format_t format;
 	pthread_t thread;
+	pthread_t thread_up;
+	struct mtx mtx;                               // Protects client
+	can_gw_client_t client[CAN_GW_MAX_CLIENTS];
 } can_gw_config_t;
 
 #define CAN_MAX_DLEN 8
@@ -168,7 +218,16 @@ driver_error_t *can_tx(int32_t unit, uint32_t msg_id, uint8_t msg_type, uint8_t
 driver_error_t *can_rx(int32_t unit, uint32_t *msg_id, uint8_t *msg_type, uint8_t *data, uint8_t *len, uint32_t timeout);
 driver_error_t *can_add_filter(int32_t unit, int32_t fromId, int32_t toId);
 driver_error_t *can_remove_filter(int32_t unit, int32_t fromId, int32_t toId);
-driver_error_t *can_gateway_start(int32_t unit, uint32_t speed, int32_t port);
+driver_error_t *can_gateway_start(int32_t unit, uint32_t speed, int32_t port, can_gw_format_t format);
 driver_error_t *can_gateway_stop(int32_t unit);
+driver_error_t *can_gateway_stats(int32_t unit, can_gw_stats_t *stats);
+
+/*
+ * Gateway frame codec, exported for testing. can_gw_encode returns the
+ * encoded length. can_gw_decode returns the decoded length, 0 if buffer
+ * doesn't have a complete frame yet, or -1 if the frame is not valid.
+ */
+int can_gw_encode(can_gw_format_t format, can_message_t *frame, uint8_t *buffer);
+int can_gw_decode(can_gw_format_t format, uint8_t *buffer, int len, can_message_t *frame);
 
 #endif	/* CAN_H */
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, CAN filter compiler
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_CAN
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <drivers/can_filter.h>
+
+#define CAN_STD_ID_MAX 0x7ff
+#define CAN_EXT_ID_MAX 0x1fffffff
+
+/*
+ * Helper functions
+ */
+
+static int range_compare(const void *a, const void *b) {
+	const can_filter_range_t *ra = a;
+	const can_filter_range_t *rb = b;
+
+	if (ra->from < rb->from) return -1;
+	if (ra->from > rb->from) return 1;
+
+	return 0;
+}
+
+// Get a mask with the bits that take both values in [from, to]
+static uint32_t range_vary(uint32_t from, uint32_t to) {
+	uint32_t diff = from ^ to;
+
+	if (diff == 0) {
+		return 0;
+	}
+
+	return 0xffffffff >> __builtin_clz(diff);
+}
+
+// Get the bits that take the same value for all the identifiers of the
+// set that are in [0, max], in care, and it's values in value. Return
+// 0 if there are not identifiers in [0, max].
+static int set_constant_bits(const can_filter_set_t *set, uint32_t max, uint32_t *value, uint32_t *care) {
+	uint32_t vary = 0;
+	uint32_t to;
+	int i, found = 0;
+
+	for(i = 0;i < set->ranges;i++) {
+		if (set->range[i].from > max) {
+			break;
+		}
+
+		to = (set->range[i].to > max)?max:set->range[i].to;
+
+		if (!found) {
+			*value = set->range[i].from;
+			found = 1;
+		}
+
+		vary |= range_vary(set->range[i].from, to) | (set->range[i].from ^ *value);
+	}
+
+	*care = ~vary & max;
+	*value &= *care;
+
+	return found;
+}
+
+// Compute the hardware acceptance code and mask, in single filter mode. In
+// this mode standard frames are compared against bits 31..21 (id), 20 (rtr),
+// and 19..0 (data), and extended frames against bits 31..3 (id) and 2 (rtr).
+static void set_hardware(can_filter_set_t *set) {
+	uint32_t std_value, std_care;
+	uint32_t ext_value, ext_care;
+	uint32_t care;
+
+	set_constant_bits(set, CAN_EXT_ID_MAX, &ext_value, &ext_care);
+	ext_value <<= 3;
+	ext_care <<= 3;
+
+	if (set_constant_bits(set, CAN_STD_ID_MAX, &std_value, &std_care)) {
+		std_value <<= 21;
+		std_care <<= 21;
+
+		// Only the bits that must be checked, with the same value, for both formats
+		care = std_care & ext_care & ~(std_value ^ ext_value);
+	} else {
+		// No standard frames are accepted, so it doesn't matter what bits are
+		// checked for them
+		care = ext_care;
+	}
+
+	set->code = ext_value & care;
+	set->mask = ~care;
+}
+
+/*
+ * Operation functions
+ */
+
+int can_filter_compile(const can_filter_range_t *filter, int filters, can_filter_set_t *set) {
+	uint32_t id, to;
+	int i, ranges;
+
+	memset(set, 0, sizeof(can_filter_set_t));
+
+	if (filters == 0) {
+		set->all = 1;
+		set->code = 0;
+		set->mask = 0xffffffff;
+
+		return 0;
+	}
+
+	// Sort by the first identifier, and merge overlapping or adjacent ranges
+	set->range = malloc(sizeof(can_filter_range_t) * filters);
+	if (!set->range) {
+		return -1;
+	}
+
+	memcpy(set->range, filter, sizeof(can_filter_range_t) * filters);
+	qsort(set->range, filters, sizeof(can_filter_range_t), range_compare);
+
+	ranges = 0;
+	for(i = 1;i < filters;i++) {
+		if ((set->range[ranges].to == 0xffffffff) || (set->range[i].from <= set->range[ranges].to + 1)) {
+			if (set->range[i].to > set->range[ranges].to) {
+				set->range[ranges].to = set->range[i].to;
+			}
+		} else {
+			set->range[++ranges] = set->range[i];
+		}
+	}
+
+	set->ranges = ranges + 1;
+
+	// Build the bitmap of 11-bit identifiers
+	for(i = 0;(i < set->ranges) && (set->range[i].from <= CAN_STD_ID_MAX);i++) {
+		to = (set->range[i].to > CAN_STD_ID_MAX)?CAN_STD_ID_MAX:set->range[i].to;
+
+		for(id = set->range[i].from;id <= to;id++) {
+			set->std[id >> 5] |= (1u << (id & 31));
+		}
+	}
+
+	set_hardware(set);
+
+	return 0;
+}
+
+int can_filter_match(const can_filter_set_t *set, uint32_t id) {
+	int low, high, mid;
+
+	if (set->all) {
+		return 1;
+	}
+
+	if (id <= CAN_STD_ID_MAX) {
+		return (set->std[id >> 5] >> (id & 31)) & 1;
+	}
+
+	low = 0;
+	high = set->ranges - 1;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+
+		if (id < set->range[mid].from) {
+			high = mid - 1;
+		} else if (id > set->range[mid].to) {
+			low = mid + 1;
+		} else {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void can_filter_free(can_filter_set_t *set) {
+	free(set->range);
+	set->range = NULL;
+	set->ranges = 0;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, CAN filter compiler
+ *
+ */
+
+#ifndef CAN_FILTER_H
+#define	CAN_FILTER_H
+
+#include <stdint.h>
+
+// Number of 32-bit words of the bitmap of accepted 11-bit identifiers
+#define CAN_FILTER_STD_WORDS (2048 / 32)
+
+typedef struct {
+	uint32_t from;
+	uint32_t to;
+} can_filter_range_t;
+
+/*
+ * Compiled filter set
+ *
+ * Identifiers lower than 2048 are checked in a bitmap, and the rest of
+ * identifiers are checked with a binary search in a sorted list of non
+ * overlapping ranges.
+ *
+ * code and mask are the acceptance code and acceptance mask to program in
+ * the hardware acceptance filter, in single filter mode. They accept a
+ * superset of the compiled set, for both standard and extended frames.
+ */
+typedef struct {
+	uint8_t all;                           // 1 if all identifiers are accepted
+	int ranges;                            // Number of ranges
+	can_filter_range_t *range;             // Ranges, sorted and non overlapping
+	uint32_t std[CAN_FILTER_STD_WORDS];    // Bitmap of accepted 11-bit identifiers
+	uint32_t code;                         // Hardware acceptance code
+	uint32_t mask;                         // Hardware acceptance mask (1 = don't care)
+} can_filter_set_t;
+
+/**
+ * @brief Compile a list of filters.
+ *
+ * @param filter  Filters, as ranges of accepted identifiers. Ranges can overlap,
+ *                and don't need to be sorted.
+ * @param filters Number of filters. If 0, all identifiers are accepted.
+ * @param set     Compiled set. Must be released with can_filter_free.
+ *
+ * @return 0 on success, or -1 if there is not enough memory.
+ */
+int can_filter_compile(const can_filter_range_t *filter, int filters, can_filter_set_t *set);
+
+/**
+ * @brief Check if an identifier is accepted by a compiled set.
+ *
+ * @param set Compiled set.
+ * @param id  Identifier.
+ *
+ * @return 1 if accepted, 0 if not.
+ */
+int can_filter_match(const can_filter_set_t *set, uint32_t id);
+
+/**
+ * @brief Release the memory used by a compiled set.
+ *
+ * @param set Compiled set.
+ */
+void can_filter_free(can_filter_set_t *set);
+
+#endif	/* CAN_FILTER_H */
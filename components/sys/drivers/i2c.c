@@ -52,6 +52,7 @@
 #include "driver/periph_ctrl.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <sys/macros.h>
@@ -81,6 +82,9 @@ DRIVER_REGISTER_BEGIN(I2C,i2c,CONFIG_LUA_RTOS_USE_HARDWARE_LOCKS * ((CPU_LAST_I2
     DRIVER_REGISTER_ERROR(I2C, i2c, PinNowAllowed, "pin not allowed", I2C_ERR_PIN_NOT_ALLOWED);
     DRIVER_REGISTER_ERROR(I2C, i2c, CannotChangePinMap, "cannot change pin map once the I2C unit has an attached device", I2C_ERR_CANNOT_CHANGE_PINMAP);
     DRIVER_REGISTER_ERROR(I2C, i2c, NoMoreDevicesAllowed, "no more devices allowed", I2C_ERR_NO_MORE_DEVICES_ALLOWED);
+    DRIVER_REGISTER_ERROR(I2C, i2c, InvalidMessage, "invalid message", I2C_ERR_INVALID_MESSAGE);
+    DRIVER_REGISTER_ERROR(I2C, i2c, QueueFull, "transfer queue is full", I2C_ERR_QUEUE_FULL);
+    DRIVER_REGISTER_ERROR(I2C, i2c, CannotQueue, "cannot start the transfer task", I2C_ERR_CANNOT_QUEUE);
 DRIVER_REGISTER_END(I2C,i2c,CONFIG_LUA_RTOS_USE_HARDWARE_LOCKS * ((CPU_LAST_I2C + 1) * I2C_BUS_DEVICES),i2c_init,NULL);
 
 // i2c info needed by driver
@@ -252,6 +256,246 @@ static driver_error_t *i2c_flush_internal(int unit, int device,
     return NULL;
 }
 
+/*
+ * Message lists
+ *
+ * The bus operations queue the commands of a segment in a command link, and
+ * send the whole segment to the I2C controller in the stop operation.
+ */
+
+typedef struct {
+    int unit;
+    i2c_cmd_handle_t cmd;
+} i2c_msg_bus_t;
+
+static int i2c_msg_start(void *arg, uint8_t address) {
+    i2c_msg_bus_t *bus = (i2c_msg_bus_t *)arg;
+
+    if (!bus->cmd) {
+        bus->cmd = i2c_cmd_link_create();
+        if (!bus->cmd) {
+            return I2C_MSG_ERR_NO_MEMORY;
+        }
+    }
+
+    if (i2c_master_start(bus->cmd) != ESP_OK) {
+        return I2C_MSG_ERR_NO_MEMORY;
+    }
+
+    if (i2c_master_write_byte(bus->cmd, address, ACK_CHECK_EN) != ESP_OK) {
+        return I2C_MSG_ERR_NO_MEMORY;
+    }
+
+    return 0;
+}
+
+static int i2c_msg_write(void *arg, const uint8_t *data, int len) {
+    i2c_msg_bus_t *bus = (i2c_msg_bus_t *)arg;
+
+    if (i2c_master_write(bus->cmd, (uint8_t *)data, len, ACK_CHECK_EN) != ESP_OK) {
+        return I2C_MSG_ERR_NO_MEMORY;
+    }
+
+    return 0;
+}
+
+static int i2c_msg_read(void *arg, uint8_t *data, int len) {
+    i2c_msg_bus_t *bus = (i2c_msg_bus_t *)arg;
+
+    if (i2c_master_read(bus->cmd, data, len, I2C_MASTER_LAST_NACK) != ESP_OK) {
+        return I2C_MSG_ERR_NO_MEMORY;
+    }
+
+    return 0;
+}
+
+static void i2c_msg_reset(void *arg) {
+    i2c_msg_bus_t *bus = (i2c_msg_bus_t *)arg;
+
+    if (bus->cmd) {
+        i2c_cmd_link_delete(bus->cmd);
+        bus->cmd = NULL;
+    }
+}
+
+static int i2c_msg_stop(void *arg) {
+    i2c_msg_bus_t *bus = (i2c_msg_bus_t *)arg;
+    esp_err_t err;
+
+    if (i2c_master_stop(bus->cmd) != ESP_OK) {
+        i2c_msg_reset(bus);
+        return I2C_MSG_ERR_NO_MEMORY;
+    }
+
+    err = i2c_master_cmd_begin(bus->unit, bus->cmd, 1000 / portTICK_RATE_MS);
+
+    i2c_msg_reset(bus);
+
+    if (err == ESP_ERR_TIMEOUT) {
+        return I2C_MSG_ERR_TIMEOUT;
+    } else if (err != ESP_OK) {
+        return I2C_MSG_ERR_NACK;
+    }
+
+    return 0;
+}
+
+static const i2c_bus_ops_t i2c_msg_ops = {
+    .start = i2c_msg_start,
+    .write = i2c_msg_write,
+    .read = i2c_msg_read,
+    .stop = i2c_msg_stop,
+    .reset = i2c_msg_reset,
+};
+
+static driver_error_t *i2c_msg_error(int ret) {
+    switch (ret) {
+    case 0:
+        return NULL;
+
+    case I2C_MSG_ERR_NACK:
+        return driver_error(I2C_DRIVER, I2C_ERR_NOT_ACK, NULL);
+
+    case I2C_MSG_ERR_TIMEOUT:
+        return driver_error(I2C_DRIVER, I2C_ERR_TIMEOUT, NULL);
+
+    case I2C_MSG_ERR_NO_MEMORY:
+        return driver_error(I2C_DRIVER, I2C_ERR_NOT_ENOUGH_MEMORY, NULL);
+
+    default:
+        return driver_error(I2C_DRIVER, I2C_ERR_INVALID_MESSAGE, NULL);
+    }
+}
+
+static driver_error_t *i2c_transfer_check(int deviceid, i2c_msg_t *msg, int count) {
+    driver_error_t *error;
+
+    int unit = (deviceid & 0xff00) >> 8;
+    int device = (deviceid & 0x00ff);
+
+    // Sanity checks
+    if ((error = i2c_check(unit))) {
+        return error;
+    }
+
+    if ((device >= I2C_BUS_DEVICES) || (i2c[unit].device[device].speed == 0)) {
+        return driver_error(I2C_DRIVER, I2C_ERR_IS_NOT_SETUP, NULL);
+    }
+
+    if (i2c[unit].mode != I2C_MASTER) {
+        return driver_error(I2C_DRIVER, I2C_ERR_INVALID_OPERATION,
+                "only allowed in master mode");
+    }
+
+    if (i2c_msg_check(msg, count)) {
+        return driver_error(I2C_DRIVER, I2C_ERR_INVALID_MESSAGE, NULL);
+    }
+
+    return NULL;
+}
+
+static void i2c_transfer_task(void *arg) {
+    int unit = (int)arg;
+    i2c_request_t *request[I2C_QUEUE_LEN];
+    driver_error_t *error[I2C_QUEUE_LEN];
+    int i, n;
+
+    for(;;) {
+        xQueueReceive(i2c[unit].queue, &request[0], portMAX_DELAY);
+
+        // Run the queued requests back-to-back, without releasing the bus
+        i2c_lock(unit);
+
+        n = 0;
+        do {
+            error[n] = i2c_transfer(request[n]->deviceid, request[n]->msg, request[n]->count, &request[n]->done);
+            n++;
+        } while ((n < I2C_QUEUE_LEN) && (xQueueReceive(i2c[unit].queue, &request[n], 0) == pdTRUE));
+
+        i2c_unlock(unit);
+
+        for(i = 0;i < n;i++) {
+            if (request[i]->callback) {
+                request[i]->callback(request[i], error[i]);
+            } else if (error[i]) {
+                free(error[i]);
+            }
+        }
+    }
+}
+
+driver_error_t *i2c_transfer(int deviceid, i2c_msg_t *msg, int count, int *done) {
+    driver_error_t *error;
+    i2c_msg_bus_t bus;
+    int ret;
+
+    int unit = (deviceid & 0xff00) >> 8;
+    int device = (deviceid & 0x00ff);
+
+    if (done) {
+        *done = 0;
+    }
+
+    if ((error = i2c_transfer_check(deviceid, msg, count))) {
+        return error;
+    }
+
+    i2c_lock(unit);
+
+    if (i2c[unit].speed != i2c[unit].device[device].speed) {
+        i2c_setspeed(deviceid, i2c[unit].device[device].speed);
+    }
+
+    bus.unit = unit;
+    bus.cmd = NULL;
+
+    ret = i2c_msg_run(msg, count, &i2c_msg_ops, &bus, done);
+
+    i2c_unlock(unit);
+
+    return i2c_msg_error(ret);
+}
+
+driver_error_t *i2c_transfer_submit(i2c_request_t *request) {
+    driver_error_t *error;
+
+    int unit = (request->deviceid & 0xff00) >> 8;
+
+    if ((error = i2c_transfer_check(request->deviceid, request->msg, request->count))) {
+        return error;
+    }
+
+    request->done = 0;
+
+    i2c_lock(unit);
+
+    // Start the transfer task the first time
+    if (!i2c[unit].queue) {
+        i2c[unit].queue = xQueueCreate(I2C_QUEUE_LEN, sizeof(i2c_request_t *));
+        if (!i2c[unit].queue) {
+            i2c_unlock(unit);
+            return driver_error(I2C_DRIVER, I2C_ERR_NOT_ENOUGH_MEMORY, NULL);
+        }
+
+        if (xTaskCreatePinnedToCore(i2c_transfer_task, "i2c", CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE, (void *)unit, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &i2c[unit].task, xPortGetCoreID()) != pdPASS) {
+            vQueueDelete(i2c[unit].queue);
+            i2c[unit].queue = NULL;
+
+            i2c_unlock(unit);
+            return driver_error(I2C_DRIVER, I2C_ERR_CANNOT_QUEUE, NULL);
+        }
+    }
+
+    if (xQueueSend(i2c[unit].queue, &request, 0) != pdTRUE) {
+        i2c_unlock(unit);
+        return driver_error(I2C_DRIVER, I2C_ERR_QUEUE_FULL, NULL);
+    }
+
+    i2c_unlock(unit);
+
+    return NULL;
+}
+
 /*
  * Operation functions
  */
@@ -50,6 +50,8 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 
 #include "driver/i2c.h"
 
@@ -58,10 +60,14 @@
 #include <sys/driver.h>
 
 #include <drivers/cpu.h>
+#include <drivers/i2c_msg.h>
 
 #define I2C_BUS_DEVICES CONFIG_LUA_RTOS_I2C_DEVICES_PER_BUS
 #define I2C_TRANSACTION_INITIALIZER -1
 
+// Number of transfer requests that can be queued in an I2C unit
+#define I2C_QUEUE_LEN 8
+
 typedef struct i2c_device {
     int speed;
     int8_t reading;
@@ -75,9 +81,27 @@ typedef struct i2c {
     int8_t scl;
     int speed;
     SemaphoreHandle_t mtx;
+    QueueHandle_t queue;  // Queued transfer requests
+    TaskHandle_t task;    // Task that runs the queued transfer requests
     i2c_device_t device[I2C_BUS_DEVICES];
 } i2c_t;
 
+typedef struct i2c_request i2c_request_t;
+
+// Called when a queued transfer request is completed. The callback must
+// free error, if not NULL.
+typedef void (*i2c_request_callback_t)(i2c_request_t *request, driver_error_t *error);
+
+// Transfer request
+struct i2c_request {
+    int deviceid;                     // Device identifier returned by i2c_attach
+    i2c_msg_t *msg;                   // Messages
+    int count;                        // Number of messages
+    int done;                         // Number of messages completed
+    i2c_request_callback_t callback;  // Completion callback
+    void *arg;                        // Argument for the callback
+};
+
 #define I2C_SLAVE    0 /*!< I2C slave mode */
 #define I2C_MASTER    1 /*!< I2C master mode */
 
@@ -93,6 +117,9 @@ typedef struct i2c {
 #define I2C_ERR_PIN_NOT_ALLOWED          (DRIVER_EXCEPTION_BASE(I2C_DRIVER_ID) |  8)
 #define I2C_ERR_CANNOT_CHANGE_PINMAP     (DRIVER_EXCEPTION_BASE(I2C_DRIVER_ID) |  10)
 #define I2C_ERR_NO_MORE_DEVICES_ALLOWED  (DRIVER_EXCEPTION_BASE(I2C_DRIVER_ID) |  11)
+#define I2C_ERR_INVALID_MESSAGE          (DRIVER_EXCEPTION_BASE(I2C_DRIVER_ID) |  12)
+#define I2C_ERR_QUEUE_FULL               (DRIVER_EXCEPTION_BASE(I2C_DRIVER_ID) |  13)
+#define I2C_ERR_CANNOT_QUEUE             (DRIVER_EXCEPTION_BASE(I2C_DRIVER_ID) |  14)
 extern const int i2c_errors;
 extern const int i2c_error_map;
 
@@ -268,4 +295,56 @@ driver_error_t *i2c_read(int deviceid, int *transaction, char *data, int len);
  */
 driver_error_t *i2c_flush(int deviceid, int *transaction, int new_transaction);
 
+/**
+ * @brief Run a message list as a whole, if configured in master mode. This function
+ *        is thread safe.
+ *
+ *        The bus is locked during the transfer, and each segment of the list (the
+ *        messages between two stop conditions) is sent as a single hardware
+ *        transaction. The messages can be addressed to any slave on the bus.
+ *
+ * @param deviceid A device identifier returned by the i2c_attach function.
+ * @param msg Messages. Read data is stored in the buffers of the read messages.
+ * @param count Number of messages.
+ * @param done If not NULL, the number of messages completed before an error is
+ *             stored here.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs.
+ *
+ *          I2C_ERR_INVALID_UNIT
+ *          I2C_ERR_IS_NOT_SETUP
+ *          I2C_ERR_INVALID_OPERATION
+ *          I2C_ERR_INVALID_MESSAGE
+ *          I2C_ERR_NOT_ENOUGH_MEMORY
+ *          I2C_ERR_NOT_ACK
+ *          I2C_ERR_TIMEOUT
+ */
+driver_error_t *i2c_transfer(int deviceid, i2c_msg_t *msg, int count, int *done);
+
+/**
+ * @brief Queue a transfer request, if configured in master mode. This function is
+ *        thread safe.
+ *
+ *        The requests queued in an I2C unit are run back-to-back by a task, in the
+ *        queued order, and the request's callback is called when each request is
+ *        completed. The request, and its messages, must be valid until then.
+ *
+ * @param request The transfer request.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs.
+ *
+ *          I2C_ERR_INVALID_UNIT
+ *          I2C_ERR_IS_NOT_SETUP
+ *          I2C_ERR_INVALID_OPERATION
+ *          I2C_ERR_INVALID_MESSAGE
+ *          I2C_ERR_NOT_ENOUGH_MEMORY
+ *          I2C_ERR_QUEUE_FULL
+ *          I2C_ERR_CANNOT_QUEUE
+ */
+driver_error_t *i2c_transfer_submit(i2c_request_t *request);
+
 #endif /* I2C_H */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, I2C message lists
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include <stddef.h>
+
+#include <drivers/i2c_msg.h>
+
+int i2c_msg_check(const i2c_msg_t *msg, int count) {
+    int i;
+
+    if ((msg == NULL) || (count <= 0)) {
+        return I2C_MSG_ERR_INVALID;
+    }
+
+    for(i = 0;i < count;i++) {
+        if (msg[i].address > 0x7f) {
+            return I2C_MSG_ERR_INVALID;
+        }
+
+        // The controller can't read 0 bytes
+        if ((msg[i].flags & I2C_MSG_READ) && (msg[i].len == 0)) {
+            return I2C_MSG_ERR_INVALID;
+        }
+
+        if ((msg[i].len > 0) && (msg[i].buf == NULL)) {
+            return I2C_MSG_ERR_INVALID;
+        }
+    }
+
+    return 0;
+}
+
+int i2c_msg_segments(const i2c_msg_t *msg, int count) {
+    int i, segments = 0;
+
+    for(i = 0;i < count;i++) {
+        if ((msg[i].flags & I2C_MSG_STOP) || (i == count - 1)) {
+            segments++;
+        }
+    }
+
+    return segments;
+}
+
+int i2c_msg_run(const i2c_msg_t *msg, int count, const i2c_bus_ops_t *ops, void *arg, int *done) {
+    uint8_t address;
+    int i, ret;
+
+    if (done) {
+        *done = 0;
+    }
+
+    for(i = 0;i < count;i++) {
+        address = (msg[i].address << 1) | ((msg[i].flags & I2C_MSG_READ)?1:0);
+
+        if ((ret = ops->start(arg, address))) {
+            goto error;
+        }
+
+        if (msg[i].len > 0) {
+            if (msg[i].flags & I2C_MSG_READ) {
+                ret = ops->read(arg, msg[i].buf, msg[i].len);
+            } else {
+                ret = ops->write(arg, msg[i].buf, msg[i].len);
+            }
+
+            if (ret) {
+                goto error;
+            }
+        }
+
+        if ((msg[i].flags & I2C_MSG_STOP) || (i == count - 1)) {
+            // The segment is aborted by the stop operation if it fails
+            if ((ret = ops->stop(arg))) {
+                return ret;
+            }
+
+            if (done) {
+                *done = i + 1;
+            }
+        }
+    }
+
+    return 0;
+
+error:
+    ops->reset(arg);
+
+    return ret;
+}
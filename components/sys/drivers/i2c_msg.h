@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, I2C message lists
+ *
+ */
+
+#ifndef _I2C_MSG_H_
+#define _I2C_MSG_H_
+
+#include <stdint.h>
+
+// Message flags
+#define I2C_MSG_READ  (1 << 0) // Read from the slave, if not set write to the slave
+#define I2C_MSG_STOP  (1 << 1) // Send a stop condition after the message
+
+// Errors
+#define I2C_MSG_ERR_NACK      -1 // A byte was not acknowledged
+#define I2C_MSG_ERR_TIMEOUT   -2 // The bus didn't complete the transaction
+#define I2C_MSG_ERR_NO_MEMORY -3 // Not enough memory to queue the commands
+#define I2C_MSG_ERR_INVALID   -4 // Invalid message
+
+/*
+ * An I2C message
+ *
+ * Each message starts with a start condition (or a repeated start condition, if
+ * the previous message didn't end with a stop condition), followed by the slave
+ * address, and the data. The last message of a list always ends with a stop
+ * condition.
+ *
+ * Messages between two stop conditions form a segment, that is sent to the
+ * bus as a single hardware transaction.
+ */
+typedef struct {
+    uint8_t address; // 7-bit slave address
+    uint8_t flags;   // I2C_MSG_READ / I2C_MSG_STOP
+    uint16_t len;    // Bytes to read / write
+    uint8_t *buf;    // Data to write, or buffer for the read data
+} i2c_msg_t;
+
+/*
+ * Bus operations used to run a message list
+ *
+ * The operations can execute each condition when called (as a bit-bang, or a
+ * simulated bus does), or queue them and execute the whole segment in the stop
+ * operation (as the I2C controller does). In both cases, the operations return
+ * 0 on success, or an I2C_MSG_ERR_* error.
+ *
+ * After an error, no more operations of the segment are called, and the reset
+ * operation is called instead of the stop operation, to abort the segment.
+ */
+typedef struct {
+    int (*start)(void *arg, uint8_t address); // Start condition, and address byte
+    int (*write)(void *arg, const uint8_t *data, int len);
+    int (*read)(void *arg, uint8_t *data, int len); // NACK after the last byte
+    int (*stop)(void *arg);
+    void (*reset)(void *arg);
+} i2c_bus_ops_t;
+
+/**
+ * @brief Check a message list.
+ *
+ * @param msg   Messages.
+ * @param count Number of messages.
+ *
+ * @return 0 if the list is valid, or I2C_MSG_ERR_INVALID.
+ */
+int i2c_msg_check(const i2c_msg_t *msg, int count);
+
+/**
+ * @brief Get the number of segments of a message list.
+ *
+ * @param msg   Messages.
+ * @param count Number of messages.
+ *
+ * @return Number of segments.
+ */
+int i2c_msg_segments(const i2c_msg_t *msg, int count);
+
+/**
+ * @brief Run a message list.
+ *
+ * @param msg   Messages. Must be checked with i2c_msg_check.
+ * @param count Number of messages.
+ * @param ops   Bus operations.
+ * @param arg   Argument for the bus operations.
+ * @param done  If not NULL, the number of messages of the segments completed before
+ *              an error is stored here. Read data of these messages is valid.
+ *
+ * @return 0 on success, or an I2C_MSG_ERR_* error.
+ */
+int i2c_msg_run(const i2c_msg_t *msg, int count, const i2c_bus_ops_t *ops, void *arg, int *done);
+
+#endif /* _I2C_MSG_H_ */
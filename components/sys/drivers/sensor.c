@@ -50,9 +50,15 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "esp_timer.h"
 
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <math.h>
 
 #include <sys/status.h>
 #include <sys/list.h>
@@ -92,22 +98,184 @@ DRIVER_REGISTER_END(SENSOR,sensor,0,NULL,NULL);
 
 static xQueueHandle queue = NULL;
 static TaskHandle_t task = NULL;
+
+// Held by the sensor task while it dispatches a queued instance, so that an
+// instance is not freed in the middle. It's recursive, because a callback can
+// detach a sensor from the sensor task.
+static struct mtx dispatch_mtx;
+
+// Deferred callbacks, dispatched by the sensor task
+static sensor_dispatch_t dispatch;
+
 static uint8_t attached = 0;
 static uint8_t counter = 0;
 
+// Sampled sensors, protected by sampling_mtx
+static sensor_sched_t sampled;
+static struct mtx sampling_mtx;
+static TaskHandle_t sampling_task = NULL;
+
+// Given by the sampling scheduler at the end of a round, once for each task
+// waiting for a busy sensor. sampling_waiting is protected by sampling_mtx.
+static SemaphoreHandle_t sampling_done = NULL;
+static uint8_t sampling_waiting = 0;
+
+// Protects the deferred data of the sensor instances
+static portMUX_TYPE deferred_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#define SENSOR_DEFERRED_LOCK(isr) \
+    do { if (isr) portENTER_CRITICAL_ISR(&deferred_mux); else portENTER_CRITICAL(&deferred_mux); } while (0)
+
+#define SENSOR_DEFERRED_UNLOCK(isr) \
+    do { if (isr) portEXIT_CRITICAL_ISR(&deferred_mux); else portEXIT_CRITICAL(&deferred_mux); } while (0)
+
 /*
  * Helper functions
  */
 
+// Free an instance, once it's detached
+static void sensor_free(sensor_instance_t *unit) {
+    int i;
+
+    for(i=0;i < SENSOR_MAX_PROPERTIES;i++) {
+        free(unit->filter[i]);
+    }
+
+    mtx_destroy(&unit->mtx);
+    free(unit);
+}
+
+// Event data got from the deferred slot of an instance, for the callbacks
+typedef struct {
+    sensor_value_t *data;
+    sensor_latch_t *latch;
+} sensor_event_t;
+
+static void IRAM_ATTR deferred_lock(int isr) {
+    SENSOR_DEFERRED_LOCK(isr);
+}
+
+static void IRAM_ATTR deferred_unlock(int isr) {
+    SENSOR_DEFERRED_UNLOCK(isr);
+}
+
+// Store the instance data into its slot. When coalesced, the latch of the
+// first event is kept.
+static void IRAM_ATTR deferred_store(sensor_deferred_t *slot, uint8_t from, uint8_t to, int coalesce) {
+    sensor_instance_t *unit = (sensor_instance_t *)slot->owner;
+    int i;
+
+    if (coalesce) {
+        for(i = from; i <= to; i++) {
+            unit->deferred.data[i] = unit->data[i];
+            unit->deferred.latch[i].timeout |= unit->latch[i].timeout;
+            unit->deferred.latch[i].repeat |= unit->latch[i].repeat;
+        }
+    } else {
+        memcpy(unit->deferred.data, unit->data, sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
+        memcpy(unit->deferred.latch, unit->latch, sizeof(sensor_latch_t) * SENSOR_MAX_PROPERTIES);
+    }
+}
+
+static void deferred_load(sensor_deferred_t *slot, void *arg) {
+    sensor_instance_t *unit = (sensor_instance_t *)slot->owner;
+    sensor_event_t *event = (sensor_event_t *)arg;
+
+    memcpy(event->data, unit->deferred.data, sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
+    memcpy(event->latch, unit->deferred.latch, sizeof(sensor_latch_t) * SENSOR_MAX_PROPERTIES);
+}
+
+static void deferred_call(sensor_deferred_t *slot, void *arg) {
+    sensor_instance_t *unit = (sensor_instance_t *)slot->owner;
+    sensor_event_t *event = (sensor_event_t *)arg;
+    sensor_callback_t callback;
+    int callback_id;
+    int i;
+
+    for(i=0;i < SENSOR_MAX_CALLBACKS;i++) {
+        mtx_lock(&unit->mtx);
+        callback = unit->callbacks[i].callback;
+        callback_id = unit->callbacks[i].callback_id;
+        mtx_unlock(&unit->mtx);
+
+        if (callback) {
+            callback(callback_id, unit, event->data, event->latch);
+        }
+    }
+}
+
+static int IRAM_ATTR deferred_send(sensor_deferred_t *slot, int isr) {
+    portBASE_TYPE high_priority_task_awoken = 0;
+
+    if (!isr) {
+        return (xQueueSend(queue, &slot, 0) == pdTRUE);
+    }
+
+    if (xQueueSendFromISR(queue, &slot, &high_priority_task_awoken) != pdTRUE) {
+        return 0;
+    }
+
+    if (high_priority_task_awoken == pdTRUE) {
+        portYIELD_FROM_ISR();
+    }
+
+    return 1;
+}
+
+static int deferred_receive(sensor_deferred_t **slot) {
+    return (xQueueReceive(queue, slot, 0) == pdTRUE);
+}
+
+static uint32_t deferred_waiting() {
+    return uxQueueMessagesWaiting(queue);
+}
+
+static void deferred_dispatch_lock() {
+    mtx_lock(&dispatch_mtx);
+}
+
+static void deferred_dispatch_unlock() {
+    mtx_unlock(&dispatch_mtx);
+}
+
+static void deferred_yield() {
+    vTaskDelay(1);
+}
+
+// Not const, so that it's in RAM, because it's used by the interrupt handlers
+static sensor_deferred_ops_t deferred_ops = {
+    .lock = deferred_lock,
+    .unlock = deferred_unlock,
+    .store = deferred_store,
+    .load = deferred_load,
+    .call = deferred_call,
+    .send = deferred_send,
+    .receive = deferred_receive,
+    .waiting = deferred_waiting,
+    .dispatch_lock = deferred_dispatch_lock,
+    .dispatch_unlock = deferred_dispatch_unlock,
+    .yield = deferred_yield,
+};
+
 static void sensor_task(void *arg) {
-    sensor_deferred_data_t *data;
+    sensor_instance_t *unit;
+    sensor_deferred_t *slot;
+    sensor_event_t event;
+
+    event.data = calloc(1,sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
+    assert(event.data);
 
-    data = calloc(1,sizeof(sensor_deferred_data_t));
-    assert(data);
+    event.latch = calloc(1,sizeof(sensor_latch_t) * SENSOR_MAX_PROPERTIES);
+    assert(event.latch);
 
     for(;;) {
-        xQueueReceive(queue, data, portMAX_DELAY);
-        data->callback(data->callback_id, data->instance, data->data, data->latch);
+        // Wait for a slot, that is taken by sensor_deferred_dispatch
+        xQueuePeek(queue, &slot, portMAX_DELAY);
+
+        // If a callback detached the instance, it's freed here
+        if ((unit = sensor_deferred_dispatch(&dispatch, &event))) {
+            sensor_free(unit);
+        }
     }
 }
 
@@ -397,6 +565,7 @@ driver_error_t *sensor_setup(const sensor_t *sensor, sensor_setup_t *setup, sens
 
     // Create mutex
     mtx_init(&instance->mtx, NULL, NULL, 0);
+    sensor_deferred_init(&instance->deferred.slot, instance);
 
     // Store reference to sensor into instance
     instance->sensor = sensor;
@@ -517,8 +686,47 @@ driver_error_t *sensor_setup(const sensor_t *sensor, sensor_setup_t *setup, sens
 
 driver_error_t *sensor_unsetup(sensor_instance_t *unit) {
     driver_error_t *error;
+    uint8_t dispatched = 0;
     int i;
 
+    // Stop sampling
+    if (unit->sampling.sched.period) {
+        sensor_sample(unit, 0, 0);
+    }
+
+    // Remove the callbacks, so that the instance is not queued anymore
+    mtx_lock(&unit->mtx);
+    portENTER_CRITICAL(&deferred_mux);
+    for(i=0;i < SENSOR_MAX_CALLBACKS;i++) {
+        unit->callbacks[i].callback = NULL;
+        unit->callbacks[i].callback_id = 0;
+    }
+    portEXIT_CRITICAL(&deferred_mux);
+    mtx_unlock(&unit->mtx);
+
+    // Close the deferred slot of the instance, removing its queued entries,
+    // and wait until the sensor task is not dispatching it. This is also done
+    // when a callback detaches the sensor from the sensor task, because
+    // dispatch_mtx is recursive. When it's the last instance, the sensor task
+    // is stopped while it's not dispatching, unless the sensor task itself is
+    // detaching it. Then the task and its queue are kept, and used by the next
+    // attached sensor.
+    if (task) {
+        dispatched = sensor_deferred_close(&dispatch, &unit->deferred.slot);
+
+        mtx_lock(&dispatch_mtx);
+
+        if ((attached == 1) && (xTaskGetCurrentTaskHandle() != task)) {
+            vTaskDelete(task);
+            task = NULL;
+
+            vQueueDelete(queue);
+            queue = NULL;
+        }
+
+        mtx_unlock(&dispatch_mtx);
+    }
+
     portDISABLE_INTERRUPTS();
 
     if (attached == 0) {
@@ -547,18 +755,6 @@ driver_error_t *sensor_unsetup(sensor_instance_t *unit) {
         }
     }
 
-    if (attached == 1) {
-        if (task) {
-            vTaskDelete(task);
-            task = NULL;
-        }
-
-        if (queue) {
-            vQueueDelete(queue);
-            queue = NULL;
-        }
-    }
-
     // Detach interface
     for(i=0;i<SENSOR_MAX_INTERFACES;i++) {
         if (!(unit->sensor->interface[i].flags & SENSOR_FLAG_CUSTOM_INTERFACE_INIT) && unit->sensor->interface[i].type) {
@@ -577,8 +773,13 @@ driver_error_t *sensor_unsetup(sensor_instance_t *unit) {
 
     attached--;
 
-    mtx_destroy(&unit->mtx);
-    free(unit);
+    // If the sensor task is dispatching the instance, it's freed by the
+    // sensor task when the dispatch ends
+    if (dispatched) {
+        dispatch.detached = 1;
+    } else {
+        sensor_free(unit);
+    }
 
 #if (CONFIG_LUA_RTOS_POWER_BUS_PIN >= 0)
     pwbus_off();
@@ -589,31 +790,71 @@ driver_error_t *sensor_unsetup(sensor_instance_t *unit) {
     return NULL;
 }
 
-driver_error_t *sensor_acquire(sensor_instance_t *unit) {
-    driver_error_t *error = NULL;
-    sensor_value_t *value = NULL;
-    int i = 0, j = 0;
+// Pass a new value of a data through its filter, if any. If the filter doesn't
+// produce a new output, the value is replaced by the current value, so it's
+// not seen as a change. Called with the instance mutex locked.
+static void sensor_filter_data(sensor_instance_t *unit, int i, sensor_value_t *value) {
+    sensor_filter_t *filter = unit->filter[i];
+    float x, y;
 
-    // Check if we can get data
-    uint64_t next_available_data = unit->next.tv_sec * 1000000 +unit->next.tv_usec;
+    if (!filter) {
+        return;
+    }
 
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    uint64_t now_usec = now.tv_sec * 1000000 + now.tv_usec;
+    switch (unit->data[i].type) {
+        case SENSOR_DATA_INT:    x = value->integerd.value; break;
+        case SENSOR_DATA_FLOAT:  x = value->floatd.value; break;
+        case SENSOR_DATA_DOUBLE: x = value->doubled.value; break;
+        default:
+            return;
+    }
 
-    if (now_usec < next_available_data) {
-        return NULL;
+    if (!sensor_filter_process(filter, x, &y)) {
+        value->raw = unit->data[i].raw;
+        return;
     }
 
-    // Allocate space for sensor data
-    if (!(value = calloc(1, sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES))) {
-        return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
+    value->raw.value = 0;
+
+    switch (unit->data[i].type) {
+        case SENSOR_DATA_INT:    value->integerd.value = lroundf(y); break;
+        case SENSOR_DATA_FLOAT:  value->floatd.value = y; break;
+        case SENSOR_DATA_DOUBLE: value->doubled.value = y; break;
+        default:
+            break;
+    }
+}
+
+// Add the current data of a sampled sensor to its history. Called with the
+// instance mutex locked.
+static void sensor_history_add(sensor_instance_t *unit, uint64_t t) {
+    int64_t values[SENSOR_MAX_PROPERTIES];
+    int i, n = 0;
+
+    for(i=0;i < SENSOR_MAX_PROPERTIES;i++) {
+        if (unit->sensor->data[i].id) {
+            values[n++] = unit->data[i].raw.value;
+        }
     }
 
+    sensor_ring_add(&unit->sampling.history, t, values);
+}
+
+// Acquire data from the sensor into the instance, using value as buffer. t
+// is the time of the acquisition in milliseconds, stored in the history of
+// sampled sensors.
+static driver_error_t *sensor_acquire_ll(sensor_instance_t *unit, sensor_value_t *value, uint64_t t) {
+    driver_error_t *error = NULL;
+    int i = 0, j = 0;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    memset(value, 0, sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
+
     // Call to specific acquire function, if any
     if (unit->sensor->acquire) {
         if ((error = unit->sensor->acquire(unit, value))) {
-            free(value);
             return error;
         }
     }
@@ -639,14 +880,350 @@ driver_error_t *sensor_acquire(sensor_instance_t *unit) {
             unit->latch[i].timeout = 0;
             unit->latch[i].t = now;
             unit->latch[i].value.raw.value = unit->data[i].raw.value;
+            sensor_filter_data(unit, i, &value[i]);
             unit->data[i].raw = value[i].raw;
         }
     }
 
+    if (unit->sampling.history.samples) {
+        sensor_history_add(unit, t);
+    }
+
     mtx_unlock(&unit->mtx);
 
+    return NULL;
+}
+
+// Get an identifier of the bus used by the sensor, used for scheduling the
+// samples of the sensors in the same bus together. Returns 0 if the sensor
+// doesn't use a shared bus, or if the bus is not known.
+static uint32_t sensor_bus(sensor_instance_t *unit) {
+    int i;
+
+    for(i=0;i < SENSOR_MAX_INTERFACES;i++) {
+        switch (unit->sensor->interface[i].type) {
+            case ADC_INTERFACE:   return (ADC_INTERFACE << 16) | unit->setup[i].adc.unit;
+            case I2C_INTERFACE:   return (I2C_INTERFACE << 16) | unit->setup[i].i2c.id;
+            case OWIRE_INTERFACE: return (OWIRE_INTERFACE << 16) | unit->setup[i].owire.gpio;
+            case UART_INTERFACE:  return (UART_INTERFACE << 16) | unit->setup[i].uart.id;
+            case SPI_INTERFACE:
+                // The SPI unit is not stored in the setup, so the sensor can't
+                // be grouped with the other sensors in the same bus
+                return 0;
+            default:
+                break;
+        }
+    }
+
+    return 0;
+}
+
+// Sampling scheduler task. Takes the samples of the sampled sensors when they
+// are due, in rounds selected by sensor_sched_round (see sensor_sched.h for
+// how the sensors in the same bus are grouped).
+//
+// The sensors of a round are selected with sampling_mtx locked, and marked as
+// busy, so that they are not removed while they are acquired. The acquisitions
+// are done with sampling_mtx unlocked, so a slow sensor doesn't block
+// sensor_sample.
+static void sensor_sampling_task(void *arg) {
+    sensor_sched_entry_t *entry, *round;
+    sensor_instance_t *unit;
+    driver_error_t *error;
+    sensor_value_t *value;
+    uint64_t now, next;
+    TickType_t wait;
+
+    value = calloc(1,sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
+    assert(value);
+
+    for(;;) {
+        mtx_lock(&sampling_mtx);
+        round = sensor_sched_round(&sampled, &now);
+        mtx_unlock(&sampling_mtx);
+
+        for(entry = round;entry;entry = entry->round) {
+            unit = (sensor_instance_t *)entry->arg;
+
+            if ((error = sensor_acquire_ll(unit, value, now))) {
+                unit->sampling.errors++;
+                free(error);
+            } else {
+                unit->sampling.samples++;
+            }
+        }
+
+        mtx_lock(&sampling_mtx);
+
+        sensor_sched_end(round);
+
+        // Wake up the tasks waiting for the end of the round
+        while (sampling_waiting > 0) {
+            xSemaphoreGive(sampling_done);
+            sampling_waiting--;
+        }
+
+        // Get the time of the next sample
+        next = sensor_sched_next(&sampled);
+
+        mtx_unlock(&sampling_mtx);
+
+        // Wait until the next sample, or until the sampled sensors change
+        if (next == UINT64_MAX) {
+            wait = portMAX_DELAY;
+        } else {
+            now = sensor_time();
+            if (next <= now) {
+                continue;
+            }
+
+            wait = (next - now) / portTICK_PERIOD_MS;
+            if (wait == 0) {
+                wait = 1;
+            }
+        }
+
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+driver_error_t *sensor_acquire(sensor_instance_t *unit) {
+    driver_error_t *error = NULL;
+    sensor_value_t *value = NULL;
+
+    // Data of sampled sensors is acquired by the sampling scheduler
+    if (unit->sampling.sched.period) {
+        return NULL;
+    }
+
+    // Check if we can get data
+    uint64_t next_available_data = unit->next.tv_sec * 1000000 +unit->next.tv_usec;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t now_usec = now.tv_sec * 1000000 + now.tv_usec;
+
+    if (now_usec < next_available_data) {
+        return NULL;
+    }
+
+    // Allocate space for sensor data
+    if (!(value = calloc(1, sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES))) {
+        return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
+    }
+
+    error = sensor_acquire_ll(unit, value, 0);
+
     free(value);
 
+    return error;
+}
+
+// Filter the values of the id data before they are stored into the instance,
+// and seen by readers and callbacks. A SENSOR_FILTER_NONE filter without
+// deadband removes the filter. Data stored by a GPIO interrupt (ON_OFF
+// interfaces), or by the driver from an interrupt handler (data with the
+// SENSOR_DATA_FLAG_ISR flag) can't be filtered, the filter isn't run from an
+// ISR.
+driver_error_t *sensor_set_filter(sensor_instance_t *unit, const char *id, const sensor_filter_config_t *config) {
+    sensor_filter_t *filter = NULL;
+    int idx, i;
+
+    for(idx=0;idx < SENSOR_MAX_PROPERTIES;idx++) {
+        if (unit->sensor->data[idx].id && (strcmp(unit->sensor->data[idx].id, id) == 0)) {
+            break;
+        }
+    }
+
+    if (idx == SENSOR_MAX_PROPERTIES) {
+        return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_FOUND, NULL);
+    }
+
+    switch (unit->sensor->data[idx].type) {
+        case SENSOR_DATA_INT:
+        case SENSOR_DATA_FLOAT:
+        case SENSOR_DATA_DOUBLE:
+            break;
+        default:
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_INVALID_DATA, NULL);
+    }
+
+    if (unit->sensor->data[idx].flags & SENSOR_DATA_FLAG_ISR) {
+        return driver_error(SENSOR_DRIVER, SENSOR_ERR_INVALID_DATA, "filters not allowed for interrupt driven data");
+    }
+
+    for(i=0;i < SENSOR_MAX_INTERFACES;i++) {
+        if ((unit->sensor->interface[i].type == GPIO_INTERFACE) &&
+            (unit->sensor->interface[i].flags & SENSOR_FLAG_ON_OFF) &&
+            (SENSOR_FLAG_GET_PROPERTY(unit->sensor->interface[i]) == idx)) {
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_INVALID_DATA, "filters not allowed for interrupt driven data");
+        }
+    }
+
+    if ((config->type != SENSOR_FILTER_NONE) || (config->deadband > 0)) {
+        if (!(filter = calloc(1, sizeof(sensor_filter_t)))) {
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
+        }
+
+        if (sensor_filter_init(filter, config) < 0) {
+            free(filter);
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_INVALID_VALUE, NULL);
+        }
+    }
+
+    mtx_lock(&unit->mtx);
+    free(unit->filter[idx]);
+    unit->filter[idx] = filter;
+    mtx_unlock(&unit->mtx);
+
+    return NULL;
+}
+
+// Get the time used by the sampling scheduler, in milliseconds
+uint64_t sensor_time() {
+    return esp_timer_get_time() / 1000;
+}
+
+// Start sampling a sensor each period milliseconds, keeping the last depth
+// samples in a history. A 0 period stops sampling. While a sensor is sampled,
+// sensor_acquire doesn't access the sensor, and readers get the last sample.
+//
+// Sensors in the same bus that are due at about the same time are sampled one
+// after the other (counted in the batched stat). This only groups the samples
+// in time, so that the bus is used in bursts: each sensor still does its own
+// bus transactions, they are not merged into one.
+driver_error_t *sensor_sample(sensor_instance_t *unit, uint32_t period, uint16_t depth) {
+    sensor_ring_t history = {0}, old;
+    uint8_t props = 0;
+    int i;
+
+    if (period) {
+        if (!unit->sensor->acquire) {
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_ACQUIRE_UNDEFINED, NULL);
+        }
+
+        if (depth == 0) {
+            depth = SENSOR_HISTORY_DEPTH;
+        }
+
+        for(i=0;i < SENSOR_MAX_PROPERTIES;i++) {
+            if (unit->sensor->data[i].id) {
+                props++;
+            }
+        }
+
+        // Each sample has the time, and the data values
+        if (sensor_ring_init(&history, depth, props) < 0) {
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
+        }
+    }
+
+    // Create the sampling scheduler if needed
+    portDISABLE_INTERRUPTS();
+
+    if (!sampling_task) {
+        BaseType_t xReturn;
+
+        mtx_init(&sampling_mtx, NULL, NULL, 0);
+        sensor_sched_init(&sampled, sensor_time);
+
+        sampling_done = xSemaphoreCreateCounting(UINT8_MAX, 0);
+        if (!sampling_done) {
+            mtx_destroy(&sampling_mtx);
+
+            portENABLE_INTERRUPTS();
+            sensor_ring_free(&history);
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
+        }
+
+        xReturn = xTaskCreatePinnedToCore(sensor_sampling_task, "sampling", CONFIG_LUA_RTOS_LUA_THREAD_STACK_SIZE, NULL, CONFIG_LUA_RTOS_LUA_THREAD_PRIORITY, &sampling_task, xPortGetCoreID());
+        if (xReturn != pdPASS) {
+            mtx_destroy(&sampling_mtx);
+            vSemaphoreDelete(sampling_done);
+            sampling_done = NULL;
+            sampling_task = NULL;
+
+            portENABLE_INTERRUPTS();
+            sensor_ring_free(&history);
+            return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
+        }
+    }
+
+    portENABLE_INTERRUPTS();
+
+    mtx_lock(&sampling_mtx);
+
+    // Wait until the scheduler ends the acquisition of the sensor, if any
+    while (unit->sampling.sched.busy) {
+        sampling_waiting++;
+        mtx_unlock(&sampling_mtx);
+        xSemaphoreTake(sampling_done, portMAX_DELAY);
+        mtx_lock(&sampling_mtx);
+    }
+
+    // Remove from the sampled sensors
+    sensor_sched_remove(&sampled, &unit->sampling.sched);
+
+    mtx_lock(&unit->mtx);
+    old = unit->sampling.history;
+    unit->sampling.history = history;
+    mtx_unlock(&unit->mtx);
+
+    // Add to the sampled sensors
+    if (period) {
+        sensor_sched_add(&sampled, &unit->sampling.sched, period, sensor_bus(unit), unit);
+    }
+
+    mtx_unlock(&sampling_mtx);
+
+    sensor_ring_free(&old);
+
+    // Wake up the scheduler, to take the first sample
+    xTaskNotifyGive(sampling_task);
+
+    return NULL;
+}
+
+// Get the last samples of the id data from the history of a sampled sensor,
+// oldest first. count is the number of samples to get, and it's updated with
+// the number of samples stored in t (time in milliseconds), and value.
+driver_error_t *sensor_history(sensor_instance_t *unit, const char *id, int *count, int64_t *t, sensor_value_t *value) {
+    const int64_t *sample;
+    int idx, pos = 1;
+    int i, first;
+
+    for(idx=0;idx <  SENSOR_MAX_PROPERTIES;idx++) {
+        if (unit->sensor->data[idx].id) {
+            if (strcmp(unit->sensor->data[idx].id, id) == 0) {
+                break;
+            }
+
+            pos++;
+        }
+    }
+
+    if (idx == SENSOR_MAX_PROPERTIES) {
+        return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_FOUND, NULL);
+    }
+
+    mtx_lock(&unit->mtx);
+
+    if (*count > unit->sampling.history.count) {
+        *count = unit->sampling.history.count;
+    }
+
+    first = unit->sampling.history.count - *count;
+
+    for(i=0;i < *count;i++) {
+        sample = sensor_ring_sample(&unit->sampling.history, first + i);
+
+        t[i] = sample[0];
+        value[i].type = unit->data[idx].type;
+        value[i].raw.value = sample[pos];
+    }
+
+    mtx_unlock(&unit->mtx);
+
     return NULL;
 }
 
@@ -740,9 +1317,9 @@ driver_error_t *sensor_register_callback(sensor_instance_t *unit, sensor_callbac
         return driver_error(SENSOR_DRIVER, SENSOR_ERR_CALLBACKS_NOT_ALLOWED, NULL);
     }
 
-    portDISABLE_INTERRUPTS();
-
     // Find for a free callback
+    mtx_lock(&unit->mtx);
+
     for(i=0;i < SENSOR_MAX_CALLBACKS;i++) {
         if (unit->callbacks[i].callback == NULL) {
             unit->callbacks[i].callback = callback;
@@ -751,14 +1328,22 @@ driver_error_t *sensor_register_callback(sensor_instance_t *unit, sensor_callbac
         }
     }
 
+    mtx_unlock(&unit->mtx);
+
     if (i == SENSOR_MAX_CALLBACKS) {
-        portENABLE_INTERRUPTS();
         return driver_error(SENSOR_DRIVER, SENSOR_ERR_NO_MORE_CALLBACKS, NULL);
     }
 
+    portDISABLE_INTERRUPTS();
+
+    if (!mtx_inited(&dispatch_mtx)) {
+        mtx_init(&dispatch_mtx, NULL, NULL, MTX_RECURSE);
+        sensor_dispatch_init(&dispatch, &deferred_ops);
+    }
+
     // Create queue if needed
     if (!queue) {
-        queue = xQueueCreate(10, sizeof(sensor_deferred_data_t));
+        queue = xQueueCreate(SENSOR_DEFERRED_QUEUE_LEN, sizeof(sensor_deferred_t *));
         if (!queue) {
             portENABLE_INTERRUPTS();
             return driver_error(SENSOR_DRIVER, SENSOR_ERR_NOT_ENOUGH_MEMORY, NULL);
@@ -781,51 +1366,39 @@ driver_error_t *sensor_register_callback(sensor_instance_t *unit, sensor_callbac
     return NULL;
 }
 
+// Queue the sensor callbacks to the sensor task, if any of the properties from
+// "from" to "to" has changed, or has a latch timeout or repeat. This can be
+// called from an interrupt handler, so no memory is allocated. Each instance
+// has a deferred data slot, that is queued once. If the slot is still pending
+// the new event is coalesced into it, keeping the latch of the first event.
 void IRAM_ATTR sensor_queue_callbacks(sensor_instance_t *unit, uint8_t from, uint8_t to) {
-    portBASE_TYPE high_priority_task_awoken = 0;
-    sensor_deferred_data_t *data;
-    portBASE_TYPE yield = 0;
+    int changed = 0;
+    int i;
 
-    int i, j;
+    // Test if there is something to notify
+    for(i = from; i <= to; i++) {
+        if (unit->latch[i].timeout || unit->latch[i].repeat || (unit->data[i].raw.value != unit->latch[i].value.raw.value))  {
+            changed = 1;
+            break;
+        }
+    }
 
-    data = calloc(1,sizeof(sensor_deferred_data_t));
-    assert(data);
+    if (!changed) {
+        return;
+    }
 
+    // Test if there are callbacks
     for(i=0;i < SENSOR_MAX_CALLBACKS;i++) {
         if (unit->callbacks[i].callback) {
-            data->instance = unit;
-            data->callback = unit->callbacks[i].callback;
-            data->callback_id = unit->callbacks[i].callback_id;
-
-            memcpy(data->data, unit->data, sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
-            memcpy(data->latch, unit->latch, sizeof(sensor_latch_t) * SENSOR_MAX_PROPERTIES);
-
-            for(j=0; j < SENSOR_MAX_PROPERTIES;j++) {
-                if (data->latch[j].timeout || data->latch[j].repeat || (data->data[j].raw.value != data->latch[j].value.raw.value))  {
-                    if (xPortInIsrContext()) {
-                        xQueueSendFromISR(queue, data, &high_priority_task_awoken);
-                        yield |= high_priority_task_awoken;
-                    } else {
-                        xQueueSend(queue, data, 0);
-                    }
-
-                    free(data);
-
-                    if (yield == pdTRUE) {
-                        portYIELD_FROM_ISR();
-                    }
-
-                    return;
-                }
-            }
+            break;
         }
     }
 
-    free(data);
-
-    if (yield == pdTRUE) {
-        portYIELD_FROM_ISR();
+    if ((i == SENSOR_MAX_CALLBACKS) || !queue) {
+        return;
     }
+
+    sensor_deferred_post(&dispatch, &unit->deferred.slot, from, to, xPortInIsrContext());
 }
 
 void IRAM_ATTR sensor_init_data(sensor_instance_t *unit) {
@@ -845,6 +1418,7 @@ void IRAM_ATTR sensor_init_data(sensor_instance_t *unit) {
 
 void IRAM_ATTR sensor_update_data(sensor_instance_t *unit, uint8_t from, uint8_t to, sensor_value_t *new_data, uint64_t delay, uint64_t rate, uint8_t ignore, uint64_t ignore_val) {
     struct timeval now;
+    sensor_value_t value;
     uint64_t t0, t1;
     int i;
 
@@ -863,7 +1437,17 @@ void IRAM_ATTR sensor_update_data(sensor_instance_t *unit, uint8_t from, uint8_t
         unit->latch[i].value.raw.value = unit->data[i].raw.value;
 
         // Update data
-        unit->data[i].raw.value = new_data[i].raw.value;
+        value.raw = new_data[i].raw;
+
+        // Filters use floating point, and are not in IRAM, so they are only
+        // run from a task. Drivers that call this from an interrupt handler
+        // flag their data with SENSOR_DATA_FLAG_ISR, and sensor_set_filter
+        // doesn't allow a filter for it.
+        if (!xPortInIsrContext()) {
+            sensor_filter_data(unit, i, &value);
+        }
+
+        unit->data[i].raw.value = value.raw.value;
 
         if (delay || rate) {
             // If changed update latch time
@@ -892,8 +1476,12 @@ void IRAM_ATTR sensor_update_data(sensor_instance_t *unit, uint8_t from, uint8_t
 
     sensor_queue_callbacks(unit, from, to);
 
-    if (unit->latch[i].timeout || unit->latch[i].repeat) {
-        unit->latch[i].t = now;
+    if (delay || rate) {
+        for(i = from; i <= to;i++) {
+            if (unit->latch[i].timeout || unit->latch[i].repeat) {
+                unit->latch[i].t = now;
+            }
+        }
     }
 
     mtx_unlock(&unit->mtx);
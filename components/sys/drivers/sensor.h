@@ -59,6 +59,9 @@
 #include <drivers/adc.h>
 #include <drivers/gpio.h>
 #include <drivers/gpio_debouncing.h>
+#include <drivers/sensor_deferred.h>
+#include <drivers/sensor_filter.h>
+#include <drivers/sensor_sched.h>
 
 #define SENSOR_FAMILY_TEMP "Temperature"
 #define SENSOR_FAMILY_HUM  "Humidity"
@@ -80,6 +83,12 @@ extern const int sensor_error_map;
 #define SENSOR_MAX_PROPERTIES 16
 #define SENSOR_MAX_CALLBACKS  8
 
+// Number of sensor instances that can be waiting for the sensor task at the same time
+#define SENSOR_DEFERRED_QUEUE_LEN 16
+
+// Default number of samples stored in the history of a sampled sensor
+#define SENSOR_HISTORY_DEPTH 16
+
 /*
  * Sensor flags. Each sensor has a definition flag that stores information about
  * how sensor acquires it's information.
@@ -152,6 +161,15 @@ typedef enum {
     SENSOR_DATA_STRING,
 } sensor_data_type_t;
 
+/*
+ * Sensor data flags, stored in the flags of each data definition.
+ */
+
+// bit 0
+// Data is updated from an interrupt handler with sensor_update_data. Filters
+// can't be run from an interrupt handler, so this data can't be filtered.
+#define SENSOR_DATA_FLAG_ISR (1 << 0)
+
 // Sensor data
 typedef struct {
     const char *id;
@@ -276,19 +294,30 @@ typedef struct sensor_instance {
         int callback_id;
     } callbacks[SENSOR_MAX_CALLBACKS];
 
+    // Data for the callbacks, stored by sensor_queue_callbacks until the sensor
+    // task calls the callbacks (see sensor_deferred.h)
+    struct {
+        sensor_deferred_t slot;       // Pending flag, and event counters
+        sensor_value_t data[SENSOR_MAX_PROPERTIES];
+        sensor_latch_t latch[SENSOR_MAX_PROPERTIES];
+    } deferred;
+
+    // Data filters, NULL if the data is not filtered (see sensor_set_filter)
+    sensor_filter_t *filter[SENSOR_MAX_PROPERTIES];
+
+    // Periodic sampling, done by the sampling scheduler (see sensor_sample)
+    struct {
+        sensor_sched_entry_t sched;   // Scheduling, period is 0 if not sampled
+        sensor_ring_t history;        // For each sample, the time and the data raw values
+        uint32_t samples;             // Samples taken
+        uint32_t errors;              // Samples failed
+    } sampling;
+
     const sensor_t *sensor;
     sensor_setup_t setup[SENSOR_MAX_INTERFACES];
     void *args;
 } sensor_instance_t;
 
-typedef struct {
-    sensor_instance_t *instance;
-    sensor_callback_t callback;
-    sensor_value_t data[SENSOR_MAX_PROPERTIES];
-    sensor_latch_t latch[SENSOR_MAX_PROPERTIES];
-    int callback_id;
-} sensor_deferred_data_t;
-
 const sensor_t *get_sensor(const char *id);
 const sensor_data_t *sensor_get_property(const sensor_t *sensor, const char *property);
 driver_error_t *sensor_setup(const sensor_t *sensor, sensor_setup_t *setup, sensor_instance_t **unit);
@@ -301,6 +330,10 @@ driver_error_t *sensor_register_callback(sensor_instance_t *unit, sensor_callbac
 void sensor_queue_callbacks(sensor_instance_t *unit, uint8_t from, uint8_t to);
 void sensor_init_data(sensor_instance_t *unit);
 void sensor_update_data(sensor_instance_t *unit, uint8_t from, uint8_t to, sensor_value_t *new_data, uint64_t delay, uint64_t rate, uint8_t ignore, uint64_t ignore_val);
+driver_error_t *sensor_set_filter(sensor_instance_t *unit, const char *id, const sensor_filter_config_t *config);
+driver_error_t *sensor_sample(sensor_instance_t *unit, uint32_t period, uint16_t depth);
+driver_error_t *sensor_history(sensor_instance_t *unit, const char *id, int *count, int64_t *t, sensor_value_t *value);
+uint64_t sensor_time(void);
 void IRAM_ATTR sensor_lock(sensor_instance_t *unit);
 void IRAM_ATTR sensor_unlock(sensor_instance_t *unit);
 
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor deferred callbacks
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+#include <stddef.h>
+
+#include <drivers/sensor_deferred.h>
+
+/*
+ * Helper functions
+ */
+
+// Remove the queued entries of a slot. The other entries are queued again, in
+// the same order. Called with the dispatch lock taken.
+static void deferred_purge(sensor_dispatch_t *dispatch, sensor_deferred_t *slot) {
+    const sensor_deferred_ops_t *ops = dispatch->ops;
+    sensor_deferred_t *queued;
+    uint32_t n;
+
+    n = ops->waiting();
+    while (n-- > 0) {
+        if (!ops->receive(&queued)) {
+            break;
+        }
+
+        if ((queued != slot) && !ops->send(queued, 0)) {
+            // The queue was filled in the meantime, so the entry is lost
+            ops->lock(0);
+            queued->dropped++;
+            queued->pending = 0;
+            ops->unlock(0);
+        }
+    }
+}
+
+/*
+ * Operation functions
+ */
+
+void sensor_dispatch_init(sensor_dispatch_t *dispatch, const sensor_deferred_ops_t *ops) {
+    dispatch->ops = ops;
+    dispatch->dispatching = NULL;
+    dispatch->detached = 0;
+}
+
+void sensor_deferred_init(sensor_deferred_t *slot, void *owner) {
+    slot->pending = 0;
+    slot->sending = 0;
+    slot->closed = 0;
+    slot->dispatched = 0;
+    slot->coalesced = 0;
+    slot->dropped = 0;
+    slot->owner = owner;
+}
+
+void *sensor_deferred_dispatch(sensor_dispatch_t *dispatch, void *arg) {
+    const sensor_deferred_ops_t *ops = dispatch->ops;
+    sensor_deferred_t *slot;
+    void *detached = NULL;
+
+    // Take the slot with the dispatch lock taken, because sensor_deferred_close
+    // can remove it from the queue in the meantime
+    ops->dispatch_lock();
+
+    if (!ops->receive(&slot)) {
+        ops->dispatch_unlock();
+        return NULL;
+    }
+
+    dispatch->dispatching = slot;
+
+    // Get the event data, new events can be queued after that
+    ops->lock(0);
+    ops->load(slot, arg);
+    slot->pending = 0;
+    ops->unlock(0);
+
+    ops->call(slot, arg);
+
+    // The owner was detached by the call, and it was not freed because it
+    // was in use here
+    if (dispatch->detached) {
+        detached = slot->owner;
+        dispatch->detached = 0;
+    }
+
+    dispatch->dispatching = NULL;
+
+    ops->dispatch_unlock();
+
+    return detached;
+}
+
+int sensor_deferred_close(sensor_dispatch_t *dispatch, sensor_deferred_t *slot) {
+    const sensor_deferred_ops_t *ops = dispatch->ops;
+    int dispatching;
+
+    // Stop accepting events, and wait for the producer that is queuing the
+    // slot, if any, so that its entry is in the queue when it's purged
+    ops->lock(0);
+
+    slot->closed = 1;
+    while (slot->sending) {
+        ops->unlock(0);
+        ops->yield();
+        ops->lock(0);
+    }
+
+    ops->unlock(0);
+
+    // Wait until the consumer is not dispatching, unless the caller is the
+    // consumer, because the dispatch lock is recursive
+    ops->dispatch_lock();
+
+    deferred_purge(dispatch, slot);
+    dispatching = (dispatch->dispatching == slot);
+
+    ops->dispatch_unlock();
+
+    return dispatching;
+}
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor deferred callbacks
+ *
+ * Each sensor instance has a slot with the data of its last event. The slot
+ * is queued once to the consumer (the sensor task), and while it's pending new
+ * events are coalesced into it, so the producers (interrupt handlers) never
+ * wait, and never allocate memory.
+ *
+ */
+
+#ifndef _SENSOR_DEFERRED_H_
+#define _SENSOR_DEFERRED_H_
+
+#include <stdint.h>
+
+// Functions used by the interrupt handlers are always inlined, so they are
+// placed in IRAM with the interrupt handler
+#define SENSOR_DEFERRED_INLINE static inline __attribute__((always_inline))
+
+// Results of sensor_deferred_post
+#define SENSOR_DEFERRED_QUEUED     1  // The slot was queued
+#define SENSOR_DEFERRED_COALESCED  0  // The event was coalesced into the pending slot
+#define SENSOR_DEFERRED_DROPPED   -1  // The queue was full
+#define SENSOR_DEFERRED_CLOSED    -2  // The slot is closed
+
+struct sensor_deferred;
+
+/*
+ * Platform functions
+ *
+ * The lock protects the slots, and it's taken by producers and consumer. isr
+ * is 1 when it's taken from an interrupt handler. The dispatch lock is only
+ * taken by the consumer and by sensor_deferred_close, and it must be
+ * recursive, because a slot can be closed while it's dispatched.
+ */
+typedef struct {
+    void (*lock)(int isr);
+    void (*unlock)(int isr);
+
+    // Store the owner data of an event into the slot: all of it, or if
+    // coalesce is 1, only the data from "from" to "to", merged into the
+    // pending event. Called with the lock taken.
+    void (*store)(struct sensor_deferred *slot, uint8_t from, uint8_t to, int coalesce);
+
+    // Copy the slot data into arg. Called with the lock taken.
+    void (*load)(struct sensor_deferred *slot, void *arg);
+
+    // Call the consumer of an event, with the data got by load
+    void (*call)(struct sensor_deferred *slot, void *arg);
+
+    // Queue operations, without waiting. send and receive return 1 on
+    // success, and 0 if the queue is full or empty.
+    int (*send)(struct sensor_deferred *slot, int isr);
+    int (*receive)(struct sensor_deferred **slot);
+    uint32_t (*waiting)(void);
+
+    void (*dispatch_lock)(void);
+    void (*dispatch_unlock)(void);
+
+    // Let a producer that is queuing a slot run
+    void (*yield)(void);
+} sensor_deferred_ops_t;
+
+/*
+ * Slot of an owner
+ */
+typedef struct sensor_deferred {
+    volatile uint8_t pending;   // Queued, and not dispatched yet
+    volatile uint8_t sending;   // Being queued by a producer
+    uint8_t closed;             // Not accepting events
+    uint32_t dispatched;        // Events queued to the consumer
+    uint32_t coalesced;         // Events coalesced into a pending event
+    uint32_t dropped;           // Events dropped because the queue was full
+    void *owner;
+} sensor_deferred_t;
+
+/*
+ * Consumer state
+ */
+typedef struct {
+    const sensor_deferred_ops_t *ops;
+    sensor_deferred_t *dispatching; // Slot being dispatched, protected by the dispatch lock
+    uint8_t detached;               // Set if the owner of the dispatched slot must be freed
+                                    // when the dispatch ends, protected by the dispatch lock
+} sensor_dispatch_t;
+
+/**
+ * @brief Initialize a consumer.
+ *
+ * @param dispatch Consumer.
+ * @param ops      Platform functions.
+ */
+void sensor_dispatch_init(sensor_dispatch_t *dispatch, const sensor_deferred_ops_t *ops);
+
+/**
+ * @brief Initialize a slot.
+ *
+ * @param slot  Slot.
+ * @param owner Owner of the slot.
+ */
+void sensor_deferred_init(sensor_deferred_t *slot, void *owner);
+
+/**
+ * @brief Post an event to the consumer. Can be called from an interrupt
+ *        handler.
+ *
+ * @param dispatch Consumer.
+ * @param slot     Slot.
+ * @param from     First data changed by the event.
+ * @param to       Last data changed by the event.
+ * @param isr      1 if called from an interrupt handler.
+ *
+ * @return SENSOR_DEFERRED_QUEUED, SENSOR_DEFERRED_COALESCED,
+ *         SENSOR_DEFERRED_DROPPED, or SENSOR_DEFERRED_CLOSED.
+ */
+SENSOR_DEFERRED_INLINE int sensor_deferred_post(sensor_dispatch_t *dispatch, sensor_deferred_t *slot, uint8_t from, uint8_t to, int isr) {
+    const sensor_deferred_ops_t *ops = dispatch->ops;
+    int queued;
+
+    ops->lock(isr);
+
+    if (slot->closed) {
+        ops->unlock(isr);
+        return SENSOR_DEFERRED_CLOSED;
+    }
+
+    if (slot->pending) {
+        ops->store(slot, from, to, 1);
+        slot->coalesced++;
+        ops->unlock(isr);
+        return SENSOR_DEFERRED_COALESCED;
+    }
+
+    ops->store(slot, from, to, 0);
+    slot->pending = 1;
+    slot->sending = 1;
+
+    ops->unlock(isr);
+
+    // Only this producer queues the slot, until the consumer takes it
+    queued = ops->send(slot, isr);
+
+    ops->lock(isr);
+
+    if (queued) {
+        slot->dispatched++;
+    } else {
+        slot->dropped++;
+        slot->pending = 0;
+    }
+
+    slot->sending = 0;
+
+    ops->unlock(isr);
+
+    return queued ? SENSOR_DEFERRED_QUEUED : SENSOR_DEFERRED_DROPPED;
+}
+
+/**
+ * @brief Take a queued slot and call its consumer. If the queue is empty it
+ *        does nothing.
+ *
+ * @param dispatch Consumer.
+ * @param arg      Buffer for the event data, passed to the load and call
+ *                 functions.
+ *
+ * @return The owner of the dispatched slot, if it was detached by setting
+ *         dispatch->detached while it was dispatched, so it must be freed,
+ *         or NULL.
+ */
+void *sensor_deferred_dispatch(sensor_dispatch_t *dispatch, void *arg);
+
+/**
+ * @brief Close a slot, so that it doesn't accept new events, and remove it
+ *        from the queue. When it returns, no producer is using the slot.
+ *        The queue order of the other slots is kept.
+ *
+ * @param dispatch Consumer.
+ * @param slot     Slot.
+ *
+ * @return 1 if the slot is being dispatched, because the caller is the
+ *         consumer, or 0 if not.
+ */
+int sensor_deferred_close(sensor_dispatch_t *dispatch, sensor_deferred_t *slot);
+
+#endif /* _SENSOR_DEFERRED_H_ */
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor data filters
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+#include <string.h>
+#include <math.h>
+
+#include <drivers/sensor_filter.h>
+
+/*
+ * Helper functions
+ */
+
+static float filter_average(sensor_filter_t *filter) {
+    float sum = 0;
+    int i;
+
+    for(i = 0;i < filter->count;i++) {
+        sum += filter->window[i];
+    }
+
+    return sum / filter->count;
+}
+
+static float filter_median(sensor_filter_t *filter) {
+    float sorted[SENSOR_FILTER_MAX_N];
+    float v;
+    int i, j;
+
+    // Insertion sort, windows are small
+    for(i = 0;i < filter->count;i++) {
+        v = filter->window[i];
+
+        for(j = i;(j > 0) && (sorted[j - 1] > v);j--) {
+            sorted[j] = sorted[j - 1];
+        }
+
+        sorted[j] = v;
+    }
+
+    if (filter->count & 1) {
+        return sorted[filter->count / 2];
+    }
+
+    return (sorted[filter->count / 2 - 1] + sorted[filter->count / 2]) / 2;
+}
+
+/*
+ * Operation functions
+ */
+
+int sensor_filter_init(sensor_filter_t *filter, const sensor_filter_config_t *config) {
+    switch (config->type) {
+        case SENSOR_FILTER_NONE:
+            break;
+
+        case SENSOR_FILTER_AVERAGE:
+        case SENSOR_FILTER_MEDIAN:
+            if ((config->n < 1) || (config->n > SENSOR_FILTER_MAX_N)) {
+                return -1;
+            }
+            break;
+
+        case SENSOR_FILTER_IIR:
+            if (!(config->alpha > 0) || (config->alpha > 1)) {
+                return -1;
+            }
+            break;
+
+        case SENSOR_FILTER_DECIMATE:
+            if (config->n < 1) {
+                return -1;
+            }
+            break;
+
+        default:
+            return -1;
+    }
+
+    if (!(config->deadband >= 0)) {
+        return -1;
+    }
+
+    memset(filter, 0, sizeof(sensor_filter_t));
+    filter->config = *config;
+
+    return 0;
+}
+
+int sensor_filter_process(sensor_filter_t *filter, float x, float *y) {
+    float v = x;
+
+    switch (filter->config.type) {
+        case SENSOR_FILTER_AVERAGE:
+        case SENSOR_FILTER_MEDIAN:
+            filter->window[filter->pos] = x;
+            filter->pos = (filter->pos + 1) % filter->config.n;
+            if (filter->count < filter->config.n) {
+                filter->count++;
+            }
+
+            if (filter->config.type == SENSOR_FILTER_AVERAGE) {
+                v = filter_average(filter);
+            } else {
+                v = filter_median(filter);
+            }
+            break;
+
+        case SENSOR_FILTER_IIR:
+            if (filter->primed) {
+                filter->y += filter->config.alpha * (x - filter->y);
+            } else {
+                filter->y = x;
+            }
+
+            v = filter->y;
+            break;
+
+        case SENSOR_FILTER_DECIMATE:
+            // Pass the first sample, and then 1 of each n samples
+            if (filter->pos++ != 0) {
+                if (filter->pos == filter->config.n) {
+                    filter->pos = 0;
+                }
+
+                *y = filter->out;
+                return 0;
+            }
+
+            if (filter->pos == filter->config.n) {
+                filter->pos = 0;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    // Changes inside the deadband don't produce a new output
+    if (filter->primed && (fabsf(v - filter->out) < filter->config.deadband)) {
+        *y = filter->out;
+        return 0;
+    }
+
+    filter->primed = 1;
+    filter->out = v;
+    *y = v;
+
+    return 1;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor data filters
+ *
+ */
+
+#ifndef _SENSOR_FILTER_H_
+#define _SENSOR_FILTER_H_
+
+#include <stdint.h>
+
+// Maximum window size of the average and median filters
+#define SENSOR_FILTER_MAX_N 32
+
+typedef enum {
+    SENSOR_FILTER_NONE = 0,
+    SENSOR_FILTER_AVERAGE,  // Moving average of the last n samples
+    SENSOR_FILTER_MEDIAN,   // Median of the last n samples
+    SENSOR_FILTER_IIR,      // Single pole IIR: y = y + alpha * (x - y)
+    SENSOR_FILTER_DECIMATE, // Pass 1 of each n samples
+} sensor_filter_type_t;
+
+typedef struct {
+    sensor_filter_type_t type;
+    uint8_t n;       // Window size (average, median), or decimation factor
+    float alpha;     // Smoothing factor (iir), in (0, 1]
+    float deadband;  // Minimum change of the output to produce a new value
+} sensor_filter_config_t;
+
+/*
+ * Filter state
+ *
+ * All the state is allocated with the filter, so filtering a sample doesn't
+ * allocate memory.
+ */
+typedef struct {
+    sensor_filter_config_t config;
+    uint8_t count;                      // Samples in the window
+    uint8_t pos;                        // Window position for the next sample
+    uint8_t primed;                     // 1 if there is an output value
+    float y;                            // IIR filter output
+    float out;                          // Last output value
+    float window[SENSOR_FILTER_MAX_N];  // Last n samples (average, median)
+} sensor_filter_t;
+
+/**
+ * @brief Initialize a filter.
+ *
+ * @param filter Filter.
+ * @param config Filter configuration.
+ *
+ * @return 0 on success, or -1 if the configuration is not valid.
+ */
+int sensor_filter_init(sensor_filter_t *filter, const sensor_filter_config_t *config);
+
+/**
+ * @brief Filter a sample.
+ *
+ * @param filter Filter.
+ * @param x      Sample.
+ * @param y      Filter output. If there is no new output, it's set to the
+ *               last output.
+ *
+ * @return 1 if there is a new output, or 0 if the sample is absorbed by the
+ *         decimation, or the output change is inside the deadband.
+ */
+int sensor_filter_process(sensor_filter_t *filter, float x, float *y);
+
+#endif /* _SENSOR_FILTER_H_ */
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor sampling scheduler
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <drivers/sensor_sched.h>
+
+/*
+ * Helper functions
+ */
+
+// Add an entry to a round, and compute the time of its next sample
+static void sched_select(sensor_sched_entry_t *entry, sensor_sched_entry_t ***last, uint64_t now) {
+    entry->busy = 1;
+    entry->round = NULL;
+    **last = entry;
+    *last = &entry->round;
+
+    // Keep the sampling phase, unless the sample is late for more than a period
+    entry->due += entry->period;
+    if (entry->due <= now) {
+        entry->due = now + entry->period;
+    }
+}
+
+/*
+ * Operation functions
+ */
+
+void sensor_sched_init(sensor_sched_t *sched, sensor_sched_clock_t clock) {
+    sched->entries = NULL;
+    sched->clock = clock;
+}
+
+void sensor_sched_add(sensor_sched_t *sched, sensor_sched_entry_t *entry, uint32_t period, uint32_t bus, void *arg) {
+    entry->period = period;
+    entry->bus = bus;
+    entry->due = sched->clock();
+    entry->batched = 0;
+    entry->busy = 0;
+    entry->arg = arg;
+    entry->round = NULL;
+
+    entry->next = sched->entries;
+    sched->entries = entry;
+}
+
+void sensor_sched_remove(sensor_sched_t *sched, sensor_sched_entry_t *entry) {
+    sensor_sched_entry_t **prev;
+
+    for(prev = &sched->entries;*prev;prev = &(*prev)->next) {
+        if (*prev == entry) {
+            *prev = entry->next;
+            break;
+        }
+    }
+
+    entry->period = 0;
+    entry->next = NULL;
+}
+
+sensor_sched_entry_t *sensor_sched_round(sensor_sched_t *sched, uint64_t *now) {
+    sensor_sched_entry_t *entry, *other, *round = NULL, **last = &round;
+
+    *now = sched->clock();
+
+    for(entry = sched->entries;entry;entry = entry->next) {
+        if (entry->busy || (entry->due > *now)) {
+            continue;
+        }
+
+        sched_select(entry, &last, *now);
+
+        if (!entry->bus) {
+            continue;
+        }
+
+        // Select the entries in the same bus that are almost due
+        for(other = sched->entries;other;other = other->next) {
+            if (!other->busy && (other->bus == entry->bus) &&
+                (other->due <= *now + other->period / 4)) {
+                if (other->due > *now) {
+                    other->batched++;
+                }
+
+                sched_select(other, &last, *now);
+            }
+        }
+    }
+
+    return round;
+}
+
+void sensor_sched_end(sensor_sched_entry_t *round) {
+    for(;round;round = round->round) {
+        round->busy = 0;
+    }
+}
+
+uint64_t sensor_sched_next(const sensor_sched_t *sched) {
+    const sensor_sched_entry_t *entry;
+    uint64_t next = UINT64_MAX;
+
+    for(entry = sched->entries;entry;entry = entry->next) {
+        if (entry->due < next) {
+            next = entry->due;
+        }
+    }
+
+    return next;
+}
+
+int sensor_ring_init(sensor_ring_t *ring, uint16_t depth, uint8_t values) {
+    memset(ring, 0, sizeof(sensor_ring_t));
+
+    if (!(ring->samples = calloc(depth * (1 + values), sizeof(int64_t)))) {
+        return -1;
+    }
+
+    ring->depth = depth;
+    ring->values = values;
+
+    return 0;
+}
+
+void sensor_ring_free(sensor_ring_t *ring) {
+    free(ring->samples);
+    memset(ring, 0, sizeof(sensor_ring_t));
+}
+
+void sensor_ring_add(sensor_ring_t *ring, int64_t t, const int64_t *values) {
+    int64_t *sample = ring->samples + ring->head * (1 + ring->values);
+
+    sample[0] = t;
+    memcpy(&sample[1], values, ring->values * sizeof(int64_t));
+
+    ring->head = (ring->head + 1) % ring->depth;
+    if (ring->count < ring->depth) {
+        ring->count++;
+    }
+}
+
+const int64_t *sensor_ring_sample(const sensor_ring_t *ring, uint16_t i) {
+    return ring->samples + ((ring->head + ring->depth - ring->count + i) % ring->depth) * (1 + ring->values);
+}
+
+#endif
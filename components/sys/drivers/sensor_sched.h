@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor sampling scheduler
+ *
+ */
+
+#ifndef _SENSOR_SCHED_H_
+#define _SENSOR_SCHED_H_
+
+#include <stdint.h>
+
+// Get the current time, in milliseconds
+typedef uint64_t (*sensor_sched_clock_t)(void);
+
+/*
+ * Sampled sensor
+ *
+ * When an entry is due, the entries in the same bus that are due in less than
+ * a quarter of their period are selected in the same round, right after it.
+ * This "batching" only groups the samples in time, so that the accesses to a
+ * bus come in bursts instead of being spread over the period: each sensor
+ * still does its own bus transactions, they are not merged into one.
+ */
+typedef struct sensor_sched_entry {
+    uint32_t period;                  // Sampling period in milliseconds, 0 if not scheduled
+    uint32_t bus;                     // Bus shared with other entries, 0 if none
+    uint64_t due;                     // Time of the next sample, in milliseconds
+    uint32_t batched;                 // Samples selected before time, with other entries in the same bus
+    uint8_t busy;                     // Selected in a round that is not ended
+    void *arg;                        // Owner of the entry
+    struct sensor_sched_entry *round; // Next entry in the same round
+    struct sensor_sched_entry *next;  // Next scheduled entry
+} sensor_sched_entry_t;
+
+/*
+ * Scheduler state
+ *
+ * The scheduler doesn't lock anything, the caller must serialize the calls.
+ * Entries selected in a round are busy until the round is ended, and must not
+ * be removed until then.
+ */
+typedef struct {
+    sensor_sched_entry_t *entries;    // Scheduled entries
+    sensor_sched_clock_t clock;       // Time source
+} sensor_sched_t;
+
+/*
+ * History of samples
+ *
+ * Each sample has a time, and a fixed number of values. When the history is
+ * full, a new sample replaces the oldest one.
+ */
+typedef struct {
+    int64_t *samples;                 // For each sample, the time and the values
+    uint16_t depth;                   // Size, in samples
+    uint16_t count;                   // Samples stored
+    uint16_t head;                    // Position for the next sample
+    uint8_t values;                   // Values in each sample
+} sensor_ring_t;
+
+/**
+ * @brief Initialize a scheduler, without entries.
+ *
+ * @param sched Scheduler.
+ * @param clock Time source.
+ */
+void sensor_sched_init(sensor_sched_t *sched, sensor_sched_clock_t clock);
+
+/**
+ * @brief Schedule an entry, with its first sample due now.
+ *
+ * @param sched  Scheduler.
+ * @param entry  Entry, not scheduled.
+ * @param period Sampling period in milliseconds, greater than 0.
+ * @param bus    Bus identifier, or 0 if the entry is not batched.
+ * @param arg    Owner of the entry.
+ */
+void sensor_sched_add(sensor_sched_t *sched, sensor_sched_entry_t *entry, uint32_t period, uint32_t bus, void *arg);
+
+/**
+ * @brief Unschedule an entry. Does nothing if the entry is not scheduled.
+ *
+ * @param sched Scheduler.
+ * @param entry Entry, not busy.
+ */
+void sensor_sched_remove(sensor_sched_t *sched, sensor_sched_entry_t *entry);
+
+/**
+ * @brief Select the entries to sample in a new round, and compute the time of
+ *        their next sample. The selected entries are marked as busy.
+ *
+ * @param sched Scheduler.
+ * @param now   Set to the time of the round.
+ *
+ * @return The first entry of the round, linked by the round field, or NULL
+ *         if no entry is due.
+ */
+sensor_sched_entry_t *sensor_sched_round(sensor_sched_t *sched, uint64_t *now);
+
+/**
+ * @brief End a round, clearing the busy mark of its entries.
+ *
+ * @param round First entry of the round.
+ */
+void sensor_sched_end(sensor_sched_entry_t *round);
+
+/**
+ * @brief Get the time of the next sample.
+ *
+ * @param sched Scheduler.
+ *
+ * @return Time in milliseconds, or UINT64_MAX if there are no entries.
+ */
+uint64_t sensor_sched_next(const sensor_sched_t *sched);
+
+/**
+ * @brief Initialize a history.
+ *
+ * @param ring   History.
+ * @param depth  Size, in samples, greater than 0.
+ * @param values Values in each sample.
+ *
+ * @return 0 on success, or -1 if there is not enough memory.
+ */
+int sensor_ring_init(sensor_ring_t *ring, uint16_t depth, uint8_t values);
+
+/**
+ * @brief Release the memory used by a history. The history is left empty,
+ *        and it can be released again.
+ *
+ * @param ring History.
+ */
+void sensor_ring_free(sensor_ring_t *ring);
+
+/**
+ * @brief Add a sample to a history, replacing the oldest one if it's full.
+ *
+ * @param ring   History.
+ * @param t      Time of the sample.
+ * @param values Values of the sample.
+ */
+void sensor_ring_add(sensor_ring_t *ring, int64_t t, const int64_t *values);
+
+/**
+ * @brief Get a sample from a history.
+ *
+ * @param ring History.
+ * @param i    Sample index, from 0 (the oldest) to ring->count - 1 (the newest).
+ *
+ * @return The sample, with the time followed by the values.
+ */
+const int64_t *sensor_ring_sample(const sensor_ring_t *ring, uint16_t i);
+
+#endif /* _SENSOR_SCHED_H_ */
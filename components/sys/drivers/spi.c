@@ -74,11 +74,14 @@
 #include "freertos/task.h"
 
 #include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 #include "soc/io_mux_reg.h"
 #include "soc/spi_reg.h"
 #include "soc/gpio_sig_map.h"
 #include "soc/gpio_reg.h"
+#include "soc/soc_memory_layout.h"
 
 #include "driver/periph_ctrl.h"
 #include "driver/spi_master.h"
@@ -97,9 +100,6 @@
 
 #define PIN_FUNC_SPI 1
 
-extern uint32_t _rodata_start;
-extern uint32_t _lit4_end;
-
 static void spi_init();
 
 // Register driver and messages
@@ -114,6 +114,7 @@ DRIVER_REGISTER_BEGIN(SPI,spi,0,spi_init,NULL);
     DRIVER_REGISTER_ERROR(SPI, spi, DeviceNotSetup, "is not set up", SPI_ERR_DEVICE_NOT_SETUP);
     DRIVER_REGISTER_ERROR(SPI, spi, DeviceNotSelected, "device is not selected", SPI_ERR_DEVICE_IS_NOT_SELECTED);
     DRIVER_REGISTER_ERROR(SPI, spi, CannotChangePinMap, "cannot change pin map once the SPI unit has an attached device", SPI_ERR_CANNOT_CHANGE_PINMAP);
+    DRIVER_REGISTER_ERROR(SPI, spi, TransferInProgress, "a transfer is in progress", SPI_ERR_TRANSFER_IN_PROGRESS);
 DRIVER_REGISTER_END(SPI,spi,0,spi_init,NULL);
 
 // SPI bus information
@@ -201,7 +202,7 @@ static int spi_get_free_device(int unit) {
     return -1;
 }
 
-static driver_error_t *spi_tranfer_sanity_checks(int deviceid) {
+static driver_error_t *spi_device_sanity_checks(int deviceid) {
     int unit = (deviceid & 0xff00) >> 8;
     int device = (deviceid & 0x00ff);
 
@@ -225,6 +226,141 @@ static driver_error_t *spi_tranfer_sanity_checks(int deviceid) {
     return NULL;
 }
 
+// Same as spi_device_sanity_checks, and also checks that there is not a transfer
+// started with spi_bulk_submit in progress, because its transactions can't be
+// mixed with the transactions of other transfer in the device queue
+static driver_error_t *spi_tranfer_sanity_checks(int deviceid) {
+    int unit = (deviceid & 0xff00) >> 8;
+    int device = (deviceid & 0x00ff);
+
+    driver_error_t *error = spi_device_sanity_checks(deviceid);
+    if (error) {
+        return error;
+    }
+
+    if (spi_bus[spi_idx(unit)].device[device].transfer) {
+        return driver_error(SPI_DRIVER, SPI_ERR_TRANSFER_IN_PROGRESS, NULL);
+    }
+
+    return NULL;
+}
+
+// Count a completed transfer in the device counters
+static void IRAM_ATTR spi_stats_update(spi_device_t *dev, uint32_t bytes, int64_t start) {
+    uint32_t latency = esp_timer_get_time() - start;
+
+    dev->stats.transfers++;
+    dev->stats.bytes += bytes;
+    dev->stats.time += latency;
+
+    if (latency > dev->stats.max_latency) {
+        dev->stats.max_latency = latency;
+    }
+}
+
+// Queue the next DMA transaction of a transfer
+static void spi_dma_queue(int unit, int device, spi_transfer_t *transfer) {
+    spi_device_t *dev = &spi_bus[spi_idx(unit)].device[device];
+    spi_transaction_t *t = &transfer->t[transfer->next];
+    uint8_t *copy = transfer->copy[transfer->next];
+    uint32_t offset, bytes;
+    esp_err_t ret;
+
+    bytes = spi_dma_plan_next(&transfer->plan, &offset);
+
+    memset(t, 0, sizeof(spi_transaction_t));
+    t->length = bytes * 8;
+
+    if (transfer->in) {
+        if (copy) {
+            memcpy(copy, transfer->in + offset, bytes);
+            t->tx_buffer = copy;
+            dev->stats.copies++;
+        } else {
+            t->tx_buffer = transfer->in + offset;
+        }
+    }
+
+    if (transfer->out) {
+        t->rx_buffer = transfer->out + offset;
+    }
+
+    ret = spi_device_queue_trans(dev->h, t, portMAX_DELAY);
+    assert(ret==ESP_OK);
+
+    transfer->next = (transfer->next + 1) % SPI_DMA_QUEUE;
+    transfer->queued++;
+}
+
+// Start a DMA transfer. The transfer is split into transactions, each one using
+// a chain of DMA descriptors, and the first transactions are queued.
+static int spi_dma_submit(int unit, int device, uint32_t word_size, uint32_t len,
+        const uint8_t *in, uint8_t *out, spi_transfer_t *transfer) {
+    int i;
+
+    memset(transfer, 0, sizeof(spi_transfer_t));
+
+    transfer->in = in;
+    transfer->out = out;
+    transfer->start = esp_timer_get_time();
+
+    if (in && !esp_ptr_dma_capable(in)) {
+        // Data can't be transferred by DMA (for example, it's in flash). It's
+        // copied to DMA capable memory before queuing each transaction, so
+        // transactions are limited to a descriptor.
+        spi_dma_plan_init(&transfer->plan, word_size * len, word_size, 1);
+
+        for(i = 0;(i < SPI_DMA_QUEUE) && (i < spi_dma_plan_pending(&transfer->plan));i++) {
+            transfer->copy[i] = heap_caps_malloc(transfer->plan.max, MALLOC_CAP_DMA);
+            if (!transfer->copy[i]) {
+                while (--i >= 0) {
+                    free(transfer->copy[i]);
+                }
+
+                return -1;
+            }
+        }
+    } else {
+        spi_dma_plan_init(&transfer->plan, word_size * len, word_size, SPI_DMA_DESCRIPTORS);
+    }
+
+    while ((transfer->queued < SPI_DMA_QUEUE) && spi_dma_plan_pending(&transfer->plan)) {
+        spi_dma_queue(unit, device, transfer);
+    }
+
+    return 0;
+}
+
+// Wait for the completion of a DMA transfer, queuing the remaining transactions
+// as the queued ones complete
+static void spi_dma_wait(int unit, int device, spi_transfer_t *transfer) {
+    spi_device_t *dev = &spi_bus[spi_idx(unit)].device[device];
+    spi_transaction_t *t;
+    esp_err_t ret;
+    int i;
+
+    while (transfer->queued > 0) {
+        ret = spi_device_get_trans_result(dev->h, &t, portMAX_DELAY);
+        assert(ret==ESP_OK);
+
+        transfer->queued--;
+        dev->stats.transactions++;
+
+        // Transactions complete in order, so the completed transaction is the
+        // next one to use
+        if (spi_dma_plan_pending(&transfer->plan)) {
+            spi_dma_queue(unit, device, transfer);
+        }
+    }
+
+    for(i = 0;i < SPI_DMA_QUEUE;i++) {
+        free(transfer->copy[i]);
+        transfer->copy[i] = NULL;
+    }
+
+    spi_stats_update(dev, transfer->plan.total, transfer->start);
+}
+
 static void IRAM_ATTR spi_master_op(int deviceid, uint32_t word_size,
         uint32_t len, uint8_t *in, uint8_t *out) {
     int unit = (deviceid & 0xff00) >> 8;
@@ -234,6 +370,9 @@ static void IRAM_ATTR spi_master_op(int deviceid, uint32_t word_size,
         // SPI hardware registers index
         uint32_t idx = 0;
 
+        // Start time, for the device counters
+        int64_t start = esp_timer_get_time();
+
         // TX / RX buffer
         uint8_t buffer[64];
 
@@ -296,65 +435,25 @@ static void IRAM_ATTR spi_master_op(int deviceid, uint32_t word_size,
                 out = out + cbytes;
             }
         }
+
+        spi_stats_update(&spi_bus[spi_idx(unit)].device[device], word_size * len, start);
     } else {
-        device = (deviceid & 0x00ff);
-        esp_err_t ret;
-        spi_transaction_t t;
-        uint8_t *bin = NULL;
-        uint8_t *nbin = NULL;
-        uint8_t ro = 0;
-
-        // esp-idf driver used DMA, but data in FLASH can't be transferred by DMA, so in this case
-        // we copy to RAM
-        if (in) {
-            if (((&_rodata_start) <= (uint32_t *) in)
-                    && ((uint32_t *) in <= (&_lit4_end))) {
-                ro = 1;
-                bin = malloc(word_size * len);
-                assert(bin != NULL);
-
-                nbin = bin;
-                memcpy(bin, in, word_size * len);
-            } else {
-                bin = in;
-            }
+        spi_device_t *dev = &spi_bus[spi_idx(unit)].device[device];
+        spi_transfer_t transfer;
+        int ret;
+
+        // The spi_ll functions can't fail, so if a transfer started with
+        // spi_bulk_submit is in progress, complete it first. Otherwise its
+        // results would be taken here, and spi_bulk_wait would never return.
+        if (dev->transfer) {
+            spi_dma_wait(unit, device, dev->transfer);
+            dev->transfer = NULL;
         }
 
-        // Lua RTOS SPI driver don't specify max_transfer_sz for spi bus
-        // config, so max tranfer size is limited to 4 Kb. If we need to
-        // transfer more than 4 Kb the transfer is split into 4 Kb chunks
-        int size;
+        ret = spi_dma_submit(unit, device, word_size, len, in, out, &transfer);
+        assert(ret == 0);
 
-        while (len > 0) {
-            if (len > SPI_MAX_SIZE / word_size) {
-                size = SPI_MAX_SIZE / word_size;
-            } else {
-                size = len;
-            }
-
-            memset(&t, 0, sizeof(t));
-            t.length = size * word_size * 8;
-            t.tx_buffer = (bin == NULL) ? NULL : bin;
-            t.rx_buffer = (out == NULL) ? NULL : out;
-
-            ret = spi_device_transmit(spi_bus[spi_idx(unit)].device[device].h,
-                    &t);
-            assert(ret==ESP_OK);
-
-            len = len - size;
-
-            if (bin) {
-                bin = bin + size * word_size;
-            }
-
-            if (out) {
-                out = out + size * word_size;
-            }
-        }
-
-        if (ro) {
-            free(nbin);
-        }
+        spi_dma_wait(unit, device, &transfer);
     }
 }
 
@@ -465,7 +564,8 @@ static void spi_setup_bus(uint8_t unit, uint8_t flags) {
         spi_bus_config_t buscfg = { .miso_io_num = spi_bus[spi_idx(unit)].miso,
                 .mosi_io_num = spi_bus[spi_idx(unit)].mosi, .sclk_io_num =
                         spi_bus[spi_idx(unit)].clk, .quadwp_io_num = -1,
-                .quadhd_io_num = -1 };
+                .quadhd_io_num = -1,
+                .max_transfer_sz = SPI_DMA_DESCRIPTORS * SPI_DMA_DESC_MAX };
 
         ret = spi_bus_initialize(unit - 1, &buscfg, unit - 1);
         assert(ret==ESP_OK);
@@ -729,7 +829,7 @@ int IRAM_ATTR spi_ll_bulk_rw16(int deviceid, uint32_t nelements, uint16_t *data)
     uint16_t *read = (uint16_t *) malloc(nelements * sizeof(uint16_t));
     if (read) {
         spi_master_op(deviceid, 2, nelements, (uint8_t *) data,(uint8_t *) read);
-        memcpy(data, read, nelements);
+        memcpy(data, read, nelements * sizeof(uint16_t));
         free(read);
     } else {
         return -1;
@@ -751,7 +851,7 @@ int IRAM_ATTR spi_ll_bulk_rw32(int deviceid, uint32_t nelements, uint32_t *data)
     if (read) {
         spi_master_op(deviceid, 4, nelements, (uint8_t *) data, (uint8_t *) read);
 
-        memcpy(data, read, nelements);
+        memcpy(data, read, nelements * sizeof(uint32_t));
         free(read);
     } else {
         return -1;
@@ -1153,6 +1253,79 @@ driver_error_t *spi_bulk_rw32(int deviceid, uint32_t nelements, uint32_t *data)
     return NULL;
 }
 
+driver_error_t *spi_bulk_submit(int deviceid, uint32_t word_size, uint32_t nelements, const uint8_t *in, uint8_t *out, spi_transfer_t *transfer) {
+    int unit = (deviceid & 0xff00) >> 8;
+    int device = (deviceid & 0x00ff);
+
+    // Sanity checks
+    driver_error_t *error = spi_tranfer_sanity_checks(deviceid);
+    if (error) {
+        return error;
+    }
+
+    spi_device_t *dev = &spi_bus[spi_idx(unit)].device[device];
+
+    if (!dev->dma) {
+        // Without DMA the transfer is done now
+        memset(transfer, 0, sizeof(spi_transfer_t));
+        spi_master_op(deviceid, word_size, nelements, (uint8_t *)in, out);
+
+        return NULL;
+    }
+
+    if (spi_dma_submit(unit, device, word_size, nelements, in, out, transfer) < 0) {
+        return driver_error(SPI_DRIVER, SPI_ERR_NOT_ENOUGH_MEMORY, NULL);
+    }
+
+    dev->transfer = transfer;
+
+    return NULL;
+}
+
+driver_error_t *spi_bulk_wait(int deviceid, spi_transfer_t *transfer) {
+    int unit = (deviceid & 0xff00) >> 8;
+    int device = (deviceid & 0x00ff);
+
+    // Sanity checks
+    driver_error_t *error = spi_device_sanity_checks(deviceid);
+    if (error) {
+        return error;
+    }
+
+    spi_device_t *dev = &spi_bus[spi_idx(unit)].device[device];
+
+    // Nothing to wait for if the transfer was done without DMA, or if it's
+    // already completed
+    if (dev->transfer == transfer) {
+        spi_dma_wait(unit, device, transfer);
+        dev->transfer = NULL;
+    }
+
+    return NULL;
+}
+
+driver_error_t *spi_get_stats(int deviceid, spi_stats_t *stats) {
+    int unit = (deviceid & 0xff00) >> 8;
+    int device = (deviceid & 0x00ff);
+
+    // Sanity checks
+    if ((unit > CPU_LAST_SPI) || (unit < CPU_FIRST_SPI)) {
+        return driver_error(SPI_DRIVER, SPI_ERR_INVALID_UNIT, NULL);
+    }
+
+    if ((device < 0) || (device >= SPI_BUS_DEVICES)) {
+        return driver_error(SPI_DRIVER, SPI_ERR_INVALID_DEVICE, NULL);
+    }
+
+    if (!spi_bus[spi_idx(unit)].device[device].setup) {
+        return driver_error(SPI_DRIVER, SPI_ERR_DEVICE_NOT_SETUP, NULL);
+    }
+
+    *stats = spi_bus[spi_idx(unit)].device[device].stats;
+
+    return NULL;
+}
+
 #if CONFIG_LUA_RTOS_USE_HARDWARE_LOCKS
 driver_error_t *spi_lock_bus_resources(int unit, uint8_t flags) {
     driver_unit_lock_error_t *lock_error = NULL;
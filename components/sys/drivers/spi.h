@@ -74,10 +74,17 @@
 #include <sys/driver.h>
 
 #include <drivers/cpu.h>
+#include <drivers/spi_dma.h>
 
 // Number of SPI devices per bus
 #define SPI_BUS_DEVICES 3
 
+// DMA descriptors chained for a transaction
+#define SPI_DMA_DESCRIPTORS 8
+
+// DMA transactions of a transfer queued at the same time
+#define SPI_DMA_QUEUE 2
+
 // Get the index for a SPI unit in the spi_bus array
 #define spi_idx(unit) (unit - CPU_FIRST_SPI)
 
@@ -104,6 +111,7 @@
 #define SPI_ERR_DEVICE_NOT_SETUP         (DRIVER_EXCEPTION_BASE(SPI_DRIVER_ID) |  7)
 #define SPI_ERR_DEVICE_IS_NOT_SELECTED   (DRIVER_EXCEPTION_BASE(SPI_DRIVER_ID) |  8)
 #define SPI_ERR_CANNOT_CHANGE_PINMAP     (DRIVER_EXCEPTION_BASE(SPI_DRIVER_ID) |  9)
+#define SPI_ERR_TRANSFER_IN_PROGRESS     (DRIVER_EXCEPTION_BASE(SPI_DRIVER_ID) | 10)
 
 extern const int spi_errors;
 extern const int spi_error_map;
@@ -118,6 +126,28 @@ extern const int spi_error_map;
 #define SPI_FLAG_CS_AUTO (1 << 3)
 #define SPI_FLAG_3WIRE   (1 << 4)
 
+// Device counters
+typedef struct {
+    uint32_t transfers;    // Transfers done, with or without DMA
+    uint32_t transactions; // DMA transactions done
+    uint32_t copies;       // DMA transactions with data copied to DMA capable memory
+    uint64_t bytes;        // Bytes transferred
+    uint64_t time;         // Time spent in transfers, in usecs
+    uint32_t max_latency;  // Max time of a transfer, in usecs
+} spi_stats_t;
+
+// A transfer, submitted with spi_bulk_submit
+typedef struct {
+    spi_dma_plan_t plan;
+    const uint8_t *in;                    // Data to send, or NULL
+    uint8_t *out;                         // Buffer for the received data, or NULL
+    spi_transaction_t t[SPI_DMA_QUEUE];   // Queued transactions
+    uint8_t *copy[SPI_DMA_QUEUE];         // Copies of the data to send, if it's not DMA capable
+    uint8_t queued;                       // Transactions queued
+    uint8_t next;                         // Transaction to use for the next queue
+    int64_t start;                        // Submit time, in usecs
+} spi_transfer_t;
+
 typedef struct {
     uint8_t setup;
     int8_t cs;
@@ -126,6 +156,8 @@ typedef struct {
     uint8_t flags;
     uint32_t regs[14];
     spi_device_handle_t h;
+    spi_stats_t stats;
+    spi_transfer_t *transfer; // Transfer started with spi_bulk_submit, not completed yet
 } spi_device_t;
 
 typedef struct {
@@ -437,6 +469,7 @@ driver_error_t *spi_set_speed(int deviceid, uint32_t speed);
  *          SPI_ERR_INVALID_UNIT
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_transfer(int deviceid, uint8_t data, uint8_t *read);
 
@@ -455,6 +488,7 @@ driver_error_t *spi_transfer(int deviceid, uint8_t data, uint8_t *read);
  *          SPI_ERR_INVALID_UNIT
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_write(int deviceid, uint32_t nbytes, uint8_t *data);
 
@@ -473,6 +507,7 @@ driver_error_t *spi_bulk_write(int deviceid, uint32_t nbytes, uint8_t *data);
  *          SPI_ERR_INVALID_UNIT
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_read(int deviceid, uint32_t nbytes, uint8_t *data);
 
@@ -493,6 +528,7 @@ driver_error_t *spi_bulk_read(int deviceid, uint32_t nbytes, uint8_t *data);
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
  *          SPI_ERR_NOT_ENOUGH_MEMORY
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_rw(int deviceid, uint32_t nbytes, uint8_t *data);
 
@@ -511,6 +547,7 @@ driver_error_t *spi_bulk_rw(int deviceid, uint32_t nbytes, uint8_t *data);
  *          SPI_ERR_INVALID_UNIT
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_write16(int deviceid, uint32_t nelements, uint16_t *data);
 
@@ -529,6 +566,7 @@ driver_error_t *spi_bulk_write16(int deviceid, uint32_t nelements, uint16_t *dat
  *          SPI_ERR_INVALID_UNIT
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_read16(int deviceid, uint32_t nelements, uint16_t *data);
 
@@ -549,6 +587,7 @@ driver_error_t *spi_bulk_read16(int deviceid, uint32_t nelements, uint16_t *data
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
  *          SPI_ERR_NOT_ENOUGH_MEMORY
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_rw16(int deviceid, uint32_t nelements, uint16_t *data);
 
@@ -567,6 +606,7 @@ driver_error_t *spi_bulk_rw16(int deviceid, uint32_t nelements, uint16_t *data);
  *          SPI_ERR_INVALID_UNIT
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_write32(int deviceid, uint32_t nelements, uint32_t *data);
 
@@ -585,6 +625,7 @@ driver_error_t *spi_bulk_write32(int deviceid, uint32_t nelements, uint32_t *dat
  *          SPI_ERR_INVALID_UNIT
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_read32(int deviceid, uint32_t nelements, uint32_t *data);
 
@@ -605,9 +646,63 @@ driver_error_t *spi_bulk_read32(int deviceid, uint32_t nelements, uint32_t *data
  *          SPI_ERR_INVALID_DEVICE
  *          SPI_ERR_DEVICE_IS_NOT_SELECTED
  *          SPI_ERR_NOT_ENOUGH_MEMORY
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
  */
 driver_error_t *spi_bulk_rw32(int deviceid, uint32_t nelements, uint32_t *data);
 
+/**
+ * @brief Start a transfer of data to / from the device, without waiting for its
+ *        completion. Data of any size is transferred using DMA transactions, that
+ *        are queued in the background. Device must be selected before calling this
+ *        function (use spi_select for that), and until the transfer is completed
+ *        with spi_bulk_wait. Only one transfer can be in progress for each device.
+ *        This function is thread safe.
+ *
+ * @param deviceid Device identifier.
+ * @param word_size Bytes of each element, 1, 2 or 4.
+ * @param nelements Number of elements to transfer.
+ * @param in A pointer to the data to send, or NULL. If data is not in DMA capable
+ *           memory, it's copied in pieces as the transfer progresses.
+ * @param out A pointer to a buffer for the received data, or NULL.
+ * @param transfer A pointer to the transfer, that must be valid until the transfer is
+ *                 completed.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs. Error can be an operation error or a lock error.
+ *
+ *          SPI_ERR_INVALID_UNIT
+ *          SPI_ERR_INVALID_DEVICE
+ *          SPI_ERR_DEVICE_IS_NOT_SELECTED
+ *          SPI_ERR_NOT_ENOUGH_MEMORY
+ *          SPI_ERR_TRANSFER_IN_PROGRESS
+ */
+driver_error_t *spi_bulk_submit(int deviceid, uint32_t word_size, uint32_t nelements, const uint8_t *in, uint8_t *out, spi_transfer_t *transfer);
+
+/**
+ * @brief Wait for the completion of a transfer started with spi_bulk_submit.
+ *
+ * @param deviceid Device identifier.
+ * @param transfer A pointer to the transfer.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs. Error can be an operation error or a lock error.
+ */
+driver_error_t *spi_bulk_wait(int deviceid, spi_transfer_t *transfer);
+
+/**
+ * @brief Get the counters of a device.
+ *
+ * @param deviceid Device identifier.
+ * @param stats A pointer to a spi_stats_t variable where the counters are stored.
+ *
+ * @return
+ *     - NULL success
+ *     - Pointer to driver_error_t if some error occurs. Error can be an operation error or a lock error.
+ */
+driver_error_t *spi_get_stats(int deviceid, spi_stats_t *stats);
+
 driver_error_t *spi_lock_bus_resources(int unit, uint8_t flags);
 void spi_unlock_bus_resources(int unit);
 
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, SPI DMA transaction planner
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include <drivers/spi_dma.h>
+
+uint32_t spi_dma_descriptors(uint32_t bytes) {
+    return (bytes + SPI_DMA_DESC_MAX - 1) / SPI_DMA_DESC_MAX;
+}
+
+void spi_dma_plan_init(spi_dma_plan_t *plan, uint32_t bytes, uint32_t word_size, uint32_t descriptors) {
+    uint32_t max = descriptors * SPI_DMA_DESC_MAX;
+
+    if (max > SPI_DMA_TRANS_MAX) {
+        max = SPI_DMA_TRANS_MAX;
+    }
+
+    // Word sizes are 1, 2 or 4, so a multiple of 4 has whole words
+    max &= ~3;
+    if (max < word_size) {
+        max = word_size;
+    }
+
+    plan->total = bytes;
+    plan->offset = 0;
+    plan->max = max;
+}
+
+uint32_t spi_dma_plan_next(spi_dma_plan_t *plan, uint32_t *offset) {
+    uint32_t bytes = plan->total - plan->offset;
+
+    if (bytes > plan->max) {
+        bytes = plan->max;
+    }
+
+    *offset = plan->offset;
+    plan->offset += bytes;
+
+    return bytes;
+}
+
+uint32_t spi_dma_plan_pending(const spi_dma_plan_t *plan) {
+    return (plan->total - plan->offset + plan->max - 1) / plan->max;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, SPI DMA transaction planner
+ *
+ */
+
+#ifndef _SPI_DMA_H_
+#define _SPI_DMA_H_
+
+#include <stdint.h>
+
+// Max bytes of a DMA descriptor
+#define SPI_DMA_DESC_MAX 4092
+
+// Max bytes of a SPI transaction, limited by the length register (24 bits)
+#define SPI_DMA_TRANS_MAX ((1 << 24) / 8)
+
+/*
+ * Splits a transfer into DMA transactions
+ *
+ * Each transaction uses a chain of DMA descriptors, so it's limited by the
+ * number of descriptors available. All the transactions, except the last one,
+ * have a length multiple of 4, so if the buffers of the transfer are word
+ * aligned, the buffers of all the transactions are word aligned.
+ */
+typedef struct {
+    uint32_t total;  // Bytes of the transfer
+    uint32_t offset; // Bytes planned
+    uint32_t max;    // Max bytes of a transaction
+} spi_dma_plan_t;
+
+/**
+ * @brief Get the number of chained DMA descriptors needed for a transaction.
+ *
+ * @param bytes Bytes of the transaction.
+ *
+ * @return The number of descriptors.
+ */
+uint32_t spi_dma_descriptors(uint32_t bytes);
+
+/**
+ * @brief Start planning a transfer.
+ *
+ * @param plan        Plan.
+ * @param bytes       Bytes of the transfer.
+ * @param word_size   Bytes of each word, 1, 2 or 4. A word is never split
+ *                    between transactions.
+ * @param descriptors DMA descriptors available for a transaction.
+ */
+void spi_dma_plan_init(spi_dma_plan_t *plan, uint32_t bytes, uint32_t word_size, uint32_t descriptors);
+
+/**
+ * @brief Get the next transaction of a transfer.
+ *
+ * @param plan   Plan.
+ * @param offset Offset of the transaction in the transfer.
+ *
+ * @return Bytes of the transaction, or 0 if the transfer is completely planned.
+ */
+uint32_t spi_dma_plan_next(spi_dma_plan_t *plan, uint32_t *offset);
+
+/**
+ * @brief Get the number of transactions of a transfer that are not planned yet.
+ *
+ * @param plan Plan.
+ *
+ * @return The number of transactions.
+ */
+uint32_t spi_dma_plan_pending(const spi_dma_plan_t *plan);
+
+#endif /* _SPI_DMA_H_ */
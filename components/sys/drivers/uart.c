@@ -85,6 +85,7 @@
 #include "driver/gpio.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <signal.h>
@@ -134,16 +135,33 @@ static const char * const names[] = {
 // UART array
 struct uart uart[NUART] = {
     {
-        0, NULL, 0, 115200, PTHREAD_MUTEX_INITIALIZER, CONFIG_LUA_RTOS_UART0_RX,CONFIG_LUA_RTOS_UART0_TX,
+        .brg = 115200, .mtx = PTHREAD_MUTEX_INITIALIZER, .rx = CONFIG_LUA_RTOS_UART0_RX, .tx = CONFIG_LUA_RTOS_UART0_TX,
+        .spinlock = portMUX_INITIALIZER_UNLOCKED,
     },
     {
-        0, NULL, 0, 115200, PTHREAD_MUTEX_INITIALIZER, CONFIG_LUA_RTOS_UART1_RX,CONFIG_LUA_RTOS_UART1_TX,
+        .brg = 115200, .mtx = PTHREAD_MUTEX_INITIALIZER, .rx = CONFIG_LUA_RTOS_UART1_RX, .tx = CONFIG_LUA_RTOS_UART1_TX,
+        .spinlock = portMUX_INITIALIZER_UNLOCKED,
     },
     {
-        0, NULL, 0, 115200, PTHREAD_MUTEX_INITIALIZER, CONFIG_LUA_RTOS_UART2_RX,CONFIG_LUA_RTOS_UART2_TX,
+        .brg = 115200, .mtx = PTHREAD_MUTEX_INITIALIZER, .rx = CONFIG_LUA_RTOS_UART2_RX, .tx = CONFIG_LUA_RTOS_UART2_TX,
+        .spinlock = portMUX_INITIALIZER_UNLOCKED,
     },
 };
 
+// The reader is woken up when this number of bytes are received, even if
+// it's waiting for more bytes
+#define UART_RX_THRESHOLD(unit) (uart[unit].rx_ring.size / 2)
+
+// The writer is woken up when this number of bytes are free in the TX ring
+// buffer, even if it's waiting for more free bytes
+#define UART_TX_THRESHOLD(unit) (uart[unit].tx_ring.size / 2)
+
+// Size of the TX FIFO
+#define UART_TX_FIFO_LEN 126
+
+// Get the number of bytes in the TX FIFO
+#define UART_TX_FIFO_CNT(unit) ((READ_PERI_REG(UART_STATUS_REG(unit)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT)
+
 /*
  * This is for process deferred process for CONSOLE interrupt handler
  */
@@ -322,13 +340,61 @@ void IRAM_ATTR uart_ll_set_raw(uint8_t raw) {
 	console_raw = raw;
 }
 
-void IRAM_ATTR uart_rx_intr_handler(void *args) {
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-    uint32_t uart_intr_status = 0;
+// Move all the bytes in the RX FIFO to the RX ring buffer
+static void IRAM_ATTR uart_rx_fifo(int unit, BaseType_t *xHigherPriorityTaskWoken) {
     uart_deferred_data data;
 
 	uint8_t byte, status;
 	int signal = 0;
+
+	while ((READ_PERI_REG(UART_STATUS_REG(unit)) >> UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT) {
+		byte = READ_PERI_REG(UART_FIFO_REG(unit)) & 0xFF;
+		if (queue_byte(unit, byte, &status, &signal)) {
+			// Put byte to UART ring buffer, the line is not idle anymore
+			uart_ring_put(&uart[unit].rx_ring, byte);
+			uart[unit].rx_idle = 0;
+		} else {
+			if (signal) {
+				data.type = 0;
+				data.data = signal;
+
+				xQueueSendFromISR(deferred_q, &data, xHigherPriorityTaskWoken);
+			}
+
+			if (status) {
+				data.type = 1;
+				data.data = status;
+
+				xQueueSendFromISR(deferred_q, &data, xHigherPriorityTaskWoken);
+			}
+		}
+	}
+}
+
+// Move bytes from the TX ring buffer to the TX FIFO, until the TX FIFO is full
+static void IRAM_ATTR uart_tx_fifo(int unit) {
+	uint8_t byte;
+	int free = UART_TX_FIFO_LEN - UART_TX_FIFO_CNT(unit);
+
+	while ((free-- > 0) && uart_ring_take(&uart[unit].tx_ring, &byte)) {
+		WRITE_PERI_REG(UART_FIFO_REG(unit), byte);
+	}
+
+	// Disable the TX FIFO empty interrupt if there are not more bytes to send.
+	// This is checked inside the critical section, because a writer can put
+	// bytes in the middle.
+	portENTER_CRITICAL_ISR(&uart[unit].spinlock);
+	if (uart_ring_count(&uart[unit].tx_ring) == 0) {
+		CLEAR_PERI_REG_MASK(UART_INT_ENA_REG(unit), UART_TXFIFO_EMPTY_INT_ENA);
+	}
+	portEXIT_CRITICAL_ISR(&uart[unit].spinlock);
+}
+
+void IRAM_ATTR uart_rx_intr_handler(void *args) {
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    uint32_t uart_intr_status = 0;
+    uint32_t count;
+
 	int unit = (int)args;
 
 	uart_intr_status = READ_PERI_REG(UART_INT_ST_REG(unit));
@@ -339,56 +405,38 @@ void IRAM_ATTR uart_rx_intr_handler(void *args) {
 		} else if (UART_RXFIFO_FULL_INT_ST == (uart_intr_status & UART_RXFIFO_FULL_INT_ST)) {
 			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_RXFIFO_FULL_INT_CLR);
 
-			while ((READ_PERI_REG(UART_STATUS_REG(unit)) >> UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT) {
-				byte = READ_PERI_REG(UART_FIFO_REG(unit)) & 0xFF;
-				if (queue_byte(unit, byte, &status, &signal)) {
-					// Put byte to UART queue
-					xQueueSendFromISR(uart[unit].q, &byte, &xHigherPriorityTaskWoken);
-				} else {
-					if (signal) {
-						data.type = 0;
-						data.data = signal;
-
-						xQueueSendFromISR(deferred_q, &data, &xHigherPriorityTaskWoken);
-					}
-
-					if (status) {
-						data.type = 1;
-						data.data = status;
-
-						xQueueSendFromISR(deferred_q, &data, &xHigherPriorityTaskWoken);
-					}
-				}
-			}
+			uart_rx_fifo(unit, &xHigherPriorityTaskWoken);
 		} else if (UART_RXFIFO_TOUT_INT_ST == (uart_intr_status & UART_RXFIFO_TOUT_INT_ST)) {
 			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_RXFIFO_TOUT_INT_CLR);
 
-			while ((READ_PERI_REG(UART_STATUS_REG(unit)) >> UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT) {
-				byte = READ_PERI_REG(UART_FIFO_REG(unit)) & 0xFF;
-				if (queue_byte(unit, byte, &status, &signal)) {
-					// Put byte to UART queue
-					xQueueSendFromISR(uart[unit].q, &byte, &xHigherPriorityTaskWoken);
-				} else {
-					if (signal) {
-						data.type = 0;
-						data.data = signal;
-
-						xQueueSendFromISR(deferred_q, &data, &xHigherPriorityTaskWoken);
-					}
-
-					if (status) {
-						data.type = 1;
-						data.data = status;
-
-						xQueueSendFromISR(deferred_q, &data, &xHigherPriorityTaskWoken);
-					}
-				}
-			}
+			uart_rx_fifo(unit, &xHigherPriorityTaskWoken);
+			uart[unit].rx_idle = 1;
+		} else if (UART_TXFIFO_EMPTY_INT_ST == (uart_intr_status & UART_TXFIFO_EMPTY_INT_ST)) {
+			WRITE_PERI_REG(UART_INT_CLR_REG(unit), UART_TXFIFO_EMPTY_INT_CLR);
+
+			uart_tx_fifo(unit);
 		}
 
 		uart_intr_status = READ_PERI_REG(UART_INT_ST_REG(unit));
 	}
 
+	// Wake up the reader, if it's waiting, once for all the received bytes
+	if (uart[unit].rx_wait) {
+		count = uart_ring_count(&uart[unit].rx_ring);
+		if ((count >= uart[unit].rx_wait) || (uart[unit].rx_idle && (count > 0))) {
+			uart[unit].rx_wait = 0;
+			xSemaphoreGiveFromISR(uart[unit].rx_sem, &xHigherPriorityTaskWoken);
+		}
+	}
+
+	// Wake up the writer, if it's waiting, when there is enough free space
+	if (uart[unit].tx_wait) {
+		if (uart_ring_free(&uart[unit].tx_ring) >= uart[unit].tx_wait) {
+			uart[unit].tx_wait = 0;
+			xSemaphoreGiveFromISR(uart[unit].tx_sem, &xHigherPriorityTaskWoken);
+		}
+	}
+
 	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
 }
 
@@ -520,15 +568,42 @@ driver_error_t *uart_init(int8_t unit, uint32_t brg, uint8_t databits, uint8_t p
     }
 
     // If the requested queue size is greater than current queue size,
-	// delete it and create a new one
-    if (qs > uart[unit].qs) {
-		if (uart[unit].q) {
-			vQueueDelete(uart[unit].q);
+	// free the ring buffers and create new ones. The RX and TX ring buffers
+	// have the same size, and are allocated in the same block. Once the
+	// interrupt handler is installed it uses the ring buffers at any time, so
+	// they are only created before, and kept as they are after.
+    if ((qs > uart[unit].qs) && !(uart[unit].flags & UART_FLAG_IRQ_INIT)) {
+		uint32_t size = uart_ring_size(qs);
+		uint8_t *buffer = malloc(size * 2);
+		uint8_t *old = uart[unit].rx_ring.buffer;
+
+		if (!buffer) {
+			return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+		}
+
+		uart_ring_init(&uart[unit].rx_ring, buffer, size);
+		uart_ring_init(&uart[unit].tx_ring, buffer + size, size);
+		free(old);
+	}
+
+    if (!uart[unit].rx_sem) {
+		uart[unit].rx_sem = xSemaphoreCreateBinary();
+		if (!uart[unit].rx_sem) {
+			return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+		}
+	}
+
+    if (!uart[unit].rx_mtx) {
+		uart[unit].rx_mtx = xSemaphoreCreateMutex();
+		if (!uart[unit].rx_mtx) {
+			return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
 		}
+	}
 
-		uart[unit].q  = xQueueCreate(qs, sizeof(uint8_t));
-		if (!uart[unit].q) {
-			driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
+    if (!uart[unit].tx_sem) {
+		uart[unit].tx_sem = xSemaphoreCreateBinary();
+		if (!uart[unit].tx_sem) {
+			return driver_error(UART_DRIVER, UART_ERR_NOT_ENOUGH_MEMORY, NULL);
 		}
 	}
 
@@ -619,31 +694,390 @@ driver_error_t *uart_setup_interrupts(int8_t unit) {
 	return NULL;
 }
 
+// Writes bytes directly to the TX FIFO, waiting for free space in the TX FIFO.
+// Used when the TX ring buffer can't be used.
+static void IRAM_ATTR uart_ll_write(int8_t unit, const char *buf, int len) {
+    while (len--) {
+	    while (UART_TX_FIFO_CNT(unit) >= UART_TX_FIFO_LEN);
+	    WRITE_PERI_REG(UART_FIFO_REG(unit), *buf++);
+    }
+}
+
+// Test if the TX ring buffer can be used. It can't be used before the interrupts
+// are enabled, before the scheduler is started, and from an interrupt handler.
+static int IRAM_ATTR uart_tx_ring_ready(int8_t unit) {
+	return (
+		(uart[unit].flags & UART_FLAG_IRQ_INIT) &&
+		(uart[unit].tx_ring.buffer != NULL) &&
+		!xPortInIsrContext() &&
+		(xTaskGetSchedulerState() == taskSCHEDULER_RUNNING)
+	);
+}
+
+// Enable the TX FIFO empty interrupt, so that the interrupt handler starts to
+// send the bytes in the TX ring buffer
+static void IRAM_ATTR uart_tx_start(int8_t unit) {
+	portENTER_CRITICAL(&uart[unit].spinlock);
+	SET_PERI_REG_MASK(UART_INT_ENA_REG(unit), UART_TXFIFO_EMPTY_INT_ENA);
+	portEXIT_CRITICAL(&uart[unit].spinlock);
+}
+
+// Wait until there are wait free bytes in the TX ring buffer. Returns 0 if
+// timeout.
+static int IRAM_ATTR uart_tx_wait(int8_t unit, uint32_t wait, TickType_t start, TickType_t ticks) {
+	uart_ring_t *ring = &uart[unit].tx_ring;
+	TickType_t elapsed;
+	TickType_t remaining = portMAX_DELAY;
+
+	for(;;) {
+		// Tell the interrupt handler what we are waiting for, and check it
+		// after, so that a wake up in the middle is not lost
+		uart[unit].tx_wait = wait;
+
+		if (uart_ring_free(ring) >= wait) {
+			uart[unit].tx_wait = 0;
+			return 1;
+		}
+
+		if (ticks != portMAX_DELAY) {
+			elapsed = xTaskGetTickCount() - start;
+			if (elapsed >= ticks) {
+				uart[unit].tx_wait = 0;
+				return 0;
+			}
+
+			remaining = ticks - elapsed;
+		}
+
+		xSemaphoreTake(uart[unit].tx_sem, remaining);
+	}
+}
+
+// Writes len bytes to the UART. The bytes are queued into the TX ring buffer, and
+// are sent by the interrupt handler, so this function returns as soon as the
+// bytes are queued. If the TX ring buffer is full, waits for free space until
+// timeout expires, and the bytes that can't be queued are dropped. Returns the
+// number of queued bytes.
+//
+// The TX ring buffer has only one producer, so the unit lock is held while
+// the bytes are queued. The lock is recursive, so callers that already hold
+// it (uart.lock(), the tty) can call this function, and the bytes are not
+// mixed with the bytes written by other tasks.
+int IRAM_ATTR uart_write_buf(int8_t unit, const char *buf, int len, uint32_t timeout) {
+	uart_ring_t *ring = &uart[unit].tx_ring;
+	TickType_t start, ticks;
+	uint32_t wait;
+	int n = 0;
+
+	if (!uart_tx_ring_ready(unit)) {
+		uart_ll_write(unit, buf, len);
+		return len;
+	}
+
+	start = xTaskGetTickCount();
+	ticks = timeout;
+
+    if (timeout != portMAX_DELAY) {
+        ticks = timeout / portTICK_PERIOD_MS;
+    }
+
+	uart_ll_lock(unit);
+
+	for(;;) {
+		n += uart_ring_write(ring, (const uint8_t *)buf + n, len - n);
+		uart_tx_start(unit);
+
+		if (n == len) {
+			break;
+		}
+
+		// Wake up when there is space for the remaining bytes, but don't wait
+		// for more than the threshold
+		wait = len - n;
+		if (wait > UART_TX_THRESHOLD(unit)) {
+			wait = UART_TX_THRESHOLD(unit);
+		}
+
+		if (!uart_tx_wait(unit, wait, start, ticks)) {
+			n += uart_ring_write(ring, (const uint8_t *)buf + n, len - n);
+			uart_tx_start(unit);
+			break;
+		}
+	}
+
+	uart[unit].tx_queued += n;
+	uart[unit].tx_dropped += len - n;
+
+	uart_ll_unlock(unit);
+
+	return n;
+}
+
+// Wait until all the queued bytes are sent, or until timeout expires. With a 0
+// timeout only checks if all the queued bytes are sent. Returns 1 if all
+// the queued bytes are sent, or 0 if not.
+int uart_tx_flush(int8_t unit, uint32_t timeout) {
+	TickType_t start, ticks;
+
+	if (!uart_tx_ring_ready(unit)) {
+		while (UART_TX_FIFO_CNT(unit));
+		return 1;
+	}
+
+	start = xTaskGetTickCount();
+	ticks = timeout;
+
+    if (timeout != portMAX_DELAY) {
+        ticks = timeout / portTICK_PERIOD_MS;
+    }
+
+	// Wait until the TX ring buffer is empty. The unit lock is held while
+	// waiting, so that only one task waits for the interrupt handler.
+	uart_ll_lock(unit);
+	if (!uart_tx_wait(unit, uart[unit].tx_ring.size, start, ticks)) {
+		uart_ll_unlock(unit);
+		return 0;
+	}
+	uart_ll_unlock(unit);
+
+	// Wait until the TX FIFO is empty
+	while (UART_TX_FIFO_CNT(unit)) {
+		if ((ticks != portMAX_DELAY) && (xTaskGetTickCount() - start >= ticks)) {
+			return 0;
+		}
+
+		delay(1);
+	}
+
+	return 1;
+}
+
+// Get the number of queued and dropped bytes in the TX ring buffer
+void uart_tx_stats(int8_t unit, uint32_t *queued, uint32_t *dropped) {
+	*queued = uart[unit].tx_queued;
+	*dropped = uart[unit].tx_dropped;
+}
+
 // Writes a byte to the UART
 void IRAM_ATTR uart_write(int8_t unit, char byte) {
-    while (((READ_PERI_REG(UART_STATUS_REG(unit)) & (UART_TXFIFO_CNT << UART_TXFIFO_CNT_S)) >> UART_TXFIFO_CNT_S & UART_TXFIFO_CNT) >= 126);
-    WRITE_PERI_REG(UART_FIFO_REG(unit), byte);
+	uart_write_buf(unit, &byte, 1, portMAX_DELAY);
 }
 
 // Writes a null-terminated string to the UART
 void IRAM_ATTR uart_writes(int8_t unit, char *s) {
-    while (*s) {
-	    while (((READ_PERI_REG(UART_STATUS_REG(unit)) & (UART_TXFIFO_CNT << UART_TXFIFO_CNT_S)) >> UART_TXFIFO_CNT_S & UART_TXFIFO_CNT) >= 126);
-	    WRITE_PERI_REG(UART_FIFO_REG(unit) , *s++);
-   }
+	uart_write_buf(unit, s, strlen(s), portMAX_DELAY);
+}
+
+// Take the reader lock, waiting for the current reader until timeout expires.
+// The RX ring buffer has only one consumer, and only one task can wait for the
+// interrupt handler, so readers take turns. Returns 0 if timeout.
+static int uart_rx_lock(int8_t unit, TickType_t start, TickType_t ticks) {
+	TickType_t elapsed;
+	TickType_t remaining = portMAX_DELAY;
+
+	if (ticks != portMAX_DELAY) {
+		elapsed = xTaskGetTickCount() - start;
+		remaining = (elapsed >= ticks)?0:(ticks - elapsed);
+	}
+
+	return (xSemaphoreTake(uart[unit].rx_mtx, remaining) == pdTRUE);
+}
+
+static void uart_rx_unlock(int8_t unit) {
+	xSemaphoreGive(uart[unit].rx_mtx);
+}
+
+// Wait until there are wait bytes in the RX ring buffer, or until the RX line is
+// idle with some bytes in the RX ring buffer. Returns 0 if timeout.
+static int uart_rx_wait(int8_t unit, uint32_t wait, TickType_t start, TickType_t ticks) {
+	uart_ring_t *ring = &uart[unit].rx_ring;
+	TickType_t elapsed;
+	TickType_t remaining = portMAX_DELAY;
+	uint32_t count;
+
+	for(;;) {
+		// Tell the interrupt handler what we are waiting for, and check it
+		// after, so that bytes received in the middle are not lost
+		uart[unit].rx_wait = wait;
+
+		count = uart_ring_count(ring);
+		if ((count >= wait) || (uart[unit].rx_idle && (count > 0))) {
+			uart[unit].rx_wait = 0;
+			return 1;
+		}
+
+		if (ticks != portMAX_DELAY) {
+			elapsed = xTaskGetTickCount() - start;
+			if (elapsed >= ticks) {
+				uart[unit].rx_wait = 0;
+				return 0;
+			}
+
+			remaining = ticks - elapsed;
+		}
+
+		xSemaphoreTake(uart[unit].rx_sem, remaining);
+	}
+}
+
+// Reads up to len bytes from uart. Returns when len bytes are read, when the
+// RX line is idle after receiving some bytes, or when timeout expires, and
+// returns the number of bytes read. If other task is reading from the unit,
+// waits until it ends, and this time counts for the timeout.
+int uart_read_buf(int8_t unit, char *buf, int len, uint32_t timeout) {
+	TickType_t start = xTaskGetTickCount();
+	TickType_t ticks = timeout;
+	uint32_t wait;
+	int n = 0;
+
+    if (timeout != portMAX_DELAY) {
+        ticks = timeout / portTICK_PERIOD_MS;
+    }
+
+	if (!uart_rx_lock(unit, start, ticks)) {
+		return 0;
+	}
+
+	for(;;) {
+		n += uart_ring_get(&uart[unit].rx_ring, (uint8_t *)buf + n, len - n);
+		if ((n == len) || ((n > 0) && uart[unit].rx_idle)) {
+			break;
+		}
+
+		// Wake up when the remaining bytes are received, but don't wait for more
+		// than the threshold, so the ring buffer doesn't overflow
+		wait = len - n;
+		if (wait > UART_RX_THRESHOLD(unit)) {
+			wait = UART_RX_THRESHOLD(unit);
+		}
+
+		if (!uart_rx_wait(unit, wait, start, ticks)) {
+			n += uart_ring_get(&uart[unit].rx_ring, (uint8_t *)buf + n, len - n);
+			break;
+		}
+	}
+
+	uart_rx_unlock(unit);
+
+	return n;
+}
+
+// Reads a line from uart into buf, that has room for cap bytes, including the
+// null terminator. A line ends with any of the bytes in the delims string, that
+// is consumed, but not copied to buf. If a line ends with CR, and LF is also a
+// delimiter, a LF received just after is consumed as part of the same line end.
+//
+// Returns the line length when a delimiter is found, or cap - 1 if buf is full
+// before a delimiter is found (the rest of the line is read in the next call).
+// If timeout expires before a delimiter is found, returns the number of bytes
+// read, or -1 if no bytes were read. Timeout is for the whole line, not for
+// each byte, and includes the time waiting for other task reading from the unit.
+// If eol is not NULL, it is set to 1 if the line ended with a delimiter, or to 0
+// if it is a partial line (buf is full, or timeout).
+int uart_readline(int8_t unit, char *buf, int cap, const char *delims, uint32_t timeout, uint8_t *eol) {
+	uart_ring_t *ring = &uart[unit].rx_ring;
+	TickType_t start = xTaskGetTickCount();
+	TickType_t ticks = timeout;
+	int n = 0, found, len;
+	char delim;
+
+    if (timeout != portMAX_DELAY) {
+        ticks = timeout / portTICK_PERIOD_MS;
+    }
+
+	// Room for the null terminator
+	cap--;
+
+	if (eol) {
+		*eol = 0;
+	}
+
+	if (!uart_rx_lock(unit, start, ticks)) {
+		buf[0] = 0;
+		return -1;
+	}
+
+	for(;;) {
+		// Skip the LF of a CR + LF line end
+		if (uart[unit].rx_cr && (uart_ring_count(ring) > 0)) {
+			if ((uart_ring_find(ring, "\n", 1) == 0) && strchr(delims, '\n')) {
+				uart_ring_get(ring, (uint8_t *)&delim, 1);
+			}
+
+			uart[unit].rx_cr = 0;
+		}
+
+		// Look for a delimiter in the bytes that fit into buf, and copy all the
+		// bytes before it
+		found = uart_ring_find(ring, delims, cap - n + 1);
+		if (found >= 0) {
+			n += uart_ring_get(ring, (uint8_t *)buf + n, found);
+			uart_ring_get(ring, (uint8_t *)&delim, 1);
+
+			uart[unit].rx_cr = (delim == '\r');
+			if (eol) {
+				*eol = 1;
+			}
+
+			break;
+		}
+
+		len = uart_ring_count(ring);
+		if (len > cap - n) {
+			len = cap - n;
+		}
+
+		n += uart_ring_get(ring, (uint8_t *)buf + n, len);
+		if (n == cap) {
+			break;
+		}
+
+		// Wait for more bytes
+		if (!uart_rx_wait(unit, 1, start, ticks)) {
+			if (n == 0) {
+				n = -1;
+			}
+
+			break;
+		}
+	}
+
+	uart_rx_unlock(unit);
+
+	if (n < 0) {
+		buf[0] = 0;
+	} else {
+		buf[n] = 0;
+	}
+
+	return n;
 }
 
 // Reads a byte from uart
 uint8_t IRAM_ATTR uart_read(int8_t unit, char *c, uint32_t timeout) {
+	return (uart_read_buf(unit, c, 1, timeout) == 1);
+}
+
+// Waits until there are received bytes, and returns the number of received bytes
+int uart_rx_available(int8_t unit, uint32_t timeout) {
+	TickType_t start = xTaskGetTickCount();
+	TickType_t ticks = timeout;
+
     if (timeout != portMAX_DELAY) {
-        timeout = timeout / portTICK_PERIOD_MS;
-    }
-	
-    if (xQueueReceive(uart[unit].q, c, (TickType_t)(timeout)) == pdTRUE) {
-        return 1;
-    } else {
-        return 0;
+        ticks = timeout / portTICK_PERIOD_MS;
     }
+
+	if (uart_rx_lock(unit, start, ticks)) {
+		uart_rx_wait(unit, 1, start, ticks);
+		uart_rx_unlock(unit);
+	}
+
+	return uart_ring_count(&uart[unit].rx_ring);
+}
+
+// Gets the free space in the RX ring buffer
+int uart_rx_free(int8_t unit) {
+	return uart_ring_free(&uart[unit].rx_ring);
 }
 
 // Consume all received bytes, and do not nothing with them
@@ -797,11 +1231,6 @@ const char *uart_name(int8_t unit) {
     return names[unit - 1];
 }
 
-// Gets the UART queue
-QueueHandle_t *uart_get_queue(int8_t unit) {
-    return  uart[unit].q;
-}
-
 int uart_get_br(int unit) {
 //    int divisor;
 //    unit--;
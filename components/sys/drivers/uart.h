@@ -72,6 +72,7 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "rom/uart.h"
 #include "rom/ets_sys.h"
@@ -82,9 +83,22 @@
 #include <pthread.h>
 #include <sys/driver.h>
 
+#include <drivers/uart_ring.h>
+
 struct uart {
     uint8_t          flags;
-    QueueHandle_t    q;         // RX queue
+    uart_ring_t      rx_ring;   // RX ring buffer, filled by the interrupt handler
+    SemaphoreHandle_t rx_sem;   // Given by the interrupt handler to wake up the reader
+    SemaphoreHandle_t rx_mtx;   // Held by the reader, so there is only one reader at a time
+    volatile uint16_t rx_wait;  // Bytes the reader is waiting for, 0 if not waiting
+    volatile uint8_t rx_idle;   // 1 if the RX line is idle since the last received byte
+    uint8_t          rx_cr;     // 1 if the last line read ended with CR, so a LF after it is skipped
+    uart_ring_t      tx_ring;   // TX ring buffer, drained by the interrupt handler
+    SemaphoreHandle_t tx_sem;   // Given by the interrupt handler to wake up the writer holding mtx
+    volatile uint32_t tx_wait;  // Free bytes the writer is waiting for, 0 if not waiting
+    uint32_t         tx_queued; // Bytes queued into the TX ring buffer
+    uint32_t         tx_dropped;// Bytes not queued because the TX ring buffer was full
+    portMUX_TYPE     spinlock;  // Protects the interrupt enable register
     uint16_t         qs;        // Queue size
     uint32_t         brg;       // Baud rate
     pthread_mutex_t  mtx;		// Mutex
@@ -138,6 +152,13 @@ driver_error_t *uart_pin_map(int unit, int rx, int tx);
 void     uart_write(int8_t unit, char byte);
 void     uart_writes(int8_t unit, char *s);
 uint8_t uart_read(int8_t unit, char *c, uint32_t timeout);
+int      uart_read_buf(int8_t unit, char *buf, int len, uint32_t timeout);
+int      uart_rx_available(int8_t unit, uint32_t timeout);
+int      uart_rx_free(int8_t unit);
+int      uart_readline(int8_t unit, char *buf, int cap, const char *delims, uint32_t timeout, uint8_t *eol);
+int      uart_write_buf(int8_t unit, const char *buf, int len, uint32_t timeout);
+int      uart_tx_flush(int8_t unit, uint32_t timeout);
+void     uart_tx_stats(int8_t unit, uint32_t *queued, uint32_t *dropped);
 uint8_t  uart_reads(int8_t unit, char *buff, uint8_t crlf, uint32_t timeout);
 uint8_t  uart_wait_response(int8_t unit, char *command, uint8_t echo, char *ret, uint8_t substring, uint32_t timeout, int nargs, ...);
 uint8_t  uart_send_command(int8_t unit, char *command, uint8_t echo, uint8_t crlf, char *ret, uint8_t substring, uint32_t timeout, int nargs, ...);
@@ -145,7 +166,6 @@ const char  *uart_name(int8_t unit);
 int      uart_get_br(int unit);
 int      uart_is_setup(int unit);
 void     uart_stop(int unit);
-QueueHandle_t *uart_get_queue(int8_t unit);
 driver_error_t *uart_lock_resources(int unit, uint8_t flags, void *resources);
 
 #endif
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, UART ring buffers
+ *
+ * Single producer / single consumer ring buffer, that don't need any lock.
+ * The producer only writes head, and the consumer only writes tail. In the
+ * RX ring buffer the producer is the UART interrupt handler and the consumer
+ * is the reader task. In the TX ring buffer the producer is the writer task
+ * and the consumer is the UART interrupt handler.
+ *
+ */
+
+#ifndef __UART_RING_H__
+#define __UART_RING_H__
+
+#include <stdint.h>
+#include <string.h>
+
+// Functions used by the interrupt handler are always inlined, so they are
+// placed in IRAM with the interrupt handler
+#define UART_RING_INLINE static inline __attribute__((always_inline))
+
+typedef struct {
+	uint8_t *buffer;        // Buffer
+	uint32_t size;          // Buffer size, power of 2
+	volatile uint32_t head; // Bytes written since init, only updated by the producer
+	volatile uint32_t tail; // Bytes read since init, only updated by the consumer
+	uint32_t dropped;       // Bytes dropped because the ring buffer was full
+} uart_ring_t;
+
+// Get the smaller power of 2 greater or equal than size
+static inline uint32_t uart_ring_size(uint32_t size) {
+	uint32_t ring_size = 1;
+
+	while (ring_size < size) {
+		ring_size <<= 1;
+	}
+
+	return ring_size;
+}
+
+// Init a ring buffer. size must be a power of 2.
+static inline void uart_ring_init(uart_ring_t *ring, uint8_t *buffer, uint32_t size) {
+	ring->buffer = buffer;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->dropped = 0;
+}
+
+// Get the number of bytes in the ring buffer
+UART_RING_INLINE uint32_t uart_ring_count(const uart_ring_t *ring) {
+	return ring->head - ring->tail;
+}
+
+// Get the free space of the ring buffer
+UART_RING_INLINE uint32_t uart_ring_free(const uart_ring_t *ring) {
+	return ring->size - (ring->head - ring->tail);
+}
+
+// Put a byte into the ring buffer. Only called by the producer.
+UART_RING_INLINE int uart_ring_put(uart_ring_t *ring, uint8_t byte) {
+	uint32_t head = ring->head;
+
+	if (head - ring->tail == ring->size) {
+		ring->dropped++;
+		return 0;
+	}
+
+	ring->buffer[head & (ring->size - 1)] = byte;
+
+	// The byte must be in the buffer before the consumer can see it
+	__sync_synchronize();
+	ring->head = head + 1;
+
+	return 1;
+}
+
+// Put up to len bytes into the ring buffer, and return the number of bytes
+// copied from buffer. Only called by the producer.
+static inline uint32_t uart_ring_write(uart_ring_t *ring, const uint8_t *buffer, uint32_t len) {
+	uint32_t head = ring->head;
+	uint32_t space = ring->size - (head - ring->tail);
+	uint32_t pos, chunk;
+
+	if (len > space) {
+		len = space;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	pos = head & (ring->size - 1);
+	chunk = ring->size - pos;
+	if (chunk > len) {
+		chunk = len;
+	}
+
+	memcpy(ring->buffer + pos, buffer, chunk);
+	memcpy(ring->buffer, buffer + chunk, len - chunk);
+
+	// The bytes must be in the buffer before the consumer can see them
+	__sync_synchronize();
+	ring->head = head + len;
+
+	return len;
+}
+
+// Get a byte from the ring buffer. Returns 0 if the ring buffer is empty. Only
+// called by the consumer.
+UART_RING_INLINE int uart_ring_take(uart_ring_t *ring, uint8_t *byte) {
+	uint32_t tail = ring->tail;
+
+	if (ring->head == tail) {
+		return 0;
+	}
+
+	__sync_synchronize();
+	*byte = ring->buffer[tail & (ring->size - 1)];
+
+	__sync_synchronize();
+	ring->tail = tail + 1;
+
+	return 1;
+}
+
+// Get up to len bytes from the ring buffer, and return the number of bytes
+// copied into buffer. Only called by the consumer.
+static inline uint32_t uart_ring_get(uart_ring_t *ring, uint8_t *buffer, uint32_t len) {
+	uint32_t tail = ring->tail;
+	uint32_t count = ring->head - tail;
+	uint32_t pos, chunk;
+
+	if (len > count) {
+		len = count;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	// The bytes must be read after head, and before the producer can
+	// overwrite them
+	__sync_synchronize();
+
+	pos = tail & (ring->size - 1);
+	chunk = ring->size - pos;
+	if (chunk > len) {
+		chunk = len;
+	}
+
+	memcpy(buffer, ring->buffer + pos, chunk);
+	memcpy(buffer + chunk, ring->buffer, len - chunk);
+
+	__sync_synchronize();
+	ring->tail = tail + len;
+
+	return len;
+}
+
+// Find the first byte in the ring buffer that is one of the bytes in the delims
+// string, looking at most len bytes. Returns the offset of the byte from the
+// first byte in the ring buffer, or -1 if not found. Only called by the consumer.
+static inline int uart_ring_find(const uart_ring_t *ring, const char *delims, uint32_t len) {
+	uint32_t tail = ring->tail;
+	uint32_t count = ring->head - tail;
+	uint32_t pos, chunk, offset = 0;
+	const uint8_t *start, *found, *first;
+	const char *delim;
+
+	if (len > count) {
+		len = count;
+	}
+
+	__sync_synchronize();
+
+	// Scan the 2 contiguous spans of the ring buffer
+	while (len > 0) {
+		pos = (tail + offset) & (ring->size - 1);
+		chunk = ring->size - pos;
+		if (chunk > len) {
+			chunk = len;
+		}
+
+		// Each delimiter is only searched before the first delimiter found
+		start = ring->buffer + pos;
+		first = NULL;
+		for(delim = delims; *delim; delim++) {
+			found = memchr(start, *delim, first ? (first - start) : chunk);
+			if (found) {
+				first = found;
+			}
+		}
+
+		if (first) {
+			return offset + (first - start);
+		}
+
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return -1;
+}
+
+#endif
@@ -105,7 +105,7 @@ static void sensor_task(void *arg) {
     double mvoltsx, mvoltsy;
     sensor_value_t *data;
 
-    data = calloc(1,sizeof(sensor_deferred_data_t) * SENSOR_MAX_PROPERTIES);
+    data = calloc(1,sizeof(sensor_value_t) * SENSOR_MAX_PROPERTIES);
     assert(data);
 
     sensor_init_data(unit);
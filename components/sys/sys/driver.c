@@ -52,6 +52,7 @@
 #include <sys/syslog.h>
 #include <sys/panic.h>
 #include <sys/mutex.h>
+#include <sys/trace.h>
 
 #include <drivers/pwm.h>
 #include <drivers/adc.h>
@@ -60,8 +61,6 @@
 #include <drivers/spi.h>
 #include <drivers/gpio.h>
 
-#define DRIVER_LOCK_DEBUG 0
-
 // Mutex for lock resources
 static struct mtx driver_mtx;
 
@@ -273,19 +272,12 @@ driver_unit_lock_error_t *driver_lock(const driver_t *owner_driver, int owner_un
 	    *target_driver->lock = target_lock;
 	}
 
-	#if DRIVER_LOCK_DEBUG
-	char *name = driver_target_name(target_driver, target_unit, NULL);
-
-	syslog(LOG_DEBUG,"driver lock by %s%d on %s\r\n",
-			owner_driver->name, owner_unit, name
+	TRACE(TRACE_DRIVER, LOG_DEBUG, "driver lock by %s%d on %s%d",
+			owner_driver->name, owner_unit, target_driver->name, target_unit
 	);
 
-	#endif
-
 	if (!target_lock) {
-		#if DRIVER_LOCK_DEBUG
-		syslog(LOG_DEBUG,"driver %s haven't lock control\r\n", target_driver->name);
-		#endif
+		TRACE(TRACE_DRIVER, LOG_DEBUG, "driver %s haven't lock control", target_driver->name);
 
 		if (target_driver->lock_resources) {
 			driver_error_t *error;
@@ -294,61 +286,43 @@ driver_unit_lock_error_t *driver_lock(const driver_t *owner_driver, int owner_un
 
 			if ((error = target_driver->lock_resources(target_unit, flags, NULL))) {
 				// Target driver has no locks, then grant access
-				#if DRIVER_LOCK_DEBUG
-				syslog(LOG_DEBUG,"driver lock by %s%d on %s revoked\r\n",
-						owner_driver->name, owner_unit,
-						name
+				TRACE(TRACE_DRIVER, LOG_DEBUG, "driver lock by %s%d on %s%d revoked",
+						owner_driver->name, owner_unit, target_driver->name, target_unit
 				);
-				free(name);
-				#endif
 
 				driver_unlock_all(owner_driver, owner_unit);
 
 				return error->lock_error;
 			} else {
 				// Target driver has no locks, then grant access
-				#if DRIVER_LOCK_DEBUG
-				syslog(LOG_DEBUG,"driver lock by %s%d on %s granted\r\n",
-						owner_driver->name, owner_unit,
-						name
+				TRACE(TRACE_DRIVER, LOG_DEBUG, "driver lock by %s%d on %s%d granted",
+						owner_driver->name, owner_unit, target_driver->name, target_unit
 				);
-				free(name);
-				#endif
 
 				return NULL;
 			}
 		}
 
 		// Target driver has no locks, then grant access
-		#if DRIVER_LOCK_DEBUG
-		syslog(LOG_DEBUG,"driver lock by %s%d on %s granted\r\n",
-				owner_driver->name, owner_unit,
-				name
+		TRACE(TRACE_DRIVER, LOG_DEBUG, "driver lock by %s%d on %s%d granted",
+				owner_driver->name, owner_unit, target_driver->name, target_unit
 		);
-		free(name);
-		#endif
 
 		mtx_unlock(&driver_mtx);
 
 		return NULL;
 	}
 
-	#if DRIVER_LOCK_DEBUG
-	syslog(LOG_DEBUG,"driver %s have lock control\r\n", target_driver->name);
-	#endif
+	TRACE(TRACE_DRIVER, LOG_DEBUG, "driver %s have lock control", target_driver->name);
 
 	if (target_lock[lock_index(target_driver, target_unit)].owner) {
 		// Target unit has a lock
 
 		if ((target_lock[lock_index(target_driver, target_unit)].owner == owner_driver) && ((target_lock[lock_index(target_driver, target_unit)].unit == owner_unit))) {
 			// Target unit is locked by owner_driver, then grant access
-			#if DRIVER_LOCK_DEBUG
-			syslog(LOG_DEBUG,"driver lock by %s%d on %s granted\r\n",
-					owner_driver->name, owner_unit,
-					name
+			TRACE(TRACE_DRIVER, LOG_DEBUG, "driver lock by %s%d on %s%d granted",
+					owner_driver->name, owner_unit, target_driver->name, target_unit
 			);
-			free(name);
-			#endif
 
 			mtx_unlock(&driver_mtx);
 
@@ -366,13 +340,9 @@ driver_unit_lock_error_t *driver_lock(const driver_t *owner_driver, int owner_un
 			error->target_driver = target_driver;
 			error->target_unit = target_unit;
 
-			#if DRIVER_LOCK_DEBUG
-			syslog(LOG_DEBUG,"driver lock by %s%d on %s revoked\r\n",
-					owner_driver->name, owner_unit,
-					name
+			TRACE(TRACE_DRIVER, LOG_DEBUG, "driver lock by %s%d on %s%d revoked",
+					owner_driver->name, owner_unit, target_driver->name, target_unit
 			);
-			free(name);
-			#endif
 
 			mtx_unlock(&driver_mtx);
 
@@ -383,13 +353,9 @@ driver_unit_lock_error_t *driver_lock(const driver_t *owner_driver, int owner_un
 	} else {
 		// Target unit hasn't a lock, then grant access
 
-		#if DRIVER_LOCK_DEBUG
-		syslog(LOG_DEBUG,"driver lock by %s%d on %s granted\r\n",
-				owner_driver->name, owner_unit,
-				name
+		TRACE(TRACE_DRIVER, LOG_DEBUG, "driver lock by %s%d on %s%d granted",
+				owner_driver->name, owner_unit, target_driver->name, target_unit
 		);
-		free(name);
-		#endif
 
 		target_lock[lock_index(target_driver, target_unit)].owner = owner_driver;
 		target_lock[lock_index(target_driver, target_unit)].unit = owner_unit;
@@ -36,6 +36,7 @@
 #define _PATH_LOG   "/dev/log"
 
 #include <stdarg.h>
+#include <stdint.h>
 
 /*
  * priorities/facilities are encoded into a single 32-bit quantity, where the
@@ -175,3 +176,16 @@ int getlogmask();
 int getlogstat();
 const char *syslog_setloghost (const char *host);
 const char *syslog_getloghost ();
+
+/*
+ * counters of the rsyslog client.
+ */
+typedef struct {
+    uint32_t queued;    /* records queued for the rsyslog server */
+    uint32_t sent;      /* records sent to the rsyslog server */
+    uint32_t datagrams; /* datagrams sent to the rsyslog server */
+    uint32_t dropped;   /* records dropped, buffer full or network down */
+    uint32_t limited;   /* records dropped by the facility rate limit */
+} syslog_stats_t;
+
+void syslog_getstats(syslog_stats_t *stats);
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS binary trace log
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_USE_TRACE
+
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <sys/trace.h>
+
+// Subsystem names, in the same order than trace_subsystem_t
+static const char *trace_names[TRACE_SUBSYSTEMS] = {
+	"sys", "driver", "lua", "net", "http", "mqtt", "can", "uart", "spi", "i2c", "sensor"
+};
+
+// Level of each subsystem
+int8_t trace_level[TRACE_SUBSYSTEMS] = {
+	[0 ... TRACE_SUBSYSTEMS - 1] = CONFIG_LUA_RTOS_TRACE_LEVEL
+};
+
+// Ring buffers, one for each CPU, so records from different CPUs never
+// compete for the same slot
+static trace_record_t trace_ring[portNUM_PROCESSORS][CONFIG_LUA_RTOS_TRACE_RECORDS];
+
+// Number of records written in each ring buffer since the last clear
+static uint32_t trace_count[portNUM_PROCESSORS];
+
+// Set while a record is being written in each ring buffer
+static volatile uint8_t trace_busy[portNUM_PROCESSORS];
+
+// If true, new records are discarded
+static volatile uint8_t trace_frozen = 0;
+
+/*
+ * Helper functions
+ */
+
+// Discard new records, and wait for the records that are being written
+static void trace_freeze() {
+	int cpu;
+
+	trace_frozen = 1;
+
+	for(cpu = 0;cpu < portNUM_PROCESSORS;cpu++) {
+		while (trace_busy[cpu]);
+	}
+}
+
+/*
+ * Operation functions
+ */
+void IRAM_ATTR trace_add(const char *fmt, int subsystem, int level, int nargs, ...) {
+	trace_record_t *record;
+	uint32_t state;
+	va_list args;
+	int cpu, i;
+
+	// Each CPU has it's own ring buffer, so disabling the interrupts is enough
+	// to protect the ring buffer against other writers
+	state = portENTER_CRITICAL_NESTED();
+
+	cpu = xPortGetCoreID();
+
+	trace_busy[cpu] = 1;
+	if (trace_frozen) {
+		trace_busy[cpu] = 0;
+		portEXIT_CRITICAL_NESTED(state);
+		return;
+	}
+
+	record = &trace_ring[cpu][trace_count[cpu] % CONFIG_LUA_RTOS_TRACE_RECORDS];
+	trace_count[cpu]++;
+
+	record->fmt = fmt;
+	record->time = (uint32_t)esp_timer_get_time();
+	record->subsystem = subsystem;
+	record->level = level;
+	record->nargs = nargs;
+	record->cpu = cpu;
+
+	va_start(args, nargs);
+	for(i = 0;i < nargs;i++) {
+		record->args[i] = va_arg(args, uint32_t);
+	}
+	va_end(args);
+
+	trace_busy[cpu] = 0;
+
+	portEXIT_CRITICAL_NESTED(state);
+}
+
+const char *trace_subsystem_name(int subsystem) {
+	if ((subsystem < 0) || (subsystem >= TRACE_SUBSYSTEMS)) {
+		return NULL;
+	}
+
+	return trace_names[subsystem];
+}
+
+int trace_subsystem(const char *name) {
+	int subsystem;
+
+	for(subsystem = 0;subsystem < TRACE_SUBSYSTEMS;subsystem++) {
+		if (strcmp(trace_names[subsystem], name) == 0) {
+			return subsystem;
+		}
+	}
+
+	return -1;
+}
+
+void trace_set_level(int subsystem, int level) {
+	trace_level[subsystem] = level;
+}
+
+int trace_get_level(int subsystem) {
+	return trace_level[subsystem];
+}
+
+int trace_dump(trace_writer_t writer, void *arg) {
+	trace_header_t header;
+	char name[TRACE_NAME_LEN];
+	uint32_t count, first, i;
+	int cpu, subsystem, rc = 0;
+
+	trace_freeze();
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.cpus = portNUM_PROCESSORS;
+	header.record_size = sizeof(trace_record_t);
+	header.subsystems = TRACE_SUBSYSTEMS;
+	header.records = CONFIG_LUA_RTOS_TRACE_RECORDS;
+
+	if ((rc = writer(arg, &header, sizeof(header))) < 0) {
+		goto exit;
+	}
+
+	for(subsystem = 0;subsystem < TRACE_SUBSYSTEMS;subsystem++) {
+		memset(name, 0, sizeof(name));
+		strncpy(name, trace_names[subsystem], sizeof(name));
+
+		if ((rc = writer(arg, name, sizeof(name))) < 0) {
+			goto exit;
+		}
+	}
+
+	for(cpu = 0;cpu < portNUM_PROCESSORS;cpu++) {
+		if (trace_count[cpu] > CONFIG_LUA_RTOS_TRACE_RECORDS) {
+			count = CONFIG_LUA_RTOS_TRACE_RECORDS;
+			first = trace_count[cpu] % CONFIG_LUA_RTOS_TRACE_RECORDS;
+		} else {
+			count = trace_count[cpu];
+			first = 0;
+		}
+
+		if ((rc = writer(arg, &count, sizeof(count))) < 0) {
+			goto exit;
+		}
+
+		for(i = 0;i < count;i++) {
+			if ((rc = writer(arg, &trace_ring[cpu][(first + i) % CONFIG_LUA_RTOS_TRACE_RECORDS], sizeof(trace_record_t))) < 0) {
+				goto exit;
+			}
+		}
+	}
+
+	rc = 0;
+
+exit:
+	trace_frozen = 0;
+
+	return rc;
+}
+
+void trace_clear() {
+	int cpu;
+
+	trace_freeze();
+
+	for(cpu = 0;cpu < portNUM_PROCESSORS;cpu++) {
+		trace_count[cpu] = 0;
+	}
+
+	trace_frozen = 0;
+}
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS binary trace log
+ *
+ */
+
+#ifndef _SYS_TRACE_H_
+#define _SYS_TRACE_H_
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+
+#include <sys/syslog.h>
+
+/*
+ * Trace subsystems. Each subsystem has it's own level, that can be changed
+ * at runtime. If a new subsystem is added, add also it's name in trace.c.
+ */
+typedef enum {
+	TRACE_SYS = 0,
+	TRACE_DRIVER,
+	TRACE_LUA,
+	TRACE_NET,
+	TRACE_HTTP,
+	TRACE_MQTT,
+	TRACE_CAN,
+	TRACE_UART,
+	TRACE_SPI,
+	TRACE_I2C,
+	TRACE_SENSOR,
+	TRACE_SUBSYSTEMS
+} trace_subsystem_t;
+
+#define TRACE_MAX_ARGS 5
+
+/*
+ * Trace record. Only the address of the format string is stored, the format
+ * string is resolved in the host by the decoder using the ELF file. Arguments
+ * are stored raw, as 32-bit values, so doubles and 64-bit integers are not
+ * allowed, and %s arguments must point to constant strings.
+ */
+typedef struct {
+	const char *fmt;                // Format string
+	uint32_t time;                  // Timestamp, in microseconds
+	uint8_t subsystem;              // Subsystem
+	uint8_t level;                  // Level
+	uint8_t nargs;                  // Number of arguments
+	uint8_t cpu;                    // CPU
+	uint32_t args[TRACE_MAX_ARGS];  // Arguments
+} trace_record_t;
+
+/*
+ * Dump header. After the header there are TRACE_SUBSYSTEMS subsystem names,
+ * of TRACE_NAME_LEN bytes each, and then, for each CPU, a 32-bit record
+ * count followed by the records, from the oldest to the newest.
+ */
+#define TRACE_MAGIC    "LTRC"
+#define TRACE_VERSION  1
+#define TRACE_NAME_LEN 8
+
+typedef struct {
+	char magic[4];       // TRACE_MAGIC
+	uint8_t version;     // TRACE_VERSION
+	uint8_t cpus;        // Number of CPUs
+	uint8_t record_size; // sizeof(trace_record_t)
+	uint8_t subsystems;  // TRACE_SUBSYSTEMS
+	uint32_t records;    // Records per CPU
+} trace_header_t;
+
+typedef int (*trace_writer_t)(void *arg, const void *buffer, int len);
+
+#if CONFIG_LUA_RTOS_USE_TRACE
+
+#define TRACE_NARGS(...) _TRACE_NARGS(0, ##__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+#define _TRACE_NARGS(_0, _1, _2, _3, _4, _5, n, ...) n
+
+#define _TRACE_CAT(a, b) a##b
+#define _TRACE_ARGS(n) _TRACE_CAT(_TRACE_ARGS_, n)
+
+#define _TRACE_ARGS_0()
+#define _TRACE_ARGS_1(a)             , (uint32_t)(a)
+#define _TRACE_ARGS_2(a, b)          , (uint32_t)(a), (uint32_t)(b)
+#define _TRACE_ARGS_3(a, b, c)       , (uint32_t)(a), (uint32_t)(b), (uint32_t)(c)
+#define _TRACE_ARGS_4(a, b, c, d)    , (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d)
+#define _TRACE_ARGS_5(a, b, c, d, e) , (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d), (uint32_t)(e)
+
+/*
+ * Add a record to the trace log, if level is enabled for the subsystem.
+ *
+ * The format string is placed in the .rodata.trace section, so it is never
+ * copied to RAM, and it's address is used as the record identifier.
+ */
+#define TRACE(subsystem, lvl, format, ...) \
+do { \
+	if ((lvl) <= trace_level[subsystem]) { \
+		static const char __attribute__((section(".rodata.trace"))) _trace_fmt[] = format; \
+		trace_add(_trace_fmt, (subsystem), (lvl), TRACE_NARGS(__VA_ARGS__) _TRACE_ARGS(TRACE_NARGS(__VA_ARGS__))(__VA_ARGS__)); \
+	} \
+} while (0)
+
+extern int8_t trace_level[TRACE_SUBSYSTEMS];
+
+void trace_add(const char *fmt, int subsystem, int level, int nargs, ...);
+#else
+#define TRACE(subsystem, lvl, format, ...) do {} while (0)
+#endif
+
+/**
+ * @brief Get the name of a trace subsystem.
+ *
+ * @param subsystem Subsystem.
+ *
+ * @return The subsystem name, or NULL if subsystem is invalid.
+ */
+const char *trace_subsystem_name(int subsystem);
+
+/**
+ * @brief Get a trace subsystem by it's name.
+ *
+ * @param name Subsystem name.
+ *
+ * @return The subsystem, or -1 if there is not a subsystem with this name.
+ */
+int trace_subsystem(const char *name);
+
+/**
+ * @brief Set the level of a trace subsystem. Records with a level greater
+ *        than this level are discarded.
+ *
+ * @param subsystem Subsystem.
+ * @param level     Level, from LOG_EMERG to LOG_DEBUG, or -1 to disable
+ *                  all the records of the subsystem.
+ */
+void trace_set_level(int subsystem, int level);
+
+/**
+ * @brief Get the level of a trace subsystem.
+ *
+ * @param subsystem Subsystem.
+ *
+ * @return The subsystem level.
+ */
+int trace_get_level(int subsystem);
+
+/**
+ * @brief Dump the trace log. The trace log is frozen while dumping, so new
+ *        records are discarded until the dump ends.
+ *
+ * @param writer Function called to write each chunk of the dump.
+ * @param arg    Argument passed to the writer.
+ *
+ * @return 0 on success, or the first negative value returned by writer.
+ */
+int trace_dump(trace_writer_t writer, void *arg);
+
+/**
+ * @brief Remove all the records from the trace log.
+ */
+void trace_clear();
+
+#endif /* !_SYS_TRACE_H_ */
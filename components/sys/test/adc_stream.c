@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, ADC continuous sampling blocks test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <math.h>
+
+#include <drivers/adc_stream.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_ADC
+
+#define TEST_BLOCK  64
+#define TEST_BLOCKS 50
+
+// Simulated ADC source, a 12 bit sawtooth
+static uint32_t sim_sample;
+
+static void sim_write(adc_stream_t *stream, uint32_t n, uint32_t chunk) {
+    uint16_t buffer[32];
+    uint32_t i, count;
+
+    while (n > 0) {
+        count = (n < chunk)?n:chunk;
+
+        for(i = 0;i < count;i++) {
+            buffer[i] = sim_sample++ & 0x0fff;
+        }
+
+        adc_stream_write(stream, buffer, count);
+        n -= count;
+    }
+}
+
+// Consumer that processes each block as soon as it's ready
+static uint32_t consumed;
+static int continuous;
+
+static void consume(adc_stream_t *stream) {
+    const uint16_t *block;
+    adc_block_stats_t stats;
+    uint32_t i;
+
+    block = adc_stream_get(stream);
+    TEST_ASSERT(block != NULL);
+
+    for(i = 0;i < stream->size;i++) {
+        if (block[i] != ((consumed * stream->size + i) & 0x0fff)) {
+            continuous = 0;
+        }
+    }
+
+    adc_stream_stats(block, stream->size, &stats);
+    TEST_ASSERT_EQUAL(block[0], stats.min);
+    TEST_ASSERT_EQUAL(block[stream->size - 1], stats.max);
+
+    consumed++;
+    adc_stream_release(stream);
+}
+
+TEST_CASE("sys", "[adc_stream]") {
+    static const uint16_t samples[] = {0, 3, 4};
+    static const uint16_t full[] = {4095, 4095, 4095, 4095};
+    adc_block_stats_t stats;
+    adc_stream_t stream;
+    const uint16_t *block;
+    uint32_t chunk, i;
+
+    // Statistics against reference values
+    adc_stream_stats(samples, 3, &stats);
+    TEST_ASSERT_EQUAL(0, stats.min);
+    TEST_ASSERT_EQUAL(4, stats.max);
+    TEST_ASSERT(fabs(stats.mean - 7.0 / 3) < 1e-9);
+    TEST_ASSERT(fabs(stats.rms - sqrt(25.0 / 3)) < 1e-9);
+
+    adc_stream_stats(full, 4, &stats);
+    TEST_ASSERT_EQUAL(4095, stats.min);
+    TEST_ASSERT_EQUAL(4095, stats.max);
+    TEST_ASSERT(fabs(stats.mean - 4095) < 1e-9);
+    TEST_ASSERT(fabs(stats.rms - 4095) < 1e-9);
+
+    // A consumer that keeps up gets all the samples, in order, for any
+    // producer chunk size
+    for(chunk = 1;chunk <= 32;chunk += 7) {
+        TEST_ASSERT_EQUAL(0, adc_stream_init(&stream, TEST_BLOCK, consume, NULL));
+
+        sim_sample = 0;
+        consumed = 0;
+        continuous = 1;
+
+        sim_write(&stream, TEST_BLOCK * TEST_BLOCKS + TEST_BLOCK / 2, chunk);
+
+        TEST_ASSERT_EQUAL(TEST_BLOCKS, consumed);
+        TEST_ASSERT_EQUAL(TEST_BLOCKS, stream.blocks);
+        TEST_ASSERT_EQUAL(0, stream.overruns);
+        TEST_ASSERT_EQUAL(TEST_BLOCK / 2, stream.fill);
+        TEST_ASSERT(continuous);
+
+        adc_stream_free(&stream);
+    }
+
+    // A late consumer doesn't block the producer, blocks are dropped while it
+    // holds a block
+    TEST_ASSERT_EQUAL(0, adc_stream_init(&stream, TEST_BLOCK, NULL, NULL));
+
+    sim_sample = 0;
+    TEST_ASSERT(adc_stream_get(&stream) == NULL);
+
+    sim_write(&stream, TEST_BLOCK * 4, 32);
+    TEST_ASSERT_EQUAL(1, stream.blocks);
+    TEST_ASSERT_EQUAL(3, stream.overruns);
+
+    block = adc_stream_get(&stream);
+    TEST_ASSERT(block != NULL);
+    for(i = 0;i < TEST_BLOCK;i++) {
+        TEST_ASSERT_EQUAL(i, block[i]);
+    }
+
+    adc_stream_release(&stream);
+    TEST_ASSERT(adc_stream_get(&stream) == NULL);
+
+    // The next block has the samples taken after the release
+    sim_write(&stream, TEST_BLOCK, 32);
+    TEST_ASSERT_EQUAL(2, stream.blocks);
+
+    block = adc_stream_get(&stream);
+    TEST_ASSERT(block != NULL);
+    TEST_ASSERT_EQUAL(TEST_BLOCK * 4, block[0]);
+
+    adc_stream_release(&stream);
+    adc_stream_free(&stream);
+}
+
+#endif
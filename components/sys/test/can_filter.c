@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, CAN filter compiler test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <stdlib.h>
+
+#include <drivers/can_filter.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_CAN
+
+#define TEST_FILTERS 64
+#define TEST_IDS     20000
+
+// Reference matcher, that scans all the filters
+static int linear_match(const can_filter_range_t *filter, int filters, uint32_t id) {
+    int i;
+
+    for(i = 0;i < filters;i++) {
+        if ((id >= filter[i].from) && (id <= filter[i].to)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Check that the hardware acceptance filter accepts all the identifiers accepted
+// by the compiled set, both for standard and extended frames
+static void check_hardware(const can_filter_set_t *set, uint32_t id) {
+    if (id <= 0x7ff) {
+        TEST_ASSERT_EQUAL_HEX32(set->code & ~set->mask & 0xffe00000, (id << 21) & ~set->mask & 0xffe00000);
+    }
+
+    TEST_ASSERT_EQUAL_HEX32(set->code & ~set->mask & 0xfffffff8, (id << 3) & ~set->mask & 0xfffffff8);
+}
+
+TEST_CASE("sys", "[can_filter]") {
+    can_filter_range_t filter[TEST_FILTERS];
+    can_filter_set_t set;
+    uint32_t id, max;
+    int i, n, width, expected;
+
+    // No filters, all identifiers accepted
+    TEST_ASSERT_EQUAL(0, can_filter_compile(NULL, 0, &set));
+    TEST_ASSERT(can_filter_match(&set, 0));
+    TEST_ASSERT(can_filter_match(&set, 0x1fffffff));
+    TEST_ASSERT_EQUAL_HEX32(0xffffffff, set.mask);
+    can_filter_free(&set);
+
+    // Overlapping and adjacent ranges are merged
+    filter[0].from = 10;  filter[0].to = 20;
+    filter[1].from = 15;  filter[1].to = 30;
+    filter[2].from = 31;  filter[2].to = 40;
+    filter[3].from = 100; filter[3].to = 100;
+    TEST_ASSERT_EQUAL(0, can_filter_compile(filter, 4, &set));
+    TEST_ASSERT_EQUAL(2, set.ranges);
+    TEST_ASSERT_EQUAL(10, set.range[0].from);
+    TEST_ASSERT_EQUAL(40, set.range[0].to);
+    TEST_ASSERT(!can_filter_match(&set, 9));
+    TEST_ASSERT(can_filter_match(&set, 35));
+    TEST_ASSERT(!can_filter_match(&set, 41));
+    TEST_ASSERT(can_filter_match(&set, 100));
+    can_filter_free(&set);
+
+    // Standard identifiers in the last bit of a bitmap word
+    filter[0].from = 31;    filter[0].to = 31;
+    filter[1].from = 0x7ff; filter[1].to = 0x7ff;
+    TEST_ASSERT_EQUAL(0, can_filter_compile(filter, 2, &set));
+    TEST_ASSERT(!can_filter_match(&set, 30));
+    TEST_ASSERT(can_filter_match(&set, 31));
+    TEST_ASSERT(!can_filter_match(&set, 32));
+    TEST_ASSERT(!can_filter_match(&set, 0x7fe));
+    TEST_ASSERT(can_filter_match(&set, 0x7ff));
+    can_filter_free(&set);
+
+    // Random filters, first with standard identifiers only, then with extended identifiers
+    srand(1);
+    for(width = 0;width < 2;width++) {
+        max = width?0x1fffffff:0x7ff;
+
+        for(n = 1;n <= TEST_FILTERS;n *= 2) {
+            for(i = 0;i < n;i++) {
+                filter[i].from = rand() % max;
+                filter[i].to = filter[i].from + rand() % ((n < 8)?0x100:0x10);
+                if (filter[i].to > max) {
+                    filter[i].to = max;
+                }
+            }
+
+            TEST_ASSERT_EQUAL(0, can_filter_compile(filter, n, &set));
+
+            for(i = 0;i < TEST_IDS;i++) {
+                id = (i & 1)?(filter[i % n].from + rand() % 0x20):(rand() % max);
+                if (id > max) {
+                    id = max;
+                }
+                expected = linear_match(filter, n, id);
+
+                TEST_ASSERT_EQUAL(expected, can_filter_match(&set, id));
+                if (expected) {
+                    check_hardware(&set, id);
+                }
+            }
+
+            can_filter_free(&set);
+        }
+    }
+}
+
+#endif
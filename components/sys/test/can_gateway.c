@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, CAN gateway frame codec test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <string.h>
+
+#include <driver/can.h>
+#include <drivers/can.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_CAN
+
+static void check_roundtrip(can_gw_format_t format) {
+    uint8_t buffer[CAN_GW_CLIENT_BUFFER];
+    can_message_t frame, decoded;
+    int i, len;
+
+    for(i = 0;i <= CAN_MAX_DLEN;i++) {
+        memset(&frame, 0, sizeof(frame));
+        frame.identifier = (i & 1)?0x1abcdef0 + i:0x123 + i;
+        frame.flags = (i & 1)?CAN_MSG_FLAG_EXTD:CAN_MSG_FLAG_NONE;
+        frame.data_length_code = i;
+        memset(frame.data, 0xa0 + i, i);
+
+        len = can_gw_encode(format, &frame, buffer);
+
+        // An incomplete frame is kept until the rest arrives
+        TEST_ASSERT_EQUAL(0, can_gw_decode(format, buffer, len - 1, &decoded));
+
+        memset(&decoded, 0, sizeof(decoded));
+        TEST_ASSERT_EQUAL(len, can_gw_decode(format, buffer, len, &decoded));
+        TEST_ASSERT_EQUAL_HEX32(frame.identifier, decoded.identifier);
+        TEST_ASSERT_EQUAL_HEX32(frame.flags, decoded.flags);
+        TEST_ASSERT_EQUAL(frame.data_length_code, decoded.data_length_code);
+        TEST_ASSERT_EQUAL_MEMORY(frame.data, decoded.data, i);
+    }
+}
+
+TEST_CASE("sys", "[can_gateway]") {
+    uint8_t buffer[CAN_GW_CLIENT_BUFFER];
+    can_message_t frame;
+
+    check_roundtrip(CAN_GW_FORMAT_SOCKETCAN);
+    check_roundtrip(CAN_GW_FORMAT_COMPACT);
+
+    // A dlc greater than CAN_MAX_DLEN is rejected, whether the frame is
+    // complete or not, before any data is copied into the frame
+    memset(buffer, 0, sizeof(buffer));
+    buffer[2] = 0x01;
+    buffer[3] = 0x23;
+    buffer[4] = 200;
+
+    TEST_ASSERT_EQUAL(-1, can_gw_decode(CAN_GW_FORMAT_COMPACT, buffer, 6, &frame));
+    TEST_ASSERT_EQUAL(-1, can_gw_decode(CAN_GW_FORMAT_COMPACT, buffer, 205, &frame));
+
+    buffer[4] = CAN_MAX_DLEN + 1;
+    TEST_ASSERT_EQUAL(-1, can_gw_decode(CAN_GW_FORMAT_COMPACT, buffer, 5 + CAN_MAX_DLEN + 1, &frame));
+
+    // Same for the dlc of a struct can_frame
+    TEST_ASSERT_EQUAL(-1, can_gw_decode(CAN_GW_FORMAT_SOCKETCAN, buffer, 16, &frame));
+
+    // Nothing is decoded from less than a frame header
+    TEST_ASSERT_EQUAL(0, can_gw_decode(CAN_GW_FORMAT_COMPACT, buffer, 4, &frame));
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, unity subset for the host build of the test cases
+ *
+ */
+
+#ifndef _HOST_UNITY_H_
+#define _HOST_UNITY_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef void (*unity_test_t)(void);
+
+void unity_register(const char *file, unity_test_t test);
+void unity_fail(const char *file, int line, const char *msg);
+
+#define UNITY_CAT2(a, b) a##b
+#define UNITY_CAT(a, b) UNITY_CAT2(a, b)
+
+// Test cases register themselves before main runs
+#define TEST_CASE(name, tag) \
+    static void UNITY_CAT(unity_test_, __LINE__)(void); \
+    __attribute__((constructor)) static void UNITY_CAT(unity_reg_, __LINE__)(void) { \
+        unity_register(__FILE__ " " tag, UNITY_CAT(unity_test_, __LINE__)); \
+    } \
+    static void UNITY_CAT(unity_test_, __LINE__)(void)
+
+#define TEST_ASSERT_MESSAGE(c, msg) do { if (!(c)) unity_fail(__FILE__, __LINE__, msg); } while (0)
+#define TEST_ASSERT(c) TEST_ASSERT_MESSAGE(c, #c)
+#define TEST_ASSERT_TRUE(c) TEST_ASSERT(c)
+#define TEST_ASSERT_FALSE(c) TEST_ASSERT(!(c))
+#define TEST_ASSERT_NULL(p) TEST_ASSERT((p) == NULL)
+#define TEST_ASSERT_NOT_NULL(p) TEST_ASSERT((p) != NULL)
+#define TEST_ASSERT_EQUAL(e, a) TEST_ASSERT_MESSAGE((e) == (a), #e " == " #a)
+#define TEST_ASSERT_EQUAL_HEX32(e, a) TEST_ASSERT_MESSAGE((uint32_t)(e) == (uint32_t)(a), #e " == " #a)
+#define TEST_ASSERT_EQUAL_MEMORY(e, a, len) TEST_ASSERT_MESSAGE(memcmp((e), (a), (len)) == 0, #e " == " #a)
+
+#endif /* _HOST_UNITY_H_ */
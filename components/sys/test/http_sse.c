@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, http server event stream test cases
+ *
+ */
+
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/delay.h>
+#include <sys/status.h>
+
+#include "lwip/sockets.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#if CONFIG_LUA_RTOS_USE_HTTP_SERVER
+
+#include "httpsrv.h"
+
+#define TEST_STREAM "/sse-test"
+
+extern int http_start(lua_State* L);
+extern void http_stop();
+extern int http_running();
+extern int http_eventstream(lua_State* L);
+extern int http_broadcast(lua_State* L);
+
+// Calls net.service.http.broadcast(TEST_STREAM, data, event), returns the
+// number of subscribers reached
+static int broadcast(lua_State *L, const char *data, const char *event) {
+    int count;
+
+    lua_pushcfunction(L, http_broadcast);
+    lua_pushstring(L, TEST_STREAM);
+    lua_pushstring(L, data);
+    lua_pushstring(L, event);
+    TEST_ASSERT(lua_pcall(L, 3, 1, 0) == LUA_OK);
+
+    count = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    return count;
+}
+
+// Reads from the socket until the buffer contains the expected text
+static int recv_until(int sock, char *buf, int size, const char *expected) {
+    int len = 0, n;
+
+    while (len < size - 1) {
+        n = recv(sock, buf + len, size - 1 - len, 0);
+        if (n <= 0) {
+            break;
+        }
+
+        len += n;
+        buf[len] = '\0';
+
+        if (strstr(buf, expected)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+TEST_CASE("http", "[event stream]") {
+    static const char request[] = "GET " TEST_STREAM " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    struct sockaddr_in addr;
+    struct timeval timeout = {5L, 0L};
+    int sock, started = 0;
+    lua_State *L;
+    char *buf;
+
+    if (!NETWORK_AVAILABLE()) {
+        TEST_IGNORE_MESSAGE("network not available");
+    }
+
+    L = luaL_newstate();
+    TEST_ASSERT(L != NULL);
+
+    buf = malloc(512);
+    TEST_ASSERT(buf != NULL);
+
+    if (!http_running()) {
+        lua_pushcfunction(L, http_start);
+        TEST_ASSERT(lua_pcall(L, 0, 0, 0) == LUA_OK);
+        started = 1;
+    }
+
+    lua_pushcfunction(L, http_eventstream);
+    lua_pushstring(L, TEST_STREAM);
+    TEST_ASSERT(lua_pcall(L, 1, 0, 0) == LUA_OK);
+
+    // Plain HTTP subscriber
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT(sock >= 0);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CONFIG_LUA_RTOS_HTTP_SERVER_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    TEST_ASSERT(send(sock, request, sizeof(request) - 1, 0) == sizeof(request) - 1);
+
+    TEST_ASSERT(recv_until(sock, buf, 512, "\r\n\r\n"));
+    TEST_ASSERT(strstr(buf, " 200 ") != NULL);
+    TEST_ASSERT(strstr(buf, "text/event-stream") != NULL);
+
+    // Let the server go through its select loop, where closed subscribers are
+    // reaped, before broadcasting
+    delay(1500);
+
+    TEST_ASSERT_EQUAL(1, broadcast(L, "hello", "tick"));
+    TEST_ASSERT(recv_until(sock, buf, 512, "\n\n"));
+    TEST_ASSERT(strcmp(buf, "event: tick\ndata: hello\n\n") == 0);
+
+    // Line breaks can't inject fields, neither from the event name nor the data
+    TEST_ASSERT_EQUAL(1, broadcast(L, "a\r\nevent: x\rb", "tick\r\nid: 1"));
+    TEST_ASSERT(recv_until(sock, buf, 512, "\n\n"));
+    TEST_ASSERT(strcmp(buf, "event: tickid: 1\ndata: a\ndata: event: x\ndata: b\n\n") == 0);
+
+    close(sock);
+    free(buf);
+
+    TEST_ASSERT(http_route_remove("GET", TEST_STREAM) == 0);
+
+    if (started) {
+        http_stop();
+    }
+
+    lua_close(L);
+}
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, I2C message list test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#if CONFIG_LUA_RTOS_LUA_USE_I2C
+
+#include "unity.h"
+
+#include <string.h>
+
+#include <drivers/i2c_msg.h>
+
+/*
+ * Simulated bus
+ *
+ * Fake devices have 256 registers. The first byte written after the address
+ * sets the register pointer, next bytes are written to the registers, and reads
+ * return the registers. The register pointer is incremented after each access.
+ *
+ * The bus can report errors when they happen, or when the segment is stopped,
+ * as the I2C controller does.
+ */
+typedef struct {
+    uint8_t address;
+    uint8_t reg[256];
+    uint8_t ptr;
+    uint8_t pointer_set;
+} fake_device_t;
+
+typedef struct {
+    fake_device_t *device;
+    int devices;
+    int deferred;             // 1 if errors are reported in the stop operation
+    fake_device_t *selected;
+    int read;
+    int error;
+    char trace[64];           // S = start, P = stop, X = reset
+    int conditions;
+} sim_bus_t;
+
+static void sim_trace(sim_bus_t *bus, char c) {
+    if (bus->conditions < (int)sizeof(bus->trace) - 1) {
+        bus->trace[bus->conditions++] = c;
+        bus->trace[bus->conditions] = '\0';
+    }
+}
+
+static int sim_error(sim_bus_t *bus, int error) {
+    if (!bus->error) {
+        bus->error = error;
+    }
+
+    return bus->deferred?0:error;
+}
+
+static int sim_start(void *arg, uint8_t address) {
+    sim_bus_t *bus = (sim_bus_t *)arg;
+    int i;
+
+    sim_trace(bus, 'S');
+
+    bus->selected = NULL;
+
+    if (bus->error) {
+        return sim_error(bus, bus->error);
+    }
+
+    for(i = 0;i < bus->devices;i++) {
+        if (bus->device[i].address == (address >> 1)) {
+            bus->selected = &bus->device[i];
+            bus->selected->pointer_set = 0;
+            bus->read = address & 1;
+
+            return 0;
+        }
+    }
+
+    return sim_error(bus, I2C_MSG_ERR_NACK);
+}
+
+static int sim_write(void *arg, const uint8_t *data, int len) {
+    sim_bus_t *bus = (sim_bus_t *)arg;
+    fake_device_t *device = bus->selected;
+    int i;
+
+    if (bus->error) {
+        return sim_error(bus, bus->error);
+    }
+
+    TEST_ASSERT(device != NULL);
+    TEST_ASSERT(!bus->read);
+
+    for(i = 0;i < len;i++) {
+        if (!device->pointer_set) {
+            device->ptr = data[i];
+            device->pointer_set = 1;
+        } else {
+            device->reg[device->ptr++] = data[i];
+        }
+    }
+
+    return 0;
+}
+
+static int sim_read(void *arg, uint8_t *data, int len) {
+    sim_bus_t *bus = (sim_bus_t *)arg;
+    fake_device_t *device = bus->selected;
+    int i;
+
+    if (bus->error) {
+        return sim_error(bus, bus->error);
+    }
+
+    TEST_ASSERT(device != NULL);
+    TEST_ASSERT(bus->read);
+
+    for(i = 0;i < len;i++) {
+        data[i] = device->reg[device->ptr++];
+    }
+
+    return 0;
+}
+
+static int sim_stop(void *arg) {
+    sim_bus_t *bus = (sim_bus_t *)arg;
+    int error = bus->error;
+
+    sim_trace(bus, 'P');
+
+    bus->selected = NULL;
+    bus->error = 0;
+
+    return error;
+}
+
+static void sim_reset(void *arg) {
+    sim_bus_t *bus = (sim_bus_t *)arg;
+
+    sim_trace(bus, 'X');
+
+    bus->selected = NULL;
+    bus->error = 0;
+}
+
+static const i2c_bus_ops_t sim_ops = {
+    .start = sim_start,
+    .write = sim_write,
+    .read = sim_read,
+    .stop = sim_stop,
+    .reset = sim_reset,
+};
+
+static fake_device_t device[2];
+
+static void sim_init(sim_bus_t *bus, int deferred) {
+    memset(bus, 0, sizeof(sim_bus_t));
+    memset(device, 0, sizeof(device));
+
+    // A memory, and a sensor with a chip id register
+    device[0].address = 0x50;
+    device[1].address = 0x76;
+    device[1].reg[0xd0] = 0x60;
+
+    bus->device = device;
+    bus->devices = 2;
+    bus->deferred = deferred;
+}
+
+TEST_CASE("sys", "[i2c_msg]") {
+    uint8_t reg[] = {0xd0}, wr[] = {0x10, 1, 2, 3}, ctrl[] = {0xf4, 0x27}, rd[3];
+    sim_bus_t bus;
+    int done, deferred;
+
+    // Invalid lists
+    i2c_msg_t bad_addr[] = {{0x80, 0, 0, NULL}};
+    i2c_msg_t bad_read[] = {{0x50, I2C_MSG_READ, 0, rd}};
+    i2c_msg_t bad_buf[] = {{0x50, 0, 1, NULL}};
+
+    TEST_ASSERT_EQUAL(I2C_MSG_ERR_INVALID, i2c_msg_check(bad_addr, 1));
+    TEST_ASSERT_EQUAL(I2C_MSG_ERR_INVALID, i2c_msg_check(bad_read, 1));
+    TEST_ASSERT_EQUAL(I2C_MSG_ERR_INVALID, i2c_msg_check(bad_buf, 1));
+    TEST_ASSERT_EQUAL(I2C_MSG_ERR_INVALID, i2c_msg_check(bad_buf, 0));
+
+    // Write a register address, and read with a repeated start
+    i2c_msg_t chip_id[] = {
+        {0x76, 0, sizeof(reg), reg},
+        {0x76, I2C_MSG_READ, 1, rd},
+    };
+
+    TEST_ASSERT_EQUAL(0, i2c_msg_check(chip_id, 2));
+    TEST_ASSERT_EQUAL(1, i2c_msg_segments(chip_id, 2));
+
+    sim_init(&bus, 0);
+    TEST_ASSERT_EQUAL(0, i2c_msg_run(chip_id, 2, &sim_ops, &bus, &done));
+    TEST_ASSERT_EQUAL(2, done);
+    TEST_ASSERT_EQUAL(0x60, rd[0]);
+    TEST_ASSERT(strcmp(bus.trace, "SSP") == 0);
+
+    // Several devices, back-to-back
+    i2c_msg_t list[] = {
+        {0x50, I2C_MSG_STOP, sizeof(wr), wr},
+        {0x76, I2C_MSG_STOP, sizeof(ctrl), ctrl},
+        {0x50, 0, 1, wr},
+        {0x50, I2C_MSG_READ, 3, rd},
+    };
+
+    TEST_ASSERT_EQUAL(0, i2c_msg_check(list, 4));
+    TEST_ASSERT_EQUAL(3, i2c_msg_segments(list, 4));
+
+    for(deferred = 0;deferred < 2;deferred++) {
+        sim_init(&bus, deferred);
+        memset(rd, 0, sizeof(rd));
+
+        TEST_ASSERT_EQUAL(0, i2c_msg_run(list, 4, &sim_ops, &bus, &done));
+        TEST_ASSERT_EQUAL(4, done);
+        TEST_ASSERT(strcmp(bus.trace, "SPSPSSP") == 0);
+        TEST_ASSERT(memcmp(rd, &wr[1], 3) == 0);
+        TEST_ASSERT_EQUAL(0x27, device[1].reg[0xf4]);
+    }
+
+    // A missing device aborts its segment, and the list
+    list[1].address = 0x20;
+
+    sim_init(&bus, 0);
+    TEST_ASSERT_EQUAL(I2C_MSG_ERR_NACK, i2c_msg_run(list, 4, &sim_ops, &bus, &done));
+    TEST_ASSERT_EQUAL(1, done);
+    TEST_ASSERT(strcmp(bus.trace, "SPSX") == 0);
+
+    sim_init(&bus, 1);
+    TEST_ASSERT_EQUAL(I2C_MSG_ERR_NACK, i2c_msg_run(list, 4, &sim_ops, &bus, &done));
+    TEST_ASSERT_EQUAL(1, done);
+    TEST_ASSERT(strcmp(bus.trace, "SPSP") == 0);
+    TEST_ASSERT_EQUAL(0, device[1].reg[0xf4]);
+
+    // Address probe
+    i2c_msg_t probe[] = {{0x50, 0, 0, NULL}};
+
+    TEST_ASSERT_EQUAL(0, i2c_msg_check(probe, 1));
+
+    sim_init(&bus, 0);
+    TEST_ASSERT_EQUAL(0, i2c_msg_run(probe, 1, &sim_ops, &bus, NULL));
+
+    probe[0].address = 0x51;
+    TEST_ASSERT_EQUAL(I2C_MSG_ERR_NACK, i2c_msg_run(probe, 1, &sim_ops, &bus, NULL));
+}
+
+#endif
@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor deferred callbacks test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include <drivers/sensor_deferred.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+#define TEST_QUEUE_MAX   8
+#define TEST_OWNERS      4
+#define TEST_ISR_SAMPLES 200000
+
+// Owner of a slot, with a value and a flag, like the data and the latch of a
+// sensor instance
+typedef struct test_owner {
+    sensor_deferred_t slot;
+    int32_t value;          // Set by the producer
+    uint8_t flag;           // Set by the producer
+    int32_t deferred_value; // Stored in the slot
+    uint8_t deferred_flag;  // Stored in the slot, ORed when coalesced
+    uint32_t posts;
+    uint32_t calls;
+    uint32_t closed_stores; // Stores after the slot was closed
+    int32_t last;           // Last value got by the consumer
+    uint8_t flags;          // Flags got by the consumer, ORed
+    int ordered;
+    void (*on_call)(struct test_owner *owner);
+} test_owner_t;
+
+typedef struct {
+    int32_t value;
+    uint8_t flag;
+} test_event_t;
+
+static pthread_mutex_t lock_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dispatch_mtx;
+
+// Queue of the consumer
+static pthread_mutex_t queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+static sensor_deferred_t *queue[TEST_QUEUE_MAX];
+static uint32_t queue_head;
+static uint32_t queue_count;
+static uint32_t queue_len;
+
+static sensor_dispatch_t dispatch;
+
+static void test_lock(int isr) {
+    pthread_mutex_lock(&lock_mtx);
+}
+
+static void test_unlock(int isr) {
+    pthread_mutex_unlock(&lock_mtx);
+}
+
+static void test_store(sensor_deferred_t *slot, uint8_t from, uint8_t to, int coalesce) {
+    test_owner_t *owner = (test_owner_t *)slot->owner;
+
+    if (slot->closed) {
+        owner->closed_stores++;
+    }
+
+    owner->deferred_value = owner->value;
+    if (coalesce) {
+        owner->deferred_flag |= owner->flag;
+    } else {
+        owner->deferred_flag = owner->flag;
+    }
+}
+
+static void test_load(sensor_deferred_t *slot, void *arg) {
+    test_owner_t *owner = (test_owner_t *)slot->owner;
+    test_event_t *event = (test_event_t *)arg;
+
+    event->value = owner->deferred_value;
+    event->flag = owner->deferred_flag;
+}
+
+static void test_call(sensor_deferred_t *slot, void *arg) {
+    test_owner_t *owner = (test_owner_t *)slot->owner;
+    test_event_t *event = (test_event_t *)arg;
+
+    if (event->value < owner->last) {
+        owner->ordered = 0;
+    }
+
+    owner->last = event->value;
+    owner->flags |= event->flag;
+
+    // Read by the test cases while the consumer runs
+    __atomic_add_fetch(&owner->calls, 1, __ATOMIC_RELEASE);
+
+    if (owner->on_call) {
+        owner->on_call(owner);
+    }
+}
+
+static int test_send(sensor_deferred_t *slot, int isr) {
+    int queued = 0;
+
+    pthread_mutex_lock(&queue_mtx);
+    if (queue_count < queue_len) {
+        queue[(queue_head + queue_count) % TEST_QUEUE_MAX] = slot;
+        queue_count++;
+        queued = 1;
+    }
+    pthread_mutex_unlock(&queue_mtx);
+
+    return queued;
+}
+
+static int test_receive(sensor_deferred_t **slot) {
+    int received = 0;
+
+    pthread_mutex_lock(&queue_mtx);
+    if (queue_count > 0) {
+        *slot = queue[queue_head];
+        queue_head = (queue_head + 1) % TEST_QUEUE_MAX;
+        queue_count--;
+        received = 1;
+    }
+    pthread_mutex_unlock(&queue_mtx);
+
+    return received;
+}
+
+static uint32_t test_waiting(void) {
+    uint32_t count;
+
+    pthread_mutex_lock(&queue_mtx);
+    count = queue_count;
+    pthread_mutex_unlock(&queue_mtx);
+
+    return count;
+}
+
+static void test_dispatch_lock(void) {
+    pthread_mutex_lock(&dispatch_mtx);
+}
+
+static void test_dispatch_unlock(void) {
+    pthread_mutex_unlock(&dispatch_mtx);
+}
+
+static void test_yield(void) {
+    sched_yield();
+}
+
+static const sensor_deferred_ops_t test_ops = {
+    .lock = test_lock,
+    .unlock = test_unlock,
+    .store = test_store,
+    .load = test_load,
+    .call = test_call,
+    .send = test_send,
+    .receive = test_receive,
+    .waiting = test_waiting,
+    .dispatch_lock = test_dispatch_lock,
+    .dispatch_unlock = test_dispatch_unlock,
+    .yield = test_yield,
+};
+
+// Get the number of queued entries of a slot
+static int queued(sensor_deferred_t *slot) {
+    uint32_t i;
+    int n = 0;
+
+    pthread_mutex_lock(&queue_mtx);
+    for(i = 0;i < queue_count;i++) {
+        if (queue[(queue_head + i) % TEST_QUEUE_MAX] == slot) {
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&queue_mtx);
+
+    return n;
+}
+
+static void setup(uint32_t len, test_owner_t *owners, int n) {
+    pthread_mutexattr_t attr;
+    int i;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&dispatch_mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    queue_head = 0;
+    queue_count = 0;
+    queue_len = len;
+
+    sensor_dispatch_init(&dispatch, &test_ops);
+
+    memset(owners, 0, sizeof(test_owner_t) * n);
+    for(i = 0;i < n;i++) {
+        sensor_deferred_init(&owners[i].slot, &owners[i]);
+        owners[i].ordered = 1;
+    }
+}
+
+// Post a new value of an owner, as an interrupt handler does
+static int post(test_owner_t *owner, uint8_t flag) {
+    owner->value++;
+    owner->flag = flag;
+    owner->posts++;
+
+    return sensor_deferred_post(&dispatch, &owner->slot, 0, 0, 1);
+}
+
+// Dispatch until the queue is empty
+static void drain(void) {
+    test_event_t event;
+
+    while (test_waiting() > 0) {
+        TEST_ASSERT_NULL(sensor_deferred_dispatch(&dispatch, &event));
+    }
+}
+
+/*
+ * Consumer thread, and fake interrupt handler thread
+ */
+
+static volatile int stop_consumer;
+static volatile int stop_isr;
+static volatile int isr_rounds;
+static volatile int isr_skip;   // Owner not posted by the fake interrupt handler
+static int isr_samples;         // Samples to post, or 0 to post until stopped
+static test_owner_t *isr_owners;
+static int isr_n;
+
+static void *consumer(void *arg) {
+    test_event_t event;
+
+    while (!__atomic_load_n(&stop_consumer, __ATOMIC_ACQUIRE)) {
+        if (test_waiting() == 0) {
+            sched_yield();
+            continue;
+        }
+
+        sensor_deferred_dispatch(&dispatch, &event);
+    }
+
+    return NULL;
+}
+
+static void *isr(void *arg) {
+    int i, j;
+
+    for(i = 0;!__atomic_load_n(&stop_isr, __ATOMIC_ACQUIRE);i++) {
+        if (isr_samples && (i >= isr_samples)) {
+            break;
+        }
+
+        j = i % isr_n;
+        if (j != __atomic_load_n(&isr_skip, __ATOMIC_ACQUIRE)) {
+            post(&isr_owners[j], (i & 0xff) == 0);
+        }
+
+        __atomic_store_n(&isr_rounds, i + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void start_threads(pthread_t *c, pthread_t *p, test_owner_t *owners, int n, int samples) {
+    stop_consumer = 0;
+    stop_isr = 0;
+    isr_rounds = 0;
+    isr_skip = -1;
+    isr_samples = samples;
+    isr_owners = owners;
+    isr_n = n;
+
+    TEST_ASSERT(pthread_create(c, NULL, consumer, NULL) == 0);
+    TEST_ASSERT(pthread_create(p, NULL, isr, NULL) == 0);
+}
+
+static void stop_threads(pthread_t c, pthread_t p) {
+    __atomic_store_n(&stop_isr, 1, __ATOMIC_RELEASE);
+    pthread_join(p, NULL);
+
+    __atomic_store_n(&stop_consumer, 1, __ATOMIC_RELEASE);
+    pthread_join(c, NULL);
+}
+
+/*
+ * Test cases
+ */
+
+TEST_CASE("sys", "[sensor_deferred]") {
+    test_owner_t owners[3];
+    test_event_t event;
+
+    setup(2, owners, 3);
+
+    // The first event queues the slot, and the next ones are coalesced
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[0], 0));
+    TEST_ASSERT(owners[0].slot.pending);
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_COALESCED, post(&owners[0], 1));
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_COALESCED, post(&owners[0], 0));
+    TEST_ASSERT_EQUAL(1, queued(&owners[0].slot));
+
+    // The consumer gets the last value, and the flags of all the events
+    TEST_ASSERT_NULL(sensor_deferred_dispatch(&dispatch, &event));
+    TEST_ASSERT_EQUAL(1, owners[0].calls);
+    TEST_ASSERT_EQUAL(3, owners[0].last);
+    TEST_ASSERT_EQUAL(1, owners[0].flags);
+    TEST_ASSERT(!owners[0].slot.pending);
+    TEST_ASSERT_EQUAL(1, owners[0].slot.dispatched);
+    TEST_ASSERT_EQUAL(2, owners[0].slot.coalesced);
+
+    // Nothing queued
+    TEST_ASSERT_NULL(sensor_deferred_dispatch(&dispatch, &event));
+    TEST_ASSERT_EQUAL(1, owners[0].calls);
+
+    // When the queue is full the event is dropped, and the next one can be
+    // queued
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[0], 0));
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[1], 0));
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_DROPPED, post(&owners[2], 0));
+    TEST_ASSERT(!owners[2].slot.pending);
+    TEST_ASSERT_EQUAL(1, owners[2].slot.dropped);
+
+    drain();
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[2], 0));
+    drain();
+    TEST_ASSERT_EQUAL(1, owners[2].calls);
+    TEST_ASSERT_EQUAL(2, owners[2].last);
+
+    // A closed slot doesn't accept events
+    TEST_ASSERT_EQUAL(0, sensor_deferred_close(&dispatch, &owners[1].slot));
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_CLOSED, post(&owners[1], 0));
+    TEST_ASSERT_EQUAL(0, queued(&owners[1].slot));
+    TEST_ASSERT_EQUAL(1, owners[1].slot.dispatched);
+    TEST_ASSERT_EQUAL(0, owners[1].closed_stores);
+
+    pthread_mutex_destroy(&dispatch_mtx);
+}
+
+TEST_CASE("sys", "[sensor_deferred_isr]") {
+    test_owner_t owners[TEST_OWNERS];
+    pthread_t c, p;
+    int i;
+
+    // A queue shorter than the number of owners, so that there are drops
+    setup(TEST_OWNERS - 1, owners, TEST_OWNERS);
+
+    start_threads(&c, &p, owners, TEST_OWNERS, TEST_ISR_SAMPLES);
+    pthread_join(p, NULL);
+
+    while (test_waiting() > 0) {
+        sched_yield();
+    }
+
+    __atomic_store_n(&stop_consumer, 1, __ATOMIC_RELEASE);
+    pthread_join(c, NULL);
+    drain();
+
+    for(i = 0;i < TEST_OWNERS;i++) {
+        // Each event is dispatched, coalesced, or dropped, and each dispatch
+        // calls the consumer once, with the values in order
+        TEST_ASSERT_EQUAL(owners[i].posts, owners[i].slot.dispatched + owners[i].slot.coalesced + owners[i].slot.dropped);
+        TEST_ASSERT_EQUAL(owners[i].slot.dispatched, owners[i].calls);
+        TEST_ASSERT(owners[i].ordered);
+        TEST_ASSERT(!owners[i].slot.pending);
+        TEST_ASSERT(!owners[i].slot.sending);
+
+        // The last value is delivered, once the queue has space
+        TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[i], 0));
+        drain();
+        TEST_ASSERT_EQUAL(owners[i].value, owners[i].last);
+    }
+
+    pthread_mutex_destroy(&dispatch_mtx);
+}
+
+TEST_CASE("sys", "[sensor_deferred_close]") {
+    test_owner_t *owners;
+    pthread_t c, p;
+    uint32_t calls;
+    int rounds;
+
+    // Owners are allocated, so that a use after free is reported by the
+    // address sanitizer
+    owners = calloc(2, sizeof(test_owner_t));
+    TEST_ASSERT_NOT_NULL(owners);
+
+    setup(TEST_QUEUE_MAX, owners, 2);
+
+    start_threads(&c, &p, owners, 2, 0);
+
+    while ((__atomic_load_n(&isr_rounds, __ATOMIC_ACQUIRE) < 10000) ||
+           (__atomic_load_n(&owners[0].calls, __ATOMIC_ACQUIRE) == 0)) {
+        sched_yield();
+    }
+
+    // Closed while the producer posts events, and the consumer dispatches
+    // them, as sensor_unsetup does
+    TEST_ASSERT_EQUAL(0, sensor_deferred_close(&dispatch, &owners[0].slot));
+    TEST_ASSERT_EQUAL(0, queued(&owners[0].slot));
+    calls = owners[0].calls;
+
+    // Then the interrupt is detached
+    __atomic_store_n(&isr_skip, 0, __ATOMIC_RELEASE);
+    rounds = __atomic_load_n(&isr_rounds, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&isr_rounds, __ATOMIC_ACQUIRE) < rounds + 2) {
+        sched_yield();
+    }
+
+    TEST_ASSERT_EQUAL(calls, owners[0].calls);
+    TEST_ASSERT_EQUAL(0, owners[0].closed_stores);
+
+    // The other owner is still dispatched
+    calls = __atomic_load_n(&owners[1].calls, __ATOMIC_ACQUIRE);
+    rounds = __atomic_load_n(&isr_rounds, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&isr_rounds, __ATOMIC_ACQUIRE) < rounds + 10000) {
+        sched_yield();
+    }
+
+    stop_threads(c, p);
+    drain();
+
+    TEST_ASSERT(owners[1].calls > calls);
+    TEST_ASSERT(owners[1].ordered);
+    TEST_ASSERT_EQUAL(0, owners[1].closed_stores);
+    TEST_ASSERT_EQUAL(owners[1].posts, owners[1].slot.dispatched + owners[1].slot.coalesced + owners[1].slot.dropped);
+
+    free(owners);
+    pthread_mutex_destroy(&dispatch_mtx);
+}
+
+static test_owner_t *detach_owners;
+
+// Detaches the owner and the next one, from the consumer, as a callback that
+// calls sensor_unsetup
+static void detach(test_owner_t *owner) {
+    TEST_ASSERT_EQUAL(0, sensor_deferred_close(&dispatch, &detach_owners[1].slot));
+    TEST_ASSERT_EQUAL(1, sensor_deferred_close(&dispatch, &owner->slot));
+    dispatch.detached = 1;
+}
+
+TEST_CASE("sys", "[sensor_deferred_detach]") {
+    test_owner_t owners[3];
+    test_event_t event;
+
+    setup(TEST_QUEUE_MAX, owners, 3);
+    detach_owners = owners;
+
+    owners[0].on_call = detach;
+
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[0], 0));
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[1], 0));
+    TEST_ASSERT_EQUAL(SENSOR_DEFERRED_QUEUED, post(&owners[2], 0));
+
+    // The detached owner is returned, to be freed by the consumer
+    TEST_ASSERT(sensor_deferred_dispatch(&dispatch, &event) == &owners[0]);
+    TEST_ASSERT_EQUAL(0, dispatch.detached);
+    TEST_ASSERT_NULL(dispatch.dispatching);
+
+    // The other queued entries are kept, in order
+    TEST_ASSERT_EQUAL(1, test_waiting());
+    TEST_ASSERT_NULL(sensor_deferred_dispatch(&dispatch, &event));
+    TEST_ASSERT_EQUAL(1, owners[2].calls);
+    TEST_ASSERT_EQUAL(0, owners[1].calls);
+    TEST_ASSERT_EQUAL(0, test_waiting());
+
+    pthread_mutex_destroy(&dispatch_mtx);
+}
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor callback dispatch test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <drivers/cpu.h>
+#include <drivers/sensor.h>
+#include <drivers/timer.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+#define TEST_SAMPLES     20000
+#define TEST_ISR_SAMPLES 5000
+#define TEST_ISR_PERIOD  100  // In usecs
+#define TEST_TIMER       CPU_TIMER3
+
+static const sensor_t test_sensor = {
+    .id = "TEST",
+    .interface = {
+        {.type = INTERNAL_INTERFACE, .flags = SENSOR_FLAG_AUTO_ACQ},
+    },
+    .data = {
+        {.id = "value", .type = SENSOR_DATA_INT},
+    },
+};
+
+static SemaphoreHandle_t done;
+static volatile int32_t target;
+static volatile uint32_t calls;
+static volatile int32_t last;
+static volatile int ordered;
+
+static sensor_instance_t *isr_unit;
+static volatile int32_t isr_value;
+static volatile uint32_t isr_context;
+
+static void callback(int id, sensor_instance_t *unit, sensor_value_t *data, sensor_latch_t *latch) {
+    // Values must be delivered in order
+    if (data[0].integerd.value <= last) {
+        ordered = 0;
+    }
+
+    last = data[0].integerd.value;
+    calls++;
+
+    if (last == target) {
+        xSemaphoreGive(done);
+    }
+}
+
+// Simulates a driver that gets a new value on each acquisition, from a task
+static void *producer(void *arg) {
+    sensor_instance_t *unit = (sensor_instance_t *)arg;
+    sensor_value_t data[SENSOR_MAX_PROPERTIES];
+    int i;
+
+    for(i = 1; i <= TEST_SAMPLES; i++) {
+        data[0].integerd.value = i;
+        sensor_update_data(unit, 0, 0, data, 0, 0, 0, 0);
+    }
+
+    return NULL;
+}
+
+// Simulates an interrupt driven sensor, as the GPIO interrupt handler of the
+// sensor driver does. Runs in the timer interrupt.
+static void IRAM_ATTR isr_producer(void *arg) {
+    if (isr_value >= TEST_ISR_SAMPLES) {
+        return;
+    }
+
+    isr_context += xPortInIsrContext();
+
+    isr_unit->latch[0].value.integerd.value = isr_unit->data[0].integerd.value;
+    isr_unit->data[0].integerd.value = ++isr_value;
+
+    sensor_queue_callbacks(isr_unit, 0, 0);
+}
+
+static void start(sensor_instance_t *unit, int32_t samples) {
+    sensor_init_data(unit);
+    sensor_deferred_init(&unit->deferred.slot, unit);
+
+    calls = 0;
+    last = 0;
+    ordered = 1;
+    target = samples;
+}
+
+static void check(sensor_instance_t *unit, int32_t samples) {
+    // Wait until the last value is delivered
+    TEST_ASSERT(xSemaphoreTake(done, 5000 / portTICK_PERIOD_MS) == pdTRUE);
+
+    // Each sample changes the value, so it must be dispatched, or coalesced
+    // into a pending event. An instance is queued at most once, so no events
+    // can be dropped.
+    TEST_ASSERT(unit->deferred.slot.dispatched + unit->deferred.slot.coalesced + unit->deferred.slot.dropped == samples);
+    TEST_ASSERT(unit->deferred.slot.dropped == 0);
+    TEST_ASSERT(calls == unit->deferred.slot.dispatched);
+    TEST_ASSERT(ordered);
+    TEST_ASSERT(last == samples);
+    TEST_ASSERT(!unit->deferred.slot.pending);
+}
+
+TEST_CASE("sys", "[sensor_dispatch]") {
+    sensor_instance_t *unit;
+    pthread_t thread;
+
+    done = xSemaphoreCreateBinary();
+    TEST_ASSERT(done != NULL);
+
+    unit = (sensor_instance_t *)calloc(1, sizeof(sensor_instance_t));
+    TEST_ASSERT(unit != NULL);
+
+    unit->sensor = &test_sensor;
+    mtx_init(&unit->mtx, NULL, NULL, 0);
+
+    TEST_ASSERT(sensor_register_callback(unit, callback, 0, 1) == NULL);
+
+    // From a task
+    start(unit, TEST_SAMPLES);
+
+    TEST_ASSERT(pthread_create(&thread, NULL, producer, unit) == 0);
+    pthread_join(thread, NULL);
+
+    check(unit, TEST_SAMPLES);
+
+    // A sample without changes must not be dispatched
+    sensor_update_data(unit, 0, 0, unit->data, 0, 0, 0, 0);
+    TEST_ASSERT(!unit->deferred.slot.pending);
+
+    // From an interrupt handler
+    start(unit, TEST_ISR_SAMPLES);
+
+    isr_unit = unit;
+    isr_value = 0;
+    isr_context = 0;
+
+    TEST_ASSERT(tmr_setup(TEST_TIMER, TEST_ISR_PERIOD, isr_producer, 0) == NULL);
+    TEST_ASSERT(tmr_start(TEST_TIMER) == NULL);
+
+    check(unit, TEST_ISR_SAMPLES);
+
+    TEST_ASSERT(tmr_unsetup(TEST_TIMER) == NULL);
+    TEST_ASSERT(isr_context == TEST_ISR_SAMPLES);
+
+    unit->callbacks[0].callback = NULL;
+    mtx_destroy(&unit->mtx);
+    free(unit);
+
+    vSemaphoreDelete(done);
+}
+
+#endif
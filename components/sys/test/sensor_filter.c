@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor data filters test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <math.h>
+
+#include <drivers/sensor_filter.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+#define TEST_EPSILON 1e-5f
+
+static const float input[] = {1, 5, 2, 8, 3, 3, 9, 4};
+
+#define TEST_SAMPLES (sizeof(input) / sizeof(input[0]))
+
+// Filter the input samples, and check the outputs against a reference vector.
+// fired is the expected return value for each sample.
+static void check_filter(const sensor_filter_config_t *config, const float *x, const float *expected, const int *fired, int samples) {
+    sensor_filter_t filter;
+    float y;
+    int i;
+
+    TEST_ASSERT_EQUAL(0, sensor_filter_init(&filter, config));
+
+    for(i = 0;i < samples;i++) {
+        TEST_ASSERT_EQUAL(fired[i], sensor_filter_process(&filter, x[i], &y));
+        TEST_ASSERT(fabsf(y - expected[i]) < TEST_EPSILON);
+    }
+}
+
+static void check_invalid(sensor_filter_type_t type, uint8_t n, float alpha, float deadband) {
+    sensor_filter_config_t config = {.type = type, .n = n, .alpha = alpha, .deadband = deadband};
+    sensor_filter_t filter;
+
+    TEST_ASSERT_EQUAL(-1, sensor_filter_init(&filter, &config));
+}
+
+TEST_CASE("sys", "[sensor_filter]") {
+    static const int all[TEST_SAMPLES] = {1, 1, 1, 1, 1, 1, 1, 1};
+
+    // Moving average, shorter windows until the window is full
+    static const sensor_filter_config_t average = {.type = SENSOR_FILTER_AVERAGE, .n = 3};
+    static const float average_y[] = {1, 3, 8.0f / 3, 5, 13.0f / 3, 14.0f / 3, 5, 16.0f / 3};
+    check_filter(&average, input, average_y, all, TEST_SAMPLES);
+
+    // Median
+    static const sensor_filter_config_t median = {.type = SENSOR_FILTER_MEDIAN, .n = 3};
+    static const float median_y[] = {1, 3, 2, 5, 3, 3, 3, 4};
+    check_filter(&median, input, median_y, all, TEST_SAMPLES);
+
+    // Single pole IIR, starting at the first sample
+    static const sensor_filter_config_t iir = {.type = SENSOR_FILTER_IIR, .alpha = 0.5f};
+    static const float iir_y[] = {1, 3, 2.5, 5.25, 4.125, 3.5625, 6.28125, 5.140625};
+    check_filter(&iir, input, iir_y, all, TEST_SAMPLES);
+
+    // 3:1 decimation, holding the last output
+    static const sensor_filter_config_t decimate = {.type = SENSOR_FILTER_DECIMATE, .n = 3};
+    static const float decimate_y[] = {1, 1, 1, 8, 8, 8, 9, 9};
+    static const int decimate_fired[] = {1, 0, 0, 1, 0, 0, 1, 0};
+    check_filter(&decimate, input, decimate_y, decimate_fired, TEST_SAMPLES);
+
+    // Deadband, changes are measured from the last output
+    static const sensor_filter_config_t deadband = {.type = SENSOR_FILTER_NONE, .deadband = 1};
+    static const float deadband_x[] = {10, 10.4, 9.7, 11, 10.9, 12.5};
+    static const float deadband_y[] = {10, 10, 10, 11, 11, 12.5};
+    static const int deadband_fired[] = {1, 0, 0, 1, 0, 1};
+    check_filter(&deadband, deadband_x, deadband_y, deadband_fired, 6);
+
+    // Median with deadband, an outlier doesn't produce a new output
+    static const sensor_filter_config_t median_deadband = {.type = SENSOR_FILTER_MEDIAN, .n = 3, .deadband = 0.5f};
+    static const float median_deadband_x[] = {20, 20.1, 35, 20.2, 20.9};
+    static const float median_deadband_y[] = {20, 20, 20, 20, 20.9};
+    static const int median_deadband_fired[] = {1, 0, 0, 0, 1};
+    check_filter(&median_deadband, median_deadband_x, median_deadband_y, median_deadband_fired, 5);
+
+    // Invalid configurations
+    check_invalid(SENSOR_FILTER_AVERAGE, 0, 0, 0);
+    check_invalid(SENSOR_FILTER_MEDIAN, SENSOR_FILTER_MAX_N + 1, 0, 0);
+    check_invalid(SENSOR_FILTER_IIR, 0, 0, 0);
+    check_invalid(SENSOR_FILTER_IIR, 0, 1.5f, 0);
+    check_invalid(SENSOR_FILTER_DECIMATE, 0, 0, 0);
+    check_invalid(SENSOR_FILTER_NONE, 0, 0, -1);
+    check_invalid((sensor_filter_type_t)99, 1, 0, 0);
+}
+
+#endif
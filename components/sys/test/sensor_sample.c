@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor sampling scheduler test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <stdlib.h>
+
+#include <drivers/sensor.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+#define TEST_PERIOD 50
+#define TEST_DEPTH  8
+
+static driver_error_t *sim_acquire(sensor_instance_t *unit, sensor_value_t *values);
+
+// Simulated sensor, on the I2C bus of the setup. Each acquisition returns
+// the number of calls to the acquire function.
+static const sensor_t sim_sensor = {
+    .id = "SIM",
+    .interface = {
+        {.type = I2C_INTERFACE, .flags = SENSOR_FLAG_CUSTOM_INTERFACE_INIT},
+    },
+    .data = {
+        {.id = "value", .type = SENSOR_DATA_INT},
+        {.id = "time", .type = SENSOR_DATA_INT},
+    },
+    .acquire = sim_acquire,
+};
+
+static volatile uint32_t calls[3];
+static volatile uint32_t slow;
+
+static driver_error_t *sim_acquire(sensor_instance_t *unit, sensor_value_t *values) {
+    int idx = unit->setup[0].i2c.devid;
+
+    // Sensor 2 can be slow to acquire
+    if ((idx == 2) && slow) {
+        vTaskDelay(slow / portTICK_PERIOD_MS);
+    }
+
+    calls[idx]++;
+
+    values[0].integerd.value = calls[idx];
+    values[1].integerd.value = sensor_time();
+
+    return NULL;
+}
+
+static sensor_instance_t *sim_attach(int bus, int idx) {
+    sensor_instance_t *unit;
+
+    unit = (sensor_instance_t *)calloc(1, sizeof(sensor_instance_t));
+    TEST_ASSERT(unit != NULL);
+
+    unit->sensor = &sim_sensor;
+    unit->setup[0].i2c.id = bus;
+    unit->setup[0].i2c.devid = idx;
+    mtx_init(&unit->mtx, NULL, NULL, 0);
+    sensor_init_data(unit);
+
+    calls[idx] = 0;
+
+    return unit;
+}
+
+static void sim_detach(sensor_instance_t *unit) {
+    TEST_ASSERT(sensor_sample(unit, 0, 0) == NULL);
+    TEST_ASSERT(unit->sampling.history.samples == NULL);
+
+    mtx_destroy(&unit->mtx);
+    free(unit);
+}
+
+TEST_CASE("sys", "[sensor_sample]") {
+    sensor_instance_t *a, *b, *c;
+    driver_error_t *error;
+    sensor_value_t value[TEST_DEPTH];
+    int64_t t[TEST_DEPTH];
+    uint32_t samples;
+    uint64_t start;
+    int i, count;
+
+    a = sim_attach(0, 0);
+    b = sim_attach(0, 1);
+    c = sim_attach(1, 2);
+
+    // b is due a bit later than a in the same bus, so it's batched with a.
+    // c is in another bus.
+    TEST_ASSERT(sensor_sample(a, TEST_PERIOD, TEST_DEPTH) == NULL);
+    vTaskDelay(5 / portTICK_PERIOD_MS);
+    TEST_ASSERT(sensor_sample(b, TEST_PERIOD, TEST_DEPTH) == NULL);
+    TEST_ASSERT(sensor_sample(c, TEST_PERIOD, 0) == NULL);
+
+    TEST_ASSERT(c->sampling.history.depth == SENSOR_HISTORY_DEPTH);
+
+    vTaskDelay((TEST_PERIOD * 10 + TEST_PERIOD / 2) / portTICK_PERIOD_MS);
+
+    TEST_ASSERT(a->sampling.samples >= 9 && a->sampling.samples <= 12);
+    TEST_ASSERT(b->sampling.samples >= 9 && b->sampling.samples <= 12);
+    TEST_ASSERT(c->sampling.samples >= 9 && c->sampling.samples <= 12);
+    TEST_ASSERT(a->sampling.errors == 0);
+
+    TEST_ASSERT(b->sampling.sched.batched >= b->sampling.samples - 2);
+    TEST_ASSERT(c->sampling.sched.batched == 0);
+
+    // Reads from a sampled sensor don't access the sensor
+    samples = calls[0];
+    TEST_ASSERT(sensor_acquire(a) == NULL);
+    TEST_ASSERT(calls[0] - samples <= 1);
+
+    // History is returned oldest first, and holds at most depth samples
+    count = TEST_DEPTH;
+    TEST_ASSERT(sensor_history(a, "value", &count, t, value) == NULL);
+    TEST_ASSERT(count == TEST_DEPTH);
+
+    for(i = 1; i < count; i++) {
+        TEST_ASSERT(value[i].integerd.value == value[i - 1].integerd.value + 1);
+        TEST_ASSERT(t[i] > t[i - 1]);
+    }
+
+    count = 2;
+    TEST_ASSERT(sensor_history(a, "time", &count, t, value) == NULL);
+    TEST_ASSERT(count == 2);
+    TEST_ASSERT(value[0].integerd.value >= t[0]);
+    TEST_ASSERT(value[1].integerd.value >= t[1]);
+
+    error = sensor_history(a, "none", &count, t, value);
+    TEST_ASSERT(error != NULL);
+    free(error);
+
+    // Stop sampling
+    sim_detach(a);
+    sim_detach(b);
+
+    samples = c->sampling.samples;
+    TEST_ASSERT(sensor_sample(c, 0, 0) == NULL);
+    vTaskDelay((TEST_PERIOD * 2) / portTICK_PERIOD_MS);
+    TEST_ASSERT(c->sampling.samples == samples);
+
+    // Not sampled sensors are acquired on demand
+    samples = calls[2];
+    TEST_ASSERT(sensor_acquire(c) == NULL);
+    TEST_ASSERT(calls[2] == samples + 1);
+
+    // A slow acquisition doesn't block sampling changes of other sensors
+    slow = TEST_PERIOD * 4;
+    TEST_ASSERT(sensor_sample(c, TEST_PERIOD, 0) == NULL);
+    vTaskDelay((TEST_PERIOD / 2) / portTICK_PERIOD_MS);
+
+    a = sim_attach(0, 0);
+    start = sensor_time();
+    TEST_ASSERT(sensor_sample(a, TEST_PERIOD, TEST_DEPTH) == NULL);
+    TEST_ASSERT(sensor_time() - start < TEST_PERIOD);
+    sim_detach(a);
+
+    // Stopping a sensor waits until its acquisition ends
+    samples = calls[2];
+    sim_detach(c);
+    TEST_ASSERT(calls[2] == samples + 1);
+    slow = 0;
+}
+
+#endif
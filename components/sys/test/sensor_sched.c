@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sensor sampling scheduler test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <drivers/sensor_sched.h>
+
+#if CONFIG_LUA_RTOS_LUA_USE_SENSOR
+
+// Fake time source, moved by the test cases
+static uint64_t fake_now = 0;
+
+static uint64_t fake_clock(void) {
+    return fake_now;
+}
+
+// Get the number of entries in a round, checking that they are busy
+static int round_size(sensor_sched_entry_t *round) {
+    int n = 0;
+
+    for(;round;round = round->round) {
+        TEST_ASSERT(round->busy);
+        n++;
+    }
+
+    return n;
+}
+
+TEST_CASE("sys", "[sensor_sched]") {
+    sensor_sched_entry_t a, *round;
+    sensor_sched_t sched;
+    uint64_t now;
+
+    fake_now = 1000;
+    sensor_sched_init(&sched, fake_clock);
+
+    // No entries
+    TEST_ASSERT(sensor_sched_next(&sched) == UINT64_MAX);
+    TEST_ASSERT_NULL(sensor_sched_round(&sched, &now));
+    TEST_ASSERT(now == 1000);
+
+    // A new entry is due now, and then each period, keeping the phase
+    sensor_sched_add(&sched, &a, 100, 0, &a);
+    TEST_ASSERT(sensor_sched_next(&sched) == 1000);
+
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT(round == &a);
+    TEST_ASSERT(a.arg == &a);
+    TEST_ASSERT_EQUAL(1, round_size(round));
+    TEST_ASSERT(a.due == 1100);
+
+    // A busy entry is not selected again, even if it's due
+    fake_now = 1100;
+    TEST_ASSERT_NULL(sensor_sched_round(&sched, &now));
+    sensor_sched_end(round);
+    TEST_ASSERT(!a.busy);
+
+    fake_now = 1130;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT(round == &a);
+    TEST_ASSERT(a.due == 1200);
+    sensor_sched_end(round);
+
+    // More than a period late, the phase is restarted
+    fake_now = 1450;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT(round == &a);
+    TEST_ASSERT(a.due == 1550);
+    sensor_sched_end(round);
+
+    // Not due
+    fake_now = 1549;
+    TEST_ASSERT_NULL(sensor_sched_round(&sched, &now));
+    TEST_ASSERT(sensor_sched_next(&sched) == 1550);
+
+    sensor_sched_remove(&sched, &a);
+    TEST_ASSERT(a.period == 0);
+    TEST_ASSERT(sensor_sched_next(&sched) == UINT64_MAX);
+
+    // Removing an entry that is not scheduled does nothing
+    sensor_sched_remove(&sched, &a);
+    TEST_ASSERT(sensor_sched_next(&sched) == UINT64_MAX);
+}
+
+TEST_CASE("sys", "[sensor_sched_bus]") {
+    sensor_sched_entry_t a, b, c, d, *round, *entry;
+    sensor_sched_t sched;
+    uint64_t now;
+    int seen;
+
+    fake_now = 0;
+    sensor_sched_init(&sched, fake_clock);
+
+    // a and b in bus 1, c in bus 2, d not batched. b, c, and d are added
+    // 20 ms after a.
+    sensor_sched_add(&sched, &a, 100, 1, &a);
+    fake_now = 20;
+    sensor_sched_add(&sched, &b, 100, 1, &b);
+    sensor_sched_add(&sched, &c, 100, 2, &c);
+    sensor_sched_add(&sched, &d, 100, 0, &d);
+
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT_EQUAL(4, round_size(round));
+    TEST_ASSERT_EQUAL(0, a.batched);
+    TEST_ASSERT(a.due == 100);
+    TEST_ASSERT(b.due == 120);
+    sensor_sched_end(round);
+
+    // When a is due, b is selected with it, because it's due in less than a
+    // quarter of its period
+    fake_now = 100;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT_EQUAL(2, round_size(round));
+
+    seen = 0;
+    for(entry = round;entry;entry = entry->round) {
+        if (entry == &a) seen |= 1;
+        if (entry == &b) seen |= 2;
+    }
+    TEST_ASSERT_EQUAL(3, seen);
+
+    TEST_ASSERT_EQUAL(0, a.batched);
+    TEST_ASSERT_EQUAL(1, b.batched);
+    TEST_ASSERT(a.due == 200);
+    TEST_ASSERT(b.due == 220);
+    sensor_sched_end(round);
+
+    // c and d are sampled at their own time, they don't share a bus
+    fake_now = 120;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT_EQUAL(2, round_size(round));
+    TEST_ASSERT_EQUAL(0, c.batched);
+    TEST_ASSERT_EQUAL(0, d.batched);
+    sensor_sched_end(round);
+
+    // b is always sampled early, with a
+    fake_now = 200;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT_EQUAL(2, round_size(round));
+    TEST_ASSERT_EQUAL(2, b.batched);
+    TEST_ASSERT(b.due == 320);
+    sensor_sched_end(round);
+
+    fake_now = 220;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT_EQUAL(2, round_size(round));
+    sensor_sched_end(round);
+
+    sensor_sched_remove(&sched, &c);
+    sensor_sched_remove(&sched, &d);
+
+    // An entry in the same bus that is busy is not selected
+    fake_now = 300;
+    b.busy = 1;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT(round == &a);
+    TEST_ASSERT_EQUAL(1, round_size(round));
+    TEST_ASSERT_EQUAL(2, b.batched);
+    TEST_ASSERT(b.due == 320);
+    sensor_sched_end(round);
+    b.busy = 0;
+
+    // An entry in the same bus that is not almost due is not selected
+    b.due = 700;
+    fake_now = 400;
+    round = sensor_sched_round(&sched, &now);
+    TEST_ASSERT(round == &a);
+    TEST_ASSERT_EQUAL(1, round_size(round));
+    sensor_sched_end(round);
+
+    TEST_ASSERT(sensor_sched_next(&sched) == 500);
+}
+
+TEST_CASE("sys", "[sensor_ring]") {
+    sensor_ring_t ring;
+    const int64_t *sample;
+    int64_t values[2];
+    int i;
+
+    TEST_ASSERT_EQUAL(0, sensor_ring_init(&ring, 3, 2));
+    TEST_ASSERT_EQUAL(0, ring.count);
+
+    // Until the history is full
+    for(i = 0;i < 2;i++) {
+        values[0] = i;
+        values[1] = -i;
+        sensor_ring_add(&ring, 100 * i, values);
+    }
+
+    TEST_ASSERT_EQUAL(2, ring.count);
+    sample = sensor_ring_sample(&ring, 0);
+    TEST_ASSERT(sample[0] == 0);
+    sample = sensor_ring_sample(&ring, 1);
+    TEST_ASSERT(sample[0] == 100 && sample[1] == 1 && sample[2] == -1);
+
+    // Then the oldest samples are replaced
+    for(;i < 5;i++) {
+        values[0] = i;
+        values[1] = -i;
+        sensor_ring_add(&ring, 100 * i, values);
+    }
+
+    TEST_ASSERT_EQUAL(3, ring.count);
+    for(i = 0;i < 3;i++) {
+        sample = sensor_ring_sample(&ring, i);
+        TEST_ASSERT(sample[0] == 100 * (i + 2));
+        TEST_ASSERT(sample[1] == i + 2);
+        TEST_ASSERT(sample[2] == -(i + 2));
+    }
+
+    sensor_ring_free(&ring);
+    TEST_ASSERT_NULL(ring.samples);
+    TEST_ASSERT_EQUAL(0, ring.count);
+    sensor_ring_free(&ring);
+}
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, SPI DMA transaction planner test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <drivers/spi_dma.h>
+
+// Plan a transfer, and check that the transactions cover the whole transfer
+// in order, and that they fit in the descriptors. Returns the number of
+// transactions.
+static uint32_t check_plan(uint32_t bytes, uint32_t word_size, uint32_t descriptors) {
+    spi_dma_plan_t plan;
+    uint32_t offset, expected = 0, len, n = 0;
+
+    spi_dma_plan_init(&plan, bytes, word_size, descriptors);
+
+    while (spi_dma_plan_pending(&plan) > 0) {
+        uint32_t pending = spi_dma_plan_pending(&plan);
+
+        len = spi_dma_plan_next(&plan, &offset);
+
+        TEST_ASSERT_EQUAL(expected, offset);
+        TEST_ASSERT(len > 0);
+        TEST_ASSERT(spi_dma_descriptors(len) <= descriptors);
+        TEST_ASSERT_EQUAL(0, len % word_size);
+        TEST_ASSERT_EQUAL(pending - 1, spi_dma_plan_pending(&plan));
+
+        // Only the last transaction can break the word alignment
+        if (spi_dma_plan_pending(&plan) > 0) {
+            TEST_ASSERT_EQUAL(0, len % 4);
+        }
+
+        expected += len;
+        n++;
+    }
+
+    TEST_ASSERT_EQUAL(bytes, expected);
+    TEST_ASSERT_EQUAL(0, spi_dma_plan_next(&plan, &offset));
+
+    return n;
+}
+
+TEST_CASE("sys", "[spi_dma]") {
+    static const uint32_t word_size[] = {1, 2, 4};
+    spi_dma_plan_t plan;
+    uint32_t offset, bytes;
+    int i;
+
+    // Descriptors needed for a transaction
+    TEST_ASSERT_EQUAL(0, spi_dma_descriptors(0));
+    TEST_ASSERT_EQUAL(1, spi_dma_descriptors(1));
+    TEST_ASSERT_EQUAL(1, spi_dma_descriptors(SPI_DMA_DESC_MAX));
+    TEST_ASSERT_EQUAL(2, spi_dma_descriptors(SPI_DMA_DESC_MAX + 1));
+    TEST_ASSERT_EQUAL(9, spi_dma_descriptors(32768));
+
+    // Reference plan, one descriptor per transaction
+    spi_dma_plan_init(&plan, 10000, 2, 1);
+    TEST_ASSERT_EQUAL(3, spi_dma_plan_pending(&plan));
+    TEST_ASSERT_EQUAL(4092, spi_dma_plan_next(&plan, &offset));
+    TEST_ASSERT_EQUAL(0, offset);
+    TEST_ASSERT_EQUAL(4092, spi_dma_plan_next(&plan, &offset));
+    TEST_ASSERT_EQUAL(4092, offset);
+    TEST_ASSERT_EQUAL(1816, spi_dma_plan_next(&plan, &offset));
+    TEST_ASSERT_EQUAL(8184, offset);
+    TEST_ASSERT_EQUAL(0, spi_dma_plan_pending(&plan));
+
+    // Chained descriptors
+    TEST_ASSERT_EQUAL(4, check_plan(100000, 4, 8));
+    TEST_ASSERT_EQUAL(1, check_plan(8 * SPI_DMA_DESC_MAX, 1, 8));
+
+    // Transactions are limited by the length register
+    spi_dma_plan_init(&plan, 3 * SPI_DMA_TRANS_MAX, 1, 1000);
+    TEST_ASSERT_EQUAL(SPI_DMA_TRANS_MAX, spi_dma_plan_next(&plan, &offset));
+    TEST_ASSERT_EQUAL(2, spi_dma_plan_pending(&plan));
+
+    // Empty transfer
+    TEST_ASSERT_EQUAL(0, check_plan(0, 1, 8));
+
+    // Any size and word size
+    for(i = 0;i < 3;i++) {
+        for(bytes = word_size[i];bytes < 40000;bytes = bytes * 3 + word_size[i]) {
+            check_plan(bytes, word_size[i], 1);
+            check_plan(bytes, word_size[i], 3);
+        }
+    }
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, sys rsyslog test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/status.h>
+#include <sys/syslog.h>
+
+#include "lwip/sockets.h"
+
+#if CONFIG_LUA_RTOS_USE_RSYSLOG
+
+#define TEST_RECORDS 20
+
+TEST_CASE("sys", "[rsyslog]") {
+    syslog_stats_t before, after;
+    struct sockaddr_in addr;
+    struct timeval timeout = {2L, 0L};
+    char *prev, *rec, *m, *buf;
+    int sock, len, i, n, next = 0;
+
+    if (!NETWORK_AVAILABLE()) {
+        TEST_IGNORE_MESSAGE("network not available");
+    }
+
+    // Local UDP listener standing for the rsyslog server
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    TEST_ASSERT(sock >= 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CONFIG_LUA_RTOS_RSYSLOG_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    buf = malloc(1500);
+    TEST_ASSERT(buf != NULL);
+
+    prev = syslog_getloghost() ? strdup(syslog_getloghost()) : NULL;
+    TEST_ASSERT(syslog_setloghost("127.0.0.1") != NULL);
+
+    syslog_getstats(&before);
+    for (i = 0; i < TEST_RECORDS; i++) {
+        syslog(LOG_INFO, "rsyslog test %d\n", i);
+    }
+
+    // Records come in order, possibly several per datagram
+    while (next < TEST_RECORDS) {
+        len = recv(sock, buf, 1499, 0);
+        if (len <= 0) {
+            break;
+        }
+        buf[len] = '\0';
+
+        for (rec = strtok(buf, "\n"); rec; rec = strtok(NULL, "\n")) {
+            m = strstr(rec, " lua-rtos - - - rsyslog test ");
+            if ((rec[0] != '<') || !m) {
+                continue; // a record not logged by this test
+            }
+
+            TEST_ASSERT(sscanf(m + 29, "%d", &n) == 1);
+            TEST_ASSERT_EQUAL(next, n);
+            next++;
+        }
+    }
+
+    syslog_getstats(&after);
+
+    syslog_setloghost(prev ? prev : "0.0.0.0");
+    free(prev);
+    free(buf);
+    close(sock);
+
+    TEST_ASSERT_EQUAL(TEST_RECORDS, next);
+    TEST_ASSERT(after.sent - before.sent >= TEST_RECORDS);
+    TEST_ASSERT(after.datagrams - before.datagrams <= after.sent - before.sent);
+}
+
+#endif
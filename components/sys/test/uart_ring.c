@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2015 - 2020, Jaume Olivé Petrus (jolive@whitecatboard.org)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, UART ring buffer test cases
+ *
+ */
+
+#include "sdkconfig.h"
+
+#include "unity.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <drivers/uart_ring.h>
+
+#define TEST_RING_SIZE 64
+#define TEST_BYTES     100000
+
+static uart_ring_t ring;
+static uint8_t buffer[TEST_RING_SIZE];
+
+// Simulates the UART interrupt handler, putting a known sequence of bytes
+// into the ring buffer when there is free space
+static void *producer(void *arg) {
+	uint32_t i;
+
+	for(i = 0; i < TEST_BYTES; i++) {
+		while (uart_ring_free(&ring) == 0) {
+			sched_yield();
+		}
+
+		uart_ring_put(&ring, (uint8_t)(i * 7));
+	}
+
+	return NULL;
+}
+
+// Simulates a task writing a known sequence of bytes into the ring buffer in
+// chunks, waiting for free space when the ring buffer is full
+static void *writer(void *arg) {
+	uint8_t data[TEST_RING_SIZE + 7];
+	uint32_t sent = 0;
+	uint32_t chunk = 1;
+	uint32_t i, n;
+
+	while (sent < TEST_BYTES) {
+		if (chunk > TEST_BYTES - sent) {
+			chunk = TEST_BYTES - sent;
+		}
+
+		for(i = 0; i < chunk; i++) {
+			data[i] = (uint8_t)((sent + i) * 3);
+		}
+
+		n = 0;
+		while (n < chunk) {
+			n += uart_ring_write(&ring, data + n, chunk - n);
+			if (n < chunk) {
+				sched_yield();
+			}
+		}
+
+		sent += chunk;
+		chunk = (chunk % sizeof(data)) + 1;
+	}
+
+	return NULL;
+}
+
+TEST_CASE("sys", "[uart_ring]") {
+	uint8_t data[TEST_RING_SIZE * 2];
+	uint32_t received = 0;
+	uint32_t chunk = 1;
+	uint32_t i, n;
+	pthread_t thread;
+
+	TEST_ASSERT(uart_ring_size(1) == 1);
+	TEST_ASSERT(uart_ring_size(100) == 128);
+	TEST_ASSERT(uart_ring_size(128) == 128);
+
+	// Fill the ring buffer, the bytes that don't fit must be dropped
+	uart_ring_init(&ring, buffer, TEST_RING_SIZE);
+
+	for(i = 0; i < TEST_RING_SIZE + 10; i++) {
+		uart_ring_put(&ring, i);
+	}
+
+	TEST_ASSERT(uart_ring_count(&ring) == TEST_RING_SIZE);
+	TEST_ASSERT(uart_ring_free(&ring) == 0);
+	TEST_ASSERT(ring.dropped == 10);
+
+	n = uart_ring_get(&ring, data, sizeof(data));
+	TEST_ASSERT(n == TEST_RING_SIZE);
+	for(i = 0; i < n; i++) {
+		TEST_ASSERT(data[i] == i);
+	}
+
+	TEST_ASSERT(uart_ring_count(&ring) == 0);
+	TEST_ASSERT(uart_ring_get(&ring, data, sizeof(data)) == 0);
+
+	// Read a sequence written by a concurrent producer with different chunk
+	// sizes, so that reads wrap around the end of the buffer at different
+	// positions. No byte can be lost or reordered.
+	uart_ring_init(&ring, buffer, TEST_RING_SIZE);
+
+	TEST_ASSERT(pthread_create(&thread, NULL, producer, NULL) == 0);
+
+	while (received < TEST_BYTES) {
+		n = uart_ring_get(&ring, data, chunk);
+		for(i = 0; i < n; i++) {
+			TEST_ASSERT(data[i] == (uint8_t)((received + i) * 7));
+		}
+
+		received += n;
+
+		chunk = (chunk % (sizeof(data) - 1)) + 1;
+		if (n == 0) {
+			sched_yield();
+		}
+	}
+
+	pthread_join(thread, NULL);
+
+	TEST_ASSERT(received == TEST_BYTES);
+	TEST_ASSERT(ring.dropped == 0);
+	TEST_ASSERT(uart_ring_count(&ring) == 0);
+}
+
+TEST_CASE("sys", "[uart_ring_tx]") {
+	uint8_t data[TEST_RING_SIZE * 2];
+	uint32_t received = 0;
+	uint8_t byte;
+	uint32_t i;
+	pthread_t thread;
+
+	for(i = 0; i < sizeof(data); i++) {
+		data[i] = i;
+	}
+
+	// Fill the ring buffer, the bytes that don't fit must not be written
+	uart_ring_init(&ring, buffer, TEST_RING_SIZE);
+
+	TEST_ASSERT(uart_ring_write(&ring, data, 10) == 10);
+	TEST_ASSERT(uart_ring_write(&ring, data + 10, TEST_RING_SIZE) == TEST_RING_SIZE - 10);
+	TEST_ASSERT(uart_ring_write(&ring, data, 1) == 0);
+	TEST_ASSERT(uart_ring_free(&ring) == 0);
+
+	for(i = 0; uart_ring_take(&ring, &byte); i++) {
+		TEST_ASSERT(byte == i);
+	}
+
+	TEST_ASSERT(i == TEST_RING_SIZE);
+	TEST_ASSERT(uart_ring_count(&ring) == 0);
+
+	// Send a sequence written by a concurrent writer, taking one byte at a time
+	// as the interrupt handler does. No byte can be lost or reordered.
+	uart_ring_init(&ring, buffer, TEST_RING_SIZE);
+
+	TEST_ASSERT(pthread_create(&thread, NULL, writer, NULL) == 0);
+
+	while (received < TEST_BYTES) {
+		if (uart_ring_take(&ring, &byte)) {
+			TEST_ASSERT(byte == (uint8_t)(received * 3));
+			received++;
+		} else {
+			sched_yield();
+		}
+	}
+
+	pthread_join(thread, NULL);
+
+	TEST_ASSERT(received == TEST_BYTES);
+	TEST_ASSERT(uart_ring_take(&ring, &byte) == 0);
+}
+
+TEST_CASE("sys", "[uart_ring_find]") {
+	uint8_t data[TEST_RING_SIZE];
+	uint32_t i;
+
+	// Put the line end at the end of the buffer, so that the data wraps around
+	uart_ring_init(&ring, buffer, TEST_RING_SIZE);
+	ring.head = ring.tail = TEST_RING_SIZE - 5;
+
+	uart_ring_write(&ring, (const uint8_t *)"AT+CSQ\r\nOK\r\n", 12);
+
+	TEST_ASSERT(uart_ring_find(&ring, "\n", TEST_RING_SIZE) == 7);
+	TEST_ASSERT(uart_ring_find(&ring, "\r\n", TEST_RING_SIZE) == 6);
+	TEST_ASSERT(uart_ring_find(&ring, "\n\r", TEST_RING_SIZE) == 6);
+	TEST_ASSERT(uart_ring_find(&ring, "+", TEST_RING_SIZE) == 2);
+	TEST_ASSERT(uart_ring_find(&ring, "\r", 6) == -1);
+	TEST_ASSERT(uart_ring_find(&ring, "\r", 7) == 6);
+	TEST_ASSERT(uart_ring_find(&ring, "#", TEST_RING_SIZE) == -1);
+
+	TEST_ASSERT(uart_ring_get(&ring, data, 8) == 8);
+	TEST_ASSERT(memcmp(data, "AT+CSQ\r\n", 8) == 0);
+	TEST_ASSERT(uart_ring_find(&ring, "\r\n", TEST_RING_SIZE) == 2);
+
+	// Every position of the delimiter, in a full ring buffer
+	for(i = 0; i < TEST_RING_SIZE; i++) {
+		uart_ring_init(&ring, buffer, TEST_RING_SIZE);
+		ring.head = ring.tail = i * 3;
+
+		memset(data, 'x', sizeof(data));
+		data[i] = '\n';
+		uart_ring_write(&ring, data, sizeof(data));
+
+		TEST_ASSERT(uart_ring_find(&ring, "\r\n", TEST_RING_SIZE) == i);
+	}
+}
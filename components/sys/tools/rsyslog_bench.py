@@ -0,0 +1,107 @@
+#
+# Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+# Copyright (C) 2015 - 2020, Jaume Olive Petrus (jolive@whitecatboard.org)
+#
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#    # Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#    # Redistributions in binary form must reproduce the above copyright
+#       notice, this list of conditions and the following disclaimer in the
+#       documentation and/or other materials provided with the distribution.
+#    # Neither the name of the <organization> nor the
+#       names of its contributors may be used to endorse or promote products
+#       derived from this software without specific prior written permission.
+#    # The WHITECAT logotype cannot be changed, you can remove it, but you
+#       cannot change it in any way. The WHITECAT logotype is:
+#
+#          /\       /\
+#         /  \_____/  \
+#        /_____________\
+#        W H I T E C A T
+#
+#    # Redistributions in binary form must retain all copyright notices printed
+#       to any local or remote output device. This include any reference to
+#       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+#       appear in the future.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# Lua RTOS, rsyslog benchmark listener
+#
+# Receives the records that a board sends to its rsyslog server, and reports
+# how many records arrived, in how many datagrams, and whether they arrived
+# in order. Start the listener, point the board to this host, and log a
+# burst of numbered records, timing the syslog calls on the board:
+#
+#   os.rsyslog("192.168.1.10")
+#   t = os.clock()
+#   for i = 0, 499 do os.syslog("bench " .. i, os.LOG_INFO) end
+#   print((os.clock() - t) * 1000000 / 500 .. " us per call")
+#   print(os.rsyslogstats())
+#
+# usage: rsyslog_bench.py [port] [idle]
+#
+# port is the CONFIG_LUA_RTOS_RSYSLOG_PORT of the board (514 by default).
+# The listener stops idle seconds (2 by default) after the last datagram.
+#
+
+import re
+import socket
+import sys
+
+RECORD = re.compile(rb"^<(\d+)>1 \S+ - lua-rtos - - - .*?bench (\d+)")
+
+def main():
+	port = int(sys.argv[1]) if len(sys.argv) > 1 else 514
+	idle = float(sys.argv[2]) if len(sys.argv) > 2 else 2
+
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+	s.bind(("", port))
+
+	records = datagrams = other = unordered = 0
+	last = -1
+
+	print("listening on udp port %d" % port)
+	while True:
+		s.settimeout(idle if datagrams else None)
+		try:
+			data = s.recv(65536)
+		except socket.timeout:
+			break
+
+		datagrams += 1
+		for line in data.split(b"\n"):
+			if not line:
+				continue
+
+			m = RECORD.match(line)
+			if not m:
+				other += 1
+				continue
+
+			n = int(m.group(2))
+			if n <= last:
+				unordered += 1
+			last = n
+			records += 1
+
+	print("%d records in %d datagrams, %d out of order, %d other records" % (records, datagrams, unordered, other))
+	if records:
+		print("%.1f records per datagram" % (records / float(datagrams)))
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,179 @@
+#
+# Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+# Copyright (C) 2015 - 2020, Jaume Olive Petrus (jolive@whitecatboard.org)
+#
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#    # Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#    # Redistributions in binary form must reproduce the above copyright
+#       notice, this list of conditions and the following disclaimer in the
+#       documentation and/or other materials provided with the distribution.
+#    # Neither the name of the <organization> nor the
+#       names of its contributors may be used to endorse or promote products
+#       derived from this software without specific prior written permission.
+#    # The WHITECAT logotype cannot be changed, you can remove it, but you
+#       cannot change it in any way. The WHITECAT logotype is:
+#
+#          /\       /\
+#         /  \_____/  \
+#        /_____________\
+#        W H I T E C A T
+#
+#    # Redistributions in binary form must retain all copyright notices printed
+#       to any local or remote output device. This include any reference to
+#       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+#       appear in the future.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# Lua RTOS, trace log decoder
+#
+# Decodes a trace log dumped with os.tracedump. The trace log only stores the
+# address of the format string of each record, so the ELF file of the firmware
+# that generated the trace log is needed to resolve them.
+#
+# usage: trace_decode.py elf dump
+#
+# dump can be a binary file (os.tracedump("/trace.bin")), or a text file with
+# the output of os.tracedump() captured from the console.
+#
+
+import re
+import struct
+import sys
+
+HEADER = struct.Struct("<4sBBBBI")
+RECORD = struct.Struct("<IIBBBB5I")
+LEVELS = ["emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"]
+SPEC = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+class Elf:
+	def __init__(self, path):
+		with open(path, "rb") as f:
+			data = f.read()
+
+		if data[0:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+			raise ValueError("%s is not a 32-bit little endian ELF file" % path)
+
+		shoff, = struct.unpack_from("<I", data, 32)
+		shentsize, shnum = struct.unpack_from("<HH", data, 46)
+
+		# Keep the sections that are loaded and have contents in the file
+		self.sections = []
+		for i in range(shnum):
+			name, type, flags, addr, offset, size = struct.unpack_from("<IIIIII", data, shoff + i * shentsize)
+			if type == 1 and flags & 2 and addr:
+				self.sections.append((addr, size, data[offset:offset + size]))
+
+	def string(self, addr):
+		for base, size, contents in self.sections:
+			if base <= addr < base + size:
+				end = contents.find(b"\0", addr - base)
+				if end < 0:
+					end = size
+				return contents[addr - base:end].decode("utf-8", "replace")
+
+		return None
+
+def load(path):
+	with open(path, "rb") as f:
+		data = f.read()
+
+	if data[0:4] == b"LTRC":
+		return data
+
+	# Text dump, get the hex lines between the begin / end markers
+	hex = []
+	inside = False
+	for line in data.decode("utf-8", "replace").splitlines():
+		line = line.strip()
+		if line == "-- trace begin":
+			inside = True
+		elif line == "-- trace end":
+			break
+		elif inside:
+			hex.append(line)
+
+	return bytes.fromhex("".join(hex))
+
+def format(elf, fmt, args):
+	args = list(args)
+
+	def arg(m):
+		flags, conv = m.group(1), m.group(2)
+		if conv == "%":
+			return "%"
+		if not args:
+			return m.group(0)
+
+		value = args.pop(0)
+		if conv == "s":
+			s = elf.string(value)
+			return ("%" + flags + "s") % (s if s is not None else "<0x%08x>" % value)
+		if conv == "p":
+			return "0x%08x" % value
+		if conv == "c":
+			return chr(value & 0xff)
+		if conv in "di" and value & 0x80000000:
+			value -= 0x100000000
+
+		return ("%" + flags + conv.replace("i", "d").replace("u", "d")) % value
+
+	return SPEC.sub(arg, fmt)
+
+def decode(elf, data):
+	magic, version, cpus, record_size, subsystems, records = HEADER.unpack_from(data, 0)
+	if magic != b"LTRC" or version != 1 or record_size != RECORD.size:
+		raise ValueError("invalid trace log")
+
+	offset = HEADER.size
+	names = []
+	for i in range(subsystems):
+		names.append(data[offset:offset + 8].split(b"\0")[0].decode())
+		offset += 8
+
+	entries = []
+	for cpu in range(cpus):
+		count, = struct.unpack_from("<I", data, offset)
+		offset += 4
+		for i in range(count):
+			entries.append(RECORD.unpack_from(data, offset))
+			offset += RECORD.size
+
+	# Timestamps are the 32 low bits of a microsecond counter, so only records
+	# taken less than 71 minutes apart are ordered correctly
+	entries.sort(key=lambda e: e[1])
+
+	for fmt, time, subsystem, level, nargs, cpu, *args in entries:
+		text = elf.string(fmt)
+		if text is None:
+			text = "<unknown format 0x%08x>" % fmt
+		else:
+			text = format(elf, text, args[:nargs])
+
+		print("%10u.%06u %d %-7s %-7s %s" % (
+			time // 1000000, time % 1000000, cpu,
+			names[subsystem] if subsystem < len(names) else str(subsystem),
+			LEVELS[level] if level < len(LEVELS) else str(level),
+			text
+		))
+
+if __name__ == "__main__":
+	if len(sys.argv) != 3:
+		print("usage: %s elf dump" % sys.argv[0])
+		sys.exit(1)
+
+	decode(Elf(sys.argv[1]), load(sys.argv[2]))
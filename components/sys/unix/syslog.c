@@ -66,6 +66,11 @@ static char sccsid[] = "@(#)syslog.c	8.5 (Berkeley) 4/29/95";
 #include <drivers/net.h>
 #include "esp_log.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
+
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -83,12 +88,51 @@ static char sccsid[] = "@(#)syslog.c	8.5 (Berkeley) 4/29/95";
 #endif
 
 #define MAX_BUFF 512
+#define SYSLOG_HEADER 48	/* room for the message header */
 
 #if CONFIG_LUA_RTOS_USE_RSYSLOG
+#define RSYSLOG_STACK 2048
+
+/*
+ * Defaults of the rsyslog options, for configurations made before they were
+ * added, that enable rsyslog but don't have them. Same values as in Kconfig.
+ */
+#ifndef CONFIG_LUA_RTOS_RSYSLOG_BUFFER_SIZE
+#define CONFIG_LUA_RTOS_RSYSLOG_BUFFER_SIZE 4096
+#endif
+
+#ifndef CONFIG_LUA_RTOS_RSYSLOG_DATAGRAM_SIZE
+#define CONFIG_LUA_RTOS_RSYSLOG_DATAGRAM_SIZE 1024
+#endif
+
+#ifndef CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT
+#define CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT 0
+#endif
+
 static int   logSock = 0;
 static char *logHost = NULL;
 static const char *logHostDefault = CONFIG_LUA_RTOS_RSYSLOG_SERVER;
 struct sockaddr_in logAddr;
+
+/*
+ * Records for the rsyslog server are queued in a ring buffer, and sent by
+ * the rsyslog task, so that logging never waits for the network stack.
+ */
+static RingbufHandle_t rsyslogRing = NULL;
+static SemaphoreHandle_t rsyslogMtx = NULL;	/* protects logSock */
+static portMUX_TYPE rsyslogSpinlock = portMUX_INITIALIZER_UNLOCKED;
+static syslog_stats_t rsyslogStats;
+
+#if CONFIG_LUA_RTOS_RSYSLOG_DATAGRAM_SIZE > 0
+static char rsyslogDatagram[CONFIG_LUA_RTOS_RSYSLOG_DATAGRAM_SIZE];
+#endif
+
+#if CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT > 0
+static struct {
+	TickType_t last;	/* last refill */
+	uint16_t tokens;	/* records that can be sent */
+} rsyslogBucket[LOG_NFACILITIES];
+#endif
 #endif
 static FILE *logFile = NULL;
 static int	 logStat = 0;		/* status bits, set by openlog() */
@@ -97,6 +141,102 @@ static int	logMask = 0b11111111;		/* mask of priorities to be logged */
 
 void vsyslog(int pri, register const char *fmt, va_list app);
 
+/*
+ * Builds the message header, which is the RFC 5424 header if the rsyslog
+ * client is enabled. Returns the header length, less than SYSLOG_HEADER.
+ */
+static int syslog_header(char *buf, int pri) {
+#if CONFIG_LUA_RTOS_USE_RSYSLOG
+	char stamp[21] = "-";
+	struct tm tm;
+	time_t now;
+
+	(void)time(&now);
+	if ((now > 1500000000) && gmtime_r(&now, &tm)) {
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	}
+
+	return snprintf(buf, SYSLOG_HEADER, "<%d>1 %s - lua-rtos - - - ", pri, stamp);
+#else
+	return snprintf(buf, SYSLOG_HEADER, "<%d>", pri);
+#endif
+}
+
+#if CONFIG_LUA_RTOS_USE_RSYSLOG
+/*
+ * Checks if a record with the given priority can be queued for the rsyslog
+ * server, applying the rate limit of its facility.
+ */
+static int rsyslog_allow(int pri) {
+	int allow = 1;
+
+	if (NULL == rsyslogRing)
+		return 0;
+
+	// Network down
+	if (0 == logSock) {
+		portENTER_CRITICAL(&rsyslogSpinlock);
+		rsyslogStats.dropped++;
+		portEXIT_CRITICAL(&rsyslogSpinlock);
+		return 0;
+	}
+
+#if CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT > 0
+	int fac = LOG_FAC(pri);
+	TickType_t now = xTaskGetTickCount();
+	TickType_t elapsed, refill;
+
+	if (fac >= LOG_NFACILITIES)
+		fac = LOG_NFACILITIES - 1;
+
+	portENTER_CRITICAL(&rsyslogSpinlock);
+	elapsed = now - rsyslogBucket[fac].last;
+	if (elapsed >= configTICK_RATE_HZ) {
+		rsyslogBucket[fac].tokens = CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT;
+		rsyslogBucket[fac].last = now;
+	} else {
+		refill = (elapsed * CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT) / configTICK_RATE_HZ;
+		if (refill > 0) {
+			rsyslogBucket[fac].tokens += refill;
+			if (rsyslogBucket[fac].tokens > CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT)
+				rsyslogBucket[fac].tokens = CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT;
+			rsyslogBucket[fac].last += (refill * configTICK_RATE_HZ) / CONFIG_LUA_RTOS_RSYSLOG_RATE_LIMIT;
+		}
+	}
+
+	if (rsyslogBucket[fac].tokens > 0) {
+		rsyslogBucket[fac].tokens--;
+	} else {
+		rsyslogStats.limited++;
+		allow = 0;
+	}
+	portEXIT_CRITICAL(&rsyslogSpinlock);
+#endif
+
+	return allow;
+}
+
+/*
+ * Queues a record for the rsyslog server, without waiting. The record is
+ * dropped if the buffer is full.
+ */
+static void rsyslog_queue(const char *rec, int len) {
+	int queued;
+
+	while ((len > 0) && ((rec[len-1] == '\n') || (rec[len-1] == '\r')))
+		len--;
+
+	queued = (xRingbufferSend(rsyslogRing, (void *)rec, len, 0) == pdTRUE);
+
+	portENTER_CRITICAL(&rsyslogSpinlock);
+	if (queued)
+		rsyslogStats.queued++;
+	else
+		rsyslogStats.dropped++;
+	portEXIT_CRITICAL(&rsyslogSpinlock);
+}
+#endif
+
 /*
  * syslog, vsyslog --
  *	print message on log file; output is intended for syslogd(8).
@@ -132,8 +272,7 @@ vsyslog(pri, fmt, ap)
 {
 	register int cnt;
 	register char *p;
-	char *tbuf;
-	time_t now;
+	char *tbuf, *msg;
 	int fd;
 	int has_cr_lf = 0;
 
@@ -151,7 +290,7 @@ vsyslog(pri, fmt, ap)
 		return;
 
 	// Allocate space
-	tbuf = (char *)malloc(MAX_BUFF + 3);
+	tbuf = (char *)malloc(SYSLOG_HEADER + MAX_BUFF + 3);
 	if (!tbuf) return;
 
 	/* Set default facility if none specified. */
@@ -159,15 +298,14 @@ vsyslog(pri, fmt, ap)
 		pri |= logFacility;
 
 	/* Build the message. */
-
-	(void)time(&now);
-	p = tbuf + snprintf(tbuf, MAX_BUFF, "<%d>", pri);
+	msg = tbuf + syslog_header(tbuf, pri);
+	p = msg;
 	if (logStat & LOG_PID) {
-		p += snprintf(p, MAX_BUFF - (p - tbuf), "[%d]", getpid());
+		p += snprintf(p, MAX_BUFF - (p - msg), "[%d]", getpid());
 	}
-	cnt = vsnprintf(p, MAX_BUFF - (p - tbuf), fmt, ap);
-	if (cnt > MAX_BUFF - (p - tbuf)) {
-		p += (MAX_BUFF - (p - tbuf)) - 1;
+	cnt = vsnprintf(p, MAX_BUFF - (p - msg), fmt, ap);
+	if (cnt >= MAX_BUFF - (p - msg)) {
+		p += (MAX_BUFF - (p - msg)) - 1;
 	}
 	else {
 		p += cnt;
@@ -176,6 +314,12 @@ vsyslog(pri, fmt, ap)
 	cnt = p - tbuf;
 	has_cr_lf = ((tbuf[cnt-1] == '\n') && (tbuf[cnt-2] == '\r'));
 
+#if CONFIG_LUA_RTOS_USE_RSYSLOG
+	if (rsyslog_allow(pri)) {
+		rsyslog_queue(tbuf, cnt);
+	}
+#endif
+
 	if (logStat & LOG_CONS) {
 		fd = fileno(_GLOBAL_REENT->_stdout);
 		if (!has_cr_lf) {
@@ -186,8 +330,7 @@ vsyslog(pri, fmt, ap)
 			has_cr_lf = 1;
 		}
 
-		p = index(tbuf, '>') + 1;
-		(void)write(fd, p, cnt - (p - tbuf));
+		(void)write(fd, msg, cnt - (msg - tbuf));
 	}
 
 	if (NULL != logFile) {
@@ -202,43 +345,159 @@ vsyslog(pri, fmt, ap)
 
 		(void)strcat(tbuf, "\n");
 		cnt += 1;
-		p = index(tbuf, '>') + 1;
 
-		fwrite(p, cnt - (p - tbuf), 1, logFile);
+		fwrite(msg, cnt - (msg - tbuf), 1, logFile);
 		fflush(logFile);
 	}
 
+	free(tbuf);
+}
+
 #if CONFIG_LUA_RTOS_USE_RSYSLOG
+/*
+ * Sends a datagram with the given number of records to the rsyslog server.
+ */
+static void rsyslog_send(const char *buf, int len, int records) {
+	int rc = -1;
+
+	xSemaphoreTake(rsyslogMtx, portMAX_DELAY);
 	if (0 != logSock) {
 		LOCK_TCPIP_CORE()
-		sendto(logSock,tbuf,cnt,0,(struct sockaddr *)&logAddr,sizeof(logAddr));
+		rc = sendto(logSock,buf,len,0,(struct sockaddr *)&logAddr,sizeof(logAddr));
 		UNLOCK_TCPIP_CORE()
 	}
+	xSemaphoreGive(rsyslogMtx);
+
+	portENTER_CRITICAL(&rsyslogSpinlock);
+	if (rc == len) {
+		rsyslogStats.sent += records;
+		rsyslogStats.datagrams++;
+	} else {
+		rsyslogStats.dropped += records;
+	}
+	portEXIT_CRITICAL(&rsyslogSpinlock);
+}
+
+/*
+ * Sends the queued records, packing the records queued together in as few
+ * datagrams as possible, separated by a line feed.
+ */
+static void rsyslog_task(void *arg) {
+	size_t size;
+	char *rec;
+
+	for(;;) {
+		rec = (char *)xRingbufferReceive(rsyslogRing, &size, portMAX_DELAY);
+
+#if CONFIG_LUA_RTOS_RSYSLOG_DATAGRAM_SIZE > 0
+		int len = 0, records = 0;
+
+		while (rec) {
+			if ((len > 0) && (len + 1 + size > sizeof(rsyslogDatagram))) {
+				rsyslog_send(rsyslogDatagram, len, records);
+				len = records = 0;
+			}
+
+			if (size >= sizeof(rsyslogDatagram)) {
+				rsyslog_send(rec, size, 1);
+			} else {
+				if (len > 0)
+					rsyslogDatagram[len++] = '\n';
+				memcpy(rsyslogDatagram + len, rec, size);
+				len += size;
+				records++;
+			}
+
+			vRingbufferReturnItem(rsyslogRing, rec);
+			rec = (char *)xRingbufferReceive(rsyslogRing, &size, 0);
+		}
+
+		if (len > 0)
+			rsyslog_send(rsyslogDatagram, len, records);
+#else
+		if (rec) {
+			rsyslog_send(rec, size, 1);
+			vRingbufferReturnItem(rsyslogRing, rec);
+		}
 #endif
+	}
+}
 
-	free(tbuf);
+static void rsyslog_start() {
+	RingbufHandle_t ring;
+
+	if (NULL != rsyslogRing)
+		return;
+
+	if (NULL == rsyslogMtx) {
+		rsyslogMtx = xSemaphoreCreateMutex();
+		if (NULL == rsyslogMtx)
+			return;
+	}
+
+	ring = xRingbufferCreate(CONFIG_LUA_RTOS_RSYSLOG_BUFFER_SIZE, RINGBUF_TYPE_NOSPLIT);
+	if (NULL == ring) {
+		printf("couldn't allocate rsyslog buffer\n");
+		return;
+	}
+
+	rsyslogRing = ring;
+	if (xTaskCreatePinnedToCore(rsyslog_task, "rsyslog", RSYSLOG_STACK, NULL, tskIDLE_PRIORITY + 1, NULL, xPortGetCoreID()) != pdPASS) {
+		printf("couldn't start rsyslog task\n");
+		rsyslogRing = NULL;
+		vRingbufferDelete(ring);
+	}
+}
+
+/*
+ * Returns the priority of an esp-idf log message, from the level letter
+ * that starts its format, after the color escape sequence if any.
+ */
+static int syslog_esp_level(const char *fmt) {
+	if (*fmt == '\033') {
+		fmt = strchr(fmt, 'm');
+		if (!fmt) return LOG_NOTICE;
+		fmt++;
+	}
+
+	switch (*fmt) {
+		case 'E': return LOG_ERR;
+		case 'W': return LOG_WARNING;
+		case 'I': return LOG_INFO;
+		case 'D':
+		case 'V': return LOG_DEBUG;
+	}
+
+	return LOG_NOTICE;
 }
 
-#if CONFIG_LUA_RTOS_USE_RSYSLOG
 static int syslog_logging_vprintf( const char *str, va_list l ) {
-	// Allocate space
-	char* tbuf = (char *)malloc(MAX_BUFF+1);
-	if (tbuf) {
-		int len = vsnprintf((char*)tbuf, MAX_BUFF, str, l);
-
-		if (0 != logSock) {
-			LOCK_TCPIP_CORE()
-			sendto(logSock,tbuf,len,0,(struct sockaddr *)&logAddr,sizeof(logAddr));
-			UNLOCK_TCPIP_CORE()
-		}
+	int pri = logFacility | syslog_esp_level(str);
+
+	if (rsyslog_allow(pri)) {
+		// Allocate space
+		char* tbuf = (char *)malloc(SYSLOG_HEADER + MAX_BUFF);
+		if (tbuf) {
+			va_list copy;
+			int len = syslog_header(tbuf, pri);
+
+			va_copy(copy, l);
+			int cnt = vsnprintf(tbuf + len, MAX_BUFF, str, copy);
+			va_end(copy);
+
+			if (cnt > 0) {
+				len += (cnt >= MAX_BUFF) ? MAX_BUFF - 1 : cnt;
+				rsyslog_queue(tbuf, len);
+			}
 
-		free(tbuf);
+			free(tbuf);
+		}
 	}
 
 	return vprintf( str, l );
 }
 
-static void reconnect_syslog() {
+static void reconnect_syslog_locked() {
 	if (0 != logSock) {
 		close(logSock);
 	}
@@ -294,6 +553,17 @@ static void reconnect_syslog() {
 	}
 }
 
+static void reconnect_syslog() {
+	// The rsyslog task must not send while the socket is changed
+	if (NULL != rsyslogMtx)
+		xSemaphoreTake(rsyslogMtx, portMAX_DELAY);
+
+	reconnect_syslog_locked();
+
+	if (NULL != rsyslogMtx)
+		xSemaphoreGive(rsyslogMtx);
+}
+
 static void syslog_net_callback(system_event_t *event){
 	if ( (NETWORK_AVAILABLE() && (0 == logSock)) ||
 	    (!NETWORK_AVAILABLE() && (0 != logSock)) ) {
@@ -328,6 +598,7 @@ int openlog(logstat, logfac)
 	}
 
 #if CONFIG_LUA_RTOS_USE_RSYSLOG
+	rsyslog_start();
 	reconnect_syslog();
 
 	driver_error_t *error;
@@ -347,11 +618,17 @@ void closelog() {
 	logFile = NULL;
 
 #if CONFIG_LUA_RTOS_USE_RSYSLOG
+	if (NULL != rsyslogMtx)
+		xSemaphoreTake(rsyslogMtx, portMAX_DELAY);
+
 	if (0 != logSock) {
 		close(logSock);
 	}
 	logSock = 0;
 
+	if (NULL != rsyslogMtx)
+		xSemaphoreGive(rsyslogMtx);
+
 	driver_error_t *error;
 	if ((error = net_event_unregister_callback(syslog_net_callback))) {
 		printf("couldn't unregister net callback\n");
@@ -398,3 +675,13 @@ const char *syslog_getloghost ()
 	return logHost;
 }
 #endif
+
+void syslog_getstats(syslog_stats_t *stats) {
+#if CONFIG_LUA_RTOS_USE_RSYSLOG
+	portENTER_CRITICAL(&rsyslogSpinlock);
+	*stats = rsyslogStats;
+	portEXIT_CRITICAL(&rsyslogSpinlock);
+#else
+	memset(stats, 0, sizeof(syslog_stats_t));
+#endif
+}
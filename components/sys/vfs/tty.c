@@ -55,44 +55,62 @@
 
 #include <drivers/uart.h>
 
+// Size of the chunks written to the uart
+#define TTY_WRITE_CHUNK 64
+
 extern FILE *lua_stdout_file;
 
 // Local storage for file descriptors
 static vfs_fd_local_storage_t *local_storage;
 
 static int has_bytes(int fd, int to) {
-	char c;
-
-	if (to != portMAX_DELAY) {
-		to = to / portTICK_PERIOD_MS;
-	}
-
-	return (xQueuePeek(uart_get_queue(fd), &c, (BaseType_t)to) == pdTRUE);
+	return (uart_rx_available(fd, to) > 0);
 }
 
 static int get(int fd, char *c) {
 	return uart_read(fd, c, portMAX_DELAY);
 }
 
-static void put(int fd, char *c) {
-    uart_write(fd, *c);
-    if (lua_stdout_file) {
-    	fwrite(c, 1, 1, lua_stdout_file);
-    }
+// Writes size bytes to the uart, in chunks of TTY_WRITE_CHUNK bytes. If crlf is
+// set, LF is converted to CR + LF, as configured in newlib. The bytes are queued
+// in the uart TX ring buffer, so this returns as soon as all bytes are queued.
+// The caller holds the uart lock.
+static ssize_t put(int fd, const char *data, size_t size, int crlf) {
+	char buf[TTY_WRITE_CHUNK];
+	size_t bytes = 0;
+	size_t start;
+	int len;
+
+	while (bytes < size) {
+		start = bytes;
+		len = 0;
+
+		while ((bytes < size) && (len < TTY_WRITE_CHUNK - 1)) {
+#if CONFIG_NEWLIB_STDOUT_LINE_ENDING_LF
+			if (crlf && (data[bytes] == '\n')) {
+				buf[len++] = '\r';
+			}
+#endif
+
+			buf[len++] = data[bytes++];
+		}
+
+		uart_write_buf(fd, buf, len, portMAX_DELAY);
+
+	    if (lua_stdout_file) {
+	    	fwrite(data + start, 1, bytes - start, lua_stdout_file);
+	    }
+	}
+
+	return bytes;
 }
 
 static int tty_has_bytes(int fd, int to) {
-    char c;
-
-    if (to != portMAX_DELAY) {
-        to = to / portTICK_PERIOD_MS;
-    }
-
-    return (xQueuePeek(uart_get_queue(fd), &c, (BaseType_t)to) == pdTRUE);
+    return (uart_rx_available(fd, to) > 0);
 }
 
 static int tty_free(int fd) {
-    return uxQueueSpacesAvailable(uart_get_queue(fd));
+    return uart_rx_free(fd);
 }
 
 static int vfs_tty_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout) {
@@ -128,7 +146,7 @@ static ssize_t vfs_tty_write(int fd, const void *data, size_t size) {
 	int ret;
 
     uart_ll_lock(fd);
-	ret = vfs_generic_write(local_storage, put, fd, data, size);
+	ret = put(fd, data, size, 1);
     uart_ll_unlock(fd);
 
     return ret;
@@ -148,10 +166,13 @@ static int vfs_tty_close(int fd) {
 }
 
 static ssize_t vfs_tty_writev(int fd, const struct iovec *iov, int iovcnt) {
-	int ret;
+	int ret = 0;
 
     uart_ll_lock(fd);
-	ret = vfs_generic_writev(local_storage, put, fd, iov, iovcnt);
+    while (iovcnt--) {
+    	ret += put(fd, iov->iov_base, iov->iov_len, 0);
+    	iov++;
+    }
     uart_ll_unlock(fd);
 
     return ret;
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2018 - 2019, Thomas E. Horner (whitecatboard.org@horner.it)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, telnet server input
+ *
+ */
+
+#include "telnet_input.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#if defined(UNIT_TESTS)
+#include <sys/select.h>
+#else
+#include "lwip/sockets.h"
+#endif
+
+// Telnet commands (RFC 854)
+#define TELNET_SE   240
+#define TELNET_SB   250
+#define TELNET_WILL 251
+#define TELNET_WONT 252
+#define TELNET_DO   253
+#define TELNET_DONT 254
+#define TELNET_IAC  255
+
+// Telnet command parser states
+typedef enum {
+  TELNET_STATE_DATA = 0,
+  TELNET_STATE_IAC,
+  TELNET_STATE_OPTION,
+  TELNET_STATE_SB,
+  TELNET_STATE_SB_IAC
+} telnet_state_t;
+
+static void telnet_refuse(telnet_input_t *input, uint8_t verb, uint8_t option) {
+  unsigned char reply[3] = {TELNET_IAC, 0, option};
+
+  // No options are supported: refuse any the client wants to enable
+  if (verb == TELNET_WILL) {
+    reply[1] = TELNET_DONT;
+  } else if (verb == TELNET_DO) {
+    reply[1] = TELNET_WONT;
+  } else {
+    return;
+  }
+
+  send(input->socket, reply, sizeof(reply), MSG_DONTWAIT);
+}
+
+/*
+ * Parses one received byte, handling telnet commands and line endings.
+ * Returns the data byte, or -1 if the byte has been consumed.
+ */
+static int telnet_input(telnet_input_t *input, unsigned char b) {
+  switch (input->state) {
+    case TELNET_STATE_DATA:
+      if (b == TELNET_IAC) {
+        input->state = TELNET_STATE_IAC;
+        return -1;
+      }
+      break;
+
+    case TELNET_STATE_IAC:
+      if (b == TELNET_IAC) {
+        // escaped 0xff data byte
+        input->state = TELNET_STATE_DATA;
+        break;
+      }
+
+      if ((b >= TELNET_WILL) && (b <= TELNET_DONT)) {
+        input->verb = b;
+        input->state = TELNET_STATE_OPTION;
+      } else {
+        input->state = (b == TELNET_SB) ? TELNET_STATE_SB : TELNET_STATE_DATA;
+      }
+      return -1;
+
+    case TELNET_STATE_OPTION:
+      telnet_refuse(input, input->verb, b);
+      input->state = TELNET_STATE_DATA;
+      return -1;
+
+    case TELNET_STATE_SB:
+      if (b == TELNET_IAC) {
+        input->state = TELNET_STATE_SB_IAC;
+      }
+      return -1;
+
+    case TELNET_STATE_SB_IAC:
+      input->state = (b == TELNET_SE) ? TELNET_STATE_DATA : TELNET_STATE_SB;
+      return -1;
+  }
+
+  // CR LF, CR NUL, and LF end a line
+  if (input->cr) {
+    input->cr = 0;
+    if ((b == '\n') || (b == '\0')) {
+      return -1;
+    }
+  }
+
+  if (b == '\r') {
+    input->cr = 1;
+    return '\n';
+  }
+
+  return b;
+}
+
+/*
+ * Refills the input buffer with all the data received so far, waiting up
+ * to TELNET_POLL_MS for some to arrive. Returns 0 if there is no data.
+ */
+static int telnet_fill(telnet_input_t *input) {
+  struct timeval timeout = {0L, TELNET_POLL_MS * 1000L};
+  fd_set readset;
+  int rc;
+
+  if (input->closed) {
+    return 0;
+  }
+
+  FD_ZERO(&readset);
+  FD_SET(input->socket, &readset);
+  if (select(input->socket + 1, &readset, NULL, NULL, &timeout) <= 0) {
+    return 0;
+  }
+
+  rc = recv(input->socket, input->inbuf, TELNET_BUFF_SIZE, MSG_DONTWAIT);
+  if (rc > 0) {
+    input->inpos = 0;
+    input->inlen = rc;
+    return 1;
+  }
+
+  if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+    input->closed = 1;
+  }
+
+  return 0;
+}
+
+int telnet_input_init(telnet_input_t *input, int socket) {
+  input->inbuf = malloc(TELNET_BUFF_SIZE);
+  if (!input->inbuf) {
+    return -1;
+  }
+
+  input->socket = socket;
+  input->inpos = 0;
+  input->inlen = 0;
+  input->linelen = 0;
+  input->state = TELNET_STATE_DATA;
+  input->verb = 0;
+  input->cr = 0;
+  input->closed = 0;
+
+  return 0;
+}
+
+void telnet_input_free(telnet_input_t *input) {
+  free(input->inbuf);
+  input->inbuf = NULL;
+}
+
+char *telnet_gets(char *s, int size, telnet_input_t *input) {
+  char *c = s + input->linelen;
+  int b;
+
+  while (c < (s + size - 1)) {
+    if ((input->inpos == input->inlen) && !telnet_fill(input)) {
+      input->linelen = c - s;
+      return NULL;
+    }
+
+    b = telnet_input(input, input->inbuf[input->inpos++]);
+    if (b < 0) {
+      continue;
+    }
+
+    *c++ = b;
+    if (b == '\n') {
+      break;
+    }
+  }
+
+  *c = 0;
+  input->linelen = 0;
+  return s;
+}
+
+#if defined(UNIT_TESTS)
+
+/*
+ * Benchmarks the buffered input against the reader it replaced, with a
+ * loopback client pasting lines in MSS-sized segments after a terminal type
+ * offer. Each line is checked against the pasted one.
+ *
+ * Build and run in the host with:
+ *
+ *   cc -O2 -DUNIT_TESTS -Wl,--wrap=recv -o telnet_input telnet_input.c -lpthread && ./telnet_input
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_LINES   20000
+#define BENCH_SEGMENT 1460
+#define BENCH_RUNS    3
+
+static unsigned long bench_recvs;
+
+ssize_t __real_recv(int socket, void *buf, size_t len, int flags);
+
+ssize_t __wrap_recv(int socket, void *buf, size_t len, int flags) {
+  bench_recvs++;
+  return __real_recv(socket, buf, len, flags);
+}
+
+// Reader used before the buffered input, one recv() per byte
+static char *old_gets(char *s, int size, int socket, int *closed) {
+  int rc;
+  char *c = s;
+  while (c < (s + size - 1)) {
+    rc = recv(socket, c, 1, MSG_DONTWAIT);
+
+    if (rc>0) {
+      if (*c == '\n') {
+        c++;
+        break;
+      }
+      c++;
+    }
+    else if (rc==0) {
+      //no data received or connection is closed
+      *closed = 1;
+      break;
+    }
+    else {
+      return NULL; //discard half-received data
+    }
+  }
+  *c = 0;
+  return (c == s ? 0 : s);
+}
+
+static void *bench_paste(void *arg) {
+  struct sockaddr_in *addr = (struct sockaddr_in *)arg;
+  static char paste[BENCH_LINES * 16];
+  int len, pos, one = 1;
+  int s;
+
+  // Terminal type offer sent by most clients on connection
+  paste[0] = (char)TELNET_IAC;
+  paste[1] = (char)TELNET_WILL;
+  paste[2] = 24;
+  len = 3;
+
+  for (pos = 0; pos < BENCH_LINES; pos++) {
+    len += sprintf(paste + len, "x = %d\r\n", pos);
+  }
+
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  connect(s, (struct sockaddr *)addr, sizeof(*addr));
+
+  for (pos = 0; pos < len; pos += BENCH_SEGMENT) {
+    send(s, paste + pos, (len - pos < BENCH_SEGMENT) ? len - pos : BENCH_SEGMENT, 0);
+  }
+
+  shutdown(s, SHUT_WR);
+
+  // Wait for the session to end
+  while (recv(s, paste, sizeof(paste), 0) > 0);
+  close(s);
+
+  return NULL;
+}
+
+// Counts a line if it is the next one pasted, or one after it
+static void bench_check(char *line, int *next, int *intact) {
+  char expected[16];
+  int len = strlen(line);
+  int n;
+
+  while ((len > 0) && ((line[len - 1] == '\r') || (line[len - 1] == '\n'))) len--;
+  line[len] = '\0';
+
+  if ((sscanf(line, "x = %d", &n) != 1) || (n < *next)) {
+    return;
+  }
+
+  snprintf(expected, sizeof(expected), "x = %d", n);
+  if (strcmp(line, expected) == 0) {
+    (*intact)++;
+    *next = n + 1;
+  }
+}
+
+static void bench(int buffered) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  struct timespec start, end;
+  char line[TELNET_BUFF_SIZE];
+  telnet_input_t input;
+  pthread_t thread;
+  int server, client;
+  int next = 0, intact = 0, closed = 0;
+  double secs;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  server = socket(AF_INET, SOCK_STREAM, 0);
+  bind(server, (struct sockaddr *)&addr, sizeof(addr));
+  getsockname(server, (struct sockaddr *)&addr, &addr_len);
+  listen(server, 1);
+
+  pthread_create(&thread, NULL, bench_paste, &addr);
+  client = accept(server, NULL, NULL);
+
+  bench_recvs = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (buffered) {
+    if (telnet_input_init(&input, client) != 0) {
+      printf("not enough memory\n");
+      exit(1);
+    }
+
+    while (!input.closed || (input.inpos < input.inlen)) {
+      if (telnet_gets(line, sizeof(line), &input)) {
+        bench_check(line, &next, &intact);
+      }
+    }
+    telnet_input_free(&input);
+  } else {
+    // Session loop used before, checking again in 200 ms if there is no line
+    while (!closed) {
+      if (old_gets(line, sizeof(line), client, &closed)) {
+        bench_check(line, &next, &intact);
+      } else if (!closed) {
+        usleep(200 * 1000);
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  close(client);
+  pthread_join(thread, NULL);
+  close(server);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%-8s %5d of %d lines intact in %.3f s, %8.0f lines/s, %6lu recv calls\n",
+         buffered ? "buffered" : "per-byte", intact, BENCH_LINES, secs, intact / secs, bench_recvs);
+}
+
+int main(void) {
+  int run;
+
+  for (run = 0; run < BENCH_RUNS; run++) {
+    bench(0);
+    bench(1);
+  }
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2015 - 2020, IBEROXARXA SERVICIOS INTEGRALES, S.L.
+ * Copyright (C) 2018 - 2019, Thomas E. Horner (whitecatboard.org@horner.it)
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the <organization> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *     * The WHITECAT logotype cannot be changed, you can remove it, but you
+ *       cannot change it in any way. The WHITECAT logotype is:
+ *
+ *          /\       /\
+ *         /  \_____/  \
+ *        /_____________\
+ *        W H I T E C A T
+ *
+ *     * Redistributions in binary form must retain all copyright notices printed
+ *       to any local or remote output device. This include any reference to
+ *       Lua RTOS, whitecatboard.org, Lua, and other copyright notices that may
+ *       appear in the future.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Lua RTOS, telnet server input
+ *
+ */
+
+#ifndef _TELNET_INPUT_H_
+#define _TELNET_INPUT_H_
+
+#include <stdint.h>
+
+#define TELNET_BUFF_SIZE 256
+#define TELNET_POLL_MS   200
+
+// Input state of a telnet session
+typedef struct {
+  int socket;
+  unsigned char *inbuf; // received bytes, not yet parsed
+  int inpos;            // next byte to parse in inbuf
+  int inlen;            // number of bytes in inbuf
+  int linelen;          // length of the partial line kept between reads
+  uint8_t state;        // telnet command parser state
+  uint8_t verb;         // WILL / WONT / DO / DONT being parsed
+  uint8_t cr;           // last data byte was a carriage return
+  uint8_t closed;       // connection closed by the peer
+} telnet_input_t;
+
+/**
+ * @brief Initialize the input state of a telnet session.
+ *
+ * @param input  Input state.
+ * @param socket Socket of the session.
+ *
+ * @return 0 on success, -1 if there is not enough memory.
+ */
+int telnet_input_init(telnet_input_t *input, int socket);
+
+/**
+ * @brief Free the input state of a telnet session.
+ *
+ * @param input Input state.
+ */
+void telnet_input_free(telnet_input_t *input);
+
+/**
+ * @brief Get the next line from a telnet session, waiting up to TELNET_POLL_MS
+ *        for input. Telnet commands are parsed, and CR LF, CR NUL and LF end
+ *        a line, which is returned ending with '\n'. A partial line is kept in
+ *        s until the rest of it is received, so s must be the same buffer on
+ *        each call.
+ *
+ * @param s     Line buffer.
+ * @param size  Size of the line buffer.
+ * @param input Input state.
+ *
+ * @return s, or NULL if there is no complete line yet. input->closed is set
+ *         when the peer has closed the connection.
+ */
+char *telnet_gets(char *s, int size, telnet_input_t *input);
+
+#endif /* _TELNET_INPUT_H_ */
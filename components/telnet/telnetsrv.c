@@ -62,6 +62,7 @@
 #include <esp_wifi.h>
 
 #include <time.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
@@ -71,7 +72,7 @@
 #include <netdb.h>
 #include <linux/in6.h>
 
-#define TELNET_BUFF_SIZE 256
+#include "telnet_input.h"
 
 #include "lua.h"
 #include "lualib.h"
@@ -100,40 +101,13 @@ typedef struct {
   struct sockaddr_storage client;
   socklen_t client_len;
   char *outbuf;
+  telnet_input_t input;
 } telnet_request_handle;
 
 #define TELNET_Request_initializer { config, client, client_addr, client_addr_len, NULL };
 
 static telnet_server_config telnetsrv = TELNET_initializer;
 
-static char *do_gets(char *s, int size, telnet_request_handle *request) {
-  int socket = request->socket;
-
-  int rc;
-  char *c = s;
-  while (c < (s + size - 1)) {
-    rc = recv(socket, c, 1, MSG_DONTWAIT);
-
-    if (rc>0) {
-      if (*c == '\n') {
-        c++;
-        break;
-      }
-      c++;
-    }
-    else if (rc==0) {
-      //no data received or connection is closed
-      syslog(LOG_DEBUG, "telnet: no data received or connection is closed\r");
-      break;
-    }
-    else {
-      return NULL; //discard half-received data
-    }
-  }
-  *c = 0;
-  return (c == s ? 0 : s);
-}
-
 static int process(telnet_request_handle *request) {
   char *reqbuf;
   char *outbuf;
@@ -178,13 +152,20 @@ static int process(telnet_request_handle *request) {
     syslog(LOG_ERR, "error allocating memory\n");
     return 0;
   }
+  if (telnet_input_init(&request->input, request->socket) != 0) {
+    free(buffer);
+    free(reqbuf);
+    free(outbuf);
+    syslog(LOG_ERR, "error allocating memory\n");
+    return 0;
+  }
 
   request->outbuf = outbuf;
   clock_t last = clock()/CLOCKS_PER_SEC;
 
   while(true) {
 
-    if (do_gets(reqbuf, TELNET_BUFF_SIZE, request) && 0 != (len = strnlen(reqbuf, TELNET_BUFF_SIZE)) ) {
+    if (telnet_gets(reqbuf, TELNET_BUFF_SIZE, &request->input) && 0 != (len = strnlen(reqbuf, TELNET_BUFF_SIZE)) ) {
 
       while(len>0 && (reqbuf[len-1]=='\r' || reqbuf[len-1]=='\n')) len--;
       reqbuf[len] = '\0';
@@ -215,17 +196,18 @@ static int process(telnet_request_handle *request) {
 
       }
     }
+    else if (request->input.closed) {
+      syslog(LOG_DEBUG, "telnet: connection closed by %s\n", buffer);
+      break;
+    }
     else if (request->config->autoclose) {
+      // telnet_gets has already waited up to TELNET_POLL_MS for input
       clock_t now = clock()/CLOCKS_PER_SEC;
       if (request->config->autoclose < (now - last)) {
         // not received any input, exiting
         syslog(LOG_DEBUG, "telnet: auto-closing connection with %s\n", buffer);
         break;
       }
-      else {
-        //syslog(LOG_DEBUG, "telnet: not yet auto-closing connection with %s\n", buffer);
-        usleep(200*1000); //check again in 200ms
-      }
     }
   }
 
@@ -233,6 +215,7 @@ static int process(telnet_request_handle *request) {
   free(reqbuf);
   request->outbuf = NULL;
   free(outbuf);
+  telnet_input_free(&request->input);
 
   return 0;
 }